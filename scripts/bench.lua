@@ -0,0 +1,136 @@
+--[[
+    lmprof hook-overhead benchmark: the average cost of each debug hook event
+    is estimated by comparing the execution time of a script with and without
+    profiling.
+
+@USAGE
+    lua scripts/bench.lua --input=scripts/test/mandel.lua --args="64" \
+        --runs=5 --mode=instrument,memory [--lazy_info] [--disable_gc] \
+        [--compress_graph=false]
+
+    # Benchmark the common mode/option combinations
+    lua scripts/bench.lua --input=scripts/test/mandel.lua --args="64" --matrix
+
+@LICENSE
+    See Copyright Notice in lmprof_lib.h
+--]]
+lmprof = require('lmprof') -- @NOTE: LUA_PATH
+
+local options = { }
+for _,v in ipairs(arg) do
+    local key,value = v:match("^%-%-([^=]+)=?(.*)$")
+    if key then
+        options[key] = (value == "" and true) or value
+    end
+end
+
+local input = options.input
+if type(input) ~= "string" then
+    error("Input Required: --input=<script>")
+end
+
+local function Bool(value, default)
+    if value == nil then
+        return default
+    end
+    return value == true or value ~= "false"
+end
+
+local function Split(str, pattern)
+    local result = { }
+    for w in tostring(str):gmatch(pattern) do
+        result[#result + 1] = w
+    end
+    return result
+end
+
+local runs = tonumber(options.runs) or 5
+local args = Split(options.args or "", "%S+")
+
+local chunk = assert(loadfile(input))
+local print = print
+
+local function Execute()
+    local prevArgs = arg
+    arg = args
+    chunk(table.unpack(args))
+    arg = prevArgs
+end
+
+--[[ Number of call/return hook events generated by a single execution. --]]
+local function CountEvents()
+    local count = 0
+    debug.sethook(function() count = count + 1 end, "cr")
+    Execute()
+    debug.sethook()
+    return count
+end
+
+--[[ Minimum execution time over all runs: optionally profiled. --]]
+local function Measure(modes)
+    local best = math.huge
+    for _=1,runs do
+        collectgarbage("collect")
+        local s = os.clock()
+        if modes then
+            lmprof.start(table.unpack(modes))
+            Execute()
+            lmprof.stop()
+        else
+            Execute()
+        end
+        best = math.min(best, os.clock() - s)
+    end
+    return best
+end
+
+local configurations = { }
+if options.matrix then
+    local modes = {
+        { "instrument" },
+        { "instrument", "memory" },
+        { "instrument", "memory", "single_thread" },
+        { "instrument", "trace" },
+        { "instrument", "memory", "trace" },
+    }
+
+    for _,m in ipairs(modes) do
+        for _,gc in ipairs({ false, true }) do
+            for _,compress in ipairs({ true, false }) do
+                configurations[#configurations + 1] = {
+                    modes = m,
+                    disable_gc = gc,
+                    compress_graph = compress,
+                    lazy_info = Bool(options.lazy_info, false),
+                }
+            end
+        end
+    end
+else
+    configurations[1] = {
+        modes = Split(options.mode or "instrument", "[^,]+"),
+        disable_gc = Bool(options.disable_gc, false),
+        compress_graph = Bool(options.compress_graph, true),
+        lazy_info = Bool(options.lazy_info, false),
+    }
+end
+
+Execute() -- Warmup
+local events = CountEvents()
+local base = Measure(nil)
+
+print(("Input:       %s %s"):format(input, table.concat(args, " ")))
+print(("Hook Events: %d"):format(events))
+print(("Baseline:    %.3f ms"):format(base * 1e3))
+print(("%-32s %-10s %-8s %12s %16s"):format("Modes", "disable_gc", "compress", "Profiled", "Hook Cost"))
+for _,conf in ipairs(configurations) do
+    lmprof.set_option("lazy_info", conf.lazy_info)
+    lmprof.set_option("disable_gc", conf.disable_gc)
+    lmprof.set_option("compress_graph", conf.compress_graph)
+
+    local profiled = Measure(conf.modes)
+    print(("%-32s %-10s %-8s %9.3f ms %9.1f ns/event"):format(
+        table.concat(conf.modes, ","), tostring(conf.disable_gc), tostring(conf.compress_graph),
+        profiled * 1e3, ((profiled - base) / math.max(events, 1)) * 1e9
+    ))
+end
@@ -0,0 +1,129 @@
+--[[
+    lmprof report-formatting benchmark: a synthetic workload generating a
+    fixed number of Trace Events is profiled and the time spent formatting,
+    i.e., lmprof.stop, is measured for each report type.
+
+@USAGE
+    lua scripts/bench_report.lua [--events=10000000] [--runs=3] \
+        [--types=file,string,table] [--mode=instrument,trace,memory] \
+        [--output=path] [--counter_freq=count] [--threads=count]
+
+    # 'table' reports allocate a Lua table for each event; use --types to
+    # exclude it on memory constrained systems.
+    lua scripts/bench_report.lua --events=1000000 --types=file,string
+
+    # Format the pages of the report on four threads ('report_threads'). Note,
+    # os.clock is the processor time of all threads, i.e., the total cost of
+    # formatting and not its latency.
+    lua scripts/bench_report.lua --types=file,string --threads=4
+
+    # The latency of lmprof.stop_async, i.e., the time until the profiled script
+    # resumes; the report is written to --output on a background thread.
+    lua scripts/bench_report.lua --types=file,async
+
+@LICENSE
+    See Copyright Notice in lmprof_lib.h
+--]]
+lmprof = require('lmprof') -- @NOTE: LUA_PATH
+
+local options = { }
+for _,v in ipairs(arg) do
+    local key,value = v:match("^%-%-([^=]+)=?(.*)$")
+    if key then
+        options[key] = (value == "" and true) or value
+    end
+end
+
+local function Split(str, pattern)
+    local result = { }
+    for w in tostring(str):gmatch(pattern) do
+        result[#result + 1] = w
+    end
+    return result
+end
+
+local events = math.floor(tonumber(options.events) or 10000000)
+local runs = tonumber(options.runs) or 3
+local types = Split(options.types or "file,string,table", "[^,]+")
+local modes = Split(options.mode or "instrument,trace", "[^,]+")
+local output = options.output or os.tmpname()
+
+--[[ Each call generates an ENTER_SCOPE and EXIT_SCOPE event --]]
+local function Leaf() end
+local function Workload(count)
+    for _=1,count do
+        Leaf()
+    end
+end
+
+--[[ Size, in bytes, of the file at 'path' --]]
+local function FileSize(path)
+    local f = assert(io.open(path, "rb"))
+    local size = f:seek("end")
+    f:close()
+    return size
+end
+
+--[[ Minimum formatting (lmprof.stop) time over all runs and the output size --]]
+local function Measure(report)
+    local best, size = math.huge, 0
+    lmprof.set_option("output_string", report == "string")
+    for _=1,runs do
+        collectgarbage("collect")
+        lmprof.start(table.unpack(modes))
+        Workload(events // 2)
+
+        local s = os.clock()
+        local result = nil
+        if report == "async" then
+            local handle = lmprof.stop_async(output)
+            best = math.min(best, os.clock() - s)
+            result = handle:wait()
+        else
+            result = (report == "file" and lmprof.stop(output)) or lmprof.stop()
+            best = math.min(best, os.clock() - s)
+        end
+
+        if report == "file" or report == "async" then
+            size = FileSize(output)
+        elseif report == "string" then
+            size = #result
+        end
+        result = nil
+    end
+    lmprof.set_option("output_string", false)
+    return best, size
+end
+
+lmprof.set_option("compress", false)
+if options.counter_freq then
+    lmprof.set_option("counter_freq", tonumber(options.counter_freq))
+end
+if options.threads then
+    lmprof.set_option("report_threads", tonumber(options.threads))
+end
+
+Workload(1024) -- Warmup
+
+print(("Events:  %d"):format(events))
+print(("Modes:   %s"):format(table.concat(modes, ",")))
+print(("Threads: %d"):format(lmprof.get_option("report_threads")))
+print(("%-8s %12s %12s %12s %14s"):format("Report", "Format", "Size", "MB/s", "ns/event"))
+
+local jsonSize = nil
+for _,report in ipairs(types) do
+    local elapsed, size = Measure(report)
+    if report ~= "table" then
+        jsonSize = jsonSize or size
+    else -- The equivalent JSON throughput
+        size = jsonSize or 0
+    end
+
+    print(("%-8s %9.3f ms %9.1f MB %12.1f %14.1f"):format(report, elapsed * 1e3,
+        size / 1e6, (size / 1e6) / math.max(elapsed, 1e-9), (elapsed / math.max(events, 1)) * 1e9
+    ))
+end
+
+if not options.output then
+    os.remove(output)
+end
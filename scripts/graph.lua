@@ -539,6 +539,10 @@ function LMGraph:Verbose(header, outfile)
     buff[#buff + 1] = { "Factored Profile Overhead", ("%s %s"):format(Decimal.Format(header.profile_overhead, timeDegree), timeSuffix)}
     buff[#buff + 1] = { "Calibration", ("%s %s"):format(Decimal.Format(header.calibration, timeDegree), timeSuffix)}
     buff[#buff + 1] = { "Instruction Counter", tostring(header.instr_count)}
+    if header.stack_pool_hits then
+        buff[#buff + 1] = { "Stack Pool Hits", tostring(header.stack_pool_hits)}
+        buff[#buff + 1] = { "Stack Pool Misses", tostring(header.stack_pool_misses)}
+    end
     buff[#buff + 1] = { "", "" }
 
     if header.callback then -- Append Trace Event statistics
@@ -556,16 +560,27 @@ function LMGraph:Verbose(header, outfile)
 
     if header.debug then -- Debug hashing statistics.
         buff[#buff + 1] = { "Hashing", "" }
-        buff[#buff + 1] = { "Buckets" , tostring(header.debug.buckets) }
-        buff[#buff + 1] = { "Used Buckets", tostring(header.debug.used_buckets) }
+        buff[#buff + 1] = { "Slots" , tostring(header.debug.buckets) }
+        buff[#buff + 1] = { "Used Slots", tostring(header.debug.used_buckets) }
         buff[#buff + 1] = { "Record Count", tostring(header.debug.record_count) }
-        buff[#buff + 1] = { "Min Bucket Count", tostring(header.debug.min) }
-        buff[#buff + 1] = { "Max Bucket Count", tostring(header.debug.max) }
-        buff[#buff + 1] = { "Mean (all)", string.format("%2.3f", header.debug.mean) }
-        buff[#buff + 1] = { "Variance (all)", string.format("%2.3f", header.debug.var) }
-        buff[#buff + 1] = { "Mean (hits)", string.format("%2.3f", header.debug.mean_hits) }
-        buff[#buff + 1] = { "Variance (hits)", string.format("%2.3f", header.debug.var_hits) }
+        buff[#buff + 1] = { "Load Factor", string.format("%2.3f", header.debug.mean) }
+        buff[#buff + 1] = { "Min Probe Length", tostring(header.debug.min) }
+        buff[#buff + 1] = { "Max Probe Length", tostring(header.debug.max) }
+        buff[#buff + 1] = { "Mean Probe Length", string.format("%2.3f", header.debug.mean_hits) }
+        buff[#buff + 1] = { "Variance (probe)", string.format("%2.3f", header.debug.var_hits) }
         buff[#buff + 1] = { "", "" }
+        if header.debug.idcache_hits then
+            buff[#buff + 1] = { "Identity Cache", "" }
+            buff[#buff + 1] = { "Hits", tostring(header.debug.idcache_hits) }
+            buff[#buff + 1] = { "Misses", tostring(header.debug.idcache_misses) }
+            buff[#buff + 1] = { "", "" }
+        end
+        if header.debug.edge_hits then
+            buff[#buff + 1] = { "Edge Cache", "" }
+            buff[#buff + 1] = { "Hits", tostring(header.debug.edge_hits) }
+            buff[#buff + 1] = { "Misses", tostring(header.debug.edge_misses) }
+            buff[#buff + 1] = { "", "" }
+        end
     end
 
     local longestLabel = 0
@@ -0,0 +1,458 @@
+--[[
+    lmprof regression checks: each case profiles a small workload and asserts
+    a property of its report. Cases that require an optional feature, e.g.,
+    LMPROF_FILE_API or LMPROF_THREADS, are skipped when it is unavailable.
+
+@USAGE
+    lua scripts/regress.lua [--case=fold_recursion,...] [--output=/tmp]
+
+    # --output: directory of the temporary files written by file-based cases.
+
+@LICENSE
+    See Copyright Notice in lmprof_lib.h
+--]]
+lmprof = require('lmprof') -- @NOTE: LUA_PATH
+json = require('dkjson')
+
+local options = { }
+for _,v in ipairs(arg) do
+    local key,value = v:match("^%-%-([^=]+)=?(.*)$")
+    if key then
+        options[key] = (value == "" and true) or value
+    end
+end
+
+local output = options.output or os.getenv("TMPDIR") or "/tmp"
+local selected = nil
+if type(options.case) == "string" then
+    selected = { }
+    for w in options.case:gmatch("[^,]+") do
+        selected[w] = true
+    end
+end
+
+local cases = { }
+local function Case(name, func)
+    cases[#cases + 1] = { name = name, func = func }
+end
+
+--[[ Thrown by a case to report that it cannot run in this build. --]]
+local Skip = setmetatable({ }, { __tostring = function() return "skipped" end })
+
+local function Check(cond, fmt, ...)
+    if not cond then
+        error(fmt:format(...), 2)
+    end
+end
+
+local unpack = unpack or table.unpack
+local function Pack(...)
+    return { n = select('#', ...), ... }
+end
+
+--[[ Invoke 'func' with the global options 'opts' set, restoring them after. --]]
+local function WithOptions(opts, func, ...)
+    local prev = { }
+    for k,v in pairs(opts) do
+        local value = lmprof.get_option(k)
+        if value == nil then -- Unset option: "", 0, or false disable it
+            value = ({ string = "", number = 0 })[type(v)] or false
+        end
+        prev[k] = value
+        lmprof.set_option(k, v)
+    end
+
+    local result = Pack(pcall(func, ...))
+    lmprof.quit()
+    for k,v in pairs(prev) do
+        lmprof.set_option(k, v)
+    end
+
+    if not result[1] then
+        error(result[2], 0)
+    end
+    return unpack(result, 2, result.n)
+end
+
+--[[ Skip the case if the profiler is not configured for File/IO. --]]
+local function RequireIO()
+    if not lmprof.has_io() then
+        error(Skip, 0)
+    end
+end
+
+local function Path(name)
+    return ("%s/lmprof_regress_%s"):format(output, name)
+end
+
+local function ReadFile(path)
+    local file = assert(io.open(path, "rb"))
+    local contents = file:read("*a")
+    file:close()
+    os.remove(path)
+    return contents
+end
+
+local function Decode(contents)
+    local report, _, err = json.decode(contents)
+    Check(report ~= nil, "invalid JSON: %s", tostring(err))
+    return report
+end
+
+local function Fib(n)
+    if n < 2 then
+        return n
+    end
+    return Fib(n - 1) + Fib(n - 2)
+end
+
+--[[ Number of Fib activations of Fib(n) --]]
+local function FibCalls(n)
+    if n < 2 then
+        return 1
+    end
+    return 1 + FibCalls(n - 1) + FibCalls(n - 2)
+end
+
+local function WorkLeaf(x)
+    return x + 1
+end
+
+local function Work(n)
+    local t = { }
+    for i=1,n do
+        t[#t + 1] = WorkLeaf(i)
+    end
+    return t
+end
+
+--[[ Trace workload: interleaved coroutine and main-thread scopes. --]]
+local WorkIterations = 200
+local function Workload()
+    local co = coroutine.wrap(function()
+        for _=1,WorkIterations do
+            Work(50)
+            coroutine.yield()
+        end
+    end)
+
+    for _=1,WorkIterations do
+        co()
+        Work(100)
+    end
+end
+
+--[[
+    Ensure every END event of a decoded TraceEvent report closes a BEGIN event
+    of the same thread, and that no workload scope remains open: only the
+    scopes active when the profiler was stopped may. Returns the number of
+    BEGIN events per name.
+--]]
+local function CheckBalanced(report)
+    local events = report.traceEvents or report
+    local stacks, names = { }, { }
+    for _,event in ipairs(events) do
+        local key = ("%s:%s"):format(tostring(event.pid), tostring(event.tid))
+        local stack = stacks[key] or { }
+        stacks[key] = stack
+
+        if event.ph == "B" then
+            stack[#stack + 1] = event.name
+            names[event.name] = (names[event.name] or 0) + 1
+        elseif event.ph == "E" then
+            Check(#stack > 0, "unmatched END event at %s on thread %s", tostring(event.ts), key)
+            stack[#stack] = nil
+        end
+    end
+
+    for key,stack in pairs(stacks) do
+        for _,name in ipairs(stack) do
+            Check(not name:find("^Work"), "scope '%s' left open on thread %s", name, key)
+        end
+    end
+    return names
+end
+
+--[[ Number of BEGIN events of the function 'name' --]]
+local function CountScopes(names, name)
+    local count = 0
+    for k,v in pairs(names) do
+        if k:find("^" .. name .. " ") then
+            count = count + v
+        end
+    end
+    return count
+end
+
+--[[
+    'fold_recursion': the recursive re-entries of a function are folded into
+    its outermost activation, i.e., a single record (per callsite) counting
+    every call, regardless of 'compress_graph'.
+--]]
+Case("fold_recursion", function()
+    local function FibRecords(fold)
+        return WithOptions({ fold_recursion = fold, compress_graph = false }, function()
+            lmprof.start("instrument")
+            Fib(12)
+            local result = lmprof.stop()
+
+            local records, count, total = { }, 0, 0
+            for _,record in ipairs(result.records) do
+                if record.linedefined == debug.getinfo(Fib, "S").linedefined and record.what == "Lua" then
+                    records[record.id] = record
+                    count = count + 1
+                    total = total + record.count
+                end
+            end
+            return records, count, total
+        end)
+    end
+
+    local _, depth, calls = FibRecords(false)
+    Check(depth > 1, "expected a record per recursion depth, got %d", depth)
+    Check(calls == FibCalls(12), "unfolded call count %d ~= %d", calls, FibCalls(12))
+
+    local folded, count, total = FibRecords(true)
+    Check(count == 1, "expected a single folded record, got %d", count)
+    Check(total == FibCalls(12), "folded call count %d ~= %d", total, FibCalls(12))
+    for _,record in pairs(folded) do
+        Check(folded[record.parent] == nil, "folded record %s has a recursive parent", tostring(record.id))
+    end
+end)
+
+--[[
+    'ring': the report is the most recent window of events, and the scopes
+    still open at the start of that window are carried over, i.e., the BEGIN
+    and END events remain balanced.
+--]]
+Case("ring", function()
+    local report = WithOptions({ ring = true, page_limit = 4 * 32768, output_string = true }, function()
+        lmprof.start("instrument", "trace")
+        Workload()
+        return lmprof.stop()
+    end)
+
+    local names = CheckBalanced(Decode(report))
+    local leaves = CountScopes(names, "WorkLeaf")
+    Check(leaves > 0, "ring window has no events")
+    Check(leaves < 150 * WorkIterations, "ring did not recycle pages: %d events", leaves)
+end)
+
+--[[
+    'stream': pages are formatted by a writer thread while the profiled thread
+    continues to create (and name) records; the streamed report must be a
+    valid and balanced TraceEvent report.
+--]]
+Case("stream", function()
+    RequireIO()
+
+    local path = Path("stream.json")
+    local ok, err = WithOptions({ stream = path, page_limit = 2 * 32768 }, pcall, function()
+        lmprof.start("instrument", "trace")
+        for i=1,WorkIterations do -- Records created and named while streaming
+            local f = function(n) return Work(n) end
+            f(i % 7)
+        end
+        Workload()
+        return lmprof.stop()
+    end)
+
+    if not ok and tostring(err):find("requires LMPROF_THREADS", 1, true) then
+        error(Skip, 0)
+    end
+    Check(ok and err == true, "stream failed: %s", tostring(err))
+
+    local names = CheckBalanced(Decode(ReadFile(path)))
+    Check(CountScopes(names, "WorkLeaf") > 0, "stream has no events")
+end)
+
+--[[
+    Canonical string of a decoded JSON value with its keys sorted. Timestamps
+    and durations are omitted: they differ between two profiles of the same
+    workload.
+--]]
+local function Canonical(value)
+    if type(value) ~= "table" then
+        return tostring(value)
+    end
+
+    local keys = { }
+    for k in pairs(value) do
+        if k ~= "ts" and k ~= "dur" and k ~= "tts" then
+            keys[#keys + 1] = k
+        end
+    end
+    table.sort(keys, function(a, b) return tostring(a) < tostring(b) end)
+
+    local result = { }
+    for i=1,#keys do
+        result[i] = ("%s=%s"):format(tostring(keys[i]), Canonical(value[keys[i]]))
+    end
+    return "{" .. table.concat(result, ",") .. "}"
+end
+
+--[[
+    'binary': a converted binary dump is equivalent to the JSON report of the
+    same profile formatted directly, i.e., the same events in the same order.
+--]]
+Case("binary", function()
+    RequireIO()
+
+    local function Profile(opts, path)
+        return WithOptions(opts, function()
+            lmprof.start("instrument", "trace")
+            Workload()
+            return lmprof.stop(path)
+        end)
+    end
+
+    local path = Path("binary.bin")
+    Check(Profile({ binary = true, compress = false }, path) == true, "binary dump failed")
+    local converted = lmprof.convert(path)
+    os.remove(path)
+
+    local direct = Decode(Profile({ output_string = true, compress = false }))
+    converted = Decode(converted)
+
+    local a, b = direct.traceEvents or direct, converted.traceEvents or converted
+    Check(#a == #b, "converted event count %d ~= %d", #b, #a)
+    for i=1,#a do
+        local x, y = Canonical(a[i]), Canonical(b[i])
+        Check(x == y, "event %d differs: %s ~= %s", i, y, x)
+    end
+end)
+
+--[[
+    'binary' (malformed input): truncated or corrupted dumps are rejected, or
+    converted, but never crash the converter.
+--]]
+Case("binary_corrupt", function()
+    RequireIO()
+
+    local path = Path("corrupt.bin")
+    local dump = WithOptions({ binary = true, compress = false }, function()
+        lmprof.start("instrument", "trace", "lines")
+        local co = coroutine.wrap(function()
+            for _=1,3 do
+                Fib(4)
+                coroutine.yield()
+            end
+        end)
+        for _=1,3 do
+            co()
+            Fib(3)
+        end
+        Check(lmprof.stop(path) == true, "binary dump failed")
+        return ReadFile(path)
+    end)
+
+    local function Convert(contents)
+        local file = assert(io.open(path, "wb"))
+        file:write(contents)
+        file:close()
+
+        local ok = pcall(lmprof.convert, path)
+        os.remove(path)
+        return ok
+    end
+
+    Check(Convert(dump), "unable to convert the unmodified dump")
+
+    local rejected = 0
+    for i=1,#dump do
+        if not Convert(dump:sub(1, i - 1)) then -- Truncated
+            rejected = rejected + 1
+        end
+        Convert(dump:sub(1, i - 1) .. "\0" .. dump:sub(i + 1)) -- Zeroed byte
+        Convert(dump:sub(1, i - 1) .. "\255" .. dump:sub(i + 1))
+    end
+    Check(rejected > 0, "truncated dumps were not rejected")
+end)
+
+--[[
+    'stop_async': the handle reports completion, may be waited on repeatedly,
+    and joins its writer when collected without being waited on.
+--]]
+Case("stop_async", function()
+    RequireIO()
+
+    local path = Path("async.json")
+    lmprof.start("instrument", "trace")
+    Workload()
+    local handle = lmprof.stop_async(path)
+    lmprof.start("instrument", "trace") -- A profiler may run while writing
+    Work(10)
+    lmprof.quit()
+
+    while not handle:done() do end -- Non-blocking
+    local result = handle:wait()
+    Check(result == true, "stop_async failed")
+    Check(handle:wait() == result, "repeated wait returned a different result")
+    Check(handle:done(), "handle not done after wait")
+    CheckBalanced(Decode(ReadFile(path)))
+
+    path = Path("async_gc.json")
+    lmprof.start("instrument", "trace")
+    Workload()
+    handle = lmprof.stop_async(path)
+    handle = nil -- Collected without being waited on
+    collectgarbage()
+    collectgarbage()
+    CheckBalanced(Decode(ReadFile(path)))
+end)
+
+--[[
+    Function identity cache: the source strings of collected chunks are often
+    reallocated, at the same address, by chunks loaded later. Each chunk must
+    keep its own record.
+--]]
+Case("identity", function()
+    local load = loadstring or load
+    local counts = WithOptions({ disable_gc = false }, function()
+        lmprof.start("instrument")
+        for i=1,400 do
+            load(("return function() return %d end"):format(100 + i % 7))()()
+            if i % 20 == 0 then
+                collectgarbage()
+            end
+        end
+        local result = lmprof.stop()
+
+        local calls = { }
+        for _,record in ipairs(result.records) do
+            local value = record.source and record.source:match("^%? %(.*return (%d+) end")
+            if value then
+                calls[value] = (calls[value] or 0) + record.count
+            end
+        end
+        return calls
+    end)
+
+    for i=0,6 do
+        local expected = (i == 1) and 58 or 57
+        local count = counts[tostring(100 + i)] or 0
+        Check(count == expected, "function %d: %d calls ~= %d", 100 + i, count, expected)
+    end
+end)
+
+local failures, skipped, passed = 0, 0, 0
+for _,case in ipairs(cases) do
+    if selected == nil or selected[case.name] then
+        local ok, err = pcall(case.func)
+        if ok then
+            passed = passed + 1
+            print(("%-24s ok"):format(case.name))
+        elseif err == Skip then
+            skipped = skipped + 1
+            print(("%-24s skipped"):format(case.name))
+        else
+            failures = failures + 1
+            print(("%-24s FAILED: %s"):format(case.name, tostring(err)))
+        end
+    end
+end
+
+print(("%d passed, %d skipped, %d failed"):format(passed, skipped, failures))
+if failures > 0 then
+    error("regression checks failed", 0)
+end
@@ -18,9 +18,9 @@ function PrintUsage(errorMessage)
     local usageMessage = [[
 script [--input] [--output] [--format] [--path] [--args] [-h | --help]
   [-t | --time] [-m | --memory] [-e | --trace] [-l | --lines] [-s | --sample] [--single_thread]
-  [--micro] [--compress_graph] [--load_stack] [--mismatch] [--line_freq] [--ignore_yield] [--gc_count] [-g | --disable_gc] [-i | --instructions]
-  [-p | --process] [-f | --draw_frame] [-c | --compress] [--split] [--tracing] [--page_limit] [--name] [--url]
-  [--callgrind] [--pepper] [--json] [--sort] [--csv] [--show_lines] [-v | --verbose]
+  [--micro] [--compress_graph] [--load_stack] [--mismatch] [--line_freq] [--ignore_yield] [--gc_count] [--lazy_info] [--fold_recursion] [--mmap] [-g | --disable_gc] [-i | --instructions]
+  [-p | --process] [-f | --draw_frame] [-c | --compress] [--split] [--tracing] [--ring] [--stream] [--page_limit] [--name] [--url]
+  [--binary] [--convert] [--callgrind] [--pepper] [--json] [--sort] [--csv] [--show_lines] [-v | --verbose]
 
 [INPUT]
   --input: input script file
@@ -50,6 +50,9 @@ script [--input] [--output] [--format] [--path] [--args] [-h | --help]
     --ignore_yield: Ignore all coroutine.yield() records.
     --gc_count: Include LUA_GCCOUNT (the amount of memory in use by Lua) information on profiler initialization.
     --disable_gc: Disable the Lua garbage collector for the duration of the profile.
+    --lazy_info: Defer the formatting of Lua function names/sources until the profile is reported.
+    --fold_recursion: Fold recursive calls of a function into the activation of its caller (graph instrumentation).
+    --mmap: Serve TraceEvent pages and record arena chunks from memory mappings (requires LMPROF_MMAP).
     --instructions=count: Number of Lua instructions to execute before generating a 'sampling' event.
     --calibrate: perform a calibration, i.e., determine an estimation, preferably an underestimation, of the Lua function call overhead.
     --output_string: Output a formatted Lua string instead of writing (antithesis to LMPROF_FILE_API)
@@ -61,6 +64,10 @@ script [--input] [--output] [--format] [--path] [--args] [-h | --help]
     --split: Output a unique thread ids for each thread in the chromium output; Otherwise, all events use the main thread.
     --tracing: Output a format compatible with chrome://tracing/.
     --page_limit: TraceEvent buffer size in bytes
+    --ring: Recycle the oldest TraceEvent pages once 'page_limit' is reached, i.e., keep the most recent events.
+    --stream=path: Write filled TraceEvent pages to 'path' on a writer thread while profiling (requires LMPROF_THREADS).
+    --binary: Write a compact binary dump of the TraceEvent timeline to 'output'; see --convert.
+    --convert: Convert a binary dump, 'input', into the TraceEvent JSON format.
     --counter_freq: Frequency of 'UpdateCounters' event generation.
     --name: Synthetic 'TracingStartedInBrowser' Name.
     --url: Synthetic 'TracingStartedInBrowser' URL.
@@ -184,6 +191,10 @@ lmprof.set_option("line_freq", options:Bool("line_freq", "", false))
 lmprof.set_option("ignore_yield", options:Bool("ignore_yield", "", false))
 lmprof.set_option("gc_count", options:Bool("gc_count", "", false))
 lmprof.set_option("disable_gc", options:Bool("disable_gc", "g", false))
+lmprof.set_option("lazy_info", options:Bool("lazy_info", "", false))
+lmprof.set_option("fold_recursion", options:Bool("fold_recursion", "", false))
+lmprof.set_option("mmap", options:Bool("mmap", "", false))
+lmprof.set_option("binary", options:Bool("binary", "", false))
 if sample_mode then
     lmprof.set_option("instructions", options:Int("instructions", "i", 1000))
 end
@@ -200,6 +211,8 @@ if trace_mode then
     lmprof.set_option("threshold", threshold)
     lmprof.set_option("counter_freq", options:Int("counter_freq", "", 1))
     lmprof.set_option("page_limit", options:Int("page_limit", "", 1))
+    lmprof.set_option("ring", options:Bool("ring", "", false))
+    lmprof.set_option("stream", options:String("stream", "", ""))
 end
 
 -- Update package path
@@ -221,6 +234,13 @@ end
 local result = nil
 if options:Bool("format", "", false) then
     result = dofile(input)
+elseif options:Bool("convert", "", false) then
+    result = lmprof.convert(input, output)
+    if not output then
+        arg = prevArgs
+        print(result)
+        return
+    end
 elseif options:Bool("calibrate", "", false) then
     result = lmprof.create(time_mode, memory_mode, trace_mode, line_mode, sample_mode, single_thread)
         :calibrate()
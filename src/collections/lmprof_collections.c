@@ -20,41 +20,199 @@
 ** ===================================================================
 */
 
-/* Number of elements */
-#define LMPROF_STACK_SIZE ((sizeof(lmprof_StackInst) * LMPROF_MAXSTACK) + offsetof(lmprof_Stack, stack))
+/* Helper for zeroing a stack; any grown stack allocation is retained. */
+static LUA_INLINE lmprof_Stack *reset_stack(lmprof_Stack *s, lua_Integer id, char callback_api) {
+  s->instr_last = 0;
+  s->instr_count = 0;
+  s->thread_identifier = id;
+  s->callback_api = callback_api;
+  s->next = l_nullptr;
+  lmprof_stack_clear(s); /* Ensure the profile stack is zeroed out */
+  return s;
+}
 
 /* Helper for initializing/zeroing an allocated stack instance. */
-static LUA_INLINE lmprof_Stack *setup_stack(lmprof_Stack *s, lua_Integer id, char callback_api) {
+static LUA_INLINE lmprof_Stack *setup_stack(lmprof_Stack *s, lmprof_Alloc *alloc, lua_Integer id, char callback_api) {
   if (s != l_nullptr) {
-    s->instr_last = 0;
-    s->instr_count = 0;
-    s->thread_identifier = id;
-    s->callback_api = callback_api;
-    lmprof_stack_clear(s); /* Ensure the profile stack is zeroed out */
+    s->alloc = *alloc;
+    s->stack = s->base;
+    s->size = LMPROF_STACK_INITIAL;
+    s->used = 0;
+    reset_stack(s, id, callback_api);
   }
   return s;
 }
 
-LUA_API lmprof_Stack *lmprof_stack_new(lua_State *L, lua_Integer id, char callback_api) {
-  lmprof_Stack *s = l_pcast(lmprof_Stack *, lmprof_newuserdata(L, LMPROF_STACK_SIZE));
-  return setup_stack(s, id, callback_api);
-}
-
 LUA_API lmprof_Stack *lmprof_stack_light_new(lmprof_Alloc *alloc, lua_Integer id, char callback_api) {
-  lmprof_Stack *s = l_pcast(lmprof_Stack *, lmprof_malloc(alloc, LMPROF_STACK_SIZE));
-  return setup_stack(s, id, callback_api);
+  lmprof_Stack *s = l_pcast(lmprof_Stack *, lmprof_malloc(alloc, sizeof(lmprof_Stack)));
+  return setup_stack(s, alloc, id, callback_api);
 }
 
 LUA_API void lmprof_stack_light_free(lmprof_Alloc *alloc, lmprof_Stack *stack) {
-  lmprof_free(alloc, l_pcast(void *, stack), LMPROF_STACK_SIZE);
+  if (stack->stack != stack->base)
+    lmprof_free(&stack->alloc, l_pcast(void *, stack->stack), stack->size * sizeof(lmprof_StackInst));
+  lmprof_free(alloc, l_pcast(void *, stack), sizeof(lmprof_Stack));
+}
+
+LUA_API void lmprof_thread_map_init(lmprof_ThreadMap *map) {
+  map->size = 0;
+  map->count = 0;
+  map->slots = l_nullptr;
+  map->current.thread = l_nullptr;
+  map->current.stack = l_nullptr;
+  map->last = map->current;
+}
+
+LUA_API void lmprof_thread_map_free(lmprof_Alloc *alloc, lmprof_ThreadMap *map) {
+  if (map->slots != l_nullptr)
+    lmprof_free(alloc, l_pcast(void *, map->slots), map->size * sizeof(lmprof_ThreadSlot));
+  lmprof_thread_map_init(map);
+}
+
+static void thread_map_place(lmprof_ThreadSlot *slots, size_t size, lmprof_ThreadSlot entry) {
+  size_t i = lmprof_thread_map_slot(entry.thread, size);
+  while (slots[i].thread != l_nullptr)
+    i = (i + 1) & (size - 1);
+  slots[i] = entry;
+}
+
+LUA_API int lmprof_thread_map_insert(lmprof_Alloc *alloc, lmprof_ThreadMap *map, const lua_State *L, lmprof_Stack *stack) {
+  lmprof_ThreadSlot entry;
+  if (map->size == 0 || (map->count + 1) * 2 > map->size) { /* Maximum load factor of one-half */
+    size_t i;
+    const size_t size = (map->size == 0) ? LMPROF_THREAD_MAP_SIZE : (map->size << 1);
+    lmprof_ThreadSlot *slots = l_pcast(lmprof_ThreadSlot *, lmprof_malloc(alloc, size * sizeof(lmprof_ThreadSlot)));
+    if (slots == l_nullptr)
+      return 0;
+
+    for (i = 0; i < size; ++i) {
+      slots[i].thread = l_nullptr;
+      slots[i].stack = l_nullptr;
+    }
+    for (i = 0; i < map->size; ++i) {
+      if (map->slots[i].thread != l_nullptr)
+        thread_map_place(slots, size, map->slots[i]);
+    }
+
+    if (map->slots != l_nullptr)
+      lmprof_free(alloc, l_pcast(void *, map->slots), map->size * sizeof(lmprof_ThreadSlot));
+    map->slots = slots;
+    map->size = size;
+  }
+
+  entry.thread = L;
+  entry.stack = stack;
+  thread_map_place(map->slots, map->size, entry);
+  map->count++;
+  return 1;
+}
+
+LUA_API void lmprof_thread_map_remove(lmprof_ThreadMap *map, const lua_State *L) {
+  size_t i, j;
+  const size_t mask = map->size - 1;
+  if (map->current.thread == L) {
+    map->current = map->last;
+    map->last.thread = l_nullptr;
+    map->last.stack = l_nullptr;
+  }
+  else if (map->last.thread == L) {
+    map->last.thread = l_nullptr;
+    map->last.stack = l_nullptr;
+  }
+
+  if (map->size == 0)
+    return;
+
+  for (i = lmprof_thread_map_slot(L, map->size); map->slots[i].thread != L; i = (i + 1) & mask) {
+    if (map->slots[i].thread == l_nullptr)
+      return;
+  }
+
+  /* Backward shift deletion: no tombstones are required for linear probing */
+  for (j = (i + 1) & mask; map->slots[j].thread != l_nullptr; j = (j + 1) & mask) {
+    const size_t home = lmprof_thread_map_slot(map->slots[j].thread, map->size);
+    if (((j - home) & mask) >= ((j - i) & mask)) { /* 'i' is within the probe sequence of 'j' */
+      map->slots[i] = map->slots[j];
+      i = j;
+    }
+  }
+  map->slots[i].thread = l_nullptr;
+  map->slots[i].stack = l_nullptr;
+  map->count--;
+}
+
+LUA_API void lmprof_stack_pool_init(lmprof_StackPool *pool, size_t limit) {
+  pool->head = l_nullptr;
+  pool->count = 0;
+  pool->limit = limit;
+  pool->hits = 0;
+  pool->misses = 0;
+}
+
+LUA_API lmprof_Stack *lmprof_stack_pool_acquire(lmprof_Alloc *alloc, lmprof_StackPool *pool, lua_Integer id, char callback_api) {
+  lmprof_Stack *s = pool->head;
+  if (s != l_nullptr) {
+    pool->head = s->next;
+    pool->count--;
+    pool->hits++;
+    return reset_stack(s, id, callback_api);
+  }
+
+  pool->misses++;
+  return lmprof_stack_light_new(alloc, id, callback_api);
+}
+
+LUA_API void lmprof_stack_pool_release(lmprof_Alloc *alloc, lmprof_StackPool *pool, lmprof_Stack *stack) {
+  if (pool->count < pool->limit) {
+    stack->next = pool->head;
+    pool->head = stack;
+    pool->count++;
+  }
+  else {
+    lmprof_stack_light_free(alloc, stack);
+  }
+}
+
+LUA_API void lmprof_stack_pool_clear(lmprof_Alloc *alloc, lmprof_StackPool *pool) {
+  while (pool->head != l_nullptr) {
+    lmprof_Stack *next = pool->head->next;
+    lmprof_stack_light_free(alloc, pool->head);
+    pool->head = next;
+  }
+  pool->count = 0;
 }
 
 LUA_API void lmprof_stack_clear(lmprof_Stack *s) {
   size_t i;
   s->head = 0;
-  s->size = LMPROF_MAXSTACK;
-  for (i = 0; i < s->size; ++i) /* Clear the entire allocated stack */
+  for (i = 0; i < s->used; ++i) { /* Clear all previously used instances */
     stack_clear_instance(s, &s->stack[i]);
+    lmprof_stack_edge_owner(&s->stack[i], l_nullptr);
+  }
+  s->used = 0;
+}
+
+LUA_API int lmprof_stack_grow(lmprof_Stack *s) {
+  const size_t size = s->size << 1;
+  lmprof_StackInst *stack = l_nullptr;
+  if (size <= s->size || size > (~l_cast(size_t, 0) / sizeof(lmprof_StackInst)))
+    return 0;
+  else if (s->stack == s->base) {
+    stack = l_pcast(lmprof_StackInst *, lmprof_malloc(&s->alloc, size * sizeof(lmprof_StackInst)));
+    if (stack != l_nullptr)
+      memcpy(l_pcast(void *, stack), l_pcast(const void *, s->base), s->used * sizeof(lmprof_StackInst));
+  }
+  else {
+    const size_t osize = s->size * sizeof(lmprof_StackInst);
+    stack = l_pcast(lmprof_StackInst *, lmprof_realloc(&s->alloc, s->stack, osize, size * sizeof(lmprof_StackInst)));
+  }
+
+  if (stack == l_nullptr)
+    return 0;
+
+  s->stack = stack;
+  s->size = size;
+  return 1;
 }
 
 LUA_API void stack_clear_instance(lmprof_Stack *s, lmprof_StackInst *inst) {
@@ -62,7 +220,9 @@ LUA_API void stack_clear_instance(lmprof_Stack *s, lmprof_StackInst *inst) {
     return;
 
   inst->tail_call = 0;
+  inst->frame = LMPROF_FRAME_NONE;
   inst->last_line = 0;
+  inst->recursion = 0;
   inst->last_line_instructions = 0;
   if (s->callback_api) {
     inst->trace.record = l_nullptr;
@@ -80,13 +240,14 @@ LUA_API void stack_clear_instance(lmprof_Stack *s, lmprof_StackInst *inst) {
   }
 }
 
-LUA_API lmprof_StackInst *lmprof_stack_measured_push(lmprof_Stack *s, lmprof_Record *record, lmprof_EventUnit *unit, char tail) {
+LUA_API lmprof_StackInst *lmprof_stack_measured_push(lmprof_Stack *s, lmprof_Record *record, lu_addr frame, lmprof_EventUnit *unit, char tail) {
   lmprof_StackInst *inst = l_nullptr;
-  if (!s->callback_api && (inst = lmprof_stack_next(s, tail)) != l_nullptr) {
+  if (!s->callback_api && (inst = lmprof_stack_next(s, frame, tail)) != l_nullptr) {
     inst->graph.overhead = 0;
     inst->graph.record = record;
     inst->graph.node = *unit;
     unit_clear(&inst->graph.path);
+    lmprof_stack_edge_owner(inst, record);
   }
   return inst;
 }
@@ -122,8 +283,15 @@ LUA_API lmprof_StackInst *lmprof_stack_measured_pop(lmprof_Stack *s, lmprof_Even
 ** ===================================================================
 */
 
-/* Size of the hashtable. */
-#define LMPROF_SIZEOF_HASH(BC) (offsetof(lmprof_Hash, buckets) + ((BC) * sizeof(lmprof_HashBucket)))
+/* Smallest allowable number of slots */
+#define LMPROF_HASH_MINSIZE 8
+
+/* Size of the slot array. */
+#define LMPROF_SIZEOF_SLOTS(BC) ((BC) * sizeof(lmprof_HashSlot))
+
+/* Whether inserting an additional record would exceed LMPROF_HASH_LOAD_FACTOR */
+#define LMPROF_HASH_OVERLOADED(H) \
+  (((H)->record_count + 1) * 100 > (H)->bucket_count * LMPROF_HASH_LOAD_FACTOR)
 
 /* Source: 'Prospecting for Hash Functions': nullprogram.com/blog/2018/07/31/ */
 #if defined(LMPROF_HASH_SPLITMIX)
@@ -155,19 +323,91 @@ static LUA_INLINE lu_addr to_identifier(lu_addr fid, lu_addr pid, int p_currentl
 }
 #endif
 
-/* <Function, Parent, LineNumber> identifiers mapped to hash bucket. */
-static LUA_INLINE size_t to_bucket(lu_addr fid, lu_addr pid, int p_currentline, size_t bucketCount) {
-  return l_cast(size_t, to_identifier(fid, pid, p_currentline)) % bucketCount;
+/*
+** <Function, Parent, LineNumber> identifiers mapped to a home slot. The slot
+** count is a power of two, the identifier is therefore finalized to ensure its
+** upper bits contribute to the slot index.
+*/
+static LUA_INLINE size_t to_slot(lu_addr fid, lu_addr pid, int p_currentline, size_t bucket_count) {
+  lu_addr x = to_identifier(fid, pid, p_currentline);
+  x = x ^ (x >> (sizeof(lu_addr) * 4));
+  x = ((x >> 16) ^ x) * 0x45d9f3b;
+  x = (x >> 16) ^ x;
+  return l_cast(size_t, x) & (bucket_count - 1);
 }
 
-LUA_API lmprof_Hash *lmprof_hash_create(lmprof_Alloc *alloc, size_t bucket_count) {
-  lmprof_Hash *h = l_pcast(lmprof_Hash *, lmprof_malloc(alloc, LMPROF_SIZEOF_HASH(bucket_count)));
-  if (h != l_nullptr) {
+/*
+** Robin Hood insertion: an entry displaces any resident entry that is closer
+** to its home slot. The key is assumed to not already exist in the table.
+*/
+static void hash_place(lmprof_HashSlot *slots, size_t bucket_count, lmprof_HashSlot entry) {
+  const size_t mask = bucket_count - 1;
+  size_t i = to_slot(entry.fid, entry.pid, entry.p_currentline, bucket_count);
+
+  entry.probe = 1;
+  for (;; i = (i + 1) & mask, entry.probe++) {
+    lmprof_HashSlot *slot = &slots[i];
+    if (slot->probe == 0) {
+      *slot = entry;
+      return;
+    }
+    else if (slot->probe < entry.probe) {
+      const lmprof_HashSlot swap = *slot;
+      *slot = entry;
+      entry = swap;
+    }
+  }
+}
+
+/* Allocate and clear an array of slots, returning NULL on error. */
+static lmprof_HashSlot *hash_newslots(lmprof_Alloc *alloc, size_t bucket_count) {
+  lmprof_HashSlot *slots = l_nullptr;
+  if (bucket_count > (~l_cast(size_t, 0) / sizeof(lmprof_HashSlot)))
+    return l_nullptr;
+
+  slots = l_pcast(lmprof_HashSlot *, lmprof_malloc(alloc, LMPROF_SIZEOF_SLOTS(bucket_count)));
+  if (slots != l_nullptr) {
     size_t i;
+    for (i = 0; i < bucket_count; i++) {
+      slots[i].probe = 0;
+      slots[i].record = l_nullptr;
+    }
+  }
+  return slots;
+}
 
-    h->bucket_count = bucket_count;
-    for (i = 0; i < h->bucket_count; i++)
-      h->buckets[i] = l_nullptr;
+/* Double the number of slots, returning zero on error. */
+static int hash_grow(lmprof_Alloc *alloc, lmprof_Hash *h) {
+  size_t i;
+  const size_t bucket_count = h->bucket_count << 1;
+  lmprof_HashSlot *slots = l_nullptr;
+  if (bucket_count <= h->bucket_count || (slots = hash_newslots(alloc, bucket_count)) == l_nullptr)
+    return 0;
+
+  for (i = 0; i < h->bucket_count; i++) {
+    if (h->slots[i].probe != 0)
+      hash_place(slots, bucket_count, h->slots[i]);
+  }
+
+  lmprof_free(alloc, l_pcast(void *, h->slots), LMPROF_SIZEOF_SLOTS(h->bucket_count));
+  h->slots = slots;
+  h->bucket_count = bucket_count;
+  return 1;
+}
+
+LUA_API lmprof_Hash *lmprof_hash_create(lmprof_Alloc *alloc, size_t bucket_count) {
+  lmprof_Hash *h = l_pcast(lmprof_Hash *, lmprof_malloc(alloc, sizeof(lmprof_Hash)));
+  if (h != l_nullptr) {
+    size_t size = LMPROF_HASH_MINSIZE;
+    while (size < bucket_count && (size << 1) > size)
+      size <<= 1;
+
+    h->record_count = 0;
+    h->bucket_count = size;
+    if ((h->slots = hash_newslots(alloc, size)) == l_nullptr) {
+      lmprof_free(alloc, l_pcast(void *, h), sizeof(lmprof_Hash));
+      return l_nullptr;
+    }
   }
   return h;
 }
@@ -175,22 +415,14 @@ LUA_API lmprof_Hash *lmprof_hash_create(lmprof_Alloc *alloc, size_t bucket_count
 LUA_API void lmprof_hash_destroy(lmprof_Alloc *alloc, lmprof_Hash *hash) {
   size_t i;
   for (i = 0; i < hash->bucket_count; i++) {
-    lmprof_HashBucket *bucket = hash->buckets[i];
-    while (bucket != l_nullptr) {
-      lmprof_HashBucket *next = bucket->next;
-      lmprof_Record *record = bucket->record;
-      if (record != l_nullptr && !BITFIELD_TEST(record->info.event, LMPROF_RECORD_USERDATA)) {
-        lmprof_record_clear(alloc, record);
-        lmprof_free(alloc, l_pcast(void *, record), sizeof(lmprof_Record));
-      }
-
-      lmprof_free(alloc, l_pcast(void *, bucket), sizeof(lmprof_HashBucket));
-      bucket = next;
-    }
-    hash->buckets[i] = l_nullptr;
+    lmprof_Record *record = hash->slots[i].record;
+    if (record != l_nullptr && !BITFIELD_TEST(record->info->event, LMPROF_RECORD_USERDATA))
+      lmprof_record_clear(alloc, record); /* lmprof_Record memory is owned by an lmprof_Arena */
+    hash->slots[i].record = l_nullptr;
   }
 
-  lmprof_free(alloc, l_pcast(void *, hash), LMPROF_SIZEOF_HASH(hash->bucket_count));
+  lmprof_free(alloc, l_pcast(void *, hash->slots), LMPROF_SIZEOF_SLOTS(hash->bucket_count));
+  lmprof_free(alloc, l_pcast(void *, hash), sizeof(lmprof_Hash));
 }
 
 LUA_API lu_addr lmprof_hash_identifier(lu_addr fid, lu_addr pid, int p_currentline) {
@@ -198,56 +430,51 @@ LUA_API lu_addr lmprof_hash_identifier(lu_addr fid, lu_addr pid, int p_currentli
 }
 
 LUA_API lmprof_Record *lmprof_hash_get(lmprof_Hash *h, lu_addr fid, lu_addr pid, int p_currentline) {
-  const size_t bucket = to_bucket(fid, pid, p_currentline, h->bucket_count);
-
-  lmprof_HashBucket *fh = l_nullptr;
-  lmprof_HashBucket *prev = l_nullptr;
-  for (fh = h->buckets[bucket]; fh != l_nullptr; fh = fh->next) {
-    if (fid == fh->record->f_id && pid == fh->record->p_id && p_currentline == fh->record->p_currentline) {
-      /*
-      ** Move the record to the beginning of the linked bucket list. Hoping for
-      ** some locality in hashing accesses.
-      */
-      if (prev) {
-        prev->next = fh->next;
-        fh->next = h->buckets[bucket];
-        h->buckets[bucket] = fh;
-      }
-      return fh->record;
-    }
-    prev = fh;
+  const size_t mask = h->bucket_count - 1;
+  size_t i = to_slot(fid, pid, p_currentline, h->bucket_count);
+
+  unsigned int probe;
+  for (probe = 1;; i = (i + 1) & mask, probe++) {
+    const lmprof_HashSlot *slot = &h->slots[i];
+    /*
+    ** An empty slot, or a resident closer to its home slot than the key would
+    ** be, terminates the search (Robin Hood invariant).
+    */
+    if (slot->probe < probe)
+      return l_nullptr;
+    else if (fid == slot->fid && pid == slot->pid && p_currentline == slot->p_currentline)
+      return slot->record;
   }
-  return l_nullptr;
 }
 
 LUA_API int lmprof_hash_insert(lmprof_Alloc *alloc, lmprof_Hash *h, lmprof_Record *record) {
-  lmprof_HashBucket *val = l_pcast(lmprof_HashBucket *, lmprof_malloc(alloc, sizeof(lmprof_HashBucket)));
-  if (val != l_nullptr) {
-    const size_t bucket = to_bucket(record->f_id, record->p_id, record->p_currentline, h->bucket_count);
-    val->record = record;
-    val->next = h->buckets[bucket]; /* insert in front */
-    h->buckets[bucket] = val;
-    return 1;
-  }
-  return 0;
+  lmprof_HashSlot entry;
+  if (LMPROF_HASH_OVERLOADED(h) && !hash_grow(alloc, h))
+    return 0;
+
+  entry.fid = record->f_id;
+  entry.pid = record->p_id;
+  entry.p_currentline = record->p_currentline;
+  entry.probe = 0;
+  entry.record = record;
+  hash_place(h->slots, h->bucket_count, entry);
+  h->record_count++;
+  return 1;
 }
 
 LUA_API void lmprof_hash_clear_statistics(lmprof_Hash *h) {
   size_t i;
   for (i = 0; i < h->bucket_count; i++) {
-    lmprof_HashBucket *fh = l_nullptr;
-    for (fh = h->buckets[i]; fh != l_nullptr; fh = fh->next) {
-      lmprof_record_clear_graph_statistics(fh->record);
-    }
+    if (h->slots[i].probe != 0)
+      lmprof_record_clear_graph_statistics(h->slots[i].record);
   }
 }
 
 LUA_API void lmprof_hash_report(lua_State *L, lmprof_Hash *h, lmprof_hash_Callback cb, const void *args) {
   size_t i;
   for (i = 0; i < h->bucket_count; i++) {
-    lmprof_HashBucket *fh;
-    for (fh = h->buckets[i]; fh != l_nullptr; fh = fh->next) {
-      const int result = cb(L, fh->record, args);
+    if (h->slots[i].probe != 0) {
+      const int result = cb(L, h->slots[i].record, args);
       if (result != LUA_OK) {
         LMPROF_LOG("Preempting hash iteration: <%d>\n", result);
         return;
@@ -257,45 +484,37 @@ LUA_API void lmprof_hash_report(lua_State *L, lmprof_Hash *h, lmprof_hash_Callba
 }
 
 LUA_API int lmprof_hash_debug(lua_State *L, lmprof_Hash *h) {
+  size_t i;
   size_t count = 0; /* Total number of records */
-  size_t nonempty = 0; /* Number of non-empty buckets */
-  size_t min = 0, max = 0; /* Min/Max of non-empty buckets */
-  size_t freqs[LMPROF_HASH_MAXSIZE + 1];
-  double mall = 0.0, mhits = 0.0;
-  double ssqall = 0.0, ssqhits = 0.0;
+  size_t min = 0, max = 0; /* Min/Max probe sequence lengths */
+  double mprobe = 0.0, ssqprobe = 0.0;
 
-  size_t i;
   for (i = 0; i < h->bucket_count; i++) {
-    const lmprof_HashBucket *fh = l_nullptr;
-
-    freqs[i] = 0;
-    for (fh = h->buckets[i]; fh != l_nullptr; fh = fh->next) {
+    const size_t probe = l_cast(size_t, h->slots[i].probe);
+    if (probe > 0) {
       count++;
-      freqs[i]++;
+      mprobe += (double)probe;
+      min = (min == 0 || probe < min) ? probe : min;
+      max = (probe > max) ? probe : max;
     }
-
-    nonempty += (freqs[i] > 0) ? 1 : 0;
-    min = (min == 0 || (freqs[i] > 0 && freqs[i] < min)) ? freqs[i] : min;
-    max = (max == 0 || (freqs[i] > 0 && freqs[i] > max)) ? freqs[i] : max;
   }
 
-  mhits = ((double)count) / ((double)nonempty);
-  mall = ((double)count) / ((double)h->bucket_count);
+  mprobe = (count > 0) ? (mprobe / (double)count) : 0.0;
   for (i = 0; i < h->bucket_count; i++) {
-    ssqall += (((double)freqs[i] - mall) * ((double)freqs[i] - mall));
-    if (freqs[i] > 0)
-      ssqhits += (((double)freqs[i] - mhits) * ((double)freqs[i] - mhits));
+    if (h->slots[i].probe > 0) {
+      const double diff = ((double)h->slots[i].probe - mprobe);
+      ssqprobe += diff * diff;
+    }
   }
 
   luaL_settabsi(L, "buckets", l_cast(lua_Integer, h->bucket_count));
-  luaL_settabsi(L, "used_buckets", l_cast(lua_Integer, nonempty));
-  luaL_settabsi(L, "record_count", l_cast(lua_Integer, count));
+  luaL_settabsi(L, "used_buckets", l_cast(lua_Integer, count));
+  luaL_settabsi(L, "record_count", l_cast(lua_Integer, h->record_count));
   luaL_settabsn(L, "min", l_cast(lua_Number, min));
   luaL_settabsn(L, "max", l_cast(lua_Number, max));
-  luaL_settabsn(L, "mean", l_cast(lua_Number, mall));
-  luaL_settabsn(L, "mean_hits", l_cast(lua_Number, mhits));
-  luaL_settabsn(L, "var", l_cast(lua_Number, ssqall / (double)(h->bucket_count - 1)));
-  luaL_settabsn(L, "var_hits", l_cast(lua_Number, ssqhits / (double)(nonempty - 1)));
+  luaL_settabsn(L, "mean", l_cast(lua_Number, ((double)count) / ((double)h->bucket_count)));
+  luaL_settabsn(L, "mean_hits", l_cast(lua_Number, mprobe));
+  luaL_settabsn(L, "var_hits", l_cast(lua_Number, (count > 1) ? (ssqprobe / (double)(count - 1)) : 0.0));
   return 1;
 }
 
@@ -323,8 +542,9 @@ LUA_API int lmprof_hash_debug(lua_State *L, lmprof_Hash *h) {
 */
 #endif
 
-/* Number of TraceEvent instances that can fit within a single TraceEventPage */
-#define TRACE_EVENT_SIZE_ARRAY ((TRACE_EVENT_PAGE_SIZE - offsetof(TraceEventPage, event_array)) / sizeof(TraceEventPage))
+/* Number of TraceEvent instances (and their heap usage) that can fit within a single TraceEventPage */
+#define TRACE_EVENT_SIZE_ARRAY(H) \
+  ((TRACE_EVENT_PAGE_SIZE - offsetof(TraceEventPage, event_array)) / (sizeof(TraceEvent) + ((H) ? sizeof(lu_sizediff) : 0)))
 
 LUA_API const char *traceevent_strerror(int traceevent_errno) {
   switch (traceevent_errno) {
@@ -349,11 +569,13 @@ LUA_API const char *traceevent_strerror(int traceevent_errno) {
   }
 }
 
-LUA_API TraceEventPage *traceevent_new(lmprof_Alloc *alloc) {
+LUA_API TraceEventPage *traceevent_new(lmprof_Alloc *alloc, int heap) {
   TraceEventPage *page = l_pcast(TraceEventPage *, lmprof_malloc(alloc, TRACE_EVENT_PAGE_SIZE));
   if (page != l_nullptr) {
     page->count = 0;
+    page->size = TRACE_EVENT_SIZE_ARRAY(heap);
     page->next = l_nullptr;
+    page->heap = heap ? l_pcast(lu_sizediff *, &page->event_array[page->size]) : l_nullptr;
     return page;
   }
 
@@ -361,12 +583,17 @@ LUA_API TraceEventPage *traceevent_new(lmprof_Alloc *alloc) {
 }
 
 LUA_API void traceevent_free(lmprof_Alloc *alloc, TraceEventPage *page) {
+  traceevent_clear(alloc, page);
+  lmprof_free(alloc, l_pcast(void *, page), TRACE_EVENT_PAGE_SIZE); /* Deallocate page */
+}
+
+LUA_API void traceevent_clear(lmprof_Alloc *alloc, TraceEventPage *page) {
   size_t i;
   for (i = 0; i < page->count; ++i) {
     TraceEvent *event = &page->event_array[i];
-    event->call.proc.pid = LMPROF_PROCESS_MAIN;
-    event->call.proc.tid = LMPROF_THREAD_BROWSER;
-    unit_clear(&event->call.s);
+    event->time = 0;
+    event->flags = 0;
+    event->line = -1;
     switch (event->op) {
       case PROCESS:
       case THREAD:
@@ -380,7 +607,6 @@ LUA_API void traceevent_free(lmprof_Alloc *alloc, TraceEventPage *page) {
         event->data.sample.next = l_nullptr;
         break;
       case LINE_SCOPE:
-        event->data.line.line = -1;
         event->data.line.info = l_nullptr;
         event->data.line.next = l_nullptr;
         event->data.line.previous = l_nullptr;
@@ -389,12 +615,17 @@ LUA_API void traceevent_free(lmprof_Alloc *alloc, TraceEventPage *page) {
       case END_FRAME:
         event->data.frame.frame = 0;
         break;
+      case SWITCH_ROUTINE:
+        event->data.routine.from = 0;
+        event->data.routine.to = 0;
+        event->data.routine.frame = 0;
+        event->data.routine.count = 0;
+        break;
       case BEGIN_ROUTINE:
       case END_ROUTINE:
       case ENTER_SCOPE:
       case EXIT_SCOPE:
       case IGNORE_SCOPE:
-        event->data.event.flags = 0;
         event->data.event.info = l_nullptr;
         event->data.event.sibling = l_nullptr;
         event->data.event.lines = l_nullptr;
@@ -403,20 +634,128 @@ LUA_API void traceevent_free(lmprof_Alloc *alloc, TraceEventPage *page) {
         break;
     }
   }
+  page->count = 0;
+}
 
-  lmprof_free(alloc, l_pcast(void *, page), TRACE_EVENT_PAGE_SIZE); /* Deallocate page */
+/* Identifier index hashing: thread identifiers are generated sequentially */
+#define THREADS_HASH(P) (l_cast(size_t, (P).tid) ^ (l_cast(size_t, (P).pid) << 16))
+
+static TraceEventThreads *threads_new(lmprof_Alloc *alloc) {
+  TraceEventThreads *T = l_pcast(TraceEventThreads *, lmprof_malloc(alloc, sizeof(TraceEventThreads)));
+  if (T != l_nullptr) {
+    size_t b;
+    T->count = T->last = T->size = 0;
+    T->slots = l_nullptr;
+    for (b = 0; b < TRACE_EVENT_THREAD_BLOCKS; ++b)
+      T->blocks[b] = l_nullptr;
+  }
+  return T;
 }
 
-LUA_API TraceEventTimeline *timeline_new(lmprof_Alloc *alloc, size_t pageLimit) {
+static void threads_free(lmprof_Alloc *alloc, TraceEventThreads *T) {
+  size_t b;
+  for (b = 0; b < TRACE_EVENT_THREAD_BLOCKS && T->blocks[b] != l_nullptr; ++b)
+    lmprof_free(alloc, l_pcast(void *, T->blocks[b]), (l_cast(size_t, 1) << b) * sizeof(lmprof_EventProcess));
+  lmprof_free(alloc, l_pcast(void *, T->slots), T->size * sizeof(size_t));
+  lmprof_free(alloc, l_pcast(void *, T), sizeof(TraceEventThreads));
+}
+
+/* Block of an identifier: floor(log2(index + 1)) */
+static LUA_INLINE size_t threads_block(size_t index) {
+  size_t b = 0;
+  for (index = index + 1; (index >> (b + 1)) != 0; ++b) {
+  }
+  return b;
+}
+
+static LUA_INLINE lmprof_EventProcess *threads_get(const TraceEventThreads *T, size_t index) {
+  const size_t b = threads_block(index);
+  return &T->blocks[b][(index + 1) - (l_cast(size_t, 1) << b)];
+}
+
+static void threads_slot(size_t *slots, size_t size, const lmprof_EventProcess *proc, size_t index) {
+  size_t i = THREADS_HASH(*proc) & (size - 1);
+  while (slots[i] != 0)
+    i = (i + 1) & (size - 1);
+  slots[i] = index + 1;
+}
+
+/* Intern a process/thread identifier; returning an error code. */
+static int threads_intern(lmprof_Alloc *alloc, TraceEventThreads *T, lmprof_EventProcess proc, unsigned int *result) {
+  size_t i, b;
+  lmprof_EventProcess *entry = l_nullptr;
+  if (T->count > 0) {
+    entry = threads_get(T, T->last);
+    if (entry->pid == proc.pid && entry->tid == proc.tid) {
+      *result = l_cast(unsigned int, T->last);
+      return TRACE_EVENT_OK;
+    }
+
+    for (i = THREADS_HASH(proc) & (T->size - 1); T->slots[i] != 0; i = (i + 1) & (T->size - 1)) {
+      entry = threads_get(T, T->slots[i] - 1);
+      if (entry->pid == proc.pid && entry->tid == proc.tid) {
+        T->last = T->slots[i] - 1;
+        *result = l_cast(unsigned int, T->last);
+        return TRACE_EVENT_OK;
+      }
+    }
+  }
+
+  if (T->count == (l_cast(size_t, 1) << TRACE_EVENT_THREAD_BLOCKS) - 1)
+    return TRACE_EVENT_ERRMEM; /* TraceEvent.thread overflow */
+  else if ((T->count + 1) * 2 > T->size) { /* Rehash */
+    const size_t size = (T->size == 0) ? 16 : (T->size << 1);
+    size_t *slots = l_pcast(size_t *, lmprof_malloc(alloc, size * sizeof(size_t)));
+    if (slots == l_nullptr)
+      return TRACE_EVENT_ERRMEM;
+
+    memset(slots, 0, size * sizeof(size_t));
+    for (i = 0; i < T->count; ++i)
+      threads_slot(slots, size, threads_get(T, i), i);
+
+    lmprof_free(alloc, l_pcast(void *, T->slots), T->size * sizeof(size_t));
+    T->slots = slots;
+    T->size = size;
+  }
+
+  b = threads_block(T->count);
+  if (T->blocks[b] == l_nullptr) {
+    const size_t size = (l_cast(size_t, 1) << b) * sizeof(lmprof_EventProcess);
+    if ((T->blocks[b] = l_pcast(lmprof_EventProcess *, lmprof_malloc(alloc, size))) == l_nullptr)
+      return TRACE_EVENT_ERRMEM;
+  }
+
+  entry = threads_get(T, T->count);
+  *entry = proc;
+  threads_slot(T->slots, T->size, entry, T->count);
+  T->last = T->count++;
+  *result = l_cast(unsigned int, T->last);
+  return TRACE_EVENT_OK;
+}
+
+static TraceEventTimeline *timeline_create(lmprof_Alloc *alloc, size_t pageLimit, int flags, TraceEventThreads *threads) {
   TraceEventTimeline *list = l_pcast(TraceEventTimeline *, lmprof_malloc(alloc, sizeof(TraceEventTimeline)));
   if (list != l_nullptr) {
-    TraceEventPage *header = traceevent_new(alloc);
+    TraceEventPage *header = traceevent_new(alloc, BITFIELD_TEST(flags, TRACE_EVENT_TIMELINE_HEAP));
     if (header != l_nullptr) {
       list->page_allocator = alloc;
+      list->flags = flags;
       list->pageCount = 0;
       list->pageLimit = pageLimit / TRACE_EVENT_PAGE_SIZE;
       list->frameCount = 1;
+      list->switchCount = 0;
+      list->recycleCount = 0;
+      list->baseTime = 0;
+      list->threads = threads;
       list->head = list->curr = header;
+      list->synthetic = l_nullptr;
+      list->prologue = l_nullptr;
+
+      list->detached.op = IGNORE_SCOPE;
+      list->detached.flags = 0;
+      list->detached.data.event.info = l_nullptr;
+      list->detached.data.event.sibling = l_nullptr;
+      list->detached.data.event.lines = l_nullptr;
       return list;
     }
     else { /* Could not allocate page header */
@@ -427,6 +766,25 @@ LUA_API TraceEventTimeline *timeline_new(lmprof_Alloc *alloc, size_t pageLimit)
   return l_nullptr;
 }
 
+/* Create an (unbounded) timeline that shares the identifiers and layout of 'list' */
+static TraceEventTimeline *timeline_derive(TraceEventTimeline *list) {
+  const int flags = (list->flags & TRACE_EVENT_TIMELINE_HEAP) | TRACE_EVENT_TIMELINE_SHARED;
+  TraceEventTimeline *derived = timeline_create(list->page_allocator, 0, flags, list->threads);
+  if (derived != l_nullptr)
+    derived->baseTime = list->baseTime;
+  return derived;
+}
+
+LUA_API TraceEventTimeline *timeline_new(lmprof_Alloc *alloc, size_t pageLimit, int heap) {
+  TraceEventTimeline *list = l_nullptr;
+  TraceEventThreads *threads = threads_new(alloc);
+  if (threads != l_nullptr) {
+    if ((list = timeline_create(alloc, pageLimit, heap ? TRACE_EVENT_TIMELINE_HEAP : 0, threads)) == l_nullptr)
+      threads_free(alloc, threads);
+  }
+  return list;
+}
+
 LUA_API void timeline_free(TraceEventTimeline *list) {
   lmprof_Alloc *alloc = list->page_allocator;
 
@@ -437,6 +795,12 @@ LUA_API void timeline_free(TraceEventTimeline *list) {
     page = next;
   }
 
+  if (list->synthetic != l_nullptr)
+    timeline_free(list->synthetic);
+  if (list->prologue != l_nullptr)
+    timeline_free(list->prologue);
+  if (!BITFIELD_TEST(list->flags, TRACE_EVENT_TIMELINE_SHARED))
+    threads_free(alloc, list->threads);
   lmprof_free(alloc, l_pcast(void *, list), sizeof(TraceEventTimeline));
 }
 
@@ -444,14 +808,32 @@ LUA_API size_t timeline_page_size(void) {
   return TRACE_EVENT_PAGE_SIZE;
 }
 
-LUA_API size_t timeline_event_array_size(void) {
-  return TRACE_EVENT_SIZE_ARRAY;
+LUA_API size_t timeline_event_array_size(const TraceEventTimeline *list) {
+  return TRACE_EVENT_SIZE_ARRAY(BITFIELD_TEST(list->flags, TRACE_EVENT_TIMELINE_HEAP));
+}
+
+LUA_API size_t timeline_event_size(const TraceEventTimeline *list) {
+  if (BITFIELD_TEST(list->flags, TRACE_EVENT_TIMELINE_HEAP))
+    return sizeof(TraceEvent) + sizeof(lu_sizediff);
+  return sizeof(TraceEvent);
+}
+
+LUA_API const lmprof_EventProcess *timeline_process(const TraceEventTimeline *list, const TraceEvent *event) {
+  return threads_get(list->threads, event->thread);
+}
+
+LUA_API int timeline_intern(TraceEventTimeline *list, lmprof_EventProcess proc, unsigned int *id) {
+  return threads_intern(list->page_allocator, list->threads, proc, id);
+}
+
+LUA_API const lmprof_EventProcess *timeline_thread(const TraceEventTimeline *list, unsigned int id) {
+  return threads_get(list->threads, id);
 }
 
 LUA_API int timeline_canbuffer(const TraceEventTimeline *list, size_t n) {
   if (list->pageLimit != 0) { /* Remaining in page + remaining pages to allocate */
-    const size_t p_avail = TRACE_EVENT_SIZE_ARRAY - list->curr->count;
-    const size_t s_avail = TRACE_EVENT_SIZE_ARRAY * (list->pageLimit - list->pageCount - 1);
+    const size_t p_avail = list->curr->size - list->curr->count;
+    const size_t s_avail = list->curr->size * (list->pageLimit - list->pageCount - 1);
     return (p_avail + s_avail) <= n;
   }
   return 1; /* Infinite paging */
@@ -463,13 +845,16 @@ LUA_API double timeline_usage(const TraceEventTimeline *list) {
   else {
     const double uniform = 1.0 / (double)list->pageLimit;
     const double result = uniform * ((double)list->pageCount - 1);
-    const double page = ((double)list->curr->count) / ((double)TRACE_EVENT_SIZE_ARRAY);
+    const double page = ((double)list->curr->count) / ((double)list->curr->size);
     return result + uniform * page;
   }
 }
 
 LUA_API void timeline_foreach(TraceEventTimeline *list, TraceEventIterator cb, void *args) {
   TraceEventPage *page = l_nullptr;
+  if (list->prologue != l_nullptr)
+    timeline_foreach(list->prologue, cb, args);
+
   for (page = list->head; page != l_nullptr; page = page->next) {
     size_t i;
     for (i = 0; i < page->count; ++i)
@@ -485,15 +870,16 @@ LUA_API void timeline_foreach(TraceEventTimeline *list, TraceEventIterator cb, v
 ** ===================================================================
 */
 
-#define FETCHPAGE(L, E)                               \
-  TraceEvent *E;                                      \
-  if ((event = timeline_allocpage((L))) == l_nullptr) \
-    return TRACE_EVENT_ERRPAGEFULL;
+#define FETCHPAGE(L, E, O, U)                                  \
+  TraceEvent *E = l_nullptr;                                   \
+  const int E##errno = timeline_append((L), (O), (U), &(E));   \
+  if (E##errno != TRACE_EVENT_OK)                              \
+    return E##errno;
 
 /* Create a new ProfilerEvent node. */
 static TraceEvent *timeline_allocpage(TraceEventTimeline *list) {
   TraceEventPage *page = list->curr;
-  if (page->count == TRACE_EVENT_SIZE_ARRAY) { /* no more available events within the page */
+  if (page->count == page->size) { /* no more available events within the page */
     if (page->next != l_nullptr) { /* use recycled page */
       page = page->next;
       page->count = 0;
@@ -501,7 +887,8 @@ static TraceEvent *timeline_allocpage(TraceEventTimeline *list) {
       list->curr = page;
     }
     /* attempt to allocate additional page */
-    else if ((list->pageLimit == 0 || list->pageCount < list->pageLimit) && (page->next = traceevent_new(list->page_allocator))) {
+    else if ((list->pageLimit == 0 || list->pageCount < list->pageLimit)
+             && (page->next = traceevent_new(list->page_allocator, BITFIELD_TEST(list->flags, TRACE_EVENT_TIMELINE_HEAP)))) {
       page = page->next;
       page->count = 0;
 
@@ -516,46 +903,87 @@ static TraceEvent *timeline_allocpage(TraceEventTimeline *list) {
   return &page->event_array[page->count++];
 }
 
-LUA_API int traceevent_metadata_process(TraceEventTimeline *list, lua_Integer process, const char *name) {
-  FETCHPAGE(list, event);
-  event->op = PROCESS;
-  event->call.proc.pid = process;
-  event->call.proc.tid = LMPROF_THREAD_BROWSER;
-  event->data.process.nameLen = strlen(name);
-  event->data.process.name = lmprof_strdup(list->page_allocator, name, event->data.process.nameLen);
+/* Set the heap usage of an event returned by the last timeline_allocpage */
+static LUA_INLINE void timeline_setheap(TraceEventTimeline *list, const TraceEvent *event, lu_sizediff heap) {
+  if (list->curr->heap != l_nullptr)
+    list->curr->heap[event - list->curr->event_array] = heap;
+}
+
+/* Append an event of the 'unit' thread; its timing adjusted for overhead */
+static int timeline_append(TraceEventTimeline *list, TraceEventType op, const lmprof_EventMeasurement *unit, TraceEvent **result) {
+  TraceEvent *event = l_nullptr;
+  unsigned int thread = 0;
+
+  /* Interned before an event is claimed */
+  const int lmproferrno = threads_intern(list->page_allocator, list->threads, unit->proc, &thread);
+  if (lmproferrno != TRACE_EVENT_OK)
+    return lmproferrno;
+  else if ((event = timeline_allocpage(list)) == l_nullptr)
+    return TRACE_EVENT_ERRPAGEFULL;
+
+  event->op = op;
+  event->flags = 0;
+  event->thread = thread;
+  event->line = -1;
+  event->time = unit->s.time - unit->overhead;
+  timeline_setheap(list, event, unit_allocated(&unit->s));
+
+  *result = event;
   return TRACE_EVENT_OK;
 }
 
-LUA_API int traceevent_metadata_thread(TraceEventTimeline *list, lmprof_EventProcess process, const char *name) {
-  FETCHPAGE(list, event);
-  event->op = THREAD;
-  event->call.proc = process;
-  event->data.process.nameLen = strlen(name);
-  event->data.process.name = lmprof_strdup(list->page_allocator, name, event->data.process.nameLen);
+LUA_API TraceEvent *timeline_reserve(TraceEventTimeline *list, lu_sizediff heap) {
+  TraceEvent *event = timeline_allocpage(list);
+  if (event != l_nullptr)
+    timeline_setheap(list, event, heap);
+  return event;
+}
+
+LUA_API TraceEventTimeline *timeline_prologue(TraceEventTimeline *list) {
+  if (list->prologue == l_nullptr)
+    list->prologue = timeline_derive(list);
+  return list->prologue;
+}
+
+/* Append a PROCESS/THREAD metadata event */
+static int timeline_metadata(TraceEventTimeline *list, TraceEventType op, lmprof_EventProcess process, const char *name) {
+  lmprof_EventMeasurement unit;
+  unit.proc = process;
+  unit.overhead = 0;
+  unit_clear(&unit.s);
+  {
+    FETCHPAGE(list, event, op, &unit);
+    event->data.process.nameLen = strlen(name);
+    event->data.process.name = lmprof_strdup(list->page_allocator, name, event->data.process.nameLen);
+  }
   return TRACE_EVENT_OK;
 }
 
+LUA_API int traceevent_metadata_process(TraceEventTimeline *list, lua_Integer process, const char *name) {
+  lmprof_EventProcess proc;
+  proc.pid = process;
+  proc.tid = LMPROF_THREAD_BROWSER;
+  return timeline_metadata(list, PROCESS, proc, name);
+}
+
+LUA_API int traceevent_metadata_thread(TraceEventTimeline *list, lmprof_EventProcess process, const char *name) {
+  return timeline_metadata(list, THREAD, process, name);
+}
+
 LUA_API int traceevent_beginframe(TraceEventTimeline *list, lmprof_EventMeasurement unit) {
-  FETCHPAGE(list, event);
-  event->op = BEGIN_FRAME;
-  event->call = unit;
+  FETCHPAGE(list, event, BEGIN_FRAME, &unit);
   event->data.frame.frame = ++list->frameCount;
   return TRACE_EVENT_OK;
 }
 
 LUA_API int traceevent_endframe(TraceEventTimeline *list, lmprof_EventMeasurement unit) {
-  FETCHPAGE(list, event);
-  event->op = END_FRAME;
-  event->call = unit;
+  FETCHPAGE(list, event, END_FRAME, &unit);
   event->data.frame.frame = list->frameCount;
   return TRACE_EVENT_OK;
 }
 
 LUA_API int traceevent_beginroutine(TraceEventTimeline *list, lmprof_EventMeasurement unit) {
-  FETCHPAGE(list, event);
-  event->op = BEGIN_ROUTINE;
-  event->call = unit;
-  event->data.event.flags = 0;
+  FETCHPAGE(list, event, BEGIN_ROUTINE, &unit);
   event->data.event.info = l_nullptr;
   event->data.event.sibling = l_nullptr;
   event->data.event.lines = l_nullptr;
@@ -563,22 +991,41 @@ LUA_API int traceevent_beginroutine(TraceEventTimeline *list, lmprof_EventMeasur
 }
 
 LUA_API int traceevent_endroutine(TraceEventTimeline *list, lmprof_EventMeasurement unit) {
-  FETCHPAGE(list, event);
-  event->op = END_ROUTINE;
-  event->call = unit;
-  event->data.event.flags = 0;
+  FETCHPAGE(list, event, END_ROUTINE, &unit);
   event->data.event.info = l_nullptr;
   event->data.event.sibling = l_nullptr;
   event->data.event.lines = l_nullptr;
   return TRACE_EVENT_OK;
 }
 
+LUA_API int traceevent_switchroutine(TraceEventTimeline *list, lmprof_EventMeasurement unit, lua_Integer from, lua_Integer to, int draw_frame) {
+  int result = TRACE_EVENT_OK;
+  TraceEvent *event = l_nullptr;
+  unsigned int from_id = 0, to_id = 0;
+  lmprof_EventProcess proc = unit.proc;
+
+  proc.tid = from;
+  if ((result = threads_intern(list->page_allocator, list->threads, proc, &from_id)) != TRACE_EVENT_OK)
+    return result;
+
+  proc.tid = to;
+  if ((result = threads_intern(list->page_allocator, list->threads, proc, &to_id)) != TRACE_EVENT_OK)
+    return result;
+  else if ((result = timeline_append(list, SWITCH_ROUTINE, &unit, &event)) != TRACE_EVENT_OK)
+    return result;
+
+  event->data.routine.from = from_id;
+  event->data.routine.to = to_id;
+  event->data.routine.frame = draw_frame ? ++list->frameCount : 0;
+  event->data.routine.count = 0;
+
+  list->switchCount++;
+  return TRACE_EVENT_OK;
+}
+
 LUA_API int traceevent_enterscope(TraceEventTimeline *list, TraceEventStackInstance *inst) {
-  FETCHPAGE(list, event);
-  event->op = ENTER_SCOPE;
-  event->call = inst->call;
-  event->data.event.info = &inst->record->info;
-  event->data.event.flags = 0;
+  FETCHPAGE(list, event, ENTER_SCOPE, &inst->call);
+  event->data.event.info = inst->record->info;
   event->data.event.sibling = l_nullptr;
   event->data.event.lines = l_nullptr;
 
@@ -587,11 +1034,8 @@ LUA_API int traceevent_enterscope(TraceEventTimeline *list, TraceEventStackInsta
 }
 
 LUA_API int traceevent_exitscope(TraceEventTimeline *list, TraceEventStackInstance *inst) {
-  FETCHPAGE(list, event);
-  event->op = EXIT_SCOPE;
-  event->call = inst->call;
-  event->data.event.info = &inst->record->info;
-  event->data.event.flags = 0;
+  FETCHPAGE(list, event, EXIT_SCOPE, &inst->call);
+  event->data.event.info = inst->record->info;
   event->data.event.sibling = l_nullptr;
   event->data.event.lines = l_nullptr;
 
@@ -603,112 +1047,541 @@ LUA_API int traceevent_exitscope(TraceEventTimeline *list, TraceEventStackInstan
 }
 
 LUA_API int traceevent_sample(TraceEventTimeline *list, TraceEventStackInstance *inst, lmprof_EventMeasurement unit, int line) {
-  FETCHPAGE(list, event);
-  if (inst->begin_event == l_nullptr) {
+  int result = TRACE_EVENT_OK;
+  TraceEvent *event = l_nullptr;
+  if (inst->begin_event == l_nullptr) { /* Checked before an event is claimed: pages may be reused */
     LMPROF_LOG("No event sibling for sample!\n");
     return TRACE_EVENT_OK;
   }
+  else if ((result = timeline_append(list, (line == -1) ? SAMPLE_EVENT : LINE_SCOPE, &unit, &event)) != TRACE_EVENT_OK) {
+    return result;
+  }
 
   if (line == -1) {
-    event->op = SAMPLE_EVENT;
-    event->call = unit;
     event->data.sample.next = l_nullptr;
   }
   else {
     TraceEvent *lines = inst->begin_event->data.event.lines;
-    event->op = LINE_SCOPE;
-    event->call = unit;
-    event->data.line.line = line;
-    event->data.line.info = &inst->record->info;
+    event->line = line;
+    event->data.line.info = inst->record->info;
     event->data.line.previous = lines;
     event->data.line.next = l_nullptr;
 
-    /* Update lines list */
-    if (lines != l_nullptr)
-      lines->data.line.next = event;
-    inst->begin_event->data.event.lines = event;
+    /* Update lines list: the lines of a detached scope are not tracked */
+    if (inst->begin_event == &list->detached)
+      event->data.line.previous = l_nullptr;
+    else {
+      if (lines != l_nullptr)
+        lines->data.line.next = event;
+      inst->begin_event->data.event.lines = event;
+    }
   }
   return TRACE_EVENT_OK;
 }
 
-LUA_API void timeline_adjust(TraceEventTimeline *list) {
-  const lu_time base = list->baseTime;
+/* Event is an element of the given page */
+#define EVENT_IN_PAGE(P, E) ((E) >= (P)->event_array && (E) < ((P)->event_array + (P)->count))
+
+/* An event of a recycled page (or the previous prologue) that is still open. */
+static int recycle_open(const TraceEvent *event, const TraceEventPage *page, const TraceEvent *routine, const TraceEvent *frame) {
+  switch (event->op) {
+    case ENTER_SCOPE:
+      return event->data.event.sibling == l_nullptr || !EVENT_IN_PAGE(page, event->data.event.sibling);
+    case BEGIN_ROUTINE:
+      return event == routine;
+    case BEGIN_FRAME:
+      return event == frame;
+    default:
+      return 0;
+  }
+}
+
+/* Copy an event of 'source' into the prologue, forwarding all references to the copy */
+static int recycle_carry(TraceEventTimeline *prologue, const TraceEventPage *source, TraceEvent *event, const TraceEventPage *page, const TraceEvent *boundary) {
+  TraceEvent *copy = timeline_allocpage(prologue);
+  if (copy == l_nullptr)
+    return TRACE_EVENT_ERRMEM;
+
+  *copy = *event;
+  if (event->op == PROCESS || event->op == THREAD) { /* Ownership of 'name' transferred */
+    event->data.process.name = l_nullptr;
+    event->data.process.nameLen = 0;
+    return TRACE_EVENT_OK;
+  }
+  else if (boundary != l_nullptr) { /* Moved to the start of the retained window */
+    copy->time = boundary->time;
+    timeline_setheap(prologue, copy, traceevent_heap(page, boundary));
+  }
+  else {
+    timeline_setheap(prologue, copy, traceevent_heap(source, event));
+  }
+
+  if (event->op == ENTER_SCOPE) {
+    if (copy->data.event.sibling != l_nullptr)
+      copy->data.event.sibling->data.event.sibling = copy;
+    if (copy->data.event.lines != l_nullptr && EVENT_IN_PAGE(page, copy->data.event.lines))
+      copy->data.event.lines = l_nullptr;
+
+    event->flags |= TRACE_EVENT_RELOCATED;
+    event->data.event.sibling = copy;
+  }
+  return TRACE_EVENT_OK;
+}
+
+/* Carry all metadata (or open) events of 'source' into the prologue. */
+static int recycle_page(TraceEventTimeline *prologue, TraceEventPage *source, const TraceEventPage *page, const TraceEvent *routine, const TraceEvent *frame, const TraceEvent *boundary, int metadata) {
+  size_t i;
+  int result = TRACE_EVENT_OK;
+  for (i = 0; i < source->count && result == TRACE_EVENT_OK; ++i) {
+    TraceEvent *event = &source->event_array[i];
+    if (metadata ? (event->op == PROCESS || event->op == THREAD) : recycle_open(event, page, routine, frame))
+      result = recycle_carry(prologue, source, event, page, boundary);
+  }
+  return result;
+}
+
+LUA_API TraceEvent *timeline_relocated(const TraceEventTimeline *list, TraceEvent *event) {
+  const TraceEventPage *page = l_nullptr;
+  if (event == l_nullptr)
+    return l_nullptr;
+  else if (EVENT_IN_PAGE(list->head, event))
+    page = list->head;
+  else if (list->prologue != l_nullptr) {
+    for (page = list->prologue->head; page != l_nullptr; page = page->next) {
+      if (EVENT_IN_PAGE(page, event))
+        break;
+    }
+  }
+
+  if (page == l_nullptr)
+    return event; /* Not recycled */
+  else if (event->op == ENTER_SCOPE && (event->flags & TRACE_EVENT_RELOCATED))
+    return event->data.event.sibling;
+  return l_nullptr;
+}
+
+LUA_API int timeline_recycle(TraceEventTimeline *list, TraceEventRelocate cb, void *args) {
+  size_t i;
+  int metadata;
+  int result = TRACE_EVENT_OK;
+  TraceEventPage *page = list->head;
+  TraceEventPage *source = l_nullptr;
+  TraceEventTimeline *prologue = l_nullptr;
+  TraceEvent *routine = l_nullptr; /* Open BEGIN_ROUTINE */
+  TraceEvent *frame = l_nullptr; /* Open BEGIN_FRAME */
+  const TraceEvent *boundary = l_nullptr; /* Last timed event of the page */
+  if (page == list->curr)
+    return TRACE_EVENT_ERRPAGEFULL;
+  else if ((prologue = timeline_derive(list)) == l_nullptr)
+    return TRACE_EVENT_ERRMEM;
+
+  if (list->prologue != l_nullptr) {
+    for (source = list->prologue->head; source != l_nullptr; source = source->next) {
+      for (i = 0; i < source->count; ++i) {
+        TraceEvent *event = &source->event_array[i];
+        if (event->op == BEGIN_ROUTINE)
+          routine = event;
+        else if (event->op == BEGIN_FRAME)
+          frame = event;
+      }
+    }
+  }
+
+  /* Close all carried events that end within the page */
+  for (i = 0; i < page->count; ++i) {
+    TraceEvent *event = &page->event_array[i];
+    switch (event->op) {
+      case BEGIN_ROUTINE:
+        routine = event;
+        break;
+      case END_ROUTINE:
+        routine = l_nullptr;
+        break;
+      case BEGIN_FRAME:
+        frame = event;
+        break;
+      case END_FRAME:
+        frame = l_nullptr;
+        break;
+      case EXIT_SCOPE: {
+        TraceEvent *sibling = event->data.event.sibling;
+        if (sibling != l_nullptr && !EVENT_IN_PAGE(page, sibling))
+          sibling->op = IGNORE_SCOPE; /* Closed: a (carried) ENTER_SCOPE of the prologue */
+        break;
+      }
+      case LINE_SCOPE: {
+        TraceEvent *next = event->data.line.next;
+        if (next != l_nullptr && !EVENT_IN_PAGE(page, next))
+          next->data.line.previous = l_nullptr;
+        break;
+      }
+      default:
+        break;
+    }
+
+    if (op_adjust(event->op))
+      boundary = event;
+  }
+
+  /* Metadata first, followed by all open events in order of occurrence */
+  for (metadata = 1; metadata >= 0 && result == TRACE_EVENT_OK; --metadata) {
+    if (list->prologue != l_nullptr) {
+      for (source = list->prologue->head; source != l_nullptr && result == TRACE_EVENT_OK; source = source->next)
+        result = recycle_page(prologue, source, page, routine, frame, boundary, metadata);
+    }
+    if (result == TRACE_EVENT_OK)
+      result = recycle_page(prologue, page, page, routine, frame, boundary, metadata);
+  }
+
+  if (result != TRACE_EVENT_OK) {
+    timeline_free(prologue);
+    return result;
+  }
+
+  if (cb != l_nullptr)
+    cb(list, args);
+  if (list->prologue != l_nullptr)
+    timeline_free(list->prologue);
+
+  /* Reuse the page once the current page has been filled */
+  list->prologue = prologue;
+  list->head = page->next;
+  list->curr->next = page;
+  page->next = l_nullptr;
+  page->count = 0;
+  list->recycleCount++;
+  return TRACE_EVENT_OK;
+}
+
+LUA_API TraceEventPage *timeline_detach(TraceEventTimeline *list, TraceEventPage *pages) {
+  size_t count = 0;
+  TraceEventPage *page = l_nullptr;
+  TraceEventPage *head = list->head;
+  if (pages == l_nullptr && (pages = traceevent_new(list->page_allocator, BITFIELD_TEST(list->flags, TRACE_EVENT_TIMELINE_HEAP))) == l_nullptr)
+    return l_nullptr;
+
+  for (page = pages; page != l_nullptr; page = page->next) {
+    page->count = 0;
+    count++;
+  }
+
+  list->head = list->curr = pages;
+  list->pageCount = count - 1;
+  return head;
+}
+
+/*
+** A 'shadow' of a coroutine call stack: the buffered ENTER_SCOPE events of each
+** function that has yet to exit.
+*/
+typedef struct TraceEventShadowFrame {
+  TraceEvent *origin; /* ENTER_SCOPE buffered when the function was called */
+  TraceEvent *begin; /* ENTER_SCOPE of the current segment: 'origin' or synthetic */
+} TraceEventShadowFrame;
+
+typedef struct TraceEventShadow {
+  size_t id; /* interned thread identifier offset by one; zero if not yet known */
+  size_t count;
+  size_t size;
+  TraceEventShadowFrame *frames;
+} TraceEventShadow;
+
+typedef struct TraceEventExpand {
+  lmprof_Alloc *alloc;
+  TraceEventTimeline *synthetic;
+  size_t generated; /* Number of synthetic events */
+  size_t count;
+  size_t size;
+  TraceEventShadow *shadows;
+} TraceEventExpand;
+
+static TraceEventShadow *expand_shadow(TraceEventExpand *E, size_t id) {
+  size_t i;
+  for (i = E->count; i > 0; --i) {
+    if (E->shadows[i - 1].id == id)
+      return &E->shadows[i - 1];
+  }
+
+  if (E->count == E->size) {
+    const size_t size = (E->size == 0) ? 8 : (E->size << 1);
+    TraceEventShadow *shadows = l_pcast(TraceEventShadow *, lmprof_realloc(E->alloc, E->shadows, E->size * sizeof(TraceEventShadow), size * sizeof(TraceEventShadow)));
+    if (shadows == l_nullptr)
+      return l_nullptr;
+
+    E->shadows = shadows;
+    E->size = size;
+  }
+
+  E->shadows[E->count].id = id;
+  E->shadows[E->count].count = 0;
+  E->shadows[E->count].size = 0;
+  E->shadows[E->count].frames = l_nullptr;
+  return &E->shadows[E->count++];
+}
+
+static int expand_push(TraceEventExpand *E, TraceEventShadow *shadow, TraceEvent *event) {
+  if (shadow->count == shadow->size) {
+    const size_t size = (shadow->size == 0) ? 16 : (shadow->size << 1);
+    TraceEventShadowFrame *frames = l_pcast(TraceEventShadowFrame *, lmprof_realloc(E->alloc, shadow->frames, shadow->size * sizeof(TraceEventShadowFrame), size * sizeof(TraceEventShadowFrame)));
+    if (frames == l_nullptr)
+      return 0;
+
+    shadow->frames = frames;
+    shadow->size = size;
+  }
+
+  shadow->frames[shadow->count].origin = event;
+  shadow->frames[shadow->count].begin = event;
+  shadow->count++;
+  return 1;
+}
+
+/* Append a synthetic scope, routine, or frame event of the 'sw' event of 'page' */
+static TraceEvent *expand_event(TraceEventExpand *E, const TraceEventPage *page, const TraceEvent *sw, TraceEventType op, const TraceEventShadowFrame *frame) {
+  TraceEvent *event = l_nullptr;
+  unsigned int thread = sw->thread;
+  if (op_frame(op)) { /* Frames are drawn on the main thread */
+    lmprof_EventProcess proc = *timeline_process(E->synthetic, sw);
+    proc.tid = LMPROF_THREAD_BROWSER;
+    if (threads_intern(E->alloc, E->synthetic->threads, proc, &thread) != TRACE_EVENT_OK)
+      return l_nullptr;
+  }
+
+  if ((event = timeline_allocpage(E->synthetic)) != l_nullptr) {
+    E->generated++;
+    event->op = op;
+    event->flags = 0;
+    event->thread = thread;
+    event->line = -1;
+    event->time = sw->time;
+    timeline_setheap(E->synthetic, event, traceevent_heap(page, sw));
+    if (op_frame(op)) {
+      event->data.frame.frame = (op == BEGIN_FRAME) ? sw->data.routine.frame : (sw->data.routine.frame - 1);
+    }
+    else {
+      event->data.event.info = (frame == l_nullptr) ? l_nullptr : frame->origin->data.event.info;
+      event->data.event.sibling = l_nullptr;
+      event->data.event.lines = l_nullptr;
+    }
+  }
+  return event;
+}
+
+static int expand_switch(TraceEventExpand *E, TraceEventShadow **current, const TraceEventPage *page, TraceEvent *sw) {
+  size_t i;
+  TraceEvent *event = l_nullptr;
+  TraceEventShadow *shadow = *current;
+  const size_t generated = E->generated;
+
+  /* The stack active prior to the first switch */
+  if (shadow->id == 0)
+    shadow->id = l_cast(size_t, sw->data.routine.from) + 1;
+
+  for (i = 0; i < shadow->count; ++i) {
+    TraceEventShadowFrame *frame = &shadow->frames[i];
+    if ((event = expand_event(E, page, sw, EXIT_SCOPE, frame)) == l_nullptr)
+      return TRACE_EVENT_ERRMEM;
+
+    frame->begin->data.event.sibling = event;
+    event->data.event.sibling = frame->begin;
+  }
+
+  if (expand_event(E, page, sw, END_ROUTINE, l_nullptr) == l_nullptr)
+    return TRACE_EVENT_ERRMEM;
+  else if (sw->data.routine.frame != 0) {
+    if (expand_event(E, page, sw, END_FRAME, l_nullptr) == l_nullptr
+        || expand_event(E, page, sw, BEGIN_FRAME, l_nullptr) == l_nullptr)
+      return TRACE_EVENT_ERRMEM;
+  }
+
+  if (expand_event(E, page, sw, BEGIN_ROUTINE, l_nullptr) == l_nullptr)
+    return TRACE_EVENT_ERRMEM;
+  else if ((shadow = expand_shadow(E, l_cast(size_t, sw->data.routine.to) + 1)) == l_nullptr)
+    return TRACE_EVENT_ERRMEM;
+
+  for (i = 0; i < shadow->count; ++i) {
+    TraceEventShadowFrame *frame = &shadow->frames[i];
+    if ((frame->begin = expand_event(E, page, sw, ENTER_SCOPE, frame)) == l_nullptr)
+      return TRACE_EVENT_ERRMEM;
+  }
+
+  *current = shadow;
+  sw->data.routine.count = E->generated - generated;
+  return TRACE_EVENT_OK;
+}
+
+LUA_API int timeline_expand(TraceEventTimeline *list) {
+  int result = TRACE_EVENT_OK;
+  TraceEventPage *page = l_nullptr;
+  TraceEventShadow *current = l_nullptr;
+
+  size_t i;
+  TraceEventExpand E;
+  if (list->switchCount == 0 || list->synthetic != l_nullptr)
+    return TRACE_EVENT_OK;
+  else if ((list->synthetic = timeline_derive(list)) == l_nullptr)
+    return TRACE_EVENT_ERRMEM;
+
+  list->synthetic->frameCount = list->frameCount;
+
+  E.alloc = list->page_allocator;
+  E.synthetic = list->synthetic;
+  E.generated = 0;
+  E.count = E.size = 0;
+  E.shadows = l_nullptr;
+  if ((current = expand_shadow(&E, 0)) == l_nullptr)
+    return TRACE_EVENT_ERRMEM;
+
+  for (page = list->head; page != l_nullptr && result == TRACE_EVENT_OK; page = page->next) {
+    for (i = 0; i < page->count && result == TRACE_EVENT_OK; ++i) {
+      TraceEvent *event = &page->event_array[i];
+      switch (event->op) {
+        case ENTER_SCOPE: {
+          event->data.event.lines = l_nullptr; /* Rebuilt on a per-segment basis */
+          if (!expand_push(&E, current, event))
+            result = TRACE_EVENT_ERRMEM;
+          break;
+        }
+        case EXIT_SCOPE: {
+          size_t j;
+          for (j = current->count; j > 0; --j) {
+            TraceEventShadowFrame *frame = &current->frames[j - 1];
+            if (frame->origin == event->data.event.sibling && event->data.event.sibling != l_nullptr) {
+              frame->begin->data.event.sibling = event;
+              event->data.event.sibling = frame->begin;
+              for (; j < current->count; ++j)
+                current->frames[j - 1] = current->frames[j];
+              current->count--;
+              break;
+            }
+          }
+          break;
+        }
+        case LINE_SCOPE: {
+          TraceEvent *begin = (current->count == 0) ? l_nullptr : current->frames[current->count - 1].begin;
+          event->data.line.previous = l_nullptr;
+          event->data.line.next = l_nullptr;
+          if (begin != l_nullptr) {
+            TraceEvent *lines = begin->data.event.lines;
+            if (lines != l_nullptr)
+              lines->data.line.next = event;
+            event->data.line.previous = lines;
+            begin->data.event.lines = event;
+          }
+          break;
+        }
+        case SWITCH_ROUTINE: {
+          result = expand_switch(&E, &current, page, event);
+          break;
+        }
+        default:
+          break;
+      }
+    }
+  }
+
+  for (i = 0; i < E.count; ++i)
+    lmprof_free(E.alloc, l_pcast(void *, E.shadows[i].frames), E.shadows[i].size * sizeof(TraceEventShadowFrame));
+  lmprof_free(E.alloc, l_pcast(void *, E.shadows), E.size * sizeof(TraceEventShadow));
+  return result;
+}
+
+LUA_API void traceevent_adjust(TraceEventPage *page, lu_time baseTime) {
+  size_t i;
 #if LMPROF_HAS_LOGGER
   lu_time last = 0;
 #endif
 
-  TraceEventPage *page = l_nullptr;
-  for (page = list->head; page != l_nullptr; page = page->next) {
-    size_t i;
-    for (i = 0; i < page->count; ++i) {
-      TraceEvent *event = &page->event_array[i];
-      if (op_adjust(event->op)) {
-        lu_time time = event->call.s.time;
+  for (i = 0; i < page->count; ++i) {
+    TraceEvent *event = &page->event_array[i];
+    if (op_adjust(event->op)) {
+      lu_time time = event->time;
 #if LMPROF_HAS_LOGGER
-        if (base > time) {
-          const char *name = LMPROF_RECORD_NAME_UNKNOWN;
-          if (op_event(event->op))
-            name = LMPROF_RECORD_NAME(event->data.event.info->source, LMPROF_RECORD_NAME_UNKNOWN);
-          LMPROF_LOG("Incorrect base time: %s %" PRIluTIME " %" PRIluTIME "\n", name, LU_TIME_MICRO(time), LU_TIME_MICRO(last));
-        }
+      if (baseTime > time) {
+        const char *name = LMPROF_RECORD_NAME_UNKNOWN;
+        if (op_event(event->op))
+          name = LMPROF_RECORD_NAME(event->data.event.info->source, LMPROF_RECORD_NAME_UNKNOWN);
+        LMPROF_LOG("Incorrect base time: %s %" PRIluTIME " %" PRIluTIME "\n", name, LU_TIME_MICRO(time), LU_TIME_MICRO(last));
+      }
 #endif
 
-        time -= base;
-        time -= event->call.overhead;
+      time -= baseTime; /* Overhead removed by timeline_append */
 
-        /*
-        ** Ensure times are strictly increasing after taking into account
-        ** overhead and base-time adjustments.
-        */
+      /*
+      ** Ensure times are strictly increasing after taking into account
+      ** overhead and base-time adjustments.
+      */
 #if LMPROF_HAS_LOGGER
-        if (time < last) {
-          const char *name = LMPROF_RECORD_NAME_UNKNOWN;
-          if (op_event(event->op))
-            name = LMPROF_RECORD_NAME(event->data.event.info->source, LMPROF_RECORD_NAME_UNKNOWN);
-          LMPROF_LOG("Time not strictly increasing: %d %s %" PRIluTIME " %" PRIluTIME "\n", event->op, name, LU_TIME_MICRO(time), LU_TIME_MICRO(last));
-        }
-        last = time;
-#endif
-        event->call.s.time = time;
+      if (time < last) {
+        const char *name = LMPROF_RECORD_NAME_UNKNOWN;
+        if (op_event(event->op))
+          name = LMPROF_RECORD_NAME(event->data.event.info->source, LMPROF_RECORD_NAME_UNKNOWN);
+        LMPROF_LOG("Time not strictly increasing: %d %s %" PRIluTIME " %" PRIluTIME "\n", event->op, name, LU_TIME_MICRO(time), LU_TIME_MICRO(last));
       }
+      last = time;
+#endif
+      event->time = time;
     }
   }
 }
 
+LUA_API void timeline_adjust(TraceEventTimeline *list) {
+  TraceEventPage *page = l_nullptr;
+  for (page = list->head; page != l_nullptr; page = page->next)
+    traceevent_adjust(page, list->baseTime);
+
+  if (list->synthetic != l_nullptr)
+    timeline_adjust(list->synthetic);
+  if (list->prologue != l_nullptr)
+    timeline_adjust(list->prologue);
+}
+
+LUA_API void traceevent_ignorescope(TraceEvent *event) {
+  TraceEvent *tail;
+
+  /*
+  ** @TODO: If non-meta TraceEvents ever allocate their own data, this
+  ** logic must change (i.e., IGNORE_SCOPE becomes a flag).
+  */
+  event->op = IGNORE_SCOPE;
+  if (event->data.event.sibling != l_nullptr)
+    event->data.event.sibling->op = IGNORE_SCOPE;
+  /* The remaining lines of an ignored line have been ignored */
+  for (tail = event->data.event.lines; tail != l_nullptr && tail->op != IGNORE_SCOPE; tail = tail->data.line.previous) {
+    tail->op = IGNORE_SCOPE;
+  }
+}
+
 /* Simplification */
-#define INCLUDE_PROCESS(E, O) ((O).id.pid == 0 || (E)->call.proc.pid == (O).id.pid)
-#define INCLUDE_THREAD(E, O) (INCLUDE_PROCESS(E, O) && ((O).id.tid == 0 || (E)->call.proc.tid == (O).id.tid))
+#define INCLUDE_PROCESS(P, O) ((O).id.pid == 0 || (P)->pid == (O).id.pid)
+#define INCLUDE_THREAD(P, O) (INCLUDE_PROCESS(P, O) && ((O).id.tid == 0 || (P)->tid == (O).id.tid))
 #define INCLUDE_DURATION(D, O) ((O).threshold == 0 || ((D) >= (O).threshold))
 
 LUA_API int timeline_compress(TraceEventTimeline *list, TraceEventCompressOpts opts) {
+  int result = TRACE_EVENT_OK;
   TraceEventPage *page = list->head;
   for (page = list->head; page != l_nullptr; page = page->next) {
     size_t i;
     for (i = 0; i < page->count; ++i) {
       TraceEvent *event = &page->event_array[i];
-      if (!INCLUDE_THREAD(event, opts))
+      if (!INCLUDE_THREAD(timeline_process(list, event), opts))
         continue;
       else if (event->op == ENTER_SCOPE && event->data.event.sibling != l_nullptr) {
         TraceEvent *sibling = event->data.event.sibling;
-        const lu_time delta_time = sibling->call.s.time - event->call.s.time;
+        const lu_time delta_time = sibling->time - event->time;
         const int ignore = BITFIELD_TEST(event->data.event.info->event, LMPROF_RECORD_IGNORED)
                            || !INCLUDE_DURATION(delta_time, opts);
 
-        /*
-        ** @TODO: If non-meta TraceEvents ever allocate their own data, this
-        ** logic must change (i.e., IGNORE_SCOPE becomes a flag).
-        */
-        if (ignore) {
-          TraceEvent *tail;
-          event->op = sibling->op = IGNORE_SCOPE;
-          for (tail = event->data.event.lines; tail != l_nullptr; tail = tail->data.line.previous) {
-            tail->op = IGNORE_SCOPE;
-          }
-        }
+        if (ignore)
+          traceevent_ignorescope(event);
       }
     }
   }
 
+  if (list->synthetic != l_nullptr && (result = timeline_compress(list->synthetic, opts)) != TRACE_EVENT_OK)
+    return result;
+  if (list->prologue != l_nullptr)
+    return timeline_compress(list->prologue, opts);
   return TRACE_EVENT_OK;
 }
 
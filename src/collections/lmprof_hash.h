@@ -1,8 +1,9 @@
 /*
 ** $Id: lmprof_hash.h $
 **
-** A simple hashtable implementation for representing <parent, child>
-** relationships between functions (i.e., parent invoking child).
+** An open-addressing hashtable implementation for representing
+** <parent, child> relationships between functions (i.e., parent invoking
+** child).
 **
 ** See Copyright Notice in lmprof_lib.h
 */
@@ -12,42 +13,63 @@
 #include "../lmprof_conf.h"
 
 /*
-@@ LMPROF_HASH_MAXSIZE: The maximum allowable size of the hash table. This value
-** is used to simplify hash operations that allocate intermediate data.
+@@ LMPROF_HASH_SIZE: Default (initial) number of slots in a hash table. The
+** table grows as required and the slot count is rounded up to a power of two.
 */
-#define LMPROF_HASH_MAXSIZE 1031
+#if !defined(LMPROF_HASH_SIZE)
+  #define LMPROF_HASH_SIZE 256
+#endif
 
 /*
-@@ LMPROF_HASH_SIZE: Default number of buckets in a hash table. The upper limit
-** is defined by LMPROF_HASH_MAXSIZE.
+@@ LMPROF_HASH_MAXSIZE: The maximum allowable initial size of a hash table,
+** i.e., the upper limit of the 'hash_size' option.
 */
-#if !defined(LMPROF_HASH_SIZE)
-  #define LMPROF_HASH_SIZE 257
+#if !defined(LMPROF_HASH_MAXSIZE)
+  #define LMPROF_HASH_MAXSIZE (1 << 20)
 #endif
 
-#if LMPROF_HASH_SIZE > LMPROF_HASH_MAXSIZE
+/*
+@@ LMPROF_HASH_LOAD_FACTOR: Maximum percentage of occupied slots before the
+** hash table is doubled in size.
+*/
+#if !defined(LMPROF_HASH_LOAD_FACTOR)
+  #define LMPROF_HASH_LOAD_FACTOR 75
+#endif
+
+#if LMPROF_HASH_SIZE < 1 || LMPROF_HASH_SIZE > LMPROF_HASH_MAXSIZE
   #error "Invalid Hash size!"
 #endif
 
+#if LMPROF_HASH_LOAD_FACTOR < 10 || LMPROF_HASH_LOAD_FACTOR > 95
+  #error "LMPROF_HASH_LOAD_FACTOR must be within [10, 95]"
+#endif
+
 /*
-** Separately chained bucket, i.e., a list of profiler records that share the
-** same index.
+** An open-addressing (Robin Hood) slot: the <function, parent, line> key of
+** the record is stored inline to avoid dereferencing records while probing.
 */
-typedef struct lmprof_HashBucket {
+typedef struct lmprof_HashSlot {
+  lu_addr fid; /* Function identifier */
+  lu_addr pid; /* Parent identifier */
+  int p_currentline; /* Callsite of the parent */
+  unsigned int probe; /* Probe sequence length + 1; zero for empty slots */
   struct lmprof_Record *record; /* Function Details & Statistics */
-  struct lmprof_HashBucket *next; /* Bucket next */
-} lmprof_HashBucket;
+} lmprof_HashSlot;
 
-/* Hashtable implemented as an array of chained hash buckets */
+/* Hashtable implemented as a growable array of open-addressing slots */
 typedef struct lmprof_Hash {
-  size_t bucket_count;
-  lmprof_HashBucket *buckets[1];
+  size_t bucket_count; /* Number of slots (power of two) */
+  size_t record_count; /* Number of occupied slots */
+  lmprof_HashSlot *slots;
 } lmprof_Hash;
 
 /* Create a new hash table, returning NULL on error. */
 LUA_API lmprof_Hash *lmprof_hash_create(lmprof_Alloc *alloc, size_t bucket_count);
 
-/* Destroy & free a hashtable instance. */
+/*
+** Destroy & free a hashtable instance. The contents of each record are cleared;
+** the records themselves are owned by the arena that allocated them.
+*/
 LUA_API void lmprof_hash_destroy(lmprof_Alloc *alloc, lmprof_Hash *hash);
 
 /* Create an identifier that mixes the functions identifier with its parent. */
@@ -61,13 +83,14 @@ LUA_API struct lmprof_Record *lmprof_hash_get(lmprof_Hash *h, lu_addr fid, lu_ad
 
 /*
 ** Inserts the function record into the hash table, i.e., associates the
-** function & parent identifier with the function record.
+** function & parent identifier with the function record. The record must not
+** already be present. Returns zero if the table failed to grow.
 */
 LUA_API int lmprof_hash_insert(lmprof_Alloc *alloc, lmprof_Hash *h, struct lmprof_Record *record);
 
 /*
-** Clear all records (i.e., lstrace_clear) contained within all hashbuckets of
-** the provided hashtable.
+** Clear all records (i.e., lstrace_clear) contained within all slots of the
+** provided hashtable.
 */
 LUA_API void lmprof_hash_clear_statistics(lmprof_Hash *h);
 
@@ -81,14 +104,14 @@ LUA_API void lmprof_hash_clear_statistics(lmprof_Hash *h);
 typedef int (*lmprof_hash_Callback)(lua_State *, struct lmprof_Record *, const void *);
 
 /*
-** Traverse through each hash bucket of the provided hashtable and invoking "cb"
-** for each stack instance in the stack.
+** Traverse through each occupied slot of the provided hashtable and invoking
+** "cb" for each record in the hashtable.
 */
 LUA_API void lmprof_hash_report(lua_State *L, lmprof_Hash *h, lmprof_hash_Callback cb, const void *args);
 
 /*
 ** Push a table on top of the Lua stack that contains some summary statistics
-** of the hash buckets & hashing algorithm.
+** of the hash slots & probe sequence lengths.
 */
 LUA_API int lmprof_hash_debug(lua_State *L, lmprof_Hash *h);
 
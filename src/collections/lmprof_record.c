@@ -138,7 +138,7 @@ static int pushglobalfuncname(lua_State *L, lua_Debug *ar) {
 /* SOURCE: lauxlib.c */
 static const char *getfuncinfo(lua_State *L, lua_Debug *ar, size_t *len) {
   const int top = lua_gettop(L);
-  if (ar->name == l_nullptr)
+  if (ar->name == l_nullptr && ar->i_ci != LUA_CALLINFO_NULL)
     lua_getinfo(L, DEBUG_NAME, ar);
 
   /*
@@ -298,11 +298,13 @@ LUA_API void lmprof_record_initialize(lua_State *L) {
 }
 
 LUA_API lmprof_Record *lmprof_record_new(lua_State *L) {
-  lmprof_Record *record = l_pcast(lmprof_Record *, lmprof_newuserdata(L, sizeof(lmprof_Record)));
+  const size_t size = sizeof(lmprof_Record) + sizeof(lmprof_FunctionInfo);
+  lmprof_Record *record = l_pcast(lmprof_Record *, lmprof_newuserdata(L, size));
   if (record != l_nullptr) { /* [..., f_table, function, userdata] */
-    memset(l_pcast(void *, record), 0, sizeof(lmprof_Record));
+    memset(l_pcast(void *, record), 0, size);
 
-    BITFIELD_SET(record->info.event, LMPROF_RECORD_USERDATA);
+    record->info = l_pcast(lmprof_FunctionInfo *, record + 1); /* function info follows the record */
+    BITFIELD_SET(record->info->event, LMPROF_RECORD_USERDATA);
 #if LUA_VERSION_NUM == 501
     luaL_getmetatable(L, LMPROF_RECORD_METATABLE);
     lua_setmetatable(L, -2);
@@ -314,19 +316,19 @@ LUA_API lmprof_Record *lmprof_record_new(lua_State *L) {
 }
 
 LUA_API void lmprof_record_clear(lmprof_Alloc *alloc, lmprof_Record *record) {
-  if (record->info.name != l_nullptr)
-    lmprof_strdup_free(alloc, record->info.name, 0);
-  if (record->info.source) {
+  if (record->info->name != l_nullptr)
+    lmprof_strdup_free(alloc, record->info->name, 0);
+  if (record->info->source && !BITFIELD_TEST(record->info->event, LMPROF_RECORD_SHARED)) {
 #if LUA_VERSION_NUM >= 504
-    const size_t srclen = record->info.srclen;
+    const size_t srclen = record->info->srclen;
 #else
-    const size_t srclen = strlen(record->info.source);
+    const size_t srclen = strlen(record->info->source);
 #endif
-    lmprof_strdup_free(alloc, record->info.source, srclen);
+    lmprof_strdup_free(alloc, record->info->source, srclen);
   }
 
-  record->info.name = l_nullptr;
-  record->info.source = l_nullptr;
+  record->info->name = l_nullptr;
+  record->info->source = l_nullptr;
   if (record->graph.line_freq != l_nullptr) {
     const int length = record->graph.line_freq_size;
     lmprof_free(alloc, l_pcast(void *, record->graph.line_freq), length * sizeof(size_t));
@@ -334,7 +336,18 @@ LUA_API void lmprof_record_clear(lmprof_Alloc *alloc, lmprof_Record *record) {
     record->graph.line_freq_size = 0;
   }
 
-  luadebug_clear(&record->info);
+  luadebug_clear(record->info);
+}
+
+LUA_API lmprof_IdentityCache *lmprof_identity_cache_create(lmprof_Alloc *alloc) {
+  lmprof_IdentityCache *cache = l_pcast(lmprof_IdentityCache *, lmprof_malloc(alloc, sizeof(lmprof_IdentityCache)));
+  if (cache != l_nullptr)
+    memset(l_pcast(void *, cache), 0, sizeof(lmprof_IdentityCache));
+  return cache;
+}
+
+LUA_API void lmprof_identity_cache_destroy(lmprof_Alloc *alloc, lmprof_IdentityCache *cache) {
+  lmprof_free(alloc, l_pcast(void *, cache), sizeof(lmprof_IdentityCache));
 }
 
 /* @NOTE: See LMPROF_BUILTIN definition in lmprof.h */
@@ -375,7 +388,7 @@ LUA_EXTERN_END
 ** This approach uses the 'CClosure' and 'LClosure' definitions to generate
 ** unique identifiers for an activation record.
 */
-LUA_API lu_addr lmprof_record_id(lua_State *L, lua_Debug *ar, int gc_disabled, lua_CFunction *result) {
+LUA_API lu_addr lmprof_record_id(lua_State *L, lua_Debug *ar, lmprof_IdentityCache *cache, int gc_disabled, lua_CFunction *result) {
   lu_addr function = 0;
   if (ar->i_ci != LUA_CALLINFO_NULL) {
     const TValue *o = s2v(LUA_CALLINFO(L, ar->i_ci)->func);
@@ -420,15 +433,73 @@ LUA_API lu_addr lmprof_record_id(lua_State *L, lua_Debug *ar, int gc_disabled, l
   #endif
   }
 
+  UNUSED(cache);
   UNUSED(gc_disabled);
   return function;
 }
 #else
+/* Index of the identity cache slot associated with the function prototype. */
+static LUA_INLINE size_t identity_slot(const lua_Debug *ar) {
+  lu_addr h = (l_pcast(lu_addr, ar->source) >> 3) ^ l_cast(lu_addr, ar->linedefined);
+  h ^= (h >> 16);
+  h *= l_cast(lu_addr, 0x9E3779B1U);
+  h ^= (h >> 15);
+  return l_cast(size_t, h) & (LMPROF_IDENTITY_CACHE_SIZE - 1);
+}
+
+/*
+** The string a function identifier is hashed from: the source of a filename or
+** literal chunk; otherwise, 'short_src'.
+*/
+static LUA_INLINE const char *identity_key(const lua_Debug *ar) {
+  return (*(ar->source) == '=' || *(ar->source) == '@') ? ar->source : ar->short_src;
+}
+
+/* Return true if the cache entry references the function of 'ar' */
+static LUA_INLINE int identity_match(const lmprof_IdentityEntry *e, const lua_Debug *ar) {
+  return e->source == ar->source
+         && e->linedefined == ar->linedefined
+         && e->lastlinedefined == ar->lastlinedefined
+         && e->nups == ar->nups
+#if LUA_VERSION_NUM >= 502
+         && e->nparams == ar->nparams
+         && e->isvararg == ar->isvararg
+#endif
+#if LUA_VERSION_NUM >= 504
+         && e->srclen == ar->srclen
+#endif
+         && strcmp(e->key, identity_key(ar)) == 0 /* source address reused */
+    ;
+}
+
+/* Populate the cache entry; keys that do not fit within an entry are ignored */
+static LUA_INLINE void identity_store(lmprof_IdentityEntry *e, const lua_Debug *ar, lu_addr fid) {
+  const char *key = identity_key(ar);
+  const size_t length = strlen(key);
+  if (length >= sizeof(e->key))
+    return;
+
+  memcpy(e->key, key, length + 1);
+  e->source = ar->source;
+  e->linedefined = ar->linedefined;
+  e->lastlinedefined = ar->lastlinedefined;
+  e->nups = ar->nups;
+#if LUA_VERSION_NUM >= 502
+  e->nparams = ar->nparams;
+  e->isvararg = ar->isvararg;
+#endif
+#if LUA_VERSION_NUM >= 504
+  e->srclen = ar->srclen;
+#endif
+  e->fid = fid;
+}
+
 /*
 ** This approach uses lua_getinfo to generate a unique identifier for a given
 ** activation record.
 */
-LUA_API lu_addr lmprof_record_id(lua_State *L, lua_Debug *ar, int gc_disabled, lua_CFunction *result) {
+LUA_API lu_addr lmprof_record_id(lua_State *L, lua_Debug *ar, lmprof_IdentityCache *cache, int gc_disabled, lua_CFunction *result) {
+  lmprof_IdentityEntry *entry = l_nullptr;
   lu_addr hash = 0, function = 0;
   lua_CFunction cfunction = l_nullptr;
   if (ar->i_ci == LUA_CALLINFO_NULL) {
@@ -465,6 +536,13 @@ LUA_API lu_addr lmprof_record_id(lua_State *L, lua_Debug *ar, int gc_disabled, l
     */
     hash = LMPROF_RECORD_ID_MAIN;
   }
+  /* Function identifier has already been computed. */
+  else if (cache != l_nullptr && ar->source != l_nullptr
+           && identity_match((entry = &cache->entries[identity_slot(ar)]), ar)) {
+    cache->hits++;
+    hash = entry->fid;
+    entry = l_nullptr;
+  }
   /*
   ** When using ar->source ensure the string is a 'literal' or a filename.
   ** Otherwise, any 'loaded' function will have its source code hashed for each
@@ -491,6 +569,10 @@ LUA_API lu_addr lmprof_record_id(lua_State *L, lua_Debug *ar, int gc_disabled, l
       hash += ar->linedefined;
   }
 
+  if (entry != l_nullptr) { /* (Re)populate the slot on a miss */
+    cache->misses++;
+    identity_store(entry, ar, hash);
+  }
   return hash;
 }
 #endif
@@ -508,7 +590,7 @@ LUA_API void lmprof_record_clear_graph_statistics(lmprof_Record *record) {
   unit_clear(&record->graph.path);
 }
 
-LUA_API void lmprof_record_populate(lua_State *L, lmprof_Alloc *alloc, lua_Debug *ar, lmprof_FunctionInfo *info) {
+LUA_API void lmprof_record_populate(lua_State *L, lmprof_Alloc *alloc, lua_Debug *ar, lmprof_FunctionInfo *info, int lazy) {
   lua_Debug debug = LMPROF_ZERO_STRUCT;
   debug.i_ci = ar->i_ci;
   if (lua_getinfo(L, DEBUG_IMMUTABLE DEBUG_FUNCTION, &debug)) { /* [ ..., function] */
@@ -524,6 +606,9 @@ LUA_API void lmprof_record_populate(lua_State *L, lmprof_Alloc *alloc, lua_Debug
     if (lua_iscfunction(L, -1)) {
       BITFIELD_SET(info->event, LMPROF_RECORD_CCLOSURE);
     }
+    else if (lazy) {
+      BITFIELD_SET(info->event, LMPROF_RECORD_LAZY);
+    }
 
     /*
     ** copy the Lua_Debug string names, ensuring those char*'s are not garbage
@@ -545,7 +630,8 @@ LUA_API void lmprof_record_populate(lua_State *L, lmprof_Alloc *alloc, lua_Debug
         updatesource = 1;
       }
 
-      if (updatesource || prevSource == l_nullptr) {
+      /* LMPROF_RECORD_LAZY: 'source' is formatted by lmprof_record_resolve */
+      if ((updatesource || prevSource == l_nullptr) && !BITFIELD_TEST(info->event, LMPROF_RECORD_LAZY)) {
         size_t sourceLen = 0;
         const char *source = getfuncinfo(L, &debug, &sourceLen); /* [..., function, record_string] */
         if (prevSource != l_nullptr) {
@@ -567,7 +653,17 @@ LUA_API void lmprof_record_populate(lua_State *L, lmprof_Alloc *alloc, lua_Debug
   }
 }
 
-LUA_API void lmprof_record_update(lua_State *L, lmprof_Alloc *alloc, lua_Debug *ar, lu_addr f_id, lmprof_FunctionInfo *info) {
+/*
+** A tail call discards the caller frame: lua_getinfo cannot resolve its name and
+** the attempt would be wasted.
+*/
+#if LUA_VERSION_NUM > 501
+  #define RECORD_IS_TAILCALL(AR) ((AR)->event == LUA_HOOKTAILCALL || (AR)->istailcall != 0)
+#else
+  #define RECORD_IS_TAILCALL(AR) 0
+#endif
+
+LUA_API void lmprof_record_update(lua_State *L, lmprof_Alloc *alloc, lua_Debug *ar, lu_addr f_id, lmprof_FunctionInfo *info, int lazy) {
   static const char *const reserved_identifiers[] = {
     LMPROF_RECORD_NAME_ROOT,
     LMPROF_RECORD_NAME_MAIN,
@@ -593,8 +689,84 @@ LUA_API void lmprof_record_update(lua_State *L, lmprof_Alloc *alloc, lua_Debug *
       if (f_id == LMPROF_RECORD_ID_ROOT)
         BITFIELD_SET(info->event, LMPROF_RECORD_ROOT);
     }
+    else if (info->what == l_nullptr) { /* Newly created record */
+      lmprof_record_populate(L, alloc, ar, info, lazy);
+    }
+    else {
+      const int attempts = l_cast(int, LMPROF_RECORD_GET_ATTEMPTS(info));
+      if (attempts < LMPROF_RECORD_NAME_RETRIES && !RECORD_IS_TAILCALL(ar)) {
+        lmprof_record_populate(L, alloc, ar, info, lazy);
+        LMPROF_RECORD_SET_ATTEMPTS(info, attempts + 1);
+      }
+    }
+  }
+}
+
+/* Duplicate the formatted 'source' of a lazy record: [..., name] */
+static void record_format(lua_State *L, lmprof_Alloc *alloc, lmprof_FunctionInfo *info) {
+  size_t sourceLen = 0;
+  const char *source = l_nullptr;
+  lua_Debug debug = *info;
+
+  debug.i_ci = LUA_CALLINFO_NULL; /* CallInfo of the activation record is no longer valid */
+  source = getfuncinfo(L, &debug, &sourceLen); /* [..., record_string] */
+  info->source = _recordstrdup(alloc, source, sourceLen);
+#if LUA_VERSION_NUM >= 504
+  info->srclen = sourceLen;
+#endif
+  lua_pop(L, 1);
+}
+
+LUA_API void lmprof_record_resolve(lua_State *L, lmprof_Alloc *alloc, lmprof_Record *record, int intern) {
+  lmprof_FunctionInfo *info = record->info;
+  if (!BITFIELD_TEST(info->event, LMPROF_RECORD_LAZY))
+    return;
+
+  BITFIELD_CLEAR(info->event, LMPROF_RECORD_LAZY);
+  luaL_checkstack(L, 4, __FUNCTION__);
+
+  /* All main chunks share the same identifier: LMPROF_RECORD_ID_MAIN */
+  if (info->what != l_nullptr && *info->what == 'm') {
+    record_format(L, alloc, info);
+    return;
+  }
+
+  lua_pushinteger(L, l_cast(lua_Integer, record->f_id)); /* [..., fid] */
+  lua_pushvalue(L, -1);
+  lua_rawget(L, intern); /* [..., fid, names] */
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, intern);
+  }
+
+  if (info->name == l_nullptr)
+    lua_pushboolean(L, 1);
+  else
+    lua_pushstring(L, info->name); /* [..., fid, names, name] */
+
+  lua_pushvalue(L, -1);
+  lua_rawget(L, -3); /* [..., fid, names, name, source] */
+  if (lua_islightuserdata(L, -1)) {
+    info->source = l_pcast(const char *, lua_touserdata(L, -1));
+#if LUA_VERSION_NUM >= 504
+    info->srclen = strlen(info->source);
+#endif
+    BITFIELD_SET(info->event, LMPROF_RECORD_SHARED);
+    lua_pop(L, 4);
+  }
+  else {
+    lua_pop(L, 1); /* [..., fid, names, name] */
+    record_format(L, alloc, info);
+    if (info->source != l_nullptr) {
+      lua_pushlightuserdata(L, l_pcast(void *, l_pcast(lu_addr, info->source)));
+      lua_rawset(L, -3); /* [..., fid, names] */
+      lua_pop(L, 2);
+    }
     else {
-      lmprof_record_populate(L, alloc, ar, info);
+      lua_pop(L, 3);
     }
   }
 }
@@ -38,6 +38,9 @@
 #define LMPROF_RECORD_ROOT             0x2 /* TraceEvent has '__metaProcess'; do not report root records */
 #define LMPROF_RECORD_CCLOSURE         0x4 /* Recored represents a C Closure */
 #define LMPROF_RECORD_IGNORED          0x8 /* Registered as 'ignored' */
+#define LMPROF_RECORD_ATTEMPTS        0xF0 /* Number of failed name resolution attempts (4 bits) */
+#define LMPROF_RECORD_LAZY           0x100 /* 'source' formatting deferred until lmprof_record_resolve */
+#define LMPROF_RECORD_SHARED         0x200 /* 'source' is interned: owned by another record */
 #define LMPROF_RECORD_REPORTED  0x80000000 /* A callgrind specific flag to enable name compression */
 
 /* Record userdata metatable */
@@ -47,6 +50,29 @@
 #define LMPROF_RECORD_NAME(n, o) (((n) == l_nullptr) ? (o) : (n))
 #define LMPROF_RECORD_HAS_NAME(I) ((I)->name != l_nullptr || BITFIELD_TEST((I)->event, LMPROF_RECORD_IGNORED))
 
+/*
+@@ LMPROF_RECORD_NAME_RETRIES: Number of times the name of an unnamed record is
+** re-resolved (lua_getinfo) after its creation. Anonymous closures and most C
+** functions never resolve a name; bounding the retries ensures their lookups are
+** as cheap as named records.
+*/
+#if !defined(LMPROF_RECORD_NAME_RETRIES)
+  #define LMPROF_RECORD_NAME_RETRIES 3
+#endif
+
+#if LMPROF_RECORD_NAME_RETRIES < 0 || LMPROF_RECORD_NAME_RETRIES > 15
+  #error "LMPROF_RECORD_NAME_RETRIES must be within [0, 15]"
+#endif
+
+#define LMPROF_RECORD_ATTEMPTS_SHIFT 4
+#define LMPROF_RECORD_GET_ATTEMPTS(I) (((I)->event & LMPROF_RECORD_ATTEMPTS) >> LMPROF_RECORD_ATTEMPTS_SHIFT)
+#define LMPROF_RECORD_SET_ATTEMPTS(I, N) \
+  ((I)->event = ((I)->event & ~LMPROF_RECORD_ATTEMPTS) | (((N) << LMPROF_RECORD_ATTEMPTS_SHIFT) & LMPROF_RECORD_ATTEMPTS))
+
+/* The function info has a name, or no longer attempts to resolve one. */
+#define LMPROF_RECORD_SETTLED(I) \
+  (LMPROF_RECORD_HAS_NAME(I) || LMPROF_RECORD_GET_ATTEMPTS(I) >= LMPROF_RECORD_NAME_RETRIES)
+
 /*
 ** An extension of lua_Debug (re-purposing the struct for simplicity) for shared
 ** and formatted function definitions.
@@ -59,13 +85,21 @@ typedef lua_Debug lmprof_FunctionInfo;
 **
 ** The record ID (r_id) is a unique identifier used to support features like
 ** 'Name Compression' in callgrind.
+**
+** Records are split into hot and cold data: the record itself only contains
+** the fields accessed on each hook event (identifiers, flags, and statistics),
+** while the (much larger) function info is stored out-of-line. Records and
+** their function info are allocated from separate arenas, i.e., the statistics
+** of consecutively created records are densely packed in r_id order.
 */
 typedef struct lmprof_Record {
   lu_addr r_id; /* global record identifier (a unique value) */
   lu_addr f_id; /* address/identifier of function */
   lu_addr p_id; /* address/identifier of parent */
   int p_currentline; /* parent callsite information */
-  lmprof_FunctionInfo info;
+  char ignored; /* Cached LMPROF_RECORD_IGNORED flag of 'info' */
+  char settled; /* 'info' is no longer modified by lmprof_record_update */
+  lmprof_FunctionInfo *info; /* Function details (cold) */
 
   /* Additional statistics for each profiling configuration. */
   union {
@@ -140,6 +174,58 @@ static LUA_INLINE lu_sizediff unit_allocated(const lmprof_EventUnit *u) {
 #define LMPROF_RECORD_NAME_GC "(profiler gc)"
 #define LMPROF_RECORD_NAME_UNKNOWN "?"
 
+/*
+@@ LMPROF_IDENTITY_CACHE_SIZE: Number of entries (a power of two) in the
+** function identity cache.
+*/
+#if !defined(LMPROF_IDENTITY_CACHE_SIZE)
+  #define LMPROF_IDENTITY_CACHE_SIZE 256
+#endif
+
+#if (LMPROF_IDENTITY_CACHE_SIZE & (LMPROF_IDENTITY_CACHE_SIZE - 1)) != 0
+  #error "LMPROF_IDENTITY_CACHE_SIZE must be a power of two"
+#endif
+
+/*
+** A direct-mapped cache of Lua function identifiers, avoiding the (string)
+** hashing of activation record fields on each hook event.
+**
+** Entries are keyed by the address of the (interned) 'source' string and the
+** immutable fields of the function prototype. As a source string may be
+** collected and its address reused by another chunk, each entry also stores a
+** copy of the string the identifier was hashed from: the source of a filename
+** or literal chunk and 'short_src' otherwise. A hit compares that copy, i.e.,
+** returns the identifier a miss would compute. Filename and literal sources
+** that do not fit within LUA_IDSIZE are not cached.
+*/
+typedef struct lmprof_IdentityEntry {
+  const char *source; /* Address of lua_Debug.source; NULL for an empty slot */
+  char key[LUA_IDSIZE]; /* Copy of the hashed string, see identity_key */
+  int linedefined;
+  int lastlinedefined;
+  unsigned char nups;
+#if LUA_VERSION_NUM >= 502
+  unsigned char nparams;
+  char isvararg;
+#endif
+#if LUA_VERSION_NUM >= 504
+  size_t srclen;
+#endif
+  lu_addr fid; /* Cached function identifier */
+} lmprof_IdentityEntry;
+
+typedef struct lmprof_IdentityCache {
+  size_t hits;
+  size_t misses;
+  lmprof_IdentityEntry entries[LMPROF_IDENTITY_CACHE_SIZE];
+} lmprof_IdentityCache;
+
+/* Create a new (empty) identity cache, returning NULL on error. */
+LUA_API lmprof_IdentityCache *lmprof_identity_cache_create(lmprof_Alloc *alloc);
+
+/* Free an identity cache instance. */
+LUA_API void lmprof_identity_cache_destroy(lmprof_Alloc *alloc, lmprof_IdentityCache *cache);
+
 /* Initialize meta-definitions for lmprof_Record's */
 LUA_API void lmprof_record_initialize(lua_State *L);
 
@@ -161,8 +247,11 @@ LUA_API void lmprof_record_clear(lmprof_Alloc *alloc, lmprof_Record *record);
 **
 ** This function ensures the activation record 'ar' is populated with all
 ** DEBUG_IMMUTABLE fields.
+**
+** 'cache' is an optional lmprof_IdentityCache used to memoize the identifiers
+** of Lua functions (unused by LMPROF_BUILTIN).
 */
-LUA_API lu_addr lmprof_record_id(lua_State *L, lua_Debug *ar, int gc_disabled, lua_CFunction *result);
+LUA_API lu_addr lmprof_record_id(lua_State *L, lua_Debug *ar, lmprof_IdentityCache *cache, int gc_disabled, lua_CFunction *result);
 
 /*
 ** Push the function referenced by the debug record onto the stack; on NULL push
@@ -173,14 +262,31 @@ LUA_API void lmprof_record_function(lua_State *L, lua_Debug *ar, lu_addr fid);
 /* Clear all profile statistics associated with the given function record. */
 LUA_API void lmprof_record_clear_graph_statistics(lmprof_Record *record);
 
-/* Given an active function for a Lua state, populate its function info record */
-LUA_API void lmprof_record_populate(lua_State *L, lmprof_Alloc *alloc, lua_Debug *ar, lmprof_FunctionInfo *info);
+/*
+** Given an active function for a Lua state, populate its function info record.
+**
+** If 'lazy' is true, the formatted 'source' of Lua functions is not created:
+** only the activation record fields (and a copy of the first observed name)
+** are stored and the record is flagged LMPROF_RECORD_LAZY. C functions are
+** always formatted as their name lookup requires the live function object.
+*/
+LUA_API void lmprof_record_populate(lua_State *L, lmprof_Alloc *alloc, lua_Debug *ar, lmprof_FunctionInfo *info, int lazy);
 
 /*
 ** Update the name to a profiler record if its details are unknown or partially
 ** unknown.
+**
+** Name resolution of an existing (unnamed) record is only retried on non-tail
+** call entries and at most LMPROF_RECORD_NAME_RETRIES times.
+*/
+LUA_API void lmprof_record_update(lua_State *L, lmprof_Alloc *alloc, lua_Debug *ar, lu_addr f_id, lmprof_FunctionInfo *info, int lazy);
+
+/*
+** Format the 'source' of a LMPROF_RECORD_LAZY record. The table at the absolute
+** stack index 'intern' is shared between all records resolved in the same pass:
+** records of the same function (and name) reference a single string.
 */
-LUA_API void lmprof_record_update(lua_State *L, lmprof_Alloc *alloc, lua_Debug *ar, lu_addr f_id, lmprof_FunctionInfo *info);
+LUA_API void lmprof_record_resolve(lua_State *L, lmprof_Alloc *alloc, lmprof_Record *record, int intern);
 
 /*
 ** Ensure the provided string is a well-formed (i.e., can be properly parsed by
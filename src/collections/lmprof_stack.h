@@ -12,18 +12,111 @@
 #include "lmprof_traceevent.h"
 
 /*
-@@ LMPROF_MAXSTACK limits the size of the profiler stack. An arbitrary limit
-** intended to (1) be a pre-configured one-time allocation instead of requiring
-** additional logic for growing/shrinking the stack; and (2) limit stack space,
-** as the profiler can be configured to create one stack instance per coroutine.
+@@ LMPROF_STACK_INITIAL: Number of stack instances allocated alongside each
+** profiler stack. The profiler can be configured to create one stack per
+** coroutine, most of which are shallow; deeper stacks grow (double) on demand.
 */
-#if !defined(LMPROF_MAXSTACK)
-#define LMPROF_MAXSTACK 1024 /* (LUAI_MAXSTACK >> 8) */
+#if !defined(LMPROF_STACK_INITIAL)
+#define LMPROF_STACK_INITIAL 32
 #endif
 
+#if LMPROF_STACK_INITIAL < 2
+  #error "LMPROF_STACK_INITIAL must be at least two"
+#endif
+
+/*
+@@ LMPROF_STACK_POOL: Default maximum number of profiler stacks, released by
+** dead coroutines, retained for reuse by newly profiled coroutines. A value of
+** zero disables the pool.
+*/
+#if !defined(LMPROF_STACK_POOL)
+#define LMPROF_STACK_POOL 16
+#endif
+
+#if LMPROF_STACK_POOL < 0
+  #error "LMPROF_STACK_POOL must be non-negative"
+#endif
+
+/*
+@@ LMPROF_STACK_GC: Default number of additionally profiled coroutines before
+** invoking an incremental garbage collection step. This handles use-cases where
+** *many* short-lived coroutines are created during the duration of a profile.
+** A value of zero disables the step.
+*/
+#if !defined(LMPROF_STACK_GC)
+#define LMPROF_STACK_GC 64
+#endif
+
+#if LMPROF_STACK_GC < 0
+  #error "LMPROF_STACK_GC must be non-negative"
+#endif
+
+/*
+@@ LMPROF_THREAD_MAP_SIZE: Initial number of slots in the lua_State to profiler
+** stack map. The map grows (doubles) as required; must be a power of two.
+*/
+#if !defined(LMPROF_THREAD_MAP_SIZE)
+#define LMPROF_THREAD_MAP_SIZE 16
+#endif
+
+#if LMPROF_THREAD_MAP_SIZE < 2 || (LMPROF_THREAD_MAP_SIZE & (LMPROF_THREAD_MAP_SIZE - 1)) != 0
+  #error "LMPROF_THREAD_MAP_SIZE must be a power of two"
+#endif
+
+/*
+@@ LMPROF_EDGE_CACHE_WAYS: Number of <child, callsite> records cached by each
+** stack instance, allowing repeated calls from the same parent to bypass the
+** graph hashtable.
+*/
+#if !defined(LMPROF_EDGE_CACHE_WAYS)
+#define LMPROF_EDGE_CACHE_WAYS 2
+#endif
+
+#if LMPROF_EDGE_CACHE_WAYS < 1
+  #error "LMPROF_EDGE_CACHE_WAYS must be positive"
+#endif
+
+/*
+** A frame token identifies the Lua activation record associated with a stack
+** instance. Return events are matched against the profiler stack by token,
+** without resolving the function identifier of the returning function.
+**
+** Lua 5.2+: The CallInfo of the activation record (lua_Debug.i_ci). Tail
+**  calls reuse the CallInfo of their caller. The FID argument is not evaluated.
+**
+** Lua 5.1: The call hook of a tail call is invoked before its CallInfo replaces
+**  the callers, i.e., the CallInfo would not match on return. Therefore, the
+**  function identifier (FID) is used instead.
+*/
+#if LUA_VERSION_NUM > 501
+  #define LMPROF_FRAME_TOKEN(AR, FID) l_pcast(lu_addr, (AR)->i_ci)
+#else
+  #define LMPROF_FRAME_TOKEN(AR, FID) (FID)
+#endif
+
+/* Token of stack instances not associated with an activation record */
+#define LMPROF_FRAME_NONE 0
+
+/*
+** A cache of the child records of a stack instance. The cached records are
+** relative to 'owner', i.e., the record the instance was pushed with, and are
+** invalidated when the stack slot is reused by a different record.
+*/
+typedef struct lmprof_EdgeCache {
+  lmprof_Record *owner; /* Parent record of all cached entries */
+  unsigned int next; /* Next entry to be replaced (round-robin) */
+  struct {
+    lu_addr fid; /* Child function identifier */
+    int line; /* Callsite (p_currentline) */
+    lmprof_Record *record; /* NULL for an empty entry */
+  } entries[LMPROF_EDGE_CACHE_WAYS];
+} lmprof_EdgeCache;
+
 typedef struct lmprof_StackInst {
   char tail_call; /* Whether the activation record is a tail call */
+  lu_addr frame; /* Frame token of the activation record (LMPROF_FRAME_TOKEN) */
   int last_line; /* Last 'currentline' value when LUA_HOOKLINE is enabled */
+  unsigned int recursion; /* Number of folded re-entries (LMPROF_OPT_FOLD_RECURSION) */
   size_t last_line_instructions; /* Instruction count on last_line update */
   union {
     struct {
@@ -34,6 +127,7 @@ typedef struct lmprof_StackInst {
     } graph;
     TraceEventStackInstance trace; /* Previous name: callFrame */
   };
+  lmprof_EdgeCache edges; /* Cached child records */
 } lmprof_StackInst;
 
 typedef struct lmprof_Stack {
@@ -49,21 +143,141 @@ typedef struct lmprof_Stack {
 
   size_t head; /* First available stack index */
   size_t size; /* Size of the stack array */
-  lmprof_StackInst stack[1]; /* Profile stack */
+  size_t used; /* Number of initialized stack instances (high-water mark) */
+  lmprof_Alloc alloc; /* Allocator used when growing the stack */
+  lmprof_StackInst *stack; /* Profile stack: 'base' or a grown allocation */
+  struct lmprof_Stack *next; /* lmprof_StackPool free-list link */
+  lmprof_StackInst base[LMPROF_STACK_INITIAL];
 } lmprof_Stack;
 
-/* Creates and pushes on the stack a new lmprof_Stack full-userdata. */
-LUA_API lmprof_Stack *lmprof_stack_new(lua_State *L, lua_Integer id, char callback_api);
+/*
+** A free-list of profiler stacks released by dead coroutines. Released stacks
+** are not sanitized until reacquired and retain any grown stack allocation.
+*/
+typedef struct lmprof_StackPool {
+  lmprof_Stack *head; /* Most recently released stack */
+  size_t count; /* Number of stacks in the free-list */
+  size_t limit; /* Maximum number of stacks in the free-list */
+  size_t hits; /* Number of stacks acquired from the free-list */
+  size_t misses; /* Number of stacks allocated */
+} lmprof_StackPool;
 
-/* Allocate a lmprof_Stack instance; intended to be used as a Lua light userdata. */
+/*
+** Allocate a lmprof_Stack instance; intended to be used as a Lua light userdata.
+** The allocator must outlive the stack.
+*/
 LUA_API lmprof_Stack *lmprof_stack_light_new(lmprof_Alloc *alloc, lua_Integer id, char callback_api);
 
 /* Free an allocated lmprof_Stack (light userdata) instance. */
 LUA_API void lmprof_stack_light_free(lmprof_Alloc *alloc, lmprof_Stack *stack);
 
+/*
+** {==================================================================
+** Thread Map
+** ===================================================================
+*/
+
+/*
+** The thread map requires each lua_State to outlive the finalizer of its stack
+** sentinel, i.e., the address of a collected lua_State cannot be reused while
+** still in the map. The sentinel references its lua_State, which requires
+** ephemeron tables (Lua 5.2+) for the lua_State to remain collectable.
+*/
+#if LUA_VERSION_NUM >= 502
+  #define LMPROF_THREAD_MAP
+#endif
+
+/*
+** An open-addressing (linear probing) map of lua_State to its profiler stack.
+** The two most recently fetched threads are cached: switching between a pair
+** of coroutines (e.g., producer/consumer) does not probe the map.
+*/
+typedef struct lmprof_ThreadSlot {
+  const lua_State *thread; /* NULL for an empty slot */
+  lmprof_Stack *stack;
+} lmprof_ThreadSlot;
+
+typedef struct lmprof_ThreadMap {
+  size_t size; /* Number of slots (power of two); zero when unallocated */
+  size_t count; /* Number of occupied slots */
+  lmprof_ThreadSlot *slots;
+  lmprof_ThreadSlot current; /* Most recently fetched thread */
+  lmprof_ThreadSlot last; /* Thread fetched before 'current' */
+} lmprof_ThreadMap;
+
+/* Initialize an empty thread map */
+LUA_API void lmprof_thread_map_init(lmprof_ThreadMap *map);
+
+/* Free all slots of the thread map; the stacks are not freed. */
+LUA_API void lmprof_thread_map_free(lmprof_Alloc *alloc, lmprof_ThreadMap *map);
+
+/*
+** Associate a profiler stack with the lua_State, which must not already exist
+** in the map. Returns zero if the map failed to grow.
+*/
+LUA_API int lmprof_thread_map_insert(lmprof_Alloc *alloc, lmprof_ThreadMap *map, const lua_State *L, lmprof_Stack *stack);
+
+/* Remove the lua_State, if it exists, from the map. */
+LUA_API void lmprof_thread_map_remove(lmprof_ThreadMap *map, const lua_State *L);
+
+/* Home slot of a lua_State; addresses are finalized as their low bits are aligned. */
+static LUA_INLINE size_t lmprof_thread_map_slot(const lua_State *L, size_t size) {
+  lu_addr x = l_pcast(lu_addr, L);
+  x = x ^ (x >> (sizeof(lu_addr) * 4));
+  x = ((x >> 16) ^ x) * 0x45d9f3b;
+  x = (x >> 16) ^ x;
+  return l_cast(size_t, x) & (size - 1);
+}
+
+/* Return the profiler stack associated with the lua_State, or NULL. */
+static LUA_INLINE lmprof_Stack *lmprof_thread_map_get(lmprof_ThreadMap *map, const lua_State *L) {
+  lmprof_ThreadSlot slot;
+  if (map->current.thread == L)
+    return map->current.stack;
+  else if (map->last.thread == L)
+    slot = map->last;
+  else if (map->size == 0)
+    return l_nullptr;
+  else {
+    const size_t mask = map->size - 1;
+    size_t i = lmprof_thread_map_slot(L, map->size);
+    for (;; i = (i + 1) & mask) {
+      if (map->slots[i].thread == L)
+        break;
+      else if (map->slots[i].thread == l_nullptr)
+        return l_nullptr;
+    }
+    slot = map->slots[i];
+  }
+
+  map->last = map->current;
+  map->current = slot;
+  return slot.stack;
+}
+
+/* }================================================================== */
+
+/* Initialize an empty stack pool */
+LUA_API void lmprof_stack_pool_init(lmprof_StackPool *pool, size_t limit);
+
+/*
+** Return a sanitized stack from the pool, allocating a new lmprof_Stack
+** (lmprof_stack_light_new) when the pool is empty.
+*/
+LUA_API lmprof_Stack *lmprof_stack_pool_acquire(lmprof_Alloc *alloc, lmprof_StackPool *pool, lua_Integer id, char callback_api);
+
+/* Return a stack to the pool; freeing the stack when the pool is full. */
+LUA_API void lmprof_stack_pool_release(lmprof_Alloc *alloc, lmprof_StackPool *pool, lmprof_Stack *stack);
+
+/* Free all stacks in the pool. */
+LUA_API void lmprof_stack_pool_clear(lmprof_Alloc *alloc, lmprof_StackPool *pool);
+
 /* Removes and sanitizes (stack_clear_instance) all stack instances from the Stack. */
 LUA_API void lmprof_stack_clear(lmprof_Stack *s);
 
+/* Double the size of the stack, returning zero on error. */
+LUA_API int lmprof_stack_grow(lmprof_Stack *s);
+
 /* Zero out all data associated with a stack instance */
 LUA_API void stack_clear_instance(lmprof_Stack *s, lmprof_StackInst *inst);
 
@@ -91,16 +305,68 @@ static LUA_INLINE lmprof_StackInst *lmprof_stack_parent(lmprof_Stack *s) {
   return (s->head > 1) ? &s->stack[s->head - 2] : l_nullptr;
 }
 
-/* Reserve the next stack instance */
-static LUA_INLINE lmprof_StackInst *lmprof_stack_next(lmprof_Stack *s, char tail) {
+/*
+** Reserve the next stack instance, growing the stack if required. Growing the
+** stack may relocate all stack instances; previously fetched instances are
+** invalidated.
+*/
+static LUA_INLINE lmprof_StackInst *lmprof_stack_next(lmprof_Stack *s, lu_addr frame, char tail) {
   lmprof_StackInst *inst = l_nullptr;
-  if (s->head < s->size) {
+  if (s->head < s->size || lmprof_stack_grow(s)) {
     inst = &s->stack[s->head++];
+    if (s->head > s->used) { /* First use of the stack instance */
+      stack_clear_instance(s, inst);
+      inst->edges.owner = l_nullptr;
+      s->used = s->head;
+    }
     inst->tail_call = tail;
+    inst->frame = frame;
+    inst->recursion = 0;
   }
   return inst;
 }
 
+/*
+** {==================================================================
+** Edge Cache
+** ===================================================================
+*/
+
+/* Ensure the edge cache of the stack instance is relative to 'record' */
+static LUA_INLINE void lmprof_stack_edge_owner(lmprof_StackInst *inst, lmprof_Record *record) {
+  if (inst->edges.owner != record) {
+    int i;
+    inst->edges.owner = record;
+    inst->edges.next = 0;
+    for (i = 0; i < LMPROF_EDGE_CACHE_WAYS; ++i)
+      inst->edges.entries[i].record = l_nullptr;
+  }
+}
+
+/* Return the cached child record of a stack instance, or NULL if one does not exist */
+static LUA_INLINE lmprof_Record *lmprof_stack_edge_get(const lmprof_StackInst *inst, lu_addr fid, int line) {
+  int i;
+  for (i = 0; i < LMPROF_EDGE_CACHE_WAYS; ++i) {
+    if (inst->edges.entries[i].fid == fid
+        && inst->edges.entries[i].line == line
+        && inst->edges.entries[i].record != l_nullptr) {
+      return inst->edges.entries[i].record;
+    }
+  }
+  return l_nullptr;
+}
+
+/* Cache the child record of a stack instance */
+static LUA_INLINE void lmprof_stack_edge_set(lmprof_StackInst *inst, lu_addr fid, int line, lmprof_Record *record) {
+  const unsigned int next = inst->edges.next;
+  inst->edges.entries[next].fid = fid;
+  inst->edges.entries[next].line = line;
+  inst->edges.entries[next].record = record;
+  inst->edges.next = (next + 1) % LMPROF_EDGE_CACHE_WAYS;
+}
+
+/* }================================================================== */
+
 /* Remove and return the stack instance at the top of the stack. */
 static LUA_INLINE lmprof_StackInst *lmprof_stack_pop(lmprof_Stack *s) {
   return (s->head > 0) ? &s->stack[--s->head] : l_nullptr;
@@ -131,6 +397,7 @@ static LUA_INLINE void lmprof_stack_foreach(lua_State *L, lmprof_Stack *s, lmpro
 **
 ** PARAMS:
 **  record - function record being profiled.
+**  frame - frame token of the activation record, see LMPROF_FRAME_TOKEN.
 **  unit - current Lua state (amount allocated, deallocated, current time)
 **  process - thread & process identifiers, corresponding to function ownership.
 **  tail - whether this profiled function corresponds to a Lua tailcall.
@@ -138,7 +405,7 @@ static LUA_INLINE void lmprof_stack_foreach(lua_State *L, lmprof_Stack *s, lmpro
 ** RETURNS:
 **  1 on success, 0 on failure (profile state exceeds size of stack)
 */
-LUA_API lmprof_StackInst *lmprof_stack_measured_push(lmprof_Stack *s, lmprof_Record *record, lmprof_EventUnit *unit, char tail);
+LUA_API lmprof_StackInst *lmprof_stack_measured_push(lmprof_Stack *s, lmprof_Record *record, lu_addr frame, lmprof_EventUnit *unit, char tail);
 
 /*
 ** Remove the stack instance at the top of this stack at a given unit (allocator
@@ -162,11 +429,12 @@ LUA_API lmprof_StackInst *lmprof_stack_measured_push(lmprof_Stack *s, lmprof_Rec
 LUA_API lmprof_StackInst *lmprof_stack_measured_pop(lmprof_Stack *s, lmprof_EventUnit *unit);
 
 /* Push a TraceEvent instance onto the stack. */
-static LUA_INLINE lmprof_StackInst *lmprof_stack_event_push(lmprof_Stack *s, lmprof_Record *record, lmprof_EventMeasurement *unit, char tail) {
+static LUA_INLINE lmprof_StackInst *lmprof_stack_event_push(lmprof_Stack *s, lmprof_Record *record, lu_addr frame, lmprof_EventMeasurement *unit, char tail) {
   lmprof_StackInst *inst;
-  if ((inst = lmprof_stack_next(s, tail)) != l_nullptr) {
+  if ((inst = lmprof_stack_next(s, frame, tail)) != l_nullptr) {
     inst->trace.call = *unit;
     inst->trace.record = record;
+    lmprof_stack_edge_owner(inst, record);
   }
   return inst;
 }
@@ -53,6 +53,7 @@ typedef enum TraceEventType {
   END_FRAME, /* timeline.frame */
   BEGIN_ROUTINE, /* [C] coroutine.resume */
   END_ROUTINE, /* [C] coroutine.yield */
+  SWITCH_ROUTINE, /* Change in coroutine: expanded at report time (timeline_expand) */
   ENTER_SCOPE, /* Begin lua*_call*/
   EXIT_SCOPE, /* End lua*_call*/
   LINE_SCOPE, /* Execution of a new line of Lua code */
@@ -62,22 +63,33 @@ typedef enum TraceEventType {
   IGNORE_SCOPE /* Ignored event */
 } TraceEventType;
 
+/* TraceEvent.flags */
+#define TRACE_EVENT_RELOCATED 0x1 /* Copied by timeline_recycle: 'sibling' references the copy */
+
+/*
+** Compact TraceEvent encoding: the process/thread identifiers of an event are
+** interned by its timeline (see timeline_process), the accumulated profiling
+** overhead is subtracted from the timestamp when the event is appended, and
+** memory usage is only stored, alongside the event, in LMPROF_MODE_MEMORY (see
+** traceevent_heap).
+*/
 typedef struct TraceEvent {
-  TraceEventType op;
-  lmprof_EventMeasurement call;
+  lu_time time; /* Event time, without profiling overhead; relative to 'baseTime' once adjusted */
+  unsigned int op : 4; /* TraceEventType */
+  unsigned int flags : 4;
+  unsigned int thread : 24; /* Interned process/thread identifier */
+  int line; /* LINE_SCOPE line number */
   union Data {
     struct {
       const lmprof_FunctionInfo *info;
       struct TraceEvent *sibling;
       struct TraceEvent *lines;
-      unsigned char flags;
     } event;
     /* A linked-list of all line events related to the function in reverse order */
     struct {
       const lmprof_FunctionInfo *info;
       struct TraceEvent *previous;
       struct TraceEvent *next;
-      int line; /* line number */
     } line;
     struct {
       struct TraceEvent *next; /* next sample event used to compute durations */
@@ -85,6 +97,16 @@ typedef struct TraceEvent {
     struct {
       size_t frame;
     } frame;
+    /*
+    ** An END_ROUTINE/BEGIN_ROUTINE pair, with the EXIT_SCOPE/ENTER_SCOPE events
+    ** of each suspended/resumed function, compacted into a single event.
+    */
+    struct {
+      unsigned int from; /* interned identifier of the suspended coroutine */
+      unsigned int to; /* interned identifier of the resumed coroutine */
+      size_t frame; /* BEGIN_FRAME identifier, zero if frames are not drawn */
+      size_t count; /* number of synthetic events; see timeline_expand */
+    } routine;
     struct {
       char *name;
       size_t nameLen;
@@ -95,35 +117,86 @@ typedef struct TraceEvent {
 
 typedef struct TraceEventPage {
   size_t count; /* available number of profiling events. */
+  size_t size; /* maximum number of profiling events. */
   struct TraceEventPage *next; /* next linked page. */
+  lu_sizediff *heap; /* heap usage of each event, stored after 'event_array'; NULL if not tracked */
   struct TraceEvent event_array[1]; /* array of trace events*/
 } TraceEventPage;
 
+/*
+@@ TRACE_EVENT_THREAD_BLOCKS: Number of TraceEventThreads blocks: block 'b'
+**  stores 2^b identifiers, i.e., at most 2^TRACE_EVENT_THREAD_BLOCKS - 1
+**  identifiers (bounded by the width of TraceEvent.thread).
+*/
+#define TRACE_EVENT_THREAD_BLOCKS 24
+
+/*
+** Interned process/thread identifiers. Identifiers are stored in blocks of
+** increasing size that are never moved once allocated, i.e., identifiers can be
+** resolved (timeline_process) while others are being interned.
+*/
+typedef struct TraceEventThreads {
+  size_t count; /* Number of interned identifiers */
+  size_t last; /* Most recently interned identifier */
+  size_t size; /* Capacity of 'slots' */
+  size_t *slots; /* Open-addressing index of identifiers: offset by one, zero if empty */
+  lmprof_EventProcess *blocks[TRACE_EVENT_THREAD_BLOCKS];
+} TraceEventThreads;
+
+/* TraceEventTimeline.flags */
+#define TRACE_EVENT_TIMELINE_HEAP 0x1 /* Pages store the heap usage of each event */
+#define TRACE_EVENT_TIMELINE_SHARED 0x2 /* 'threads' is owned by another timeline */
+
 /* Linked list of fixed-sizes pages. */
 typedef struct TraceEventTimeline {
   lmprof_Alloc *page_allocator;
+  int flags;
   size_t pageCount; /* Number of active pages */
   size_t pageLimit; /* Maximum number of allocated pages */
   size_t frameCount; /* Number of beginframe calls */
+  size_t switchCount; /* Number of buffered SWITCH_ROUTINE events */
+  size_t recycleCount; /* Number of pages recycled by timeline_recycle */
   lu_time baseTime; /* Base time subtracted from all TraceEvent instances */
+  struct TraceEventThreads *threads; /* Interned identifiers; shared with synthetic & prologue */
   struct TraceEventPage *head;
   struct TraceEventPage *curr;
+  struct TraceEventTimeline *synthetic; /* Events generated by timeline_expand */
+  struct TraceEventTimeline *prologue; /* Events carried over from recycled pages; precedes 'head' */
+  struct TraceEvent detached; /* Stand-in for the ENTER_SCOPE events of pages handed-off by timeline_detach */
 } TraceEventTimeline;
 
+/* Heap usage, i.e., allocated minus deallocated bytes, when 'event' was appended to 'page'. */
+static LUA_INLINE lu_sizediff traceevent_heap(const TraceEventPage *page, const TraceEvent *event) {
+  return (page->heap == l_nullptr) ? 0 : page->heap[event - page->event_array];
+}
+
 /* Iterator interface */
 typedef void (*TraceEventIterator)(TraceEventTimeline *, TraceEvent *, const void *);
 
-/* Create a new ProfilerEvent buffer */
-LUA_API TraceEventPage *traceevent_new(lmprof_Alloc *alloc);
+/* Invoked by timeline_recycle to update all external references to relocated events */
+typedef void (*TraceEventRelocate)(TraceEventTimeline *, void *);
+
+/* Create a new ProfilerEvent buffer; 'heap' reserving space for the heap usage of each event */
+LUA_API TraceEventPage *traceevent_new(lmprof_Alloc *alloc, int heap);
 
 /* Clear all data within a page buffer. */
 LUA_API void traceevent_free(lmprof_Alloc *alloc, TraceEventPage *buffer);
 
+/* Release all data owned by the events of a page, e.g., metadata names, and empty it. */
+LUA_API void traceevent_clear(lmprof_Alloc *alloc, TraceEventPage *page);
+
+/* Subtract 'baseTime' (and the accumulated overhead) from all events of a page; see timeline_adjust */
+LUA_API void traceevent_adjust(TraceEventPage *page, lu_time baseTime);
+
+/* Mark an ENTER_SCOPE event, its EXIT_SCOPE sibling, and all of its lines as IGNORE_SCOPE. */
+LUA_API void traceevent_ignorescope(TraceEvent *event);
+
 /*
 ** Create a new ProfilerEvent list that stores ProfilingEvent's in fixed sized
-** allocated blocks.
+** allocated blocks. If 'heap' is true, the heap usage of each event is also
+** stored (LMPROF_MODE_MEMORY).
 */
-LUA_API TraceEventTimeline *timeline_new(lmprof_Alloc *alloc, size_t pageLimit);
+LUA_API TraceEventTimeline *timeline_new(lmprof_Alloc *alloc, size_t pageLimit, int heap);
 
 /* Free all memory associated with the chrome list */
 LUA_API void timeline_free(TraceEventTimeline *list);
@@ -131,8 +204,20 @@ LUA_API void timeline_free(TraceEventTimeline *list);
 /* Return the default TraceEventPage size  */
 LUA_API size_t timeline_page_size(void);
 
-/* Number of TraceEvent instances that can fit within a single TraceEventPage */
-LUA_API size_t timeline_event_array_size(void);
+/* Number of TraceEvent instances that can fit within a single TraceEventPage of the timeline */
+LUA_API size_t timeline_event_array_size(const TraceEventTimeline *list);
+
+/* Number of page bytes used by each TraceEvent of the timeline */
+LUA_API size_t timeline_event_size(const TraceEventTimeline *list);
+
+/* Return the process/thread identifiers of an event of the timeline */
+LUA_API const lmprof_EventProcess *timeline_process(const TraceEventTimeline *list, const TraceEvent *event);
+
+/* Intern a process/thread identifier of the timeline; returning an error code. */
+LUA_API int timeline_intern(TraceEventTimeline *list, lmprof_EventProcess proc, unsigned int *id);
+
+/* Return the process/thread identifiers of an interned identifier of the timeline */
+LUA_API const lmprof_EventProcess *timeline_thread(const TraceEventTimeline *list, unsigned int id);
 
 /* Return buffer usage: a value between 0.0 and 1.0 */
 LUA_API double timeline_usage(const TraceEventTimeline *list);
@@ -140,6 +225,58 @@ LUA_API double timeline_usage(const TraceEventTimeline *list);
 /* Return true if the trace event list can buffer "N" additional trace events */
 LUA_API int timeline_canbuffer(const TraceEventTimeline *list, size_t n);
 
+/*
+** Recycle the oldest page of a full timeline, i.e., the timeline becomes a ring
+** buffer of its most recent events. Events of the page that are still 'open'
+** are carried over into the 'prologue' of the timeline: ENTER_SCOPE events
+** without an EXIT_SCOPE in the page, the last BEGIN_ROUTINE/BEGIN_FRAME, and
+** all PROCESS/THREAD metadata. The timing of the carried events is moved to the
+** start of the retained window. Sibling and line references into the recycled
+** page are rewritten (or cleared).
+**
+** Before the page is reused, 'cb' is invoked to update any references held
+** outside of the timeline, e.g., TraceEventStackInstance.begin_event, see
+** timeline_relocated.
+**
+** @RETURN An error code; TRACE_EVENT_ERRPAGEFULL if the timeline has a single
+**  page; TRACE_EVENT_OK on success.
+*/
+LUA_API int timeline_recycle(TraceEventTimeline *list, TraceEventRelocate cb, void *args);
+
+/*
+** Return the address of an event after its relocation by timeline_recycle, or
+** NULL if the event belongs to recycled memory and was not carried over (e.g.,
+** a closed scope). Only valid within a TraceEventRelocate callback.
+*/
+LUA_API TraceEvent *timeline_relocated(const TraceEventTimeline *list, TraceEvent *event);
+
+/*
+** Detach all buffered pages from the timeline, returning them in order, and
+** continue buffering into 'pages': a linked-list of pages that are reused
+** before allocating additional ones (counted against the page limit). If
+** 'pages' is NULL, a single page is allocated.
+**
+** The detached events are owned by the caller. References to them held outside
+** of the timeline, e.g., TraceEventStackInstance.begin_event, must be redirected
+** to 'list->detached' before any additional event is appended.
+**
+** @RETURN The detached pages; NULL if a replacement could not be allocated.
+*/
+LUA_API TraceEventPage *timeline_detach(TraceEventTimeline *list, TraceEventPage *pages);
+
+/*
+** Append an event to the timeline without initializing it, i.e., the caller is
+** responsible for all fields other than its heap usage. Used to rebuild a
+** timeline, e.g., from a binary dump (see lmprof_report_convert).
+**
+** @RETURN The appended event; NULL if the page limit was reached or a page could
+**  not be allocated.
+*/
+LUA_API TraceEvent *timeline_reserve(TraceEventTimeline *list, lu_sizediff heap);
+
+/* Return the prologue of a timeline, creating it if it does not exist; NULL on failure. */
+LUA_API TraceEventTimeline *timeline_prologue(TraceEventTimeline *list);
+
 /* Traverse through each profiling event, invoking 'cb' for each TraceEvent in the list. */
 LUA_API void timeline_foreach(TraceEventTimeline *list, TraceEventIterator cb, void *args);
 
@@ -151,6 +288,20 @@ LUA_API void timeline_foreach(TraceEventTimeline *list, TraceEventIterator cb, v
 */
 LUA_API void timeline_adjust(TraceEventTimeline *list);
 
+/*
+** Rebuild the EXIT_SCOPE/ENTER_SCOPE events of each SWITCH_ROUTINE event: each
+** coroutine switch generates an EXIT_SCOPE event for every function on the
+** stack of the suspended coroutine and an ENTER_SCOPE event for every function
+** on the stack of the resumed one. The generated events are stored in a
+** separate 'synthetic' timeline, in order, and the ENTER_SCOPE/EXIT_SCOPE
+** sibling (and line) relationships are rewritten to reflect them.
+**
+** This function must be invoked prior to timeline_adjust & timeline_compress.
+**
+** @RETURN An error code; TRACE_EVENT_OK on success.
+*/
+LUA_API int timeline_expand(TraceEventTimeline *list);
+
 /* Options for event compression. */
 typedef struct TraceEventCompressOpts {
   lmprof_EventProcess id; /* Only compress events from a specific process/thread, 0 for all */
@@ -195,6 +346,13 @@ LUA_API int traceevent_endframe(TraceEventTimeline *list, lmprof_EventMeasuremen
 LUA_API int traceevent_beginroutine(TraceEventTimeline *list, lmprof_EventMeasurement unit);
 LUA_API int traceevent_endroutine(TraceEventTimeline *list, lmprof_EventMeasurement unit);
 
+/*
+** Append a SWITCH_ROUTINE TraceEvent: a change from coroutine 'from' to 'to'. If
+** 'draw_frame' is true, the switch also ends the current frame and begins a new
+** one (see traceevent_endframe/traceevent_beginframe).
+*/
+LUA_API int traceevent_switchroutine(TraceEventTimeline *list, lmprof_EventMeasurement unit, lua_Integer from, lua_Integer to, int draw_frame);
+
 /* Append a ENTER_SCOPE/EXIT_SCOPE TraceEvent  */
 LUA_API int traceevent_enterscope(TraceEventTimeline *list, TraceEventStackInstance *inst);
 LUA_API int traceevent_exitscope(TraceEventTimeline *list, TraceEventStackInstance *inst);
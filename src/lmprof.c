@@ -144,6 +144,278 @@ LUA_API char *lmprof_strdup_free(lmprof_Alloc *alloc, const char *source, size_t
   return l_nullptr;
 }
 
+/* Most restrictive alignment of any object allocated from an arena */
+typedef union lmprof_ArenaAlign {
+  void *p;
+  double d;
+  lu_addr a;
+  lu_time t;
+  lua_Integer i;
+  lua_Number n;
+} lmprof_ArenaAlign;
+
+#define ARENA_ALIGN(S) \
+  ((((S) + sizeof(lmprof_ArenaAlign) - 1) / sizeof(lmprof_ArenaAlign)) * sizeof(lmprof_ArenaAlign))
+
+/* Chunk header; the allocatable region immediately follows (ARENA_HEADER) */
+typedef struct lmprof_ArenaChunk {
+  struct lmprof_ArenaChunk *next;
+  size_t size; /* Number of bytes allocated, including the header */
+  size_t used; /* Number of bytes consumed, including the header */
+} lmprof_ArenaChunk;
+
+#define ARENA_HEADER ARENA_ALIGN(sizeof(lmprof_ArenaChunk))
+
+LUA_API void lmprof_arena_init(lmprof_Arena *arena) {
+  arena->head = l_nullptr;
+  arena->chunks = 0;
+  arena->bytes = 0;
+}
+
+LUA_API void *lmprof_arena_alloc(lmprof_Alloc *alloc, lmprof_Arena *arena, size_t size) {
+  lmprof_ArenaChunk *chunk = arena->head;
+
+  size = ARENA_ALIGN(size);
+  if (chunk == l_nullptr || (chunk->size - chunk->used) < size) {
+    const size_t csize = (ARENA_HEADER + size > LMPROF_ARENA_CHUNK_SIZE) ? ARENA_HEADER + size : LMPROF_ARENA_CHUNK_SIZE;
+    if ((chunk = l_pcast(lmprof_ArenaChunk *, lmprof_malloc(alloc, csize))) == l_nullptr)
+      return l_nullptr;
+
+    chunk->size = csize;
+    chunk->used = ARENA_HEADER;
+
+    /*
+    ** Dedicated chunks are placed behind the active chunk to not discard its
+    ** remaining space.
+    */
+    if (arena->head != l_nullptr && csize > LMPROF_ARENA_CHUNK_SIZE) {
+      chunk->next = arena->head->next;
+      arena->head->next = chunk;
+    }
+    else {
+      chunk->next = arena->head;
+      arena->head = chunk;
+    }
+
+    arena->chunks++;
+    arena->bytes += csize;
+  }
+
+  chunk->used += size;
+  return l_pcast(void *, l_pcast(char *, chunk) + (chunk->used - size));
+}
+
+LUA_API void lmprof_arena_release(lmprof_Alloc *alloc, lmprof_Arena *arena) {
+  lmprof_ArenaChunk *chunk = arena->head;
+  while (chunk != l_nullptr) {
+    lmprof_ArenaChunk *next = chunk->next;
+    lmprof_free(alloc, l_pcast(void *, chunk), chunk->size);
+    chunk = next;
+  }
+  lmprof_arena_init(arena);
+}
+
+/* }================================================================== */
+
+/*
+** {==================================================================
+**  Page Provider
+** ===================================================================
+*/
+#if LMPROF_HAS_MMAP
+  #include <sys/mman.h>
+  #include <unistd.h>
+
+  #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+    #define MAP_ANONYMOUS MAP_ANON
+  #endif
+
+/* Default huge page size: MAP_HUGETLB mappings must be a multiple of it */
+#define PAGES_HUGE_SIZE 2097152
+
+/* Initial capacity of the released block stack */
+#define PAGES_RELEASED_INIT 64
+
+/* A memory mapping; the list nodes are allocated by the fallback allocator */
+typedef struct lmprof_PagesChunk {
+  struct lmprof_PagesChunk *next;
+  char *base;
+  size_t size;
+} lmprof_PagesChunk;
+
+typedef struct lmprof_Pages {
+  lmprof_Alloc alloc; /* Interface; see lmprof_pages_alloc */
+  lmprof_Alloc *fallback; /* Allocator of all other requests and of the provider itself */
+  size_t size; /* Block size */
+  size_t chunk_size; /* Size of each mapping */
+  size_t os_page; /* Operating system page size */
+  lmprof_PagesChunk *chunks;
+  char *cursor; /* Next unused block of the most recent mapping */
+  char *end;
+  void **released; /* Stack of released blocks */
+  size_t released_count;
+  size_t released_size;
+} lmprof_Pages;
+
+/* Map a new (anonymous) chunk */
+static int pages_map(lmprof_Pages *P) {
+  char *base = l_pcast(char *, MAP_FAILED);
+  lmprof_PagesChunk *chunk = l_pcast(lmprof_PagesChunk *, lmprof_malloc(P->fallback, sizeof(lmprof_PagesChunk)));
+  if (chunk == l_nullptr)
+    return 0;
+
+#if defined(LMPROF_MMAP_HUGETLB) && defined(MAP_HUGETLB)
+  if ((P->chunk_size % PAGES_HUGE_SIZE) == 0) /* Requires reserved huge pages: fallback otherwise */
+    base = l_pcast(char *, mmap(l_nullptr, P->chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0));
+#endif
+  if (base == l_pcast(char *, MAP_FAILED)) {
+    base = l_pcast(char *, mmap(l_nullptr, P->chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+#if defined(MADV_HUGEPAGE)
+    if (base != l_pcast(char *, MAP_FAILED))
+      madvise(base, P->chunk_size, MADV_HUGEPAGE); /* Transparent huge pages: only a hint */
+#endif
+  }
+
+  if (base == l_pcast(char *, MAP_FAILED)) {
+    lmprof_free(P->fallback, l_pcast(void *, chunk), sizeof(lmprof_PagesChunk));
+    return 0;
+  }
+
+  chunk->base = base;
+  chunk->size = P->chunk_size;
+  chunk->next = P->chunks;
+  P->chunks = chunk;
+  P->cursor = base;
+  P->end = base + (P->chunk_size / P->size) * P->size;
+  return 1;
+}
+
+static void *pages_acquire(lmprof_Pages *P) {
+  void *block = l_nullptr;
+  if (P->released_count > 0)
+    return P->released[--P->released_count];
+  else if (P->cursor == P->end && !pages_map(P))
+    return l_nullptr;
+
+  block = l_pcast(void *, P->cursor);
+  P->cursor += P->size;
+  return block;
+}
+
+static void pages_release(lmprof_Pages *P, void *block) {
+  if (P->released_count == P->released_size) {
+    const size_t osize = P->released_size * sizeof(void *);
+    const size_t size = (P->released_size == 0) ? PAGES_RELEASED_INIT : (P->released_size << 1);
+    void **released = l_pcast(void **, lmprof_realloc(P->fallback, P->released, osize, size * sizeof(void *)));
+    if (released == l_nullptr)
+      return; /* The block remains mapped until the provider is freed */
+
+    P->released = released;
+    P->released_size = size;
+  }
+
+  /* Return the physical pages; the block is zero-filled (or reread) on reuse */
+  if ((P->size % P->os_page) == 0)
+    madvise(block, P->size, MADV_DONTNEED);
+  P->released[P->released_count++] = block;
+}
+
+/*
+** lua_Alloc: blocks are identified by their size; when 'ptr' is NULL 'osize'
+** encodes the type of the object being allocated and not a size.
+*/
+static void *pages_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  lmprof_Pages *P = l_pcast(lmprof_Pages *, ud);
+  const int owned = (ptr != l_nullptr && osize == P->size);
+  if (nsize == 0) {
+    if (owned)
+      pages_release(P, ptr);
+    else
+      lmprof_free(P->fallback, ptr, osize);
+    return l_nullptr;
+  }
+  else if (owned && nsize == P->size)
+    return ptr;
+  else if (!owned && nsize != P->size)
+    return lmprof_realloc(P->fallback, ptr, osize, nsize);
+  else { /* Moving between a mapping and the fallback allocator */
+    void *block = (nsize == P->size) ? pages_acquire(P) : lmprof_malloc(P->fallback, nsize);
+    if (block != l_nullptr && ptr != l_nullptr) {
+      memcpy(block, ptr, (osize < nsize) ? osize : nsize);
+      if (owned)
+        pages_release(P, ptr);
+      else
+        lmprof_free(P->fallback, ptr, osize);
+    }
+    return block;
+  }
+}
+
+LUA_API lmprof_Pages *lmprof_pages_new(lmprof_Alloc *fallback, size_t size) {
+  const long os_page = sysconf(_SC_PAGESIZE);
+  size_t blocks = (size == 0) ? 0 : (LMPROF_MMAP_CHUNK_SIZE / size);
+
+  lmprof_Pages *P = l_nullptr;
+  if (size == 0 || (P = l_pcast(lmprof_Pages *, lmprof_malloc(fallback, sizeof(lmprof_Pages)))) == l_nullptr)
+    return l_nullptr;
+
+  P->alloc.f = pages_alloc;
+  P->alloc.ud = l_pcast(void *, P);
+  P->fallback = fallback;
+  P->size = size;
+  P->os_page = (os_page > 0) ? l_cast(size_t, os_page) : 4096;
+  P->chunk_size = ((blocks == 0) ? 1 : blocks) * size;
+  P->chunk_size = ((P->chunk_size + P->os_page - 1) / P->os_page) * P->os_page;
+  P->chunks = l_nullptr;
+  P->cursor = P->end = l_nullptr;
+  P->released = l_nullptr;
+  P->released_count = 0;
+  P->released_size = 0;
+  return P;
+}
+
+LUA_API void lmprof_pages_free(lmprof_Pages *P) {
+  lmprof_PagesChunk *chunk = P->chunks;
+  while (chunk != l_nullptr) {
+    lmprof_PagesChunk *next = chunk->next;
+    munmap(l_pcast(void *, chunk->base), chunk->size);
+    lmprof_free(P->fallback, l_pcast(void *, chunk), sizeof(lmprof_PagesChunk));
+    chunk = next;
+  }
+
+  lmprof_free(P->fallback, l_pcast(void *, P->released), P->released_size * sizeof(void *));
+  lmprof_free(P->fallback, l_pcast(void *, P), sizeof(lmprof_Pages));
+}
+
+LUA_API lmprof_Alloc *lmprof_pages_alloc(lmprof_Pages *P) {
+  return &P->alloc;
+}
+
+LUA_API void lmprof_pages_fallback(lmprof_Pages *P, lmprof_Alloc *fallback) {
+  P->fallback = fallback;
+}
+#else
+LUA_API struct lmprof_Pages *lmprof_pages_new(lmprof_Alloc *fallback, size_t size) {
+  UNUSED(fallback);
+  UNUSED(size);
+  return l_nullptr;
+}
+
+LUA_API void lmprof_pages_free(struct lmprof_Pages *pages) {
+  UNUSED(pages);
+}
+
+LUA_API lmprof_Alloc *lmprof_pages_alloc(struct lmprof_Pages *pages) {
+  UNUSED(pages);
+  return l_nullptr;
+}
+
+LUA_API void lmprof_pages_fallback(struct lmprof_Pages *pages, lmprof_Alloc *fallback) {
+  UNUSED(pages);
+  UNUSED(fallback);
+}
+#endif
+
 /* }================================================================== */
 
 /*
@@ -255,6 +527,11 @@ LUA_API lu_time lmprof_clock_rdtsc(void) {
 ** ===================================================================
 */
 
+/* Allocator of the record arenas: mapped chunks when LMPROF_OPT_PAGE_MMAP */
+static lmprof_Alloc *lmprof_arena_allocator(lmprof_State *st) {
+  return (st->i.chunks != l_nullptr) ? lmprof_pages_alloc(st->i.chunks) : &st->hook.alloc;
+}
+
 int lmprof_error(lua_State *L, lmprof_State *st, const char *fmt, ...) {
   va_list argp;
   BITFIELD_SET(st->state, LMPROF_STATE_ERROR | LMPROF_STATE_IGNORE_ALLOC);
@@ -290,9 +567,12 @@ int lmprof_initialize_state(lua_State *L, lmprof_State *st, uint32_t mode, lmpro
   st->thread.state = l_nullptr;
   st->thread.call_stack = l_nullptr;
   st->thread.stack_count = 0;
+  st->thread.stack_gc = LMPROF_STACK_GC;
   st->thread.r.overhead = 0;
   st->thread.r.proc = st->thread.mainproc;
   unit_clear(&st->thread.r.s);
+  lmprof_stack_pool_init(&st->thread.pool, LMPROF_STACK_POOL);
+  lmprof_thread_map_init(&st->thread.map);
 
   /* Required changes in Lua to allow memory profiling in a single-threaded state */
   if (BITFIELD_TEST(st->mode, LMPROF_MODE_SINGLE_THREAD))
@@ -305,15 +585,26 @@ int lmprof_initialize_state(lua_State *L, lmprof_State *st, uint32_t mode, lmpro
 
   st->i.url = l_nullptr;
   st->i.name = l_nullptr;
+  st->i.stream = l_nullptr;
+  st->i.writer = l_nullptr;
+  st->i.pages = l_nullptr;
+  st->i.chunks = l_nullptr;
   st->i.pageLimit = 0;
   st->i.counterFrequency = 0;
   st->i.event_threshold = 0;
+  st->i.reportThreads = 0;
 
   st->i.record_count = 0;
+  lmprof_arena_init(&st->i.arena);
+  lmprof_arena_init(&st->i.info_arena);
   st->i.hash = l_nullptr;
+  st->i.idcache = l_nullptr;
+  st->i.edge_hits = 0;
+  st->i.edge_misses = 0;
   if (BITFIELD_TEST(st->mode, LMPROF_CALLBACK_MASK)) {
     st->i.trace.arg = l_nullptr;
     st->i.trace.free = l_nullptr;
+    st->i.trace.transfer = l_nullptr;
     st->i.trace.scope = l_nullptr;
     st->i.trace.sample = l_nullptr;
   }
@@ -363,9 +654,12 @@ int lmprof_initialize_state(lua_State *L, lmprof_State *st, uint32_t mode, lmpro
     /* Initialize interface structures */
     st->i.pageLimit = lmprof_getlibi(L, LMPROF_PAGE_LIMIT, 0);
     st->i.counterFrequency = lmprof_getlibi(L, LMPROF_COUNTERS_FREQ, TRACE_EVENT_COUNTER_FREQ);
+    st->i.reportThreads = lmprof_getlibi(L, LMPROF_REPORT_THREADS, 0);
     st->i.hash_size = l_cast(size_t, lmprof_getlibi(L, LMPROF_HASHTABLE_SIZE, LMPROF_HASH_SIZE));
     st->i.event_threshold = l_cast(lu_time, lmprof_getlibi(L, LMPROF_THRESHOLD, TRACE_EVENT_DEFAULT_THRESHOLD));
     st->i.mask_count = l_cast(int, lmprof_getlibi(L, LMPROF_HOOK_COUNT, 0));
+    st->thread.pool.limit = l_cast(size_t, lmprof_getlibi(L, LMPROF_STACK_POOL_LIMIT, LMPROF_STACK_POOL));
+    st->thread.stack_gc = l_cast(size_t, lmprof_getlibi(L, LMPROF_STACK_GC_RATE, LMPROF_STACK_GC));
     st->i.calibration = 0;
     st->i.instr_count = 0;
 
@@ -377,7 +671,11 @@ int lmprof_initialize_state(lua_State *L, lmprof_State *st, uint32_t mode, lmpro
     if (lua_type(L, -1) == LUA_TSTRING && (str = lua_tostring(L, -1)) != l_nullptr)
       st->i.name = lmprof_strdup(&st->hook.alloc, str, 0);
 
-    lua_pop(L, 2);
+    lmprof_getlibfield(L, LMPROF_STREAM_PATH); /* [..., url, name, stream] */
+    if (lua_type(L, -1) == LUA_TSTRING && (str = lua_tostring(L, -1)) != l_nullptr && *str != '\0')
+      st->i.stream = lmprof_strdup(&st->hook.alloc, str, 0);
+
+    lua_pop(L, 3);
     BITFIELD_SET(st->state, LMPROF_STATE_IGNORE_CALL);
   }
 
@@ -390,12 +688,32 @@ int lmprof_clear_state(lua_State *L, lmprof_State *st) {
     lmprof_hash_destroy(&st->hook.alloc, st->i.hash);
     st->i.hash = l_nullptr;
   }
+  lmprof_arena_release(lmprof_arena_allocator(st), &st->i.arena); /* after records are cleared */
+  lmprof_arena_release(lmprof_arena_allocator(st), &st->i.info_arena);
+  if (st->i.chunks != l_nullptr) {
+    lmprof_pages_free(st->i.chunks);
+    st->i.chunks = l_nullptr;
+  }
+
+  if (st->i.pages != l_nullptr) { /* after the TraceEvent timeline is freed */
+    lmprof_pages_free(st->i.pages);
+    st->i.pages = l_nullptr;
+  }
+
+  if (st->i.idcache != l_nullptr) {
+    lmprof_identity_cache_destroy(&st->hook.alloc, st->i.idcache);
+    st->i.idcache = l_nullptr;
+  }
+  lmprof_stack_pool_clear(&st->hook.alloc, &st->thread.pool);
+  lmprof_thread_map_free(&st->hook.alloc, &st->thread.map);
 
   /* The bits from 'lmprof_initialize_state' that still require reset */
   if (BITFIELD_TEST(st->state, LMPROF_STATE_PERSISTENT)) {
     st->thread.state = l_nullptr;
     st->thread.call_stack = l_nullptr;
     st->thread.stack_count = 0;
+    st->thread.pool.hits = 0;
+    st->thread.pool.misses = 0;
     st->thread.r.overhead = 0;
     st->thread.r.proc = st->thread.mainproc;
     unit_clear(&st->thread.r.s);
@@ -411,6 +729,11 @@ int lmprof_clear_state(lua_State *L, lmprof_State *st) {
       st->i.url = l_nullptr;
     }
 
+    if (st->i.stream != l_nullptr) {
+      lmprof_strdup_free(&st->hook.alloc, st->i.stream, 0);
+      st->i.stream = l_nullptr;
+    }
+
     /* Reset all data to default state to prevent pointer leaks. */
     lmprof_initialize_state(l_nullptr, st, 0, l_nullptr);
   }
@@ -418,6 +741,45 @@ int lmprof_clear_state(lua_State *L, lmprof_State *st) {
   return LUA_OK;
 }
 
+void lmprof_move_state(lmprof_State *st, lmprof_State *to) {
+  *to = *st;
+  to->on_error = l_nullptr;
+  to->thread.main = to->thread.state = l_nullptr;
+  to->thread.call_stack = l_nullptr;
+  to->thread.stack_count = 0;
+  lmprof_stack_pool_init(&to->thread.pool, LMPROF_STACK_POOL);
+  lmprof_thread_map_init(&to->thread.map);
+
+  /* Strings and caches remain owned by 'st': lmprof_clear_state only releases the profile data of 'to' */
+  BITFIELD_SET(to->state, LMPROF_STATE_PERSISTENT);
+  to->i.url = to->i.name = to->i.stream = l_nullptr;
+  to->i.writer = l_nullptr;
+  to->i.idcache = l_nullptr;
+  if (to->i.pages != l_nullptr)
+    lmprof_pages_fallback(to->i.pages, &to->hook.alloc);
+  if (to->i.chunks != l_nullptr)
+    lmprof_pages_fallback(to->i.chunks, &to->hook.alloc);
+
+  st->i.hash = l_nullptr;
+  st->i.pages = st->i.chunks = l_nullptr;
+  lmprof_arena_init(&st->i.arena);
+  lmprof_arena_init(&st->i.info_arena);
+  if (BITFIELD_TEST(st->mode, LMPROF_CALLBACK_MASK)) {
+    st->i.trace.arg = l_nullptr;
+    st->i.trace.free = l_nullptr;
+  }
+}
+
+#if defined(LMPROF_EXTRASPACE)
+/* @SEE Singleton */
+static lmprof_State **lmprof_singleton_cache(lua_State *L);
+static void lmprof_singleton_attach(lua_State *L, lmprof_State **cache);
+#endif
+
+/* @SEE Threading */
+static lmprof_Stack **lmprof_thread_sentinel(lua_State *L, int idx);
+static void lmprof_thread_sentinel_free(lmprof_Stack **sentinel);
+
 void lmprof_initialize_thread(lua_State *L, lmprof_State *st, lua_State *ignore) {
   if (ignore != L && luaL_verify_thread(L) && lua_gethook(L) != st->hook.l_hook) {
     /*
@@ -432,6 +794,9 @@ void lmprof_initialize_thread(lua_State *L, lmprof_State *st, lua_State *ignore)
         st->thread.r.proc.tid = stack->thread_identifier;
     }
 
+#if defined(LMPROF_EXTRASPACE)
+    lmprof_singleton_attach(L, lmprof_singleton_cache(L));
+#endif
     lua_sethook(L, st->hook.l_hook, st->hook.flags, st->hook.line_count);
     st->thread.r.proc.tid = c_id;
   }
@@ -443,18 +808,9 @@ void lmprof_clear_thread(lua_State *L, lmprof_State *st, lua_State *ignore) {
     luaL_checkstack(L, 5, __FUNCTION__);
     lmprof_getlibtable(L, LMPROF_TAB_THREAD_STACKS); /* [..., thread_stacks] */
 
-    /*
-    ** If the profiler stack is a light-userdata, manage that memory.
-    **
-    ** @NOTE Future-proofing for if/when allocated profiler stacks no longer
-    **  become managed by Lua.
-    */
     lua_pushthread(L); /* [..., thread_stacks, thread] */
-    lua_rawget(L, -2); /* [..., thread_stacks, stack] */
-    if (lua_islightuserdata(L, -1)) {
-      lmprof_Stack *stack = l_pcast(lmprof_Stack *, lua_touserdata(L, -1));
-      lmprof_stack_light_free(&st->hook.alloc, stack);
-    }
+    lua_rawget(L, -2); /* [..., thread_stacks, sentinel] */
+    lmprof_thread_sentinel_free(lmprof_thread_sentinel(L, -1));
 
     lua_pushthread(L); /* [..., thread_stacks, stack, thread] */
     lua_pushnil(L); /* [..., thread_stacks, stack, thread, nil] */
@@ -474,20 +830,42 @@ void lmprof_clear_thread(lua_State *L, lmprof_State *st, lua_State *ignore) {
 */
 
 /*
-** @TODO: Experiment with lua_rawgetp/lua_rawsetp to store the active profiling
-**  state in the registry.
+** When available, the address of a static is used as the registry key to avoid
+** string interning on each lookup.
 */
-#define REGISTRY_GET_SINGLETON(L) lua_getfield((L), LUA_REGISTRYINDEX, LMPROF_PROFILER_SINGLETON)
-#define REGISTRY_SET_SINGLETON(L) lua_setfield((L), LUA_REGISTRYINDEX, LMPROF_PROFILER_SINGLETON)
+#if LUA_VERSION_NUM >= 502
+static const char lmprof_singleton_key = 0;
+  #define REGISTRY_GET_SINGLETON(L) lua_rawgetp((L), LUA_REGISTRYINDEX, l_pcast(const void *, &lmprof_singleton_key))
+  #define REGISTRY_SET_SINGLETON(L) lua_rawsetp((L), LUA_REGISTRYINDEX, l_pcast(const void *, &lmprof_singleton_key))
+#else
+  #define REGISTRY_GET_SINGLETON(L) lua_getfield((L), LUA_REGISTRYINDEX, LMPROF_PROFILER_SINGLETON)
+  #define REGISTRY_SET_SINGLETON(L) lua_setfield((L), LUA_REGISTRYINDEX, LMPROF_PROFILER_SINGLETON)
+#endif
 
+#if defined(LMPROF_EXTRASPACE)
 /*
-** Clear all threads and associated identifiers of 'dead' threads.
-**
-** 'state' - The active profiler state. If non-null perform an internal garbage
-**  collection step: removing any dead threads and associated data from the
-**  registry.
+** Fetch the singleton cache of the global_State, creating it if needed. The
+** cache is anchored in the library table and never released.
 */
-static void lmprof_thread_info_gc(lua_State *L, lmprof_State *state);
+static lmprof_State **lmprof_singleton_cache(lua_State *L) {
+  lmprof_State **cache = l_nullptr;
+  luaL_checkstack(L, 3, __FUNCTION__);
+  lmprof_getlibfield(L, LMPROF_SINGLETON_CACHE); /* [..., cache] */
+  cache = l_pcast(lmprof_State **, lua_touserdata(L, -1));
+  lua_pop(L, 1);
+  if (cache == l_nullptr) {
+    cache = l_pcast(lmprof_State **, lmprof_newuserdata(L, sizeof(lmprof_State *))); /* [..., cache] */
+    *cache = l_nullptr;
+    lmprof_setlibfield(L, LMPROF_SINGLETON_CACHE); /* [...] */
+  }
+  return cache;
+}
+
+/* Reference the singleton cache from the extraspace of the given thread. */
+static void lmprof_singleton_attach(lua_State *L, lmprof_State **cache) {
+  *l_pcast(lmprof_State ***, lua_getextraspace(L)) = cache;
+}
+#endif
 
 /* Clear and deallocate all lua_State and profile stack associations. */
 static void lmprof_thread_stacktable_free(lua_State *L, int idx);
@@ -574,13 +952,23 @@ int lmprof_check_can_profile(lua_State *L) {
 
 int lmprof_register_singleton(lua_State *L, int idx) {
   if (lmprof_singleton(L) == l_nullptr) {
+#if defined(LMPROF_EXTRASPACE)
+    lmprof_State **cache = lmprof_singleton_cache(L);
+    *cache = l_pcast(lmprof_State *, lua_touserdata(L, idx));
+
+    /* Threads created while profiling inherit the main threads extraspace */
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD); /* [..., main] */
+    lmprof_singleton_attach(lua_tothread(L, -1), cache);
+    lmprof_singleton_attach(L, cache);
+    lua_pop(L, 1);
+#endif
+
     lua_pushvalue(L, lua_absindex(L, idx));
     REGISTRY_SET_SINGLETON(L);
 
     lmprof_hook_debug(L, 0); /* Assume profiled state: cache current debug.hook */
 
     lmprof_thread_stacktable_clear(L);
-    lmprof_thread_info_gc(L, l_nullptr);
     return 1;
   }
   return 0;
@@ -590,11 +978,13 @@ void lmprof_clear_singleton(lua_State *L) {
   luaL_checkstack(L, 4, __FUNCTION__);
   lua_pushnil(L);
   REGISTRY_SET_SINGLETON(L);
+#if defined(LMPROF_EXTRASPACE)
+  *lmprof_singleton_cache(L) = l_nullptr;
+#endif
 
   lmprof_hook_debug(L, 1);
 
   lmprof_thread_stacktable_clear(L);
-  lmprof_thread_info_gc(L, l_nullptr);
 }
 
 int lmprof_verify_singleton(lua_State *L, lmprof_State *st) {
@@ -638,15 +1028,103 @@ int lmprof_verify_singleton(lua_State *L, lmprof_State *st) {
 */
 
 /*
-@@ LMPROF_STACK_GC: Number of additionally profiled coroutines before invoking
-**  an internal garbage collection step. This handles use-cases where *many*
-**  short-lived coroutines are created during the duration of a profile.
-**
-** @TODO: Make runtime configurable.
+** The profiler stack of each thread is referenced by a full userdata sentinel
+** stored in the weak-keyed LMPROF_TAB_THREAD_STACKS table. Once the thread is
+** collected, the finalizer of its sentinel returns the stack to the stack pool
+** of the active profiler (or frees it when no profiler is active).
 */
-#if !defined(LMPROF_STACK_GC)
-  #define LMPROF_STACK_GC 64
+static lmprof_Stack **lmprof_thread_sentinel(lua_State *L, int idx) {
+  if (lua_type(L, idx) == LUA_TUSERDATA)
+    return l_pcast(lmprof_Stack **, lua_touserdata(L, idx));
+  return l_nullptr;
+}
+
+/* Create and push a sentinel referencing the stack of the given thread. */
+static void lmprof_thread_sentinel_new(lua_State *L, lmprof_Stack *stack) {
+  lmprof_Stack **sentinel = l_nullptr;
+#if LUA_VERSION_NUM >= 504
+  sentinel = l_pcast(lmprof_Stack **, lua_newuserdatauv(L, sizeof(lmprof_Stack *), 1)); /* [..., sentinel] */
+#else
+  sentinel = l_pcast(lmprof_Stack **, lmprof_newuserdata(L, sizeof(lmprof_Stack *))); /* [..., sentinel] */
 #endif
+  *sentinel = stack;
+#if LUA_VERSION_NUM == 501
+  luaL_getmetatable(L, LMPROF_STACK_METATABLE);
+  lua_setmetatable(L, -2);
+#else
+  luaL_setmetatable(L, LMPROF_STACK_METATABLE);
+#endif
+
+#if defined(LMPROF_THREAD_MAP)
+  /* The thread cannot be freed until its sentinel is finalized */
+  lua_pushthread(L); /* [..., sentinel, thread] */
+  #if LUA_VERSION_NUM >= 504
+  lua_setiuservalue(L, -2, 1);
+  #elif LUA_VERSION_NUM == 503
+  lua_setuservalue(L, -2);
+  #else
+  lua_createtable(L, 1, 0); /* [..., sentinel, thread, uservalue] */
+  lua_insert(L, -2); /* [..., sentinel, uservalue, thread] */
+  lua_rawseti(L, -2, 1); /* [..., sentinel, uservalue] */
+  lua_setuservalue(L, -2);
+  #endif
+#endif
+}
+
+#if defined(LMPROF_THREAD_MAP)
+/* Return the thread referenced by the sentinel at the given index */
+static lua_State *lmprof_thread_sentinel_owner(lua_State *L, int idx) {
+  lua_State *thread = l_nullptr;
+  #if LUA_VERSION_NUM >= 504
+  lua_getiuservalue(L, idx, 1); /* [..., thread] */
+  #elif LUA_VERSION_NUM == 503
+  lua_getuservalue(L, idx); /* [..., thread] */
+  #else
+  lua_getuservalue(L, idx); /* [..., uservalue] */
+  if (lua_istable(L, -1))
+    lua_rawgeti(L, -1, 1); /* [..., uservalue, thread] */
+  else
+    lua_pushnil(L);
+  lua_remove(L, -2); /* [..., thread] */
+  #endif
+  thread = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  return thread;
+}
+#endif
+
+/* Free the stack of a sentinel; it no longer references a stack. */
+static void lmprof_thread_sentinel_free(lmprof_Stack **sentinel) {
+  if (sentinel != l_nullptr && *sentinel != l_nullptr) {
+    lmprof_Alloc alloc = (*sentinel)->alloc;
+    lmprof_stack_light_free(&alloc, *sentinel);
+    *sentinel = l_nullptr;
+  }
+}
+
+static int lmprof_thread_sentinel_gc(lua_State *L) {
+  lmprof_Stack **sentinel = lmprof_thread_sentinel(L, 1);
+  if (sentinel != l_nullptr && *sentinel != l_nullptr) {
+    lmprof_State *st = lmprof_singleton(L);
+    lmprof_Stack *stack = *sentinel;
+    if (st != l_nullptr && st->thread.call_stack == stack) {
+      st->thread.state = l_nullptr;
+      st->thread.call_stack = l_nullptr;
+    }
+
+    if (st != l_nullptr && BITFIELD_TEST(st->state, LMPROF_STATE_RUNNING)) {
+#if defined(LMPROF_THREAD_MAP)
+      lmprof_thread_map_remove(&st->thread.map, lmprof_thread_sentinel_owner(L, 1));
+#endif
+      lmprof_stack_pool_release(&st->hook.alloc, &st->thread.pool, stack);
+      *sentinel = l_nullptr;
+    }
+    else {
+      lmprof_thread_sentinel_free(sentinel);
+    }
+  }
+  return 0;
+}
 
 /*
 ** If the trace event API is enabled, generate a 'fake' event denoting that the
@@ -661,7 +1139,7 @@ static void lmprof_trace_gc_event(lua_State *L, lmprof_State *st, int begin_gc)
     if (begin_gc) {
       lmprof_Record *record = lmprof_fetch_record(L, st, l_nullptr, LMPROF_RECORD_ID_GC, LMPROF_RECORD_ID_ROOT, 0);
 
-      inst = lmprof_stack_event_push(st->thread.call_stack, record, &st->thread.r, 0);
+      inst = lmprof_stack_event_push(st->thread.call_stack, record, LMPROF_FRAME_NONE, &st->thread.r, 0);
       if ((lmprof_errno = st->i.trace.scope(L, st, inst, 1)) != LUA_OK) {
         lmprof_error(L, st, "Error: %s", traceevent_strerror(lmprof_errno));
       }
@@ -672,6 +1150,7 @@ static void lmprof_trace_gc_event(lua_State *L, lmprof_State *st, int begin_gc)
       if ((lmprof_errno = st->i.trace.scope(L, st, inst, 0)) != LUA_OK) {
         lmprof_error(L, st, "Error: %s", traceevent_strerror(lmprof_errno));
       }
+      stack_clear_instance(st->thread.call_stack, inst);
     }
   }
 }
@@ -682,6 +1161,9 @@ static void lmprof_trace_gc_event(lua_State *L, lmprof_State *st, int begin_gc)
 */
 lmprof_Stack *lmprof_thread_stacktable_get(lua_State *L, lmprof_State *st) {
   lmprof_Stack *stack = l_nullptr;
+#if !defined(LMPROF_THREAD_MAP)
+  lmprof_Stack **sentinel = l_nullptr;
+#endif
   lua_Integer thread_identifier;
   const char callback_api = BITFIELD_TEST(st->mode, LMPROF_CALLBACK_MASK) != 0;
   /* luaL_checkstack(L, 4, __FUNCTION__); */
@@ -690,57 +1172,64 @@ lmprof_Stack *lmprof_thread_stacktable_get(lua_State *L, lmprof_State *st) {
     LMPROF_LOG("Fetching stacktable when not instrumenting\n");
 #endif
 
+#if defined(LMPROF_THREAD_MAP)
+  /* The thread map is authoritative: all created stacks are inserted. */
+  if ((stack = lmprof_thread_map_get(&st->thread.map, L)) != l_nullptr)
+    return stack;
+
+  lmprof_getlibtable(L, LMPROF_TAB_THREAD_STACKS); /* [..., thread_stacks] */
+#else
   lmprof_getlibtable(L, LMPROF_TAB_THREAD_STACKS); /* [..., thread_stacks] */
   lua_pushthread(L); /* [..., thread_stacks, thread] */
-  lua_rawget(L, -2); /* [..., thread_stacks, stack] */
-  if (lua_isuserdata(L, -1)) {
-    stack = l_pcast(lmprof_Stack *, lua_touserdata(L, -1));
-    if (stack != l_nullptr) {
-      lua_pop(L, 2);
-      return stack;
-    }
+  lua_rawget(L, -2); /* [..., thread_stacks, sentinel] */
+  if ((sentinel = lmprof_thread_sentinel(L, -1)) != l_nullptr && *sentinel != l_nullptr) {
+    lua_pop(L, 2);
+    return *sentinel;
   }
 
   lua_pop(L, 1); /* [..., thread_stacks] */
+#endif
 
   /*
-  ** Track the number of allocated profiler stacks. Performing a manual garbage
-  ** collection when that threshold is passed.
-  **
-  ** @NOTE Enabling this feature has the potential to distort "memory" profiling
-  ** as lmprof_thread_identifier_clear may trigger a Lua GC step/cycle.
+  ** Track the number of allocated profiler stacks, performing an incremental
+  ** garbage collection step each 'stack_gc' stacks. Profiler stacks of dead
+  ** coroutines are reclaimed once the coroutine is collected: this step only
+  ** ensures the collector keeps pace with the creation of *many* short-lived
+  ** coroutines. The profiler never forces a full collection.
   **
-  **  If the flag LMPROF_STATE_IGNORE_ALLOC is enabled then all deallocations,
-  **  including ones script generated, will not be accounted for. Otherwise,
-  **  the amount 'deallocated' will include some profiling overhead.
-  **
-  **  The amount of 'overhead' can be minimized by having the profiler stacks
-  **  be light-userdata and then enabling 'LMPROF_STATE_IGNORE_ALLOC' for that
-  **  deallocation.
+  ** @NOTE The step has the potential to distort "memory" profiling. If the
+  **  flag LMPROF_STATE_IGNORE_ALLOC is enabled then all deallocations,
+  **  including ones script generated, will not be accounted for.
   */
   st->thread.stack_count++;
-  if (!BITFIELD_TEST(st->state, LMPROF_STATE_SETTING_UP)) {
-    if ((st->thread.stack_count % LMPROF_STACK_GC) == 0) {
-      LMPROF_LOG("[%s] Garbage collection\n", __FUNCTION__);
+  if (!BITFIELD_TEST(st->state, LMPROF_STATE_SETTING_UP) && st->thread.stack_gc > 0) {
+    if ((st->thread.stack_count % st->thread.stack_gc) == 0) {
+#if LUA_VERSION_NUM >= 502
+      if (lua_gc(L, LUA_GCISRUNNING, 0)) {
+        LMPROF_LOG("[%s] Garbage collection step\n", __FUNCTION__);
 
-      lmprof_trace_gc_event(L, st, 1);
-      lmprof_thread_info_gc(L, st);
-#if LUA_VERSION_NUM >= 503
-      if (lua_gc(L, LUA_GCISRUNNING, 0))
-        lua_gc(L, LUA_GCCOLLECT, 0);
+        lmprof_trace_gc_event(L, st, 1);
+        lua_gc(L, LUA_GCSTEP, 0);
+        lmprof_trace_gc_event(L, st, 0);
+      }
 #endif
-      lmprof_trace_gc_event(L, st, 0);
     }
   }
 
   thread_identifier = lmprof_thread_identifier(L);
-  stack = lmprof_stack_light_new(&st->hook.alloc, thread_identifier, callback_api);
+  stack = lmprof_stack_pool_acquire(&st->hook.alloc, &st->thread.pool, thread_identifier, callback_api);
+#if defined(LMPROF_THREAD_MAP)
+  if (stack != l_nullptr && !lmprof_thread_map_insert(&st->hook.alloc, &st->thread.map, L, stack)) {
+    lmprof_stack_pool_release(&st->hook.alloc, &st->thread.pool, stack);
+    stack = l_nullptr;
+  }
+#endif
 
-  lua_pushthread(L); /* [..., thread_stacks, thread] */
-  lua_pushlightuserdata(L, l_pcast(void *, stack));  /* [..., thread_stacks, thread, stack] */
   if (stack != l_nullptr) {
     lmprof_Record *record = l_nullptr;
 
+    lua_pushthread(L); /* [..., thread_stacks, thread] */
+    lmprof_thread_sentinel_new(L, stack); /* [..., thread_stacks, thread, sentinel] */
     lua_rawset(L, -3); /* [..., thread_stacks] */
     lua_pop(L, 1);
     stack->instr_last = st->thread.r.s.time;
@@ -751,10 +1240,10 @@ lmprof_Stack *lmprof_thread_stacktable_get(lua_State *L, lmprof_State *st) {
     */
     record = lmprof_fetch_record(L, st, l_nullptr, LMPROF_RECORD_ID_ROOT, LMPROF_RECORD_ID_ROOT, 0);
     if (callback_api) {
-      lmprof_stack_event_push(stack, record, &st->thread.r, 0);
+      lmprof_stack_event_push(stack, record, LMPROF_FRAME_NONE, &st->thread.r, 0);
     }
     else {
-      lmprof_stack_measured_push(stack, record, &st->thread.r.s, 0);
+      lmprof_stack_measured_push(stack, record, LMPROF_FRAME_NONE, &st->thread.r.s, 0);
     }
 
     /* Populate the thread with its current traceback. */
@@ -769,11 +1258,13 @@ lmprof_Stack *lmprof_thread_stacktable_get(lua_State *L, lmprof_State *st) {
         lua_Debug debug = LMPROF_ZERO_STRUCT;
         char istailcall = 0;
 
+        lu_addr frame = LMPROF_FRAME_NONE;
         lu_addr fid = LMPROF_RECORD_ID_UNKNOWN;
         lua_Debug *stack_debug = l_nullptr;
         if (lua_getstack(L, level, &debug)) {
           stack_debug = &debug;
-          fid = lmprof_record_id(L, &debug, BITFIELD_TEST(st->conf, LMPROF_OPT_GC_DISABLE), l_nullptr);
+          fid = lmprof_record_id(L, &debug, st->i.idcache, BITFIELD_TEST(st->conf, LMPROF_OPT_GC_DISABLE), l_nullptr);
+          frame = LMPROF_FRAME_TOKEN(&debug, fid);
 #if LUA_VERSION_NUM > 501
           if (lua_getinfo(L, DEBUG_TAIL, &debug))
             istailcall = debug.istailcall != 0;
@@ -782,10 +1273,10 @@ lmprof_Stack *lmprof_thread_stacktable_get(lua_State *L, lmprof_State *st) {
 
         record = lmprof_fetch_record(L, st, stack_debug, fid, last_fid, last_line);
         if (callback_api) {
-          lmprof_stack_event_push(stack, record, &st->thread.r, istailcall);
+          lmprof_stack_event_push(stack, record, frame, &st->thread.r, istailcall);
         }
         else {
-          lmprof_stack_measured_push(stack, record, &st->thread.r.s, istailcall);
+          lmprof_stack_measured_push(stack, record, frame, &st->thread.r.s, istailcall);
         }
 
         last_fid = BITFIELD_TEST(st->conf, LMPROF_OPT_COMPRESS_GRAPH) ? fid : record->r_id;
@@ -794,29 +1285,42 @@ lmprof_Stack *lmprof_thread_stacktable_get(lua_State *L, lmprof_State *st) {
     }
   }
   else {
-    lua_pop(L, 2);
+    lua_pop(L, 1);
   }
 
   return stack;
 }
 
+void lmprof_thread_stacktable_foreach(lua_State *L, lmprof_State *st, lmprof_thread_Callback cb, void *args) {
+#if defined(LMPROF_THREAD_MAP)
+  size_t i;
+  UNUSED(L);
+  for (i = 0; i < st->thread.map.size; ++i) {
+    if (st->thread.map.slots[i].thread != l_nullptr)
+      cb(st->thread.map.slots[i].stack, args);
+  }
+#else
+  UNUSED(st);
+  luaL_checkstack(L, 3, __FUNCTION__);
+  lmprof_getlibtable(L, LMPROF_TAB_THREAD_STACKS); /* [..., thread_stacks] */
+  lua_pushnil(L); /* [..., thread_stacks, key] */
+  while (lua_next(L, -2) != 0) { /* [..., thread_stacks, key, sentinel] */
+    lmprof_Stack *stack = lmprof_thread_tostack(L, -1);
+    if (stack != l_nullptr)
+      cb(stack, args);
+    lua_pop(L, 1); /* [..., thread_stacks, key] */
+  }
+  lua_pop(L, 1);
+#endif
+}
+
 void lmprof_thread_stacktable_free(lua_State *L, int idx) {
   const int t_idx = lua_absindex(L, idx);
 
-  lmprof_Alloc l_alloc;
-  l_alloc.f = lua_getallocf(L, &l_alloc.ud);
-
   luaL_checkstack(L, 5, __FUNCTION__);
   lua_pushnil(L); /* [..., key] */
   while (lua_next(L, t_idx) != 0) { /* [..., key, value] */
-    /*
-    ** @NOTE Future-proofing for if/when allocated profiler stacks no longer
-    **  become managed by Lua.
-    */
-    if (lua_islightuserdata(L, -1)) {
-      lmprof_Stack *stack = l_pcast(lmprof_Stack *, lua_touserdata(L, -1));
-      lmprof_stack_light_free(&l_alloc, stack);
-    }
+    lmprof_thread_sentinel_free(lmprof_thread_sentinel(L, -1));
 
     lua_pop(L, 1); /* [table, key] */
     lua_pushvalue(L, -1); /* [table, key, key] */
@@ -837,6 +1341,21 @@ void lmprof_thread_stacks_initialize(lua_State *L) {
     { l_nullptr, l_nullptr }
   };
 
+  static const luaL_Reg sentinel_metameth[] = {
+    { "__gc", lmprof_thread_sentinel_gc },
+    { l_nullptr, l_nullptr }
+  };
+
+  if (luaL_newmetatable(L, LMPROF_STACK_METATABLE)) {
+#if LUA_VERSION_NUM == 501
+    luaL_register(L, l_nullptr, sentinel_metameth);
+#else
+    luaL_setfuncs(L, sentinel_metameth, 0);
+#endif
+  }
+  lua_pop(L, 1);
+
+  /* Threads are weak references: collected threads release their stack */
   lmprof_getlibtable(L, LMPROF_TAB_THREAD_STACKS); /* [..., thread_stacks] */
 #if LUA_VERSION_NUM == 501
   lua_newtable(L);
@@ -844,6 +1363,15 @@ void lmprof_thread_stacks_initialize(lua_State *L) {
 #else
   luaL_newlib(L, stacks_metameth);
 #endif
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_pop(L, 1);
+
+  lmprof_getlibtable(L, LMPROF_TAB_THREAD_IDS); /* [..., thread_lookup] */
+  lua_newtable(L);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
   lua_setmetatable(L, -2);
   lua_pop(L, 1);
 }
@@ -880,61 +1408,6 @@ lua_Integer lmprof_thread_identifier(lua_State *L) {
   return id;
 }
 
-void lmprof_thread_info_gc(lua_State *L, lmprof_State *st) {
-  luaL_checkstack(L, 6, __FUNCTION__);
-  lmprof_getlibtable(L, LMPROF_TAB_THREAD_NAMES); /* [..., name_table] */
-  lmprof_getlibtable(L, LMPROF_TAB_THREAD_IDS); /* [..., name_table, thread_lookup] */
-
-  lua_pushnil(L); /* [..., name_table, thread_lookup, key] */
-  while (lua_next(L, -2) != 0) { /* [..., name_table, thread_lookup, key, value] */
-    lua_State *co = lua_tothread(L, -2);
-    lua_pop(L, 1); /* [..., name_table, thread_lookup, key] */
-
-    /* Thread is dead, remove all supplemental profile metadata */
-    if (co != l_nullptr && L != co && !luaL_verify_thread(co)) {
-
-      /* Remove identifier from nametable */
-      lua_pushvalue(L, -1);
-      lua_pushnil(L); /* [..., name_table, thread_lookup, key, key, nil] */
-      lua_rawset(L, -5);
-
-      /* Remove thread from identifiers table */
-      lua_pushvalue(L, -1);
-      lua_pushnil(L); /* [..., name_table, thread_lookup, key, key, nil] */
-      lua_rawset(L, -4);
-    }
-  }
-
-  lua_pop(L, 2);
-
-  /* Cleanup allocated profiler stacks */
-  if (st != l_nullptr) {
-    const uint32_t fAllocBefore = BITFIELD_TEST(st->state, LMPROF_STATE_IGNORE_ALLOC);
-
-    lmprof_getlibtable(L, LMPROF_TAB_THREAD_STACKS); /* [..., stack_table] */
-    lua_pushnil(L);
-    while (lua_next(L, -2) != 0) { /* [..., stack_table, key, value] */
-      lua_State *co = lua_tothread(L, -2);
-      if (co != l_nullptr && L != co && !luaL_verify_thread(co)) {
-        if (lua_islightuserdata(L, -1)) {
-          lmprof_Stack *stack = l_pcast(lmprof_Stack *, lua_touserdata(L, -1));
-
-          BITFIELD_SET(st->state, LMPROF_STATE_IGNORE_ALLOC);
-          lmprof_stack_light_free(&st->hook.alloc, stack);
-          BITFIELD_CLEAR(st->state, LMPROF_STATE_IGNORE_ALLOC);
-          BITFIELD_SET(st->state, fAllocBefore);
-        }
-
-        lua_pushvalue(L, -2); /* [..., stack_table, key, value, key] */
-        lua_pushnil(L); /* [..., stack_table, key, value, key, nil] */
-        lua_rawset(L, -5); /* [..., stack_table, key, value] */
-      }
-      lua_pop(L, 1);
-    }
-    lua_pop(L, 1);
-  }
-}
-
 LUA_API const char *lmprof_thread_name(lua_State *L, lua_Integer thread_id, const char *opt) {
   const char *name = l_nullptr;
 
@@ -1031,6 +1504,14 @@ LUALIB_API int lmprof_get_name(lua_State *L) {
 ** probability of a hash collision. Technically this should be handled, however,
 ** that is a sacrifice willing to be made for the sake simplicity.
 */
+/* Attempt to update the name/source fields of an existing record. */
+static LUA_INLINE void fetch_update(lua_State *L, lmprof_State *st, lmprof_Record *record, lua_Debug *ar, lu_addr fid) {
+  if (!record->settled) {
+    lmprof_record_update(L, &st->hook.alloc, ar, fid, record->info, BITFIELD_TEST(st->conf, LMPROF_OPT_LAZY_INFO));
+    record->settled = LMPROF_RECORD_SETTLED(record->info);
+  }
+}
+
 lmprof_Record *lmprof_fetch_record(lua_State *L, lmprof_State *st, lua_Debug *ar, lu_addr fid, lu_addr pid, int p_currentline) {
   lmprof_Record *record;
   lmprof_Hash *hash = st->i.hash;
@@ -1039,21 +1520,25 @@ lmprof_Record *lmprof_fetch_record(lua_State *L, lmprof_State *st, lua_Debug *ar
     ** Create a debugging record (formatted details) if current <function, parent>
     ** tuple does not exist in the hash table.
     */
-    record = l_pcast(lmprof_Record *, lmprof_malloc(&st->hook.alloc, sizeof(lmprof_Record)));
-    if (record == l_nullptr) {
+    lmprof_FunctionInfo *info = l_nullptr;
+    record = l_pcast(lmprof_Record *, lmprof_arena_alloc(lmprof_arena_allocator(st), &st->i.arena, sizeof(lmprof_Record)));
+    info = l_pcast(lmprof_FunctionInfo *, lmprof_arena_alloc(lmprof_arena_allocator(st), &st->i.info_arena, sizeof(lmprof_FunctionInfo)));
+    if (record == l_nullptr || info == l_nullptr) {
       lmprof_error(L, st, "lmprof_record_populate allocation error");
       return l_nullptr;
     }
 
     memset(l_pcast(void *, record), 0, sizeof(lmprof_Record));
+    memset(l_pcast(void *, info), 0, sizeof(lmprof_FunctionInfo));
     record->f_id = fid;
     record->p_id = pid;
     record->r_id = st->i.record_count++;
     record->p_currentline = p_currentline;
+    record->info = info;
 
-    lmprof_record_update(L, &st->hook.alloc, ar, fid, &record->info);
+    lmprof_record_update(L, &st->hook.alloc, ar, fid, record->info, BITFIELD_TEST(st->conf, LMPROF_OPT_LAZY_INFO));
     if (!lmprof_hash_insert(&st->hook.alloc, hash, record)) {
-      lmprof_record_clear(&st->hook.alloc, record); /* ensure new record is free'd */
+      lmprof_record_clear(&st->hook.alloc, record); /* record itself is owned by the arena */
       lmprof_error(L, st, "lmprof_hash_insert error");
       return l_nullptr;
     }
@@ -1063,14 +1548,22 @@ lmprof_Record *lmprof_fetch_record(lua_State *L, lmprof_State *st, lua_Debug *ar
     ** profiling.
     */
     if (BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_IGNORE_YIELD) && st->hook.yield != l_nullptr && fid == (lu_addr)st->hook.yield)
-      BITFIELD_SET(record->info.event, LMPROF_RECORD_IGNORED);
+      BITFIELD_SET(record->info->event, LMPROF_RECORD_IGNORED);
     else if (ar != l_nullptr) {
       lmprof_record_function(L, ar, fid); /* [..., function] */
       if (lmprof_function_is_ignored(L, -1))
-        BITFIELD_SET(record->info.event, LMPROF_RECORD_IGNORED);
+        BITFIELD_SET(record->info->event, LMPROF_RECORD_IGNORED);
       lua_pop(L, 1);
     }
 
+    /*
+    ** The stream writer formats records while the profile is running: their
+    ** function information is frozen once created, i.e., names of unnamed
+    ** records are not re-resolved.
+    */
+    record->ignored = BITFIELD_TEST(record->info->event, LMPROF_RECORD_IGNORED) != 0;
+    record->settled = st->i.writer != l_nullptr || LMPROF_RECORD_SETTLED(record->info);
+
     /* If configured allocate a list used to store LUA_MASKCOUNT frequencies. */
     if (BITFIELD_TEST(st->mode, LMPROF_MODE_LINE | LMPROF_MODE_SAMPLE)
         && !BITFIELD_TEST(st->mode, LMPROF_CALLBACK_MASK)
@@ -1091,7 +1584,23 @@ lmprof_Record *lmprof_fetch_record(lua_State *L, lmprof_State *st, lua_Debug *ar
   ** case of the first interaction with a function is during a tail-call.
   */
   else {
-    lmprof_record_update(L, &st->hook.alloc, ar, fid, &record->info);
+    fetch_update(L, st, record, ar, fid);
+  }
+  return record;
+}
+
+lmprof_Record *lmprof_fetch_child_record(lua_State *L, lmprof_State *st, lmprof_StackInst *parent, lua_Debug *ar, lu_addr fid, lu_addr pid, int p_currentline) {
+  lmprof_Record *record;
+  if (parent == l_nullptr)
+    return lmprof_fetch_record(L, st, ar, fid, pid, p_currentline);
+  else if ((record = lmprof_stack_edge_get(parent, fid, p_currentline)) == l_nullptr) {
+    st->i.edge_misses++;
+    if ((record = lmprof_fetch_record(L, st, ar, fid, pid, p_currentline)) != l_nullptr)
+      lmprof_stack_edge_set(parent, fid, p_currentline, record);
+  }
+  else {
+    st->i.edge_hits++;
+    fetch_update(L, st, record, ar, fid); /* @SEE lmprof_fetch_record */
   }
   return record;
 }
@@ -1212,12 +1721,20 @@ EXTERN_OPT const char *const lmprof_option_strings[] = {
   "mismatch",
   "compress_graph",
   "gc_count",
+  "lazy_info",
+  "fold_recursion",
+  "mmap",
   "verbose",
   "output_string",
+  "binary",
   "line_freq",
   "hash_size",
+  "stack_pool",
+  "stack_gc",
   "counter_freq",
   "ignore_yield",
+  "ring",
+  "stream",
   "process",
   "url",
   "name",
@@ -1227,10 +1744,11 @@ EXTERN_OPT const char *const lmprof_option_strings[] = {
   "page_limit",
   "compress",
   "threshold",
+  "report_threads",
   l_nullptr
 };
 
-EXTERN_OPT const uint32_t lmprof_option_codes[] = {
+EXTERN_OPT const uint64_t lmprof_option_codes[] = {
   LMPROF_OPT_GC_DISABLE,
   LMPROF_OPT_CLOCK_INIT,
   LMPROF_OPT_CLOCK_MICRO,
@@ -1239,12 +1757,20 @@ EXTERN_OPT const uint32_t lmprof_option_codes[] = {
   LMPROF_OPT_STACK_MISMATCH,
   LMPROF_OPT_COMPRESS_GRAPH,
   LMPROF_OPT_GC_COUNT_INIT,
+  LMPROF_OPT_LAZY_INFO,
+  LMPROF_OPT_FOLD_RECURSION,
+  LMPROF_OPT_PAGE_MMAP,
   LMPROF_OPT_REPORT_VERBOSE,
   LMPROF_OPT_REPORT_STRING,
+  LMPROF_OPT_TRACE_BINARY,
   LMPROF_OPT_LINE_FREQUENCY,
   LMPROF_OPT_HASH_SIZE,
+  LMPROF_OPT_STACK_POOL,
+  LMPROF_OPT_STACK_GC,
   LMPROF_OPT_TRACE_COUNTERS_FREQ,
   LMPROF_OPT_TRACE_IGNORE_YIELD,
+  LMPROF_OPT_TRACE_RING,
+  LMPROF_OPT_TRACE_STREAM,
   LMPROF_OPT_TRACE_PROCESS,
   LMPROF_OPT_TRACE_URL,
   LMPROF_OPT_TRACE_NAME,
@@ -1254,6 +1780,7 @@ EXTERN_OPT const uint32_t lmprof_option_codes[] = {
   LMPROF_OPT_TRACE_PAGELIMIT,
   LMPROF_OPT_TRACE_COMPRESS,
   LMPROF_OPT_TRACE_THRESHOLD,
+  LMPROF_OPT_REPORT_THREADS,
 };
 
 /* Ensure only specific mask flags are set */
@@ -1307,7 +1834,7 @@ extern "C" {
 #endif
 
 LUALIB_API int lmprof_set_option(lua_State *L) {
-  uint32_t opt = 0; /* Get current default profiler flags. */
+  uint64_t opt = 0; /* Get current default profiler flags. */
   switch ((opt = lmprof_option_codes[luaL_checkoption(L, 1, l_nullptr, lmprof_option_strings)])) {
     case LMPROF_OPT_GC_DISABLE:
     case LMPROF_OPT_CLOCK_INIT:
@@ -1316,10 +1843,15 @@ LUALIB_API int lmprof_set_option(lua_State *L) {
     case LMPROF_OPT_STACK_MISMATCH:
     case LMPROF_OPT_COMPRESS_GRAPH:
     case LMPROF_OPT_GC_COUNT_INIT:
+    case LMPROF_OPT_LAZY_INFO:
+    case LMPROF_OPT_FOLD_RECURSION:
+    case LMPROF_OPT_PAGE_MMAP:
     case LMPROF_OPT_REPORT_VERBOSE:
     case LMPROF_OPT_REPORT_STRING:
+    case LMPROF_OPT_TRACE_BINARY:
     case LMPROF_OPT_LINE_FREQUENCY:
     case LMPROF_OPT_TRACE_IGNORE_YIELD:
+    case LMPROF_OPT_TRACE_RING:
     case LMPROF_OPT_TRACE_DRAW_FRAME:
     case LMPROF_OPT_TRACE_LAYOUT_SPLIT:
     case LMPROF_OPT_TRACE_ABOUT_TRACING:
@@ -1328,7 +1860,7 @@ LUALIB_API int lmprof_set_option(lua_State *L) {
       luaL_checktype(L, 2, LUA_TBOOLEAN);
 
       conf = l_cast(uint32_t, lmprof_getlibi(L, LMPROF_FLAGS, LMPROF_OPT_DEFAULT));
-      lmprof_setlibi(L, LMPROF_FLAGS, lua_toboolean(L, 2) ? (conf | opt) : (conf & ~opt));
+      lmprof_setlibi(L, LMPROF_FLAGS, lua_toboolean(L, 2) ? (conf | l_cast(uint32_t, opt)) : (conf & ~l_cast(uint32_t, opt)));
       break;
     }
     case LMPROF_OPT_INSTRUCTION_COUNT: {
@@ -1345,7 +1877,23 @@ LUALIB_API int lmprof_set_option(lua_State *L) {
         lmprof_setlibi(L, LMPROF_HASHTABLE_SIZE, count);
         break;
       }
-      return luaL_error(L, "hashtable size is less-than/equal to zero");
+      return luaL_error(L, "hashtable size not within [1, %d]", LMPROF_HASH_MAXSIZE);
+    }
+    case LMPROF_OPT_STACK_POOL: {
+      const lua_Integer count = luaL_checkinteger(L, 2);
+      if (count >= 0) {
+        lmprof_setlibi(L, LMPROF_STACK_POOL_LIMIT, count);
+        break;
+      }
+      return luaL_error(L, "stack pool size is less-than zero");
+    }
+    case LMPROF_OPT_STACK_GC: {
+      const lua_Integer count = luaL_checkinteger(L, 2);
+      if (count >= 0) {
+        lmprof_setlibi(L, LMPROF_STACK_GC_RATE, count);
+        break;
+      }
+      return luaL_error(L, "stack gc rate is less-than zero");
     }
     /*
     ** If the profiler is already running, updating the registry table will not
@@ -1366,6 +1914,9 @@ LUALIB_API int lmprof_set_option(lua_State *L) {
     case LMPROF_OPT_TRACE_URL:
       lmprof_setlibs(L, LMPROF_URL, luaL_checkstring(L, 2));
       break;
+    case LMPROF_OPT_TRACE_STREAM:
+      lmprof_setlibs(L, LMPROF_STREAM_PATH, luaL_checkstring(L, 2));
+      break;
     case LMPROF_OPT_TRACE_PAGELIMIT:
       lmprof_setlibi(L, LMPROF_PAGE_LIMIT, luaL_checkinteger(L, 2));
       break;
@@ -1381,6 +1932,14 @@ LUALIB_API int lmprof_set_option(lua_State *L) {
       }
       return luaL_error(L, "threshold not within [0, %d]", (int)max_threshold);
     }
+    case LMPROF_OPT_REPORT_THREADS: {
+      const lua_Integer count = luaL_checkinteger(L, 2);
+      if (count >= 0) {
+        lmprof_setlibi(L, LMPROF_REPORT_THREADS, count);
+        break;
+      }
+      return luaL_error(L, "report thread count is less-than zero");
+    }
     default:
       return luaL_error(L, "Invalid option %s", luaL_checkstring(L, 1));
   }
@@ -1388,7 +1947,7 @@ LUALIB_API int lmprof_set_option(lua_State *L) {
 }
 
 LUALIB_API int lmprof_get_option(lua_State *L) {
-  const uint32_t opt = lmprof_option_codes[luaL_checkoption(L, 1, l_nullptr, lmprof_option_strings)];
+  const uint64_t opt = lmprof_option_codes[luaL_checkoption(L, 1, l_nullptr, lmprof_option_strings)];
   switch (opt) {
     case LMPROF_OPT_GC_DISABLE:
     case LMPROF_OPT_CLOCK_INIT:
@@ -1397,10 +1956,15 @@ LUALIB_API int lmprof_get_option(lua_State *L) {
     case LMPROF_OPT_STACK_MISMATCH:
     case LMPROF_OPT_COMPRESS_GRAPH:
     case LMPROF_OPT_GC_COUNT_INIT:
+    case LMPROF_OPT_LAZY_INFO:
+    case LMPROF_OPT_FOLD_RECURSION:
+    case LMPROF_OPT_PAGE_MMAP:
     case LMPROF_OPT_REPORT_VERBOSE:
     case LMPROF_OPT_REPORT_STRING:
+    case LMPROF_OPT_TRACE_BINARY:
     case LMPROF_OPT_LINE_FREQUENCY:
     case LMPROF_OPT_TRACE_IGNORE_YIELD:
+    case LMPROF_OPT_TRACE_RING:
     case LMPROF_OPT_TRACE_DRAW_FRAME:
     case LMPROF_OPT_TRACE_LAYOUT_SPLIT:
     case LMPROF_OPT_TRACE_ABOUT_TRACING:
@@ -1413,6 +1977,12 @@ LUALIB_API int lmprof_get_option(lua_State *L) {
     case LMPROF_OPT_HASH_SIZE:
       lmprof_getlibfield(L, LMPROF_HOOK_COUNT);
       break;
+    case LMPROF_OPT_STACK_POOL:
+      lua_pushinteger(L, lmprof_getlibi(L, LMPROF_STACK_POOL_LIMIT, LMPROF_STACK_POOL));
+      break;
+    case LMPROF_OPT_STACK_GC:
+      lua_pushinteger(L, lmprof_getlibi(L, LMPROF_STACK_GC_RATE, LMPROF_STACK_GC));
+      break;
     case LMPROF_OPT_TRACE_PROCESS:
       lmprof_getlibfield(L, LMPROF_PROCESS);
       break;
@@ -1422,6 +1992,9 @@ LUALIB_API int lmprof_get_option(lua_State *L) {
     case LMPROF_OPT_TRACE_NAME:
       lmprof_getlibfield(L, LMPROF_PROFILE_NAME);
       break;
+    case LMPROF_OPT_TRACE_STREAM:
+      lmprof_getlibfield(L, LMPROF_STREAM_PATH);
+      break;
     case LMPROF_OPT_TRACE_PAGELIMIT:
       lmprof_getlibfield(L, LMPROF_PAGE_LIMIT);
       break;
@@ -1431,6 +2004,9 @@ LUALIB_API int lmprof_get_option(lua_State *L) {
     case LMPROF_OPT_TRACE_COUNTERS_FREQ:
       lmprof_getlibfield(L, LMPROF_COUNTERS_FREQ);
       break;
+    case LMPROF_OPT_REPORT_THREADS:
+      lua_pushinteger(L, lmprof_getlibi(L, LMPROF_REPORT_THREADS, 0));
+      break;
     default:
       return 0;
   }
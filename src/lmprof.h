@@ -34,6 +34,18 @@
 #define LMPROF_TAB_THREAD_IDS 14
 #define LMPROF_TAB_THREAD_STACKS 15
 
+/* Userdata */
+#define LMPROF_SINGLETON_CACHE 16
+
+/* LMPROF_SUBTABLE Fields (cont.) */
+#define LMPROF_STACK_POOL_LIMIT 17
+#define LMPROF_STACK_GC_RATE 18
+#define LMPROF_STREAM_PATH 19
+#define LMPROF_REPORT_THREADS 20
+
+/* Metatables */
+#define LMPROF_STACK_METATABLE "lmprof_stack_metatable"
+
 #define TRACE_EVENT_COUNTER_FREQ 20 /* Default UpdateCounters output frequency */
 #define TRACE_EVENT_DEFAULT_PAGE_LIMIT 0 /* Maximum amount of pages in bytes (zero = infinite) */
 #define TRACE_EVENT_DEFAULT_THRESHOLD 1 /* Default compression threshold: microseconds */
@@ -88,6 +100,21 @@ LUA_EXTERN_END
 
 #endif
 
+/*
+@@ LMPROF_EXTRASPACE: When enabled, the profiler takes ownership of the
+**  LUA_EXTRASPACE of each profiled thread (Lua 5.3+), storing a reference to a
+**  per-global_State cache of the registered singleton. This allows debug hooks
+**  to fetch the active profiler without a registry lookup on each event.
+**
+** The registry remains the source of truth: the cache is updated on each
+** lmprof_register_singleton/lmprof_clear_singleton and is anchored in the
+** library table so it outlives all profiler states. Do not enable when the
+** host application makes use of lua_getextraspace.
+*/
+#if defined(LMPROF_EXTRASPACE) && LUA_VERSION_NUM < 503
+  #undef LMPROF_EXTRASPACE
+#endif
+
 /*
 ** Generate a profiling error. This function is an extension of lua_error/luaL_error
 ** and is expected to never return.
@@ -115,6 +142,13 @@ LUAI_FUNC int lmprof_initialize_state(lua_State *L, lmprof_State *st, uint32_t m
 /* Reset the profiler to its initial state, deallocating any intermediate profile data. */
 LUAI_FUNC int lmprof_clear_state(lua_State *L, lmprof_State *st);
 
+/*
+** Move the profile data of 'st', i.e., its records, arenas, page providers, and
+** (TraceEvent) interface arguments, to 'to': a copy of the state, released by
+** lmprof_clear_state, that no longer references 'st'.
+*/
+LUAI_FUNC void lmprof_move_state(lmprof_State *st, lmprof_State *to);
+
 /* Initialize the debug/profiling looks for the given Lua thread. */
 LUAI_FUNC void lmprof_initialize_thread(lua_State *L, lmprof_State *st, lua_State *ignore);
 
@@ -141,21 +175,50 @@ LUAI_FUNC void lmprof_clear_singleton(lua_State *L);
 */
 LUAI_FUNC int lmprof_verify_singleton(lua_State *L, lmprof_State *st);
 
+/*
+** Return the active profiler from within a debug hook, i.e., lmprof_singleton
+** with a fast-path for LMPROF_EXTRASPACE builds.
+**
+** @NOTE: All hooked threads have their extraspace initialized: either by
+**  lmprof_initialize_thread or by lua_newthread copying the extraspace of the
+**  main thread.
+*/
+static LUA_INLINE lmprof_State *lmprof_singleton_hook(lua_State *L) {
+#if defined(LMPROF_EXTRASPACE)
+  lmprof_State **cache = *l_pcast(lmprof_State ***, lua_getextraspace(L));
+  return (cache != l_nullptr) ? *cache : l_nullptr;
+#else
+  return lmprof_singleton(L);
+#endif
+}
+
 /* }================================================================== */
 
 /*
 ** {==================================================================
 **  Threading
 **
-** Additional data associated with profiled lua_State instances. To ensure the
-** lua_State does not get garbage collected during profiling, all data is stored
-** in the registry table.
+** Additional data associated with profiled lua_State instances. All data is
+** stored in registry tables with weak keys: the profiler does not prevent a
+** lua_State from being garbage collected, its profiler stack is reclaimed
+** once it is.
 ** ===================================================================
 */
 
-/* Initialize meta-definitions for light-userdata lmprof_Stacks */
+/* Initialize meta-definitions for the lmprof_Stack tables and sentinels */
 LUAI_FUNC void lmprof_thread_stacks_initialize(lua_State *L);
 
+/*
+** Return the profiler stack referenced by the LMPROF_TAB_THREAD_STACKS value
+** (sentinel) at the given index; NULL if one does not exist.
+*/
+static LUA_INLINE lmprof_Stack *lmprof_thread_tostack(lua_State *L, int idx) {
+  lmprof_Stack **sentinel = l_nullptr;
+  if (lua_type(L, idx) == LUA_TUSERDATA && (sentinel = l_pcast(lmprof_Stack **, lua_touserdata(L, idx))) != l_nullptr)
+    return *sentinel;
+  return l_nullptr;
+}
+
 /*
 ** Return a unique integer identifier (e.g., if the garbage collector is
 ** disabled when profiling, the pointer can be used as an identifier) associated
@@ -179,6 +242,12 @@ LUAI_FUNC lua_Integer lmprof_thread_identifier(lua_State *L);
 */
 LUAI_FUNC lmprof_Stack *lmprof_thread_stacktable_get(lua_State *L, lmprof_State *st);
 
+/* Stack iterator interface */
+typedef void (*lmprof_thread_Callback)(lmprof_Stack *, void *);
+
+/* Invoke 'cb' for each profiler stack associated with a lua_State. */
+LUAI_FUNC void lmprof_thread_stacktable_foreach(lua_State *L, lmprof_State *st, lmprof_thread_Callback cb, void *args);
+
 /* @HACK: Push a thread-info table onto the stack (to allow lua_next iteration over it) */
 LUAI_FUNC void lmprof_thread_info(lua_State *L, int tab_id);
 
@@ -193,6 +262,13 @@ LUAI_FUNC void lmprof_thread_info(lua_State *L, int tab_id);
 /* Fetch a trace record. */
 LUAI_FUNC lmprof_Record *lmprof_fetch_record(lua_State *L, lmprof_State *st, lua_Debug *ar, lu_addr fid, lu_addr pid, int p_currentline);
 
+/*
+** lmprof_fetch_record for a function invoked by the stack instance 'parent'
+** (NULL for the root): consulting the edge cache of 'parent' before the
+** hashtable.
+*/
+LUAI_FUNC lmprof_Record *lmprof_fetch_child_record(lua_State *L, lmprof_State *st, lmprof_StackInst *parent, lua_Debug *ar, lu_addr fid, lu_addr pid, int p_currentline);
+
 /*
 ** Return true if the value at the provided index is a function and is
 ** configured, to be ignored by the profiler.
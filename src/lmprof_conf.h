@@ -304,6 +304,80 @@ LUA_API char *lmprof_strdup(lmprof_Alloc *alloc, const char *source, size_t len)
 */
 LUA_API char *lmprof_strdup_free(lmprof_Alloc *alloc, const char *source, size_t len);
 
+/*
+@@ LMPROF_ARENA_CHUNK_SIZE: Size (in bytes) of each chunk an arena requests from
+** its allocator. Allocations larger than a chunk receive a dedicated chunk.
+*/
+#if !defined(LMPROF_ARENA_CHUNK_SIZE)
+  #define LMPROF_ARENA_CHUNK_SIZE 65536
+#endif
+
+#if LMPROF_ARENA_CHUNK_SIZE < 1024
+  #error "LMPROF_ARENA_CHUNK_SIZE must be at least 1024 bytes"
+#endif
+
+/*
+** A bump allocator composed of a list of chunks. Allocations cannot be freed
+** individually; all chunks are released at once (lmprof_arena_release).
+*/
+typedef struct lmprof_Arena {
+  struct lmprof_ArenaChunk *head; /* Most recently allocated chunk */
+  size_t chunks; /* Number of allocated chunks */
+  size_t bytes; /* Total number of bytes allocated by all chunks */
+} lmprof_Arena;
+
+/* Initialize an empty arena */
+LUA_API void lmprof_arena_init(lmprof_Arena *arena);
+
+/* Allocate size bytes from the arena, returning NULL on error. */
+LUA_API void *lmprof_arena_alloc(lmprof_Alloc *alloc, lmprof_Arena *arena, size_t size);
+
+/* Free all chunks allocated by the arena; invalidating all of its allocations. */
+LUA_API void lmprof_arena_release(lmprof_Alloc *alloc, lmprof_Arena *arena);
+
+/*
+@@ LMPROF_MMAP: Enable the page provider (see the 'mmap' option):
+** fixed-size blocks, e.g., TraceEventPages and arena chunks, are served from
+** memory mappings instead of the Lua allocator. Released blocks are returned to
+** the operating system (MADV_DONTNEED) and recycled.
+**
+@@ LMPROF_MMAP_HUGETLB: Attempt to back anonymous mappings with explicit huge
+** pages (MAP_HUGETLB) before falling back to transparent huge pages.
+**
+@@ LMPROF_MMAP_CHUNK_SIZE: Size (in bytes) of each mapping requested by a page
+** provider; rounded to a multiple of its block size.
+*/
+#if defined(LMPROF_MMAP) && !defined(_WIN32)
+  #define LMPROF_HAS_MMAP 1
+#else
+  #define LMPROF_HAS_MMAP 0
+#endif
+
+#if !defined(LMPROF_MMAP_CHUNK_SIZE)
+  #define LMPROF_MMAP_CHUNK_SIZE 2097152
+#endif
+
+/*
+** A page provider: allocations of exactly 'size' bytes are served from
+** anonymous memory mappings, while all other requests are forwarded to the 'fallback' allocator. Returning NULL on error or when
+** compiled without LMPROF_HAS_MMAP.
+**
+** @NOTE: The provider must outlive all allocations made through its allocator.
+*/
+LUA_API struct lmprof_Pages *lmprof_pages_new(lmprof_Alloc *fallback, size_t size);
+
+/* Unmap all mappings of the provider and free it. */
+LUA_API void lmprof_pages_free(struct lmprof_Pages *pages);
+
+/* The allocator interface (lua_Alloc semantics) of the provider. */
+LUA_API lmprof_Alloc *lmprof_pages_alloc(struct lmprof_Pages *pages);
+
+/*
+** Replace the fallback allocator of the provider, e.g., once the provider is
+** moved to another profiler state. The allocators must be interchangeable.
+*/
+LUA_API void lmprof_pages_fallback(struct lmprof_Pages *pages, lmprof_Alloc *fallback);
+
 /* }================================================================== */
 
 /*
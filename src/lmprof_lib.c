@@ -20,7 +20,7 @@ extern const char *const lmprof_mode_strings[];
 extern const uint32_t lmprof_mode_codes[];
 
 extern const char *const lmprof_option_strings[];
-extern const uint32_t lmprof_option_codes[];
+extern const uint64_t lmprof_option_codes[];
 
 extern const char *const lmprof_state_strings[];
 extern const uint32_t lmprof_state_codes[];
@@ -50,9 +50,11 @@ extern const uint32_t lmprof_state_codes[];
 /* Forward declare 'start' / 'stop' functions */
 static int state_start(lua_State *L);
 static int state_stop(lua_State *L);
+static int state_stop_async(lua_State *L);
 
 /* Used on Lua callback; compare lua_CFunction references. */
-#define PROFILE_IS_STOP(F) ((F) == lmprof_stop || (F) == state_stop)
+#define PROFILE_IS_STOP(F) \
+  ((F) == lmprof_stop || (F) == state_stop || (F) == lmprof_stop_async || (F) == state_stop_async)
 
 /* Used when 'peeking' the call stack; compare identifiers. */
 #define PROFILE_IS_START(F) ((F) == (lu_addr)lmprof_start || (F) == (lu_addr)state_start)
@@ -126,7 +128,7 @@ static void *alloc_hook(void *ud, void *ptr, size_t osize, size_t nsize) {
 */
 
 /* @HACK: Temporary helper macro for selecting 'parent' identifiers */
-#define P_ID(ST, R) BITFIELD_TEST((ST)->conf, LMPROF_OPT_COMPRESS_GRAPH) ? (R)->f_id : (R)->r_id
+#define P_ID(COMPRESS, R) ((COMPRESS) ? (R)->f_id : (R)->r_id)
 
 /*
 ** Check for a 'stack mismatch', i.e., the function that invoked start() has
@@ -152,9 +154,22 @@ static LUA_INLINE void check_stack_mismatch(lua_State *L, lmprof_State *st, lmpr
   stack_clear_instance(stack, inst);
 }
 
+/*
+** Hook Specialization: the graph/trace hooks are instantiated for each
+** combination of the configuration flags tested on every event (see
+** *_HOOK_VARIANTS); allowing the compiler to fold those branches.
+** lmprof_initialize_only_hooks selects the variant that matches the profiler
+** configuration.
+**
+** A thread that inherited the debughook of a previous profiler may invoke a
+** variant that does not correspond to the active configuration. That event is
+** forwarded to (and the thread updated with) the active hook.
+*/
+#define HOOK_VARIANT_INDEX(FOLD, GC, COMPRESS, SINGLE) (((FOLD) << 3) | ((GC) << 2) | ((COMPRESS) << 1) | (SINGLE))
+
 /* @TODO: Additional logic in cases of coroutine.yield/resume. */
-static LUA_INLINE lmprof_State *graph_prehook(lua_State *L) {
-  lmprof_State *st = lmprof_singleton(L);
+static LUA_INLINE lmprof_State *graph_prehook(lua_State *L, lua_Debug *ar, lua_Hook self, const int single_thread) {
+  lmprof_State *st = lmprof_singleton_hook(L);
 
   /*
   ** Profiler has stopped recording since it inherited its debughook.
@@ -170,11 +185,17 @@ static LUA_INLINE lmprof_State *graph_prehook(lua_State *L) {
     lua_sethook(L, l_nullptr, 0, 0); /* reset hook */
     return l_nullptr;
   }
+  /* Debughook specialized for a different configuration */
+  else if (st->hook.l_hook != self) {
+    lua_sethook(L, st->hook.l_hook, st->hook.flags, st->hook.line_count);
+    st->hook.l_hook(L, ar);
+    return l_nullptr;
+  }
   /*
   ** If configured for single threaded profiling and the invoking thread is not
   ** that thread.
   */
-  else if (BITFIELD_TEST(st->mode, LMPROF_MODE_SINGLE_THREAD) && st->thread.main != L) {
+  else if (single_thread && st->thread.main != L) {
     return l_nullptr;
   }
   /* Configured to ignore subsequent hook call. */
@@ -227,7 +248,7 @@ static int lmprof_sample_stack(lua_State *L, lmprof_State *st) {
   for (level = lua_lastlevel(L); level >= 0; --level) {
     lua_Debug debug = LMPROF_ZERO_STRUCT;
     if (lua_getstack(L, level, &debug)) {
-      const lu_addr fid = lmprof_record_id(L, &debug, gc_disabled, l_nullptr);
+      const lu_addr fid = lmprof_record_id(L, &debug, st->i.idcache, gc_disabled, l_nullptr);
 
       /*
       ** The current 'graph' sampling approach ensures that each non-leaf node
@@ -243,8 +264,8 @@ static int lmprof_sample_stack(lua_State *L, lmprof_State *st) {
         record->graph.count++;
 
       /* Update line counts */
-      if (record->graph.line_freq != l_nullptr && record->info.linedefined > 0) {
-        const int diff = debug.currentline - record->info.linedefined;
+      if (record->graph.line_freq != l_nullptr && record->info->linedefined > 0) {
+        const int diff = debug.currentline - record->info->linedefined;
         if (diff >= 0 && diff < record->graph.line_freq_size
             && (level == 0 || record->graph.line_freq[diff] == 0)) {
           record->graph.line_freq[diff]++;
@@ -263,9 +284,9 @@ static int lmprof_sample_stack(lua_State *L, lmprof_State *st) {
   return LUA_OK;
 }
 
-static void graph_sample(lua_State *L, lua_Debug *ar) {
+static LUA_INLINE void graph_sample(lua_State *L, lua_Debug *ar, lua_Hook self, const int single_thread) {
   lu_time time = 0;
-  lmprof_State *st = graph_prehook(L);
+  lmprof_State *st = graph_prehook(L, ar, self, single_thread);
   if (st == l_nullptr)
     return;
 
@@ -286,9 +307,60 @@ static void graph_sample(lua_State *L, lua_Debug *ar) {
   st->thread.r.s.time = time;
 }
 
-static void graph_instrument(lua_State *L, lua_Debug *ar) {
+/*
+** Recursion Folding (LMPROF_OPT_FOLD_RECURSION): a call to the function of the
+** active stack instance does not push a new instance. The re-entry is counted
+** as an invocation of the (shared) record and the recursion depth of the
+** instance incremented; tail calls replace their caller and do not deepen the
+** recursion. All folded activations are measured by the outermost instance, so
+** their time is attributed once and the stack depth/records are bounded by the
+** number of distinct (non-recursive) callers. Reserved identifiers, e.g., the
+** LMPROF_RECORD_ID_MAIN shared by all main chunks, are never folded.
+**
+** Returns true if the call event was folded into the active stack instance.
+*/
+static LUA_INLINE int graph_fold_call(lmprof_Stack *stack, lua_Debug *ar, lu_addr fid) {
+  lmprof_StackInst *inst = lmprof_stack_peek(stack);
+  if (inst != l_nullptr && stack->head > 1 && fid >= LMPROF_RESERVED_MAX && inst->graph.record->f_id == fid) {
+    inst->graph.record->graph.count++;
+    if (!LUA_IS_TAILCALL(ar))
+      inst->recursion++;
+    return 1;
+  }
+  return 0;
+}
+
+/* Returns true if the return event corresponds to a folded activation. */
+static LUA_INLINE int graph_fold_return(lua_State *L, lmprof_State *st, lmprof_Stack *stack, lua_Debug *ar, const int gc_disabled) {
+  lmprof_StackInst *inst = lmprof_stack_peek(stack);
+  if (inst == l_nullptr || inst->recursion == 0 || stack->head <= 1)
+    return 0;
+#if LUA_VERSION_NUM == 501
+  else if (ar->event == LUA_HOOKTAILRET) {
+    inst->recursion--;
+    return 1;
+  }
+#endif
+  else if (lmprof_record_id(L, ar, st->i.idcache, gc_disabled, l_nullptr) == inst->graph.record->f_id) {
+    inst->recursion--;
+    return 1;
+  }
+  return 0;
+}
+
+/* A tail return that unwinds into a folded activation: see graph_fold_return */
+static LUA_INLINE int graph_fold_tail(lmprof_Stack *stack) {
+  lmprof_StackInst *inst = lmprof_stack_peek(stack);
+  if (inst != l_nullptr && inst->recursion > 0) {
+    inst->recursion--;
+    return 1;
+  }
+  return 0;
+}
+
+static LUA_INLINE void graph_instrument(lua_State *L, lua_Debug *ar, lua_Hook self, const int fold, const int gc_disabled, const int compress, const int single_thread) {
   lmprof_Stack *stack = l_nullptr;
-  lmprof_State *st = graph_prehook(L);
+  lmprof_State *st = graph_prehook(L, ar, self, single_thread);
   if (st == l_nullptr) {
     return;
   }
@@ -300,14 +372,14 @@ static void graph_instrument(lua_State *L, lua_Debug *ar) {
 #endif
     case LUA_HOOKCALL: {
       lua_CFunction result = l_nullptr;
-      const lu_addr fid = lmprof_record_id(L, ar, BITFIELD_TEST(st->conf, LMPROF_OPT_GC_DISABLE), &result);
-      if (!PROFILE_IS_STOP(result)) {
-        const lmprof_StackInst *parent = lmprof_stack_peek(stack);
-        const lu_addr pid = (parent == l_nullptr) ? LMPROF_RECORD_ID_ROOT : P_ID(st, parent->graph.record);
+      const lu_addr fid = lmprof_record_id(L, ar, st->i.idcache, gc_disabled, &result);
+      if (!PROFILE_IS_STOP(result) && !(fold && graph_fold_call(stack, ar, fid))) {
+        lmprof_StackInst *parent = lmprof_stack_peek(stack);
+        const lu_addr pid = (parent == l_nullptr) ? LMPROF_RECORD_ID_ROOT : P_ID(compress, parent->graph.record);
         const int pid_lastLine = (parent == l_nullptr) ? 0 : parent->last_line;
 
-        lmprof_Record *record = lmprof_fetch_record(L, st, ar, fid, pid, pid_lastLine);
-        lmprof_StackInst *inst = lmprof_stack_measured_push(stack, record, &st->thread.r.s, LUA_IS_TAILCALL(ar));
+        lmprof_Record *record = lmprof_fetch_child_record(L, st, parent, ar, fid, pid, pid_lastLine);
+        lmprof_StackInst *inst = lmprof_stack_measured_push(stack, record, LMPROF_FRAME_TOKEN(ar, fid), &st->thread.r.s, LUA_IS_TAILCALL(ar));
         if (inst == l_nullptr) {
           lmprof_error(L, st, "profiler stack overflow");
           return;
@@ -318,21 +390,29 @@ static void graph_instrument(lua_State *L, lua_Debug *ar) {
     /*
     ** Pop the current function and any potential tail calls (>= Lua 52). If Lua
     ** is returning from a "pcall" that threw an error or an assertion failure,
-    ** the stack must be readjusted.
+    ** the stack must be readjusted: stack instances are popped until one matches
+    ** the frame token of the returning function.
+    **
+    ** When folding recursion, returns of folded activations (including a chain
+    ** of tail calls that unwinds into one) only decrement the recursion depth.
     */
 #if defined(LUA_HOOKTAILRET)
     case LUA_HOOKTAILRET:
 #endif
     case LUA_HOOKRET: {
-      lu_addr fid = 0, tail_return = 0;
-      lmprof_StackInst *inst = (stack->head > 1) ? lmprof_stack_measured_pop(stack, &st->thread.r.s) : l_nullptr;
+      lu_addr frame = 0, tail_return = 0;
+      lmprof_StackInst *inst = l_nullptr;
+      if (fold && graph_fold_return(L, st, stack, ar, gc_disabled))
+        break;
+
+      inst = (stack->head > 1) ? lmprof_stack_measured_pop(stack, &st->thread.r.s) : l_nullptr;
       if (!(tail_return = PROFILE_TAIL_EVENT(ar, inst))) {
-        fid = lmprof_record_id(L, ar, BITFIELD_TEST(st->conf, LMPROF_OPT_GC_DISABLE), l_nullptr);
+        frame = LMPROF_FRAME_TOKEN(ar, lmprof_record_id(L, ar, st->i.idcache, gc_disabled, l_nullptr));
       }
 
       for (;
-           inst != l_nullptr && (inst->tail_call || (!tail_return && inst->graph.record->f_id != fid));
-           inst = (stack->head > 1) ? lmprof_stack_measured_pop(stack, &st->thread.r.s) : l_nullptr) {
+           inst != l_nullptr && (inst->tail_call || (!tail_return && inst->frame != frame));
+           inst = (stack->head > 1 && !(fold && tail_return && graph_fold_tail(stack))) ? lmprof_stack_measured_pop(stack, &st->thread.r.s) : l_nullptr) {
         check_stack_mismatch(L, st, stack, inst, 0);
       }
       check_stack_mismatch(L, st, stack, inst, 1);
@@ -351,8 +431,8 @@ static void graph_instrument(lua_State *L, lua_Debug *ar) {
         inst->last_line_instructions = stack->instr_count;
 
         /* Ensure the currentline is consistent with the activation record. */
-        if (inst->graph.record->graph.line_freq != l_nullptr && inst->graph.record->info.linedefined > 0) {
-          const int diff = ar->currentline - inst->graph.record->info.linedefined;
+        if (inst->graph.record->graph.line_freq != l_nullptr && inst->graph.record->info->linedefined > 0) {
+          const int diff = ar->currentline - inst->graph.record->info->linedefined;
           if (diff >= 0 && diff < inst->graph.record->graph.line_freq_size) {
             inst->graph.record->graph.line_freq[diff]++;
           }
@@ -379,6 +459,44 @@ static void graph_instrument(lua_State *L, lua_Debug *ar) {
   }
 }
 
+#define GRAPH_SAMPLE_HOOK(SINGLE)                                  \
+  static void graph_sample_##SINGLE(lua_State *L, lua_Debug *ar) { \
+    graph_sample(L, ar, graph_sample_##SINGLE, SINGLE);            \
+  }
+
+#define GRAPH_INSTRUMENT_HOOK(FOLD, GC, COMPRESS, SINGLE)                                               \
+  static void graph_instrument_##FOLD##GC##COMPRESS##SINGLE(lua_State *L, lua_Debug *ar) {              \
+    graph_instrument(L, ar, graph_instrument_##FOLD##GC##COMPRESS##SINGLE, FOLD, GC, COMPRESS, SINGLE); \
+  }
+
+GRAPH_SAMPLE_HOOK(0)
+GRAPH_SAMPLE_HOOK(1)
+
+GRAPH_INSTRUMENT_HOOK(0, 0, 0, 0)
+GRAPH_INSTRUMENT_HOOK(0, 0, 0, 1)
+GRAPH_INSTRUMENT_HOOK(0, 0, 1, 0)
+GRAPH_INSTRUMENT_HOOK(0, 0, 1, 1)
+GRAPH_INSTRUMENT_HOOK(0, 1, 0, 0)
+GRAPH_INSTRUMENT_HOOK(0, 1, 0, 1)
+GRAPH_INSTRUMENT_HOOK(0, 1, 1, 0)
+GRAPH_INSTRUMENT_HOOK(0, 1, 1, 1)
+GRAPH_INSTRUMENT_HOOK(1, 0, 0, 0)
+GRAPH_INSTRUMENT_HOOK(1, 0, 0, 1)
+GRAPH_INSTRUMENT_HOOK(1, 0, 1, 0)
+GRAPH_INSTRUMENT_HOOK(1, 0, 1, 1)
+GRAPH_INSTRUMENT_HOOK(1, 1, 0, 0)
+GRAPH_INSTRUMENT_HOOK(1, 1, 0, 1)
+GRAPH_INSTRUMENT_HOOK(1, 1, 1, 0)
+GRAPH_INSTRUMENT_HOOK(1, 1, 1, 1)
+
+/* GRAPH_INSTRUMENT_HOOK variants: indexed by HOOK_VARIANT_INDEX */
+static const lua_Hook graph_instrument_hooks[] = {
+  graph_instrument_0000, graph_instrument_0001, graph_instrument_0010, graph_instrument_0011,
+  graph_instrument_0100, graph_instrument_0101, graph_instrument_0110, graph_instrument_0111,
+  graph_instrument_1000, graph_instrument_1001, graph_instrument_1010, graph_instrument_1011,
+  graph_instrument_1100, graph_instrument_1101, graph_instrument_1110, graph_instrument_1111,
+};
+
 /* }================================================================== */
 
 /*
@@ -387,6 +505,73 @@ static void graph_instrument(lua_State *L, lua_Debug *ar) {
 ** ===================================================================
 */
 
+/*
+** Flight Recorder (LMPROF_OPT_TRACE_RING): once the timeline reaches its page
+** limit the oldest page is recycled instead of the profiler throwing an error.
+** Functions still on a profiler stack have their ENTER_SCOPE events relocated
+** (see timeline_recycle); their references are updated before the page is
+** reused.
+*/
+typedef struct TraceEventRelocation {
+  lua_State *L;
+  lmprof_State *st;
+} TraceEventRelocation;
+
+static void traceevent_relocate_stack(lmprof_Stack *stack, void *args) {
+  size_t i;
+  const TraceEventTimeline *list = l_pcast(const TraceEventTimeline *, args);
+  for (i = 0; i < stack->used; ++i) { /* Includes an instance popped, but yet to exit */
+    lmprof_StackInst *inst = &stack->stack[i];
+    inst->trace.begin_event = timeline_relocated(list, inst->trace.begin_event);
+  }
+}
+
+static void traceevent_irelocate(TraceEventTimeline *list, void *args) {
+  TraceEventRelocation *R = l_pcast(TraceEventRelocation *, args);
+  lmprof_thread_stacktable_foreach(R->L, R->st, traceevent_relocate_stack, l_pcast(void *, list));
+}
+
+/*
+** Streaming (LMPROF_OPT_TRACE_STREAM): once the timeline reaches its page limit
+** all buffered pages are handed to the stream writer. Functions still on a
+** profiler stack no longer reference their ENTER_SCOPE events.
+*/
+static void traceevent_detach_stack(lmprof_Stack *stack, void *args) {
+  size_t i;
+  TraceEventTimeline *list = l_pcast(TraceEventTimeline *, args);
+  for (i = 0; i < stack->used; ++i) { /* Includes an instance popped, but yet to exit */
+    lmprof_StackInst *inst = &stack->stack[i];
+    if (inst->trace.begin_event != l_nullptr)
+      inst->trace.begin_event = &list->detached;
+  }
+}
+
+/* Returning true if the timeline operation that failed with 'lmproferrno' should be retried. */
+static int traceevent_recycle(lua_State *L, lmprof_State *st, int lmproferrno) {
+  if (lmproferrno == TRACE_EVENT_ERRPAGEFULL && st->i.writer != l_nullptr) {
+    TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
+    lmprof_thread_stacktable_foreach(L, st, traceevent_detach_stack, l_pcast(void *, list));
+    return lmprof_stream_flush(st, list) == TRACE_EVENT_OK;
+  }
+  else if (lmproferrno == TRACE_EVENT_ERRPAGEFULL && BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_RING)) {
+    TraceEventRelocation R;
+    R.L = L;
+    R.st = st;
+    return timeline_recycle(l_pcast(TraceEventTimeline *, st->i.trace.arg), traceevent_irelocate, l_pcast(void *, &R)) == TRACE_EVENT_OK;
+  }
+  return 0;
+}
+
+/* Append a BEGIN_FRAME/END_FRAME TraceEvent */
+static int traceevent_drawframe(lua_State *L, lmprof_State *st, lmprof_EventMeasurement frame, int begin_frame) {
+  int result = TRACE_EVENT_OK;
+  TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
+  do {
+    result = begin_frame ? traceevent_beginframe(list, frame) : traceevent_endframe(list, frame);
+  } while (traceevent_recycle(L, st, result));
+  return result;
+}
+
 /* Generic handler for TraceEvent routine operations. */
 static LUA_INLINE int traceevent_routine(lua_State *L, lmprof_State *st, lmprof_EventProcess thread, int begin) {
   int lmproferrno = LUA_OK;
@@ -397,7 +582,7 @@ static LUA_INLINE int traceevent_routine(lua_State *L, lmprof_State *st, lmprof_
 
 /* Generic handler for TraceEvent scope operations. */
 static LUA_INLINE int traceevent_scope(lua_State *L, lmprof_State *st, lmprof_StackInst *inst, lmprof_EventMeasurement *r, int enter) {
-  if (!BITFIELD_TEST(inst->trace.record->info.event, LMPROF_RECORD_IGNORED)) {
+  if (!inst->trace.record->ignored) {
     int lmproferrno = LUA_OK;
 
     inst->trace.call = *r;
@@ -420,7 +605,7 @@ static LUA_INLINE int traceevent_append_stack(lua_State *L, lmprof_State *st) {
     lmprof_EventMeasurement frame = unit;
     frame.proc.pid = st->thread.mainproc.pid;
     frame.proc.tid = LMPROF_THREAD_BROWSER;
-    traceevent_beginframe(l_pcast(TraceEventTimeline *, st->i.trace.arg), frame);
+    traceevent_drawframe(L, st, frame, 1);
   }
 
   if (!BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_LAYOUT_SPLIT)) {
@@ -465,14 +650,41 @@ static LUA_INLINE int traceevent_clear_stack(lua_State *L, lmprof_State *st) {
     lmprof_EventMeasurement frame = unit;
     frame.proc.pid = st->thread.mainproc.pid;
     frame.proc.tid = LMPROF_THREAD_BROWSER;
-    traceevent_endframe(l_pcast(TraceEventTimeline *, st->i.trace.arg), frame);
+    traceevent_drawframe(L, st, frame, 0);
   }
   return 1;
 }
 
-static LUA_INLINE lmprof_State *traceevent_prehook(lua_State *L) {
+/*
+** Compact alternative to traceevent_clear_stack & traceevent_append_stack when
+** the layout is not split: a single 'transfer' event is generated for the
+** change in coroutine, with the EXIT_SCOPE/ENTER_SCOPE events of both stacks
+** rebuilt when the profile is reported (see timeline_expand). Functions of a
+** newly created stack, i.e., its traceback, have never been entered and still
+** generate their ENTER_SCOPE events.
+**
+** Returning one on success; zero otherwise. On failure this function will throw
+** an lmprof_error which is technically a l_noret operation.
+*/
+static LUA_INLINE int traceevent_switch_stack(lua_State *L, lmprof_State *st, lua_Integer from) {
+  int lmproferrno = LUA_OK;
+  lmprof_Stack *stack = st->thread.call_stack;
+  if ((lmproferrno = st->i.trace.transfer(L, st, from, stack->thread_identifier)) != LUA_OK)
+    return lmprof_error(L, st, "Error: %s", traceevent_strerror(lmproferrno));
+  else if (stack->head > 0 && stack->stack[0].trace.begin_event == l_nullptr) {
+    size_t i;
+    lmprof_EventMeasurement unit = st->thread.r;
+    for (i = 0; i < stack->head; ++i) {
+      if (!traceevent_scope(L, st, &stack->stack[i], &unit, 1))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+static LUA_INLINE lmprof_State *traceevent_prehook(lua_State *L, lua_Debug *ar, lua_Hook self, const int single_thread) {
   /* @NOTE: See graph_prehook */
-  lmprof_State *st = lmprof_singleton(L);
+  lmprof_State *st = lmprof_singleton_hook(L);
   if (st == l_nullptr
       || !BITFIELD_TEST(st->mode, LMPROF_CALLBACK_MASK)
       || BITFIELD_TEST(st->state, LMPROF_STATE_ERROR)
@@ -480,7 +692,12 @@ static LUA_INLINE lmprof_State *traceevent_prehook(lua_State *L) {
     lua_sethook(L, l_nullptr, 0, 0);
     return l_nullptr;
   }
-  else if (BITFIELD_TEST(st->mode, LMPROF_MODE_SINGLE_THREAD) && st->thread.main != L) {
+  else if (st->hook.l_hook != self) {
+    lua_sethook(L, st->hook.l_hook, st->hook.flags, st->hook.line_count);
+    st->hook.l_hook(L, ar);
+    return l_nullptr;
+  }
+  else if (single_thread && st->thread.main != L) {
     return l_nullptr;
   }
   else if (BITFIELD_TEST(st->state, LMPROF_STATE_PAUSED)) {
@@ -498,7 +715,11 @@ static LUA_INLINE lmprof_State *traceevent_prehook(lua_State *L) {
 
   if (st->thread.state != L && BITFIELD_TEST(st->mode, LMPROF_MODE_INSTRUMENT)) {
     lmprof_Stack *stack = st->thread.call_stack;
-    if (stack != l_nullptr && !traceevent_clear_stack(L, st))
+    const lua_Integer from = (stack == l_nullptr) ? 0 : stack->thread_identifier;
+    const int compact = stack != l_nullptr
+                        && st->i.trace.transfer != l_nullptr
+                        && !BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_LAYOUT_SPLIT);
+    if (stack != l_nullptr && !compact && !traceevent_clear_stack(L, st))
       return l_nullptr;
     else if ((stack = lmprof_thread_stacktable_get(L, st)) == l_nullptr) {
       lmprof_error(L, st, "could not allocate local stack");
@@ -512,7 +733,7 @@ static LUA_INLINE lmprof_State *traceevent_prehook(lua_State *L) {
     if (BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_LAYOUT_SPLIT))
       st->thread.r.proc.tid = st->thread.call_stack->thread_identifier;
 
-    if (!traceevent_append_stack(L, st))
+    if (compact ? !traceevent_switch_stack(L, st, from) : !traceevent_append_stack(L, st))
       return l_nullptr;
   }
   else if (st->thread.state != L) {
@@ -524,9 +745,9 @@ static LUA_INLINE lmprof_State *traceevent_prehook(lua_State *L) {
   return st;
 }
 
-static void traceevent_instrument(lua_State *L, lua_Debug *ar) {
+static LUA_INLINE void traceevent_instrument(lua_State *L, lua_Debug *ar, lua_Hook self, const int gc_disabled, const int single_thread) {
   lmprof_Stack *stack = l_nullptr;
-  lmprof_State *st = traceevent_prehook(L);
+  lmprof_State *st = traceevent_prehook(L, ar, self, single_thread);
   if (st == l_nullptr)
     return;
 
@@ -537,13 +758,13 @@ static void traceevent_instrument(lua_State *L, lua_Debug *ar) {
 #endif
     case LUA_HOOKCALL: { /* push call onto stack */
       lua_CFunction result = l_nullptr;
-      const lu_addr fid = lmprof_record_id(L, ar, BITFIELD_TEST(st->conf, LMPROF_OPT_GC_DISABLE), &result);
+      const lu_addr fid = lmprof_record_id(L, ar, st->i.idcache, gc_disabled, &result);
       if (!(PROFILE_IS_STOP(result))) {
-        const lmprof_StackInst *parent = lmprof_stack_peek(stack);
-        const lu_addr pid = (parent == l_nullptr) ? LMPROF_RECORD_ID_ROOT : parent->graph.record->f_id;
+        lmprof_StackInst *parent = lmprof_stack_peek(stack);
+        const lu_addr pid = (parent == l_nullptr) ? LMPROF_RECORD_ID_ROOT : parent->trace.record->f_id;
 
-        lmprof_Record *record = lmprof_fetch_record(L, st, ar, fid, pid, 0);
-        lmprof_StackInst *inst = lmprof_stack_event_push(stack, record, &st->thread.r, LUA_IS_TAILCALL(ar));
+        lmprof_Record *record = lmprof_fetch_child_record(L, st, parent, ar, fid, pid, 0);
+        lmprof_StackInst *inst = lmprof_stack_event_push(stack, record, LMPROF_FRAME_TOKEN(ar, fid), &st->thread.r, LUA_IS_TAILCALL(ar));
         if (inst == l_nullptr) {
           lmprof_error(L, st, "profiler stack overflow");
           return;
@@ -558,14 +779,14 @@ static void traceevent_instrument(lua_State *L, lua_Debug *ar) {
     case LUA_HOOKTAILRET:
 #endif
     case LUA_HOOKRET: {
-      lu_addr fid = 0, tail_return = 0;
+      lu_addr frame = 0, tail_return = 0;
       lmprof_StackInst *inst = (stack->head > 1) ? lmprof_stack_pop(stack) : l_nullptr;
       if (!(tail_return = PROFILE_TAIL_EVENT(ar, inst))) {
-        fid = lmprof_record_id(L, ar, BITFIELD_TEST(st->conf, LMPROF_OPT_GC_DISABLE), l_nullptr);
+        frame = LMPROF_FRAME_TOKEN(ar, lmprof_record_id(L, ar, st->i.idcache, gc_disabled, l_nullptr));
       }
 
       for (;
-           inst != l_nullptr && (inst->tail_call || (!tail_return && inst->trace.record->f_id != fid));
+           inst != l_nullptr && (inst->tail_call || (!tail_return && inst->frame != frame));
            inst = (stack->head > 1) ? lmprof_stack_pop(stack) : l_nullptr) {
         traceevent_scope(L, st, inst, &st->thread.r, 0);
         check_stack_mismatch(L, st, stack, inst, 0);
@@ -608,6 +829,22 @@ static void traceevent_instrument(lua_State *L, lua_Debug *ar) {
   PROFILE_ADJUST_OVERHEAD(L, st); /* change in times = overhead */
 }
 
+#define TRACEEVENT_INSTRUMENT_HOOK(GC, SINGLE)                                    \
+  static void traceevent_instrument_##GC##SINGLE(lua_State *L, lua_Debug *ar) {   \
+    traceevent_instrument(L, ar, traceevent_instrument_##GC##SINGLE, GC, SINGLE); \
+  }
+
+TRACEEVENT_INSTRUMENT_HOOK(0, 0)
+TRACEEVENT_INSTRUMENT_HOOK(0, 1)
+TRACEEVENT_INSTRUMENT_HOOK(1, 0)
+TRACEEVENT_INSTRUMENT_HOOK(1, 1)
+
+/* TRACEEVENT_INSTRUMENT_HOOK variants: indexed by HOOK_VARIANT_INDEX (FOLD = 0, COMPRESS = 0) */
+static const lua_Hook traceevent_instrument_hooks[] = {
+  traceevent_instrument_00, traceevent_instrument_01, l_nullptr, l_nullptr,
+  traceevent_instrument_10, traceevent_instrument_11, l_nullptr, l_nullptr,
+};
+
 LUA_API int lmprof_resume_execution(lua_State *L, lmprof_State *st) {
   if (st != l_nullptr
       && st->thread.call_stack != l_nullptr
@@ -654,37 +891,66 @@ static void traceevent_ifree(lua_State *L, void *args) {
 }
 
 static int traceevent_iroutine(lua_State *L, lmprof_State *st, lmprof_EventProcess thread, int begin) {
+  int result = TRACE_EVENT_OK;
   TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
-  UNUSED(L); ((void)(thread));
-  return begin ? traceevent_beginroutine(list, st->thread.r)
-               : traceevent_endroutine(list, st->thread.r);
+  ((void)(thread));
+  do {
+    result = begin ? traceevent_beginroutine(list, st->thread.r)
+                   : traceevent_endroutine(list, st->thread.r);
+  } while (traceevent_recycle(L, st, result));
+  return result;
 }
 
-static int traceevent_iscope(lua_State *L, lmprof_State *st, lmprof_StackInst *inst, int enter) {
+static int traceevent_itransfer(lua_State *L, lmprof_State *st, lua_Integer from, lua_Integer to) {
   TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
   UNUSED(L);
-  return enter ? traceevent_enterscope(list, &inst->trace)
-               : traceevent_exitscope(list, &inst->trace);
+  return traceevent_switchroutine(list, st->thread.r, from, to, BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_DRAW_FRAME) != 0);
+}
+
+/*
+** timeline_compress for a stream: events are compressed as their scope is
+** closed, if the ENTER_SCOPE event has yet to be handed to the writer.
+*/
+static void traceevent_stream_compress(lmprof_State *st, TraceEventTimeline *list, TraceEvent *begin) {
+  if (begin != l_nullptr && begin != &list->detached && begin->data.event.sibling != l_nullptr) {
+    const TraceEvent *end = begin->data.event.sibling;
+    const lu_time delta = end->time - begin->time;
+    if (BITFIELD_TEST(begin->data.event.info->event, LMPROF_RECORD_IGNORED)
+        || (st->i.event_threshold != 0 && delta < st->i.event_threshold))
+      traceevent_ignorescope(begin);
+  }
+}
+
+static int traceevent_iscope(lua_State *L, lmprof_State *st, lmprof_StackInst *inst, int enter) {
+  int result = TRACE_EVENT_OK;
+  TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
+  do {
+    result = enter ? traceevent_enterscope(list, &inst->trace)
+                   : traceevent_exitscope(list, &inst->trace);
+  } while (traceevent_recycle(L, st, result));
+
+  if (!enter && result == TRACE_EVENT_OK && st->i.writer != l_nullptr && BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_COMPRESS))
+    traceevent_stream_compress(st, list, inst->trace.begin_event);
+  return result;
 }
 
 static int traceevent_isample(lua_State *L, lmprof_State *st, lmprof_StackInst *inst, int line) {
-  UNUSED(L);
-  return traceevent_sample(l_pcast(TraceEventTimeline *, st->i.trace.arg), &inst->trace, st->thread.r, line);
+  int result = TRACE_EVENT_OK;
+  do {
+    result = traceevent_sample(l_pcast(TraceEventTimeline *, st->i.trace.arg), &inst->trace, st->thread.r, line);
+  } while (traceevent_recycle(L, st, result));
+  return result;
 }
 
-static int traceevent_frame(lmprof_State *st, int begin_frame) {
+static int traceevent_frame(lua_State *L, lmprof_State *st, int begin_frame) {
   if (BITFIELD_TEST(st->mode, LMPROF_MODE_TRACE)) {
     BITFIELD_SET(st->state, LMPROF_STATE_IGNORE_ALLOC); /* disable alloc count */
     if (!BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_DRAW_FRAME)) {
-      TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
       lmprof_EventMeasurement frame = st->thread.r;
       frame.proc.pid = st->thread.mainproc.pid;
       frame.proc.tid = LMPROF_THREAD_BROWSER;
       frame.s.time = LMPROF_TIME(st);
-      if (begin_frame)
-        traceevent_beginframe(list, frame);
-      else
-        traceevent_endframe(list, frame);
+      traceevent_drawframe(L, st, frame, begin_frame);
     }
     BITFIELD_CLEAR(st->state, LMPROF_STATE_IGNORE_ALLOC); /* enable alloc count */
   }
@@ -705,15 +971,43 @@ LUA_API int lmprof_initialize_default(lua_State *L, lmprof_State *st, int idx) {
     /* FALLTHROUGH */
   }
   else if (BITFIELD_TEST(st->mode, LMPROF_MODE_TRACE)) {
-    TraceEventTimeline *list = timeline_new(&st->hook.alloc, l_cast(size_t, st->i.pageLimit));
-    if (list == l_nullptr)
+    TraceEventTimeline *list = l_nullptr;
+    lmprof_Alloc *alloc = &st->hook.alloc;
+    size_t pageLimit = l_cast(size_t, st->i.pageLimit);
+    if (st->i.stream != l_nullptr && pageLimit < timeline_page_size())
+      pageLimit = LMPROF_STREAM_PAGES * timeline_page_size(); /* The stream requires a bounded timeline */
+
+    if (BITFIELD_TEST(st->conf, LMPROF_OPT_PAGE_MMAP)) {
+      if (!LMPROF_HAS_MMAP)
+        return lmprof_error(L, st, "TraceEvent page mappings require LMPROF_MMAP");
+      else if ((st->i.pages = lmprof_pages_new(&st->hook.alloc, timeline_page_size())) == l_nullptr)
+        return lmprof_error(L, st, "Unable to map TraceEvent pages");
+      alloc = lmprof_pages_alloc(st->i.pages);
+    }
+
+    if ((list = timeline_new(alloc, pageLimit, BITFIELD_TEST(st->mode, LMPROF_MODE_MEMORY))) == l_nullptr)
       return lmprof_error(L, st, "Unable to create a TraceEvent list");
 
     st->i.trace.arg = l_pcast(void *, list);
     st->i.trace.routine = traceevent_iroutine;
+    st->i.trace.transfer = traceevent_itransfer;
     st->i.trace.scope = traceevent_iscope;
     st->i.trace.sample = traceevent_isample;
     st->i.trace.free = traceevent_ifree;
+    if (st->i.stream != l_nullptr) { /* After the timeline: the writer resolves its identifiers */
+      int result = LUA_OK;
+      if ((result = lmprof_stream_open(st, st->i.stream)) == LMPROF_REPORT_DISABLED_IO)
+        return lmprof_error(L, st, "TraceEvent streaming requires LMPROF_THREADS");
+      else if (result != LUA_OK)
+        return lmprof_error(L, st, "Unable to open TraceEvent stream: %s", st->i.stream);
+
+      /* Records are formatted by the writer as the profile is running */
+      BITFIELD_CLEAR(st->conf, LMPROF_OPT_LAZY_INFO);
+    }
+
+    /* Recycled (or streamed) pages cannot be replayed by timeline_expand: disable compaction */
+    if (BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_RING) || st->i.writer != l_nullptr)
+      st->i.trace.transfer = l_nullptr;
   }
   else if (BITFIELD_TEST(st->mode, LMPROF_MODE_INSTRUMENT | LMPROF_MODE_MEMORY | LMPROF_MODE_SAMPLE)) {
     /* FALLTHROUGH */
@@ -728,18 +1022,31 @@ LUA_API int lmprof_initialize_default(lua_State *L, lmprof_State *st, int idx) {
 
 LUA_API int lmprof_initialize_only_hooks(lua_State *L, lmprof_State *st, int idx) {
   const int abs_idx = lua_absindex(L, idx);
+  const int gc_disabled = BITFIELD_TEST(st->conf, LMPROF_OPT_GC_DISABLE) != 0;
+  const int compress = BITFIELD_TEST(st->conf, LMPROF_OPT_COMPRESS_GRAPH) != 0;
+  const int fold = BITFIELD_TEST(st->conf, LMPROF_OPT_FOLD_RECURSION) != 0;
+  const int single_thread = BITFIELD_TEST(st->mode, LMPROF_MODE_SINGLE_THREAD) != 0;
 
   lua_Hook call = l_nullptr;
   lua_Alloc memory = l_nullptr;
+  if (BITFIELD_TEST(st->conf, LMPROF_OPT_PAGE_MMAP) && !BITFIELD_TEST(st->mode, LMPROF_MODE_TIME) && st->i.chunks == l_nullptr) {
+    if (!LMPROF_HAS_MMAP)
+      return lmprof_error(L, st, "Arena mappings require LMPROF_MMAP");
+    else if ((st->i.chunks = lmprof_pages_new(&st->hook.alloc, LMPROF_ARENA_CHUNK_SIZE)) == l_nullptr)
+      return lmprof_error(L, st, "Unable to map arena chunks");
+  }
+
   if (BITFIELD_TEST(st->mode, LMPROF_MODE_TIME)) {
     /* FALLTHROUGH */
   }
   else if (BITFIELD_TEST(st->mode, LMPROF_CALLBACK_MASK)) {
     if (BITFIELD_TEST(st->mode, LMPROF_MODE_INSTRUMENT | LMPROF_MODE_MEMORY | LMPROF_MODE_SAMPLE)) {
-      if (st->i.hash == l_nullptr)
-        st->i.hash = lmprof_hash_create(&st->hook.alloc, st->i.hash_size);
+      if (st->i.hash == l_nullptr && (st->i.hash = lmprof_hash_create(&st->hook.alloc, st->i.hash_size)) == l_nullptr)
+        return lmprof_error(L, st, "Unable to allocate record hashtable");
+      if (st->i.idcache == l_nullptr)
+        st->i.idcache = lmprof_identity_cache_create(&st->hook.alloc);
 
-      call = traceevent_instrument;
+      call = traceevent_instrument_hooks[HOOK_VARIANT_INDEX(0, gc_disabled, 0, single_thread)];
       if (BITFIELD_TEST(st->mode, LMPROF_MODE_MEMORY))
         memory = alloc_hook;
     }
@@ -748,12 +1055,14 @@ LUA_API int lmprof_initialize_only_hooks(lua_State *L, lmprof_State *st, int idx
     }
   }
   else if (BITFIELD_TEST(st->mode, LMPROF_MODE_INSTRUMENT | LMPROF_MODE_MEMORY | LMPROF_MODE_SAMPLE)) {
-    if (st->i.hash == l_nullptr)
-      st->i.hash = lmprof_hash_create(&st->hook.alloc, st->i.hash_size);
+    if (st->i.hash == l_nullptr && (st->i.hash = lmprof_hash_create(&st->hook.alloc, st->i.hash_size)) == l_nullptr)
+      return lmprof_error(L, st, "Unable to allocate record hashtable");
+    if (st->i.idcache == l_nullptr)
+      st->i.idcache = lmprof_identity_cache_create(&st->hook.alloc);
 
-    call = graph_instrument;
+    call = graph_instrument_hooks[HOOK_VARIANT_INDEX(fold, gc_disabled, compress, single_thread)];
     if (BITFIELD_TEST(st->mode, LMPROF_MODE_SAMPLE) && !BITFIELD_TEST(st->mode, LMPROF_MODE_INSTRUMENT))
-      call = graph_sample; /* Configured for sampling and not instrumenting */
+      call = single_thread ? graph_sample_1 : graph_sample_0; /* Configured for sampling and not instrumenting */
     if (BITFIELD_TEST(st->mode, LMPROF_MODE_MEMORY)) /* @TODO: Memory only profiling */
       memory = alloc_hook;
   }
@@ -795,7 +1104,7 @@ static void pop_remaining_stacks(lua_State *L, lmprof_State *st) {
     lmprof_thread_info(L, LMPROF_TAB_THREAD_STACKS); /* [..., thread_stacks] */
     lua_pushnil(L); /* [..., thread_stacks, nil] */
     while (lua_next(L, -2) != 0) { /* [..., thread_stacks, key, value] */
-      lmprof_Stack *stack = l_pcast(lmprof_Stack *, lua_touserdata(L, -1));
+      lmprof_Stack *stack = lmprof_thread_tostack(L, -1);
       while (stack != l_nullptr && stack->head > 0) {
         lmprof_stack_measured_pop(stack, &st->thread.r.s);
       }
@@ -834,6 +1143,16 @@ static int stop_profiler(lua_State *L, lmprof_State *st, int file_idx) {
   return 1;
 }
 
+#if defined(LMPROF_FILE_API) || !defined(LMPROF_DISABLE_OUTPUT_PATH)
+static int stop_async_profiler(lua_State *L, lmprof_State *st, int file_idx) {
+  const char *file = luaL_checkstring(L, file_idx);
+  lmprof_finalize_profiler(L, st, 1);
+  lmprof_report_async(L, st, file);
+  lmprof_shutdown_profiler(L, st);
+  return 1;
+}
+#endif
+
 static int stack_object_profiler(lua_State *L, lmprof_State *active_state, int forcedMode, int forcedOpts, int state_idx, int args_top) {
   lmprof_State *st;
 #if defined(LMPROF_FILE_API) || !defined(LMPROF_DISABLE_OUTPUT_PATH)
@@ -935,9 +1254,9 @@ static int function_profiler(lua_State *L, lmprof_State *active_state, int state
 **  look for active threads.
 **
 **  3. LMPROF_TAB_THREAD_IDS: Traverse the 'name/id' table, a registry table
-**  that associates human-readable labels to individual threads. As those
-**  threads are referenced by the registry, they will not be garbage collected
-**  and its assumed some 'scheduling' algorithm will manage their lifetime.
+**  that associates unique identifiers to individual threads. Threads are weak
+**  references, i.e., collected threads are removed from the table, and its
+**  assumed some 'scheduling' algorithm will manage their lifetime.
 **
 ** It is also possible for a thread to inherit a debug hook from its parent and
 ** only begin its execution *after* the profiler has stopped. Unfortunately, the
@@ -1120,11 +1439,13 @@ LUA_API void lmprof_finalize_profiler(lua_State *L, lmprof_State *st, int pop_re
 LUA_API void lmprof_shutdown_profiler(lua_State *L, lmprof_State *st) {
   /* See lmprof_initialize_default */
   if (BITFIELD_TEST(st->mode, LMPROF_CALLBACK_MASK)) {
+    lmprof_stream_free(st); /* Before the timeline it references */
     if (st->i.trace.free != l_nullptr)
       st->i.trace.free(L, st->i.trace.arg);
 
     st->i.trace.arg = l_nullptr;
     st->i.trace.free = l_nullptr;
+    st->i.trace.transfer = l_nullptr;
     st->i.trace.scope = l_nullptr;
     st->i.trace.sample = l_nullptr;
   }
@@ -1191,7 +1512,7 @@ static int state_setmode(lua_State *L) {
 
 static int state_getoption(lua_State *L) {
   lmprof_State *st = state_get(L, 1);
-  const uint32_t opt = lmprof_option_codes[luaL_checkoption(L, 2, l_nullptr, lmprof_option_strings)];
+  const uint64_t opt = lmprof_option_codes[luaL_checkoption(L, 2, l_nullptr, lmprof_option_strings)];
   switch (opt) {
     case LMPROF_OPT_GC_DISABLE:
     case LMPROF_OPT_CLOCK_INIT:
@@ -1200,10 +1521,14 @@ static int state_getoption(lua_State *L) {
     case LMPROF_OPT_STACK_MISMATCH:
     case LMPROF_OPT_COMPRESS_GRAPH:
     case LMPROF_OPT_GC_COUNT_INIT:
+    case LMPROF_OPT_FOLD_RECURSION:
+    case LMPROF_OPT_PAGE_MMAP:
     case LMPROF_OPT_REPORT_VERBOSE:
     case LMPROF_OPT_REPORT_STRING:
+    case LMPROF_OPT_TRACE_BINARY:
     case LMPROF_OPT_LINE_FREQUENCY:
     case LMPROF_OPT_TRACE_IGNORE_YIELD:
+    case LMPROF_OPT_TRACE_RING:
     case LMPROF_OPT_TRACE_DRAW_FRAME:
     case LMPROF_OPT_TRACE_LAYOUT_SPLIT:
     case LMPROF_OPT_TRACE_ABOUT_TRACING:
@@ -1216,6 +1541,12 @@ static int state_getoption(lua_State *L) {
     case LMPROF_OPT_HASH_SIZE:
       lua_pushinteger(L, l_cast(lua_Integer, st->i.hash_size));
       break;
+    case LMPROF_OPT_STACK_POOL:
+      lua_pushinteger(L, l_cast(lua_Integer, st->thread.pool.limit));
+      break;
+    case LMPROF_OPT_STACK_GC:
+      lua_pushinteger(L, l_cast(lua_Integer, st->thread.stack_gc));
+      break;
     case LMPROF_OPT_TRACE_PROCESS:
       lua_pushinteger(L, st->thread.mainproc.pid);
       break;
@@ -1225,6 +1556,12 @@ static int state_getoption(lua_State *L) {
     case LMPROF_OPT_TRACE_NAME:
       lua_pushstring(L, (st->i.name == l_nullptr) ? TRACE_EVENT_DEFAULT_NAME : st->i.name);
       break;
+    case LMPROF_OPT_TRACE_STREAM:
+      if (st->i.stream == l_nullptr)
+        lua_pushnil(L);
+      else
+        lua_pushstring(L, st->i.stream);
+      break;
     case LMPROF_OPT_TRACE_PAGELIMIT:
       lua_pushinteger(L, st->i.pageLimit);
       break;
@@ -1234,6 +1571,9 @@ static int state_getoption(lua_State *L) {
     case LMPROF_OPT_TRACE_THRESHOLD:
       lua_pushinteger(L, l_cast(lua_Integer, st->i.event_threshold));
       break;
+    case LMPROF_OPT_REPORT_THREADS:
+      lua_pushinteger(L, st->i.reportThreads);
+      break;
     default:
       lua_pushnil(L);
       break;
@@ -1245,7 +1585,7 @@ static int state_setoption(lua_State *L) {
   const char *str = l_nullptr;
 
   lmprof_State *st = state_get_valid(L);
-  const uint32_t opt = lmprof_option_codes[luaL_checkoption(L, 2, l_nullptr, lmprof_option_strings)];
+  const uint64_t opt = lmprof_option_codes[luaL_checkoption(L, 2, l_nullptr, lmprof_option_strings)];
   switch (opt) {
     case LMPROF_OPT_GC_DISABLE:
     case LMPROF_OPT_CLOCK_INIT:
@@ -1254,16 +1594,25 @@ static int state_setoption(lua_State *L) {
     case LMPROF_OPT_STACK_MISMATCH:
     case LMPROF_OPT_COMPRESS_GRAPH:
     case LMPROF_OPT_GC_COUNT_INIT:
+    case LMPROF_OPT_FOLD_RECURSION:
+    case LMPROF_OPT_PAGE_MMAP:
     case LMPROF_OPT_REPORT_VERBOSE:
     case LMPROF_OPT_REPORT_STRING:
+    case LMPROF_OPT_TRACE_BINARY:
     case LMPROF_OPT_LINE_FREQUENCY:
     case LMPROF_OPT_TRACE_IGNORE_YIELD:
+    case LMPROF_OPT_TRACE_RING:
     case LMPROF_OPT_TRACE_DRAW_FRAME:
     case LMPROF_OPT_TRACE_LAYOUT_SPLIT:
     case LMPROF_OPT_TRACE_ABOUT_TRACING:
     case LMPROF_OPT_TRACE_COMPRESS: {
       luaL_checktype(L, 3, LUA_TBOOLEAN);
-      st->conf = lua_toboolean(L, 3) ? (st->conf | opt) : (st->conf & ~opt);
+      /* Hook Specialization: the active hook (and trace interface) is a function of these options */
+      if (BITFIELD_TEST(opt, LMPROF_OPT_GC_DISABLE | LMPROF_OPT_COMPRESS_GRAPH | LMPROF_OPT_FOLD_RECURSION | LMPROF_OPT_PAGE_MMAP | LMPROF_OPT_TRACE_RING)
+          && BITFIELD_TEST(st->state, LMPROF_STATE_RUNNING))
+        return luaL_error(L, "option cannot be changed while profiling");
+
+      st->conf = lua_toboolean(L, 3) ? (st->conf | l_cast(uint32_t, opt)) : (st->conf & ~l_cast(uint32_t, opt));
       break;
     }
     case LMPROF_OPT_INSTRUCTION_COUNT: {
@@ -1280,7 +1629,23 @@ static int state_setoption(lua_State *L) {
         st->i.hash_size = l_cast(size_t, count);
         break;
       }
-      return luaL_error(L, "hashtable size is less-than/equal to zero");
+      return luaL_error(L, "hashtable size not within [1, %d]", LMPROF_HASH_MAXSIZE);
+    }
+    case LMPROF_OPT_STACK_POOL: {
+      const lua_Integer count = luaL_checkinteger(L, 3);
+      if (count >= 0) {
+        st->thread.pool.limit = l_cast(size_t, count);
+        break;
+      }
+      return luaL_error(L, "stack pool size is less-than zero");
+    }
+    case LMPROF_OPT_STACK_GC: {
+      const lua_Integer count = luaL_checkinteger(L, 3);
+      if (count >= 0) {
+        st->thread.stack_gc = l_cast(size_t, count);
+        break;
+      }
+      return luaL_error(L, "stack gc rate is less-than zero");
     }
     case LMPROF_OPT_TRACE_PROCESS: {
       st->thread.mainproc.pid = luaL_checkinteger(L, 3);
@@ -1304,6 +1669,17 @@ static int state_setoption(lua_State *L) {
         st->i.name = lmprof_strdup(&st->hook.alloc, str, 0);
       break;
     }
+    case LMPROF_OPT_TRACE_STREAM: {
+      if (BITFIELD_TEST(st->state, LMPROF_STATE_RUNNING))
+        return luaL_error(L, "option cannot be changed while profiling");
+      if (st->i.stream != l_nullptr)
+        lmprof_strdup_free(&st->hook.alloc, st->i.stream, 0);
+
+      st->i.stream = l_nullptr;
+      if ((str = lua_tostring(L, 3)) != l_nullptr && *str != '\0')
+        st->i.stream = lmprof_strdup(&st->hook.alloc, str, 0);
+      break;
+    }
     case LMPROF_OPT_TRACE_PAGELIMIT: {
       st->i.pageLimit = l_cast(size_t, luaL_checkinteger(L, 3));
       break;
@@ -1321,6 +1697,14 @@ static int state_setoption(lua_State *L) {
       }
       return luaL_error(L, "threshold not within [0, %d]", (int)max_threshold);
     }
+    case LMPROF_OPT_REPORT_THREADS: {
+      const lua_Integer count = luaL_checkinteger(L, 3);
+      if (count >= 0) {
+        st->i.reportThreads = count;
+        break;
+      }
+      return luaL_error(L, "report thread count is less-than zero");
+    }
     default:
       break;
   }
@@ -1388,6 +1772,19 @@ static int state_stop(lua_State *L) {
   return luaL_error(L, "Could not stop profiler: profiler state inactive");
 }
 
+static int state_stop_async(lua_State *L) {
+  lmprof_State *st = state_get(L, 1);
+  if (st == lmprof_singleton(L)) {
+#if defined(LMPROF_FILE_API) || !defined(LMPROF_DISABLE_OUTPUT_PATH)
+    return stop_async_profiler(L, st, 2);
+#else
+    return luaL_error(L, "Could not stop profiler: output paths disabled");
+#endif
+  }
+
+  return luaL_error(L, "Could not stop profiler: profiler state inactive");
+}
+
 static int state_quit(lua_State *L) {
   lmprof_State *st = state_get(L, 1);
   if (st == lmprof_singleton(L))
@@ -1421,7 +1818,7 @@ static int state_profile_function(lua_State *L) {
 static int state_event_beginframe(lua_State *L) {
   lmprof_State *st = state_get_valid(L);
   if (BITFIELD_TEST(st->state, LMPROF_STATE_RUNNING)) {
-    traceevent_frame(st, 1);
+    traceevent_frame(L, st, 1);
     lua_pushvalue(L, 1);
     return 1; /* self */
   }
@@ -1431,7 +1828,7 @@ static int state_event_beginframe(lua_State *L) {
 static int state_event_endframe(lua_State *L) {
   lmprof_State *st = state_get_valid(L);
   if (BITFIELD_TEST(st->state, LMPROF_STATE_RUNNING)) {
-    traceevent_frame(st, 0);
+    traceevent_frame(L, st, 0);
     lua_pushvalue(L, 1);
     return 1; /* self */
   }
@@ -1459,6 +1856,7 @@ static void lmprof_state_initialize(lua_State *L) {
   static const luaL_Reg metameth[] = {
     { "start", state_start },
     { "stop", state_stop },
+    { "stop_async", state_stop_async },
     { "quit", state_quit },
     { "calibrate", state_calibrate },
     /* Profiler options */
@@ -1539,6 +1937,19 @@ LUALIB_API int lmprof_stop(lua_State *L) {
   return luaL_error(L, "Could not stop profiler: profiler state does not exist.");
 }
 
+LUALIB_API int lmprof_stop_async(lua_State *L) {
+  lmprof_State *st = lmprof_singleton(L);
+  if (st != l_nullptr) {
+#if defined(LMPROF_FILE_API) || !defined(LMPROF_DISABLE_OUTPUT_PATH)
+    return stop_async_profiler(L, st, 1);
+#else
+    return luaL_error(L, "Could not stop profiler: output paths disabled");
+#endif
+  }
+
+  return luaL_error(L, "Could not stop profiler: profiler state does not exist.");
+}
+
 LUALIB_API int lmprof_quit(lua_State *L) {
   lmprof_State *st = lmprof_singleton(L);
   if (st != l_nullptr)
@@ -1547,6 +1958,21 @@ LUALIB_API int lmprof_quit(lua_State *L) {
   return 0;
 }
 
+LUALIB_API int lmprof_convert(lua_State *L) {
+  const char *input = luaL_checkstring(L, 1);
+  const char *output = luaL_optstring(L, 2, l_nullptr);
+  lua_Integer threads = 0;
+
+  lua_pushcfunction(L, lmprof_get_option);
+  lua_pushliteral(L, "report_threads");
+  lua_call(L, 1, 1); /* [..., threads] */
+  threads = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+
+  lmprof_report_convert(L, input, output, threads);
+  return 1;
+}
+
 LUALIB_API int lmprof_profile_file(lua_State *L) {
 #if defined(LMPROF_FILE_API)
   lmprof_check_can_profile(L);
@@ -1570,7 +1996,7 @@ LUALIB_API int lchrome_trace_event_beginframe(lua_State *L) {
   lmprof_State *st = lmprof_singleton(L);
   if (st != l_nullptr && BITFIELD_TEST(st->state, LMPROF_STATE_RUNNING)
       && !BITFIELD_TEST(st->state, LMPROF_STATE_ERROR)) {
-    traceevent_frame(st, 1);
+    traceevent_frame(L, st, 1);
     return 0;
   }
   return luaL_error(L, "invalid profiler state");
@@ -1580,7 +2006,7 @@ LUALIB_API int lchrome_trace_event_endframe(lua_State *L) {
   lmprof_State *st = lmprof_singleton(L);
   if (st != l_nullptr && BITFIELD_TEST(st->state, LMPROF_STATE_RUNNING)
       && !BITFIELD_TEST(st->state, LMPROF_STATE_ERROR)) {
-    traceevent_frame(st, 0);
+    traceevent_frame(L, st, 0);
     return 0;
   }
   return luaL_error(L, "invalid profiler state");
@@ -1598,7 +2024,9 @@ LUAMOD_API int luaopen_lmprof(lua_State *L) {
     { "create", lmprof_create },
     { "start", lmprof_start },
     { "stop", lmprof_stop },
+    { "stop_async", lmprof_stop_async },
     { "quit", lmprof_quit },
+    { "convert", lmprof_convert },
     /* Global profiler options */
     { "set_option", lmprof_set_option },
     { "get_option", lmprof_get_option },
@@ -104,15 +104,46 @@ LUALIB_API int lmprof_start(lua_State *L);
 **  output_path - a file-path string where the formatted results are written.
 **    For 'graph' profiling, the generated output is a Lua compatible table that
 **    can be loaded with 'require' or 'dofile'. Meanwhile, 'trace' profiling
-**    will generate a JSON file.
+**    will generate a JSON file. Paths ending in ".gz" are gzip compressed when
+**    the library is compiled with LMPROF_ZLIB ('binary' dumps excluded).
 **
 ** @NOTE: output_path requires LMPROF_FILE_API to be enabled (see 'has_io').
 */
 LUALIB_API int lmprof_stop(lua_State *L);
 
+/*
+** stop_async(output_path): Stop the profiler singleton and write its results to
+**  output_path (see 'stop') on a background thread, returning a handle:
+**
+**  handle:done() - true once the results have been written; non-blocking.
+**  handle:wait() - block until the results have been written, returning the
+**    success of the IO (true/false).
+**
+**  Only the 'trace' results, as JSON, are formatted on the background thread:
+**  its events and records are moved to the handle and released once the
+**  handle has been waited on (or collected). All other results, i.e., 'graph'
+**  profiles, 'stream' and 'binary' traces, are written before returning.
+**
+** @NOTE: Requires LMPROF_FILE_API to be enabled (see 'has_io') and LMPROF_THREADS
+**  for the background thread.
+*/
+LUALIB_API int lmprof_stop_async(lua_State *L);
+
 /* quit(): Preempt any active profiler state without reporting its results. */
 LUALIB_API int lmprof_quit(lua_State *L);
 
+/*
+** convert(input_path[, output_path]): Convert a binary Trace Event dump, i.e.,
+**  the output of 'stop' when the 'binary' option is enabled, into the Trace
+**  Event JSON format. If no output_path is supplied the formatted string is
+**  returned; otherwise, the success of the IO (true/false) is returned. The
+**  output is identical to the JSON 'stop' would have generated. The dump is
+**  formatted on 'report_threads' threads.
+**
+** @NOTE: Requires LMPROF_FILE_API to be enabled (see 'has_io').
+*/
+LUALIB_API int lmprof_convert(lua_State *L);
+
 /*
 ** Additional profiling inputs.
 **
@@ -176,15 +207,37 @@ LUALIB_API int lmprof_profile_function(lua_State *L);
 **      If the 'lines' mode is enabled, lmprof_Record instances will include
 **      line number of the callsite in the parent/child association. This option
 **      closely resembles the V8 CpuProfilingMode enumerated type
+**    'lazy_info' - Defer the formatting of Lua function records (names and
+**      sources) until the profile is reported. Records of the same function
+**      share a single formatted string.
+**    'fold_recursion' - Fold the recursive re-entries of a function into the
+**      activation of its caller (graph instrumentation): the call is counted and
+**      its time attributed, once, to the outermost activation. Bounds the depth
+**      of profile stacks and the number of records of deeply recursive code.
+**    'mmap' - Serve Trace Event pages and the chunks of the record arenas from
+**      anonymous memory mappings (using huge pages when available) instead of
+**      the Lua allocator. Released pages are returned to the operating system.
+**      Requires the library to be compiled with LMPROF_MMAP.
 **    'output_string' - Output a string representation of the formatted output.
 **        GRAPH - A Lua table; see '_G.load'
 **        TRACEEVENT - A formatted JSON string.
+**    'binary' - Trace Event profiles written to an output_path are a compact
+**      binary dump of the buffered events, the function records and thread
+**      names they reference, instead of JSON. The dump is formatted offline
+**      with 'convert'. Ignored when 'stream' is set.
 **
 **  General Options: [INTEGER]
 **    'instructions' - Number of Lua instructions to execute before generating a
 **      'sampling' event: LUA_MASKCOUNT.
-**    'hash_size' - Default number of buckets in the hash (graph) table (limited
-**      to 1031).
+**    'hash_size' - Initial number of slots in the hash (graph) table. The
+**      table grows as required; at most LMPROF_HASH_MAXSIZE (2^20).
+**    'stack_pool' - Maximum number of profiler stacks, released by dead
+**      coroutines, retained for reuse. Zero disables the pool; the 'header'
+**      reports the number of pool hits and misses.
+**    'stack_gc' - Number of newly profiled coroutines between incremental
+**      garbage collection steps, allowing the stacks of collected coroutines
+**      to be reclaimed. Zero disables the step; the profiler never forces a
+**      full collection.
 **
 **  Trace Event Options: [BOOL]
 **    'compress' - Suppress Trace Event records with durations less than the
@@ -196,8 +249,14 @@ LUALIB_API int lmprof_profile_function(lua_State *L);
 **      between successive resume/yield calls.
 **    'split' - Output a unique thread ids for each thread in the chromium
 **      output; Otherwise, all events use the main thread and stack elements are
-**      artificially pushed/popped when the coroutine resume/yields.
+**      artificially pushed/popped when the coroutine resume/yields. These
+**      artificial events are generated when the profile is reported.
 **    'tracing' - Output a format compatible with chrome://tracing/.
+**    'ring' - Flight-recorder mode: once 'page_limit' is reached the oldest
+**      pages are recycled, and the report contains only the most recent
+**      window of events. Scopes still open at the start of that window are
+**      carried over (as ENTER events clamped to the window start); compact
+**      coroutine-switch events are disabled in this mode.
 **
 **  Trace Event Options: [INTEGER]
 **    'process' - Synthetic Trace Event process ID.
@@ -206,10 +265,22 @@ LUALIB_API int lmprof_profile_function(lua_State *L);
 **      bytes (zero = infinite)
 **    'threshold' - TraceEvent suppression threshold in microseconds, requires
 **      'compress' to be enabled.
+**    'report_threads' - Number of threads formatting the pages of a Trace Event
+**      report; the output is identical to, and written in the same order as,
+**      a report formatted by the calling thread. Zero or one (default) formats
+**      on the calling thread. Requires the library to be compiled with
+**      LMPROF_THREADS; Lua table reports are always formatted serially.
 **
 **  Trace Event Options: [STRING]
 **    'name' - Synthetic Trace Event 'TracingStartedInBrowser' Name.
 **    'url' - Synthetic Trace Event 'TracingStartedInBrowser' URL.
+**    'stream' - Output path for streaming Trace Events while profiling: pages
+**      are formatted and written on a writer thread each time 'page_limit'
+**      fills (default: LMPROF_STREAM_PAGES pages). lmprof.stop then returns a
+**      boolean and the output_path argument is ignored. Requires the library
+**      to be compiled with LMPROF_THREADS; compact coroutine-switch events and
+**      'lazy_info' are disabled in this mode, and the names of unnamed records
+**      are not re-resolved once created.
 **
 */
 LUALIB_API int lmprof_set_option(lua_State *L);
@@ -5,6 +5,8 @@
 */
 #define LUA_LIB
 
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
@@ -18,45 +20,10 @@
 #include "lmprof_state.h"
 #include "lmprof_report.h"
 
-/* Unsafe macro to reduce fprintf clutter */
-#define LMPROF_NL "\n"
-#define LMPROF_INDENT "\t"
-
-/* lua_pushfstring integer format */
-#if LUA_VERSION_NUM >= 503
-  #define LUA_INT_FORMAT "%I"
-  #define LUA_UNIT_FORMAT "%I"
-
-  #define LUA_INT_CAST(T) l_cast(lua_Integer, T)
-  #define LUA_UNIT_CAST(T) l_cast(lua_Integer, T)
-#else
-  #define LUA_INT_FORMAT "%d"
-  #define LUA_UNIT_FORMAT "%f"
-
-  #define LUA_INT_CAST(T) l_cast(int, T)
-  #define LUA_UNIT_CAST(T) l_cast(lua_Number, T)
-#endif
-
-/* Add a string literal to a string buffer. */
-#if !defined(luaL_addliteral)
-  #define luaL_addliteral(B, s) \
-    luaL_addlstring(B, "" s, (sizeof((s)) / sizeof(char)) - 1)
+#if LMPROF_HAS_THREADS
+  #include <pthread.h>
 #endif
 
-/* Adds a formatted string literal to a string buffer. */
-#define luaL_addfstring(L, B, F, ...)       \
-  LUA_MLM_BEGIN                             \
-  lua_pushfstring((L), (F), ##__VA_ARGS__); \
-  luaL_addvalue((B));                       \
-  LUA_MLM_END
-
-/* LMPROF_PRINTF for string buffers. */
-#define luaL_addifstring(L, B, F, ...)                                        \
-  LUA_MLM_BEGIN                                                               \
-  lua_pushfstring((L), "%s" LMPROF_INDENT "" F "," LMPROF_NL, ##__VA_ARGS__); \
-  luaL_addvalue((B));                                                         \
-  LUA_MLM_END
-
 /*
 ** {==================================================================
 ** File Handling
@@ -64,24 +31,106 @@
 */
 #if defined(LMPROF_FILE_API)
   #include <stdio.h>
+  #if LMPROF_HAS_ZLIB
+    #include <zlib.h>
+  #endif
+
+/* A report file: formatted reports may be compressed, see io_compressed. */
+typedef struct lmprof_IO {
+  FILE *file;
+  #if LMPROF_HAS_ZLIB
+  gzFile gz;
+  #endif
+} lmprof_IO;
+
+/* Formatted reports written to paths ending in ".gz" are compressed. */
+static int io_compressed(const char *path) {
+  #if LMPROF_HAS_ZLIB
+  const size_t length = strlen(path);
+  return length > 3 && strcmp(path + length - 3, ".gz") == 0;
+  #else
+  UNUSED(path);
+  return 0;
+  #endif
+}
+
+/*
+** Open the file at 'path': 'buffer', of LMPROF_IO_BUFFER bytes, is given to
+** stdio, while compressed files are buffered by zlib. Returning zero on failure.
+*/
+static int io_open(lmprof_IO *io, const char *path, const char *mode, int compress, char *buffer) {
+  io->file = l_nullptr;
+  #if LMPROF_HAS_ZLIB
+  io->gz = l_nullptr;
+  if (compress) {
+    char gzmode[16];
+    if (snprintf(gzmode, sizeof(gzmode), "wb%d", LMPROF_ZLIB_LEVEL) < 0)
+      return 0;
+    else if ((io->gz = gzopen(path, gzmode)) == l_nullptr)
+      return 0;
+
+    gzbuffer(io->gz, LMPROF_IO_BUFFER);
+    return 1;
+  }
+  #else
+  UNUSED(compress);
+  #endif
+
+  if ((io->file = fopen(path, mode)) == l_nullptr)
+    return 0;
 
-  /* Hacky macro for printing consistently strings */
-  #define LMPROF_PRINTF(F, L, I, ...) fprintf((F), "%s" LMPROF_INDENT "" L "," LMPROF_NL, (I), ##__VA_ARGS__)
+  setvbuf(io->file, buffer, _IOFBF, LMPROF_IO_BUFFER);
+  return 1;
+}
+
+/* Close the file; returning zero if its contents could not be written. */
+static int io_close(lmprof_IO *io) {
+  int result = 1;
+  if (io->file != l_nullptr) {
+    result = !ferror(io->file);
+    result = (fclose(io->file) == 0) && result;
+    io->file = l_nullptr;
+  }
+  #if LMPROF_HAS_ZLIB
+  if (io->gz != l_nullptr) {
+    result = (gzclose(io->gz) == Z_OK);
+    io->gz = l_nullptr;
+  }
+  #endif
+  return result;
+}
+
+/* lmprof_ReportWrite: an lmprof_IO sink */
+static int io_write(void *ud, const char *data, size_t size) {
+  lmprof_IO *io = l_pcast(lmprof_IO *, ud);
+  #if LMPROF_HAS_ZLIB
+  if (io->gz != l_nullptr) {
+    while (size > 0) { /* gzwrite lengths are an 'unsigned' */
+      const unsigned length = l_cast(unsigned, (size > 0x40000000) ? 0x40000000 : size);
+      if (gzwrite(io->gz, data, length) != l_cast(int, length))
+        return 0;
+      data += length;
+      size -= length;
+    }
+    return 1;
+  }
+  #endif
+  return fwrite(data, 1, size, io->file) == size;
+}
 
 /* iolib.f_gc */
 static int io_fgc(lua_State *L) {
-  FILE **f = l_pcast(FILE **, luaL_checkudata(L, 1, LMPROF_IO_METATABLE));
-  if (*f != l_nullptr) {
-    fclose(*f);
-    *f = l_nullptr;
-  }
+  io_close(l_pcast(lmprof_IO *, luaL_checkudata(L, 1, LMPROF_IO_METATABLE)));
   return 0;
 }
 
 /* Create & Open a file-handle userdata, placing it ontop of the Lua stack */
-static FILE **io_fud(lua_State *L, const char *output) {
-  FILE **pf = l_pcast(FILE **, lmprof_newuserdata(L, sizeof(FILE *)));
-  *pf = l_nullptr;
+static lmprof_IO *io_fud(lua_State *L, const char *output, const char *mode, int compress) {
+  lmprof_IO *io = l_pcast(lmprof_IO *, lmprof_newuserdata(L, sizeof(lmprof_IO) + LMPROF_IO_BUFFER));
+  io->file = l_nullptr;
+  #if LMPROF_HAS_ZLIB
+  io->gz = l_nullptr;
+  #endif
 
   #if LUA_VERSION_NUM == 501
   luaL_getmetatable(L, LMPROF_IO_METATABLE);
@@ -91,11 +140,12 @@ static FILE **io_fud(lua_State *L, const char *output) {
   #endif
 
   /* Open File... consider destroying the profiler state on failure? */
-  if ((*pf = fopen(output, "w")) == l_nullptr) {
+  /* The stdio buffer trails the handle and is released alongside it (after io_fgc) */
+  if (!io_open(io, output, mode, compress, l_pcast(char *, io + 1))) {
     luaL_error(L, "cannot open file '%s' (%s)", output, strerror(errno));
     return l_nullptr;
   }
-  return pf;
+  return io;
 }
 
 #endif
@@ -103,365 +153,653 @@ static FILE **io_fud(lua_State *L, const char *output) {
 
 /*
 ** {==================================================================
-** Graph Profiler Format
+** Report Writers
 ** ===================================================================
 */
 
 /*
-** For identifiers to be faithfully represented in prior versions of Lua, they
-** are encoded as formatted strings instead of integers.
+** Sugar for the lmprof_ReportWriter of a report. Trace Events make up the bulk
+** of most reports: calls to the JSON encoder are resolved statically.
 */
-#define IDENTIFIER_BUFFER_LENGTH 256
+#define REPORT_JSON(R) ((R)->writer == &json_writer)
+#define report_begin(R, K, T) (REPORT_JSON(R) ? json_begin((R), (K), (T)) : (R)->writer->begin((R), (K), (T)))
+#define report_end(R) (REPORT_JSON(R) ? json_end((R)) : (R)->writer->end((R)))
+#define report_integer(R, K, V) (REPORT_JSON(R) ? json_integer((R), (K), l_cast(lua_Integer, (V))) : (R)->writer->integer((R), (K), l_cast(lua_Integer, (V))))
+#define report_number(R, K, V) (R)->writer->number((R), (K), l_cast(lua_Number, (V)))
+#define report_boolean(R, K, V) (R)->writer->boolean((R), (K), (V))
+#define report_string(R, K, V) (REPORT_JSON(R) ? json_string((R), (K), (V)) : (R)->writer->string((R), (K), (V)))
+#define report_fstring(R, K, F, ...) (R)->writer->fstring((R), (K), (F), ##__VA_ARGS__)
+#define report_null(R, K) (R)->writer->null((R), (K))
+
+/* Open an object/array within the current one. */
+static LUA_INLINE void report_push(lmprof_Report *R, const char *key, lmprof_ReportKind kind) {
+  if (R->depth < LMPROF_REPORT_DEPTH) {
+    lmprof_ReportFrame *frame = &R->frames[R->depth++];
+    frame->key = key;
+    frame->count = 0;
+    frame->kind = kind;
+  }
+  else {
+    LMPROF_LOG("<%s>: maximum report depth\n", __FUNCTION__);
+    R->error = 1;
+  }
+}
 
-static int profiler_header(lua_State *L, lmprof_Report *R) {
-  lmprof_State *st = R->st;
-  const uint32_t mode = R->st->mode;
-  const uint32_t conf = R->st->conf;
-  if (R->type == lTable) {
-    luaL_settabss(L, "clockid", LMPROF_TIME_ID(conf));
-    luaL_settabsb(L, "instrument", BITFIELD_TEST(mode, LMPROF_MODE_INSTRUMENT));
-    luaL_settabsb(L, "memory", BITFIELD_TEST(mode, LMPROF_MODE_MEMORY));
-    luaL_settabsb(L, "sample", BITFIELD_TEST(mode, LMPROF_MODE_SAMPLE));
-    luaL_settabsb(L, "callback", BITFIELD_TEST(mode, LMPROF_CALLBACK_MASK));
-    luaL_settabsb(L, "single_thread", BITFIELD_TEST(mode, LMPROF_MODE_SINGLE_THREAD));
-    luaL_settabsb(L, "mismatch", BITFIELD_TEST(conf, LMPROF_OPT_STACK_MISMATCH));
-    luaL_settabsb(L, "line_freq", BITFIELD_TEST(conf, LMPROF_OPT_LINE_FREQUENCY));
-    luaL_settabsb(L, "compress_graph", BITFIELD_TEST(conf, LMPROF_OPT_COMPRESS_GRAPH));
-    luaL_settabsi(L, "sampler_count", l_cast(lua_Integer, st->i.mask_count));
-    luaL_settabsi(L, "instr_count", l_cast(lua_Integer, st->i.instr_count));
-    luaL_settabsi(L, "profile_overhead", l_cast(lua_Integer, LMPROF_TIME_ADJ(st->thread.r.overhead, conf)));
-    luaL_settabsi(L, "calibration", l_cast(lua_Integer, LMPROF_TIME_ADJ(st->i.calibration, conf)));
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-    const char *indent = R->f.indent;
-    LMPROF_PRINTF(f, "clockid = \"%s\"", indent, LMPROF_TIME_ID(conf));
-    LMPROF_PRINTF(f, "instrument = %s", indent, BITFIELD_TEST(mode, LMPROF_MODE_INSTRUMENT) ? "true" : "false");
-    LMPROF_PRINTF(f, "memory = %s", indent, BITFIELD_TEST(mode, LMPROF_MODE_MEMORY) ? "true" : "false");
-    LMPROF_PRINTF(f, "sample = %s", indent, BITFIELD_TEST(mode, LMPROF_MODE_SAMPLE) ? "true" : "false");
-    LMPROF_PRINTF(f, "callback = %s", indent, BITFIELD_TEST(mode, LMPROF_CALLBACK_MASK) ? "true" : "false");
-    LMPROF_PRINTF(f, "single_thread = %s", indent, BITFIELD_TEST(mode, LMPROF_MODE_SINGLE_THREAD) ? "true" : "false");
-    LMPROF_PRINTF(f, "mismatch = %s", indent, BITFIELD_TEST(conf, LMPROF_OPT_STACK_MISMATCH) ? "true" : "false");
-    LMPROF_PRINTF(f, "line_freq = %s", indent, BITFIELD_TEST(conf, LMPROF_OPT_LINE_FREQUENCY) ? "true" : "false");
-    LMPROF_PRINTF(f, "compress_graph = %s", indent, BITFIELD_TEST(conf, LMPROF_OPT_COMPRESS_GRAPH) ? "true" : "false");
-    LMPROF_PRINTF(f, "sampler_count = " LUA_INTEGER_FMT, indent, l_cast(lua_Integer, st->i.mask_count));
-    LMPROF_PRINTF(f, "instr_count = " LUA_INTEGER_FMT, indent, l_cast(lua_Integer, st->i.instr_count));
-    LMPROF_PRINTF(f, "profile_overhead = " LUA_INTEGER_FMT, indent, l_cast(lua_Integer, LMPROF_TIME_ADJ(st->thread.r.overhead, conf)));
-    LMPROF_PRINTF(f, "calibration = " LUA_INTEGER_FMT, indent, l_cast(lua_Integer, LMPROF_TIME_ADJ(st->i.calibration, conf)));
-    return LUA_OK;
+/* Close the current object/array; returning NULL if no value is open. */
+static LUA_INLINE lmprof_ReportFrame *report_pop(lmprof_Report *R) {
+  return (R->depth > 0) ? &R->frames[--R->depth] : l_nullptr;
+}
+
+/*
+** Lua Table Builder: every object/array is a table placed ontop of the Lua
+** stack until closed. The root table remains on the stack.
+*/
+
+/* Store the value ontop of the stack into the table of the current object/array. */
+static void table_store(lmprof_Report *R, const char *key) {
+  if (R->depth > 0) {
+    lmprof_ReportFrame *frame = &R->frames[R->depth - 1];
+    if (frame->kind == lObject)
+      lua_setfield(R->L, -2, key);
+    else {
+#if LUA_VERSION_NUM >= 503
+      lua_rawseti(R->L, -2, ++frame->count);
 #else
-    return LMPROF_REPORT_DISABLED_IO;
+      lua_rawseti(R->L, -2, l_cast(int, ++frame->count));
 #endif
+    }
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-    const char *indent = R->b.indent;
+}
 
-    luaL_addifstring(L, b, "clockid = \"%s\"", indent, LMPROF_TIME_ID(conf));
-    luaL_addifstring(L, b, "instrument = %s", indent, BITFIELD_TEST(mode, LMPROF_MODE_INSTRUMENT) ? "true" : "false");
-    luaL_addifstring(L, b, "memory = %s", indent, BITFIELD_TEST(mode, LMPROF_MODE_MEMORY) ? "true" : "false");
-    luaL_addifstring(L, b, "sample = %s", indent, BITFIELD_TEST(mode, LMPROF_MODE_SAMPLE) ? "true" : "false");
-    luaL_addifstring(L, b, "callback = %s", indent, BITFIELD_TEST(mode, LMPROF_CALLBACK_MASK) ? "true" : "false");
-    luaL_addifstring(L, b, "single_thread = %s", indent, BITFIELD_TEST(mode, LMPROF_MODE_SINGLE_THREAD) ? "true" : "false");
-    luaL_addifstring(L, b, "mismatch = %s", indent, BITFIELD_TEST(conf, LMPROF_OPT_STACK_MISMATCH) ? "true" : "false");
-    luaL_addifstring(L, b, "line_freq = %s", indent, BITFIELD_TEST(conf, LMPROF_OPT_LINE_FREQUENCY) ? "true" : "false");
-    luaL_addifstring(L, b, "compress_graph = %s", indent, BITFIELD_TEST(conf, LMPROF_OPT_COMPRESS_GRAPH) ? "true" : "false");
-    luaL_addifstring(L, b, "sampler_count = " LUA_INT_FORMAT, indent, LUA_INT_CAST(st->i.mask_count));
-    luaL_addifstring(L, b, "instr_count = " LUA_INT_FORMAT, indent, LUA_INT_CAST(st->i.instr_count));
-    luaL_addifstring(L, b, "profile_overhead = " LUA_INT_FORMAT, indent, LUA_INT_CAST(LMPROF_TIME_ADJ(st->thread.r.overhead, conf)));
-    luaL_addifstring(L, b, "calibration = " LUA_INT_FORMAT, indent, LUA_INT_CAST(LMPROF_TIME_ADJ(st->i.calibration, conf)));
-    return LUA_OK;
-  }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
+static void table_begin(lmprof_Report *R, const char *key, lmprof_ReportKind kind) {
+  if (R->depth == 0)
+    luaL_checkstack(R->L, LMPROF_REPORT_DEPTH + 4, __FUNCTION__);
+
+  lua_newtable(R->L);
+  report_push(R, key, kind);
+}
+
+static void table_end(lmprof_Report *R) {
+  const lmprof_ReportFrame *frame = report_pop(R);
+  if (frame != l_nullptr)
+    table_store(R, frame->key);
+}
+
+static void table_integer(lmprof_Report *R, const char *key, lua_Integer value) {
+  lua_pushinteger(R->L, value);
+  table_store(R, key);
+}
+
+static void table_number(lmprof_Report *R, const char *key, lua_Number value) {
+  lua_pushnumber(R->L, value);
+  table_store(R, key);
+}
+
+static void table_boolean(lmprof_Report *R, const char *key, int value) {
+  lua_pushboolean(R->L, value);
+  table_store(R, key);
+}
+
+static void table_string(lmprof_Report *R, const char *key, const char *value) {
+  lua_pushstring(R->L, value);
+  table_store(R, key);
+}
+
+static void table_fstring(lmprof_Report *R, const char *key, const char *fmt, ...) {
+  va_list argp;
+  va_start(argp, fmt);
+  lua_pushvfstring(R->L, fmt, argp);
+  va_end(argp);
+  table_store(R, key);
+}
+
+static void table_null(lmprof_Report *R, const char *key) {
+  UNUSED(R);
+  UNUSED(key);
 }
 
+static const lmprof_ReportWriter table_writer = {
+  table_begin, table_end, table_integer, table_number,
+  table_boolean, table_string, table_fstring, table_null
+};
+
 /*
-** @TODO: Casting from uint64_t to lua_Integer creates potential overflow issues.
-**
-** @TODO: Technically PRIluSIZE and PRIluTIME should not be used as those format
-**  strings may not be compatible with LUA_INTEGER_FMT (>= Lua 5.3) or
-**  size_t/ptrdiff_t (<= Lua 5.2)
-**
-**  The equivalent to:
-**    fprintf(f, LUA_INTEGER_FMT, (LUAI_UACINT)lua_tointeger(L, arg))
-**  should be used/back-ported.
+** Text Encoders: constant fragments are appended to the staging buffer of the
+** report, integers are converted by hand, and the buffer is handed to the sink
+** in blocks.
 */
-static int graph_hash_callback(lua_State *L, lmprof_Record *record, void *args) {
-  lmprof_Report *R = l_pcast(lmprof_Report *, args);
-  lmprof_State *st = R->st;
 
-  const uint32_t mode = st->mode;
-  const lmprof_FunctionInfo *info = &record->info;
-  luaL_checkstack(L, 8, __FUNCTION__);
-  if (R->type == lTable) {
-    char rid_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    char fid_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    char pid_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    if (snprintf(rid_str, sizeof(rid_str), "%" PRIluADDR "", record->r_id) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-    if (snprintf(fid_str, sizeof(fid_str), "%" PRIluADDR "", record->f_id) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-    if (snprintf(pid_str, sizeof(pid_str), "%" PRIluADDR "", record->p_id) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-
-    /* Function header */
-    lua_newtable(L);
-    luaL_settabss(L, "id", rid_str);
-    luaL_settabss(L, "func", fid_str);
-    luaL_settabss(L, "parent", pid_str);
-    luaL_settabsi(L, "parent_line", l_cast(lua_Integer, record->p_currentline));
-    luaL_settabsb(L, "ignored", BITFIELD_TEST(info->event, LMPROF_RECORD_IGNORED));
-    luaL_settabss(L, "name", (info->name == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->name);
-    luaL_settabss(L, "what", (info->what == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->what);
-    luaL_settabss(L, "source", (info->source == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->source);
-
-    /* Function statistics */
-    luaL_settabsi(L, "count", record->graph.count);
-    if (BITFIELD_TEST(mode, LMPROF_MODE_INSTRUMENT)) {
-      luaL_settabsi(L, "time", l_cast(lua_Integer, LMPROF_TIME_ADJ(record->graph.node.time, st->conf)));
-      luaL_settabsi(L, "total_time", l_cast(lua_Integer, LMPROF_TIME_ADJ(record->graph.path.time, st->conf)));
-    }
+/* Enough characters for any formatted lua_Integer or lu_time */
+#define TEXT_INTEGER_LENGTH 24
+
+/* Enough characters for any formatted lua_Number */
+#define TEXT_NUMBER_LENGTH 64
+
+/* Two digits are generated per division */
+static const char text_digits[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static void text_flush(lmprof_Report *R) {
+  if (R->length > 0) {
+    if (!R->error && !R->write(R->ud, R->buff, R->length))
+      R->error = 1;
+    R->length = 0;
+  }
+}
 
-    if (BITFIELD_TEST(mode, LMPROF_MODE_MEMORY)) {
-      luaL_settabsi(L, "allocated", l_cast(lua_Integer, record->graph.node.allocated));
-      luaL_settabsi(L, "deallocated", l_cast(lua_Integer, record->graph.node.deallocated));
-      luaL_settabsi(L, "total_allocated", l_cast(lua_Integer, record->graph.path.allocated));
-      luaL_settabsi(L, "total_deallocated", l_cast(lua_Integer, record->graph.path.deallocated));
-    }
+/* text_write when the staging buffer is full */
+static void text_spill(lmprof_Report *R, const char *str, size_t len) {
+  text_flush(R);
+  if (len > LMPROF_REPORT_BUFFER) {
+    if (!R->error && !R->write(R->ud, str, len))
+      R->error = 1;
+  }
+  else {
+    memcpy(R->buff, str, len);
+    R->length = len;
+  }
+}
 
-    /* Spurious activation record data */
-    luaL_settabsi(L, "linedefined", info->linedefined);
-    luaL_settabsi(L, "lastlinedefined", info->lastlinedefined);
-    luaL_settabsi(L, "nups", info->nups);
-#if LUA_VERSION_NUM >= 502
-    luaL_settabsi(L, "nparams", info->nparams);
-    luaL_settabsb(L, "isvararg", info->isvararg);
-    luaL_settabsb(L, "istailcall", info->istailcall);
-#endif
-#if LUA_VERSION_NUM >= 504
-    luaL_settabsi(L, "ftransfer", info->ftransfer);
-    luaL_settabsi(L, "ntransfer", info->ntransfer);
-#endif
+static LUA_INLINE void text_write(lmprof_Report *R, const char *str, size_t len) {
+  if (len <= LMPROF_REPORT_BUFFER - R->length) {
+    memcpy(R->buff + R->length, str, len);
+    R->length += len;
+  }
+  else {
+    text_spill(R, str, len);
+  }
+}
 
-    /* Line profiling enabled */
-    if (record->graph.line_freq != l_nullptr && record->graph.line_freq_size > 0) {
-      const size_t *freq = record->graph.line_freq;
-      const int freq_size = record->graph.line_freq_size;
-      int i = 0;
+#define text_literal(R, S) text_write((R), "" S, (sizeof((S)) / sizeof(char)) - 1)
 
-      lua_createtable(L, freq_size, 0);
-      for (i = 0; i < freq_size; ++i) {
-        lua_pushinteger(L, l_cast(lua_Integer, freq[i]));
-#if LUA_VERSION_NUM >= 503
-        lua_rawseti(L, -2, l_cast(lua_Integer, i + 1));
-#else
-        lua_rawseti(L, -2, i + 1);
-#endif
-      }
-      lua_setfield(L, -2, "lines");
-    }
-    lua_rawseti(L, -2, R->t.array_count++); /* TABLE: APPEND */
-    return LUA_OK;
+static LUA_INLINE void text_string(lmprof_Report *R, const char *str) {
+  if (str == l_nullptr)
+    str = "(null)";
+  text_write(R, str, strlen(str));
+}
+
+static LUA_INLINE void text_unsigned(lmprof_Report *R, lu_time value) {
+  char buff[TEXT_INTEGER_LENGTH];
+  char *p = buff + TEXT_INTEGER_LENGTH;
+  while (value >= 100) {
+    const size_t d = l_cast(size_t, value % 100) << 1;
+    value /= 100;
+    *--p = text_digits[d + 1];
+    *--p = text_digits[d];
   }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-    const char *indent = R->f.indent;
-    /*
-    ** Output as an array of records. The 'map' equivalent has keys of the form
-    **  ("%s_%s"):format(funcNode.func, funcNode.parent)
-    **
-    ** fprintf(f, "%s[\"%" PRIluADDR "_%" PRIluADDR "\"] = {" LMPROF_NL, indent, record->f_id, record->p_id);
-    */
-    fprintf(f, "%s{" LMPROF_NL, indent);
-
-    /* Function header */
-    LMPROF_PRINTF(f, "id = \"%" PRIluADDR "\"", indent, record->r_id);
-    LMPROF_PRINTF(f, "func = \"%" PRIluADDR "\"", indent, record->f_id);
-    LMPROF_PRINTF(f, "parent = \"%" PRIluADDR "\"", indent, record->p_id);
-    LMPROF_PRINTF(f, "parent_line = %d", indent, record->p_currentline);
-    LMPROF_PRINTF(f, "ignored = %s", indent, BITFIELD_TEST(info->event, LMPROF_RECORD_IGNORED) ? "true" : "false");
-    LMPROF_PRINTF(f, "name = \"%s\"", indent, (info->name == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->name);
-    LMPROF_PRINTF(f, "what = \"%s\"", indent, (info->what == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->what);
-    LMPROF_PRINTF(f, "source = \"%s\"", indent, (info->source == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->source);
-
-    /* Function statistics */
-    LMPROF_PRINTF(f, "count = %zu", indent, record->graph.count);
-    if (BITFIELD_TEST(mode, LMPROF_MODE_INSTRUMENT)) {
-      LMPROF_PRINTF(f, "time = %" PRIluTIME "", indent, LMPROF_TIME_ADJ(record->graph.node.time, st->conf));
-      LMPROF_PRINTF(f, "total_time = %" PRIluTIME "", indent, LMPROF_TIME_ADJ(record->graph.path.time, st->conf));
-    }
 
-    if (BITFIELD_TEST(mode, LMPROF_MODE_MEMORY)) {
-      LMPROF_PRINTF(f, "allocated = %" PRIluSIZE "", indent, record->graph.node.allocated);
-      LMPROF_PRINTF(f, "deallocated = %" PRIluSIZE "", indent, record->graph.node.deallocated);
-      LMPROF_PRINTF(f, "total_allocated = %" PRIluSIZE "", indent, record->graph.path.allocated);
-      LMPROF_PRINTF(f, "total_deallocated = %" PRIluSIZE "", indent, record->graph.path.deallocated);
+  if (value >= 10) {
+    const size_t d = l_cast(size_t, value) << 1;
+    *--p = text_digits[d + 1];
+    *--p = text_digits[d];
+  }
+  else {
+    *--p = l_cast(char, '0' + l_cast(int, value));
+  }
+
+  if (TEXT_INTEGER_LENGTH <= LMPROF_REPORT_BUFFER - R->length) {
+    char *out = R->buff + R->length;
+    while (p < buff + TEXT_INTEGER_LENGTH)
+      *out++ = *p++;
+    R->length = l_cast(size_t, out - R->buff);
+  }
+  else {
+    text_write(R, p, l_cast(size_t, (buff + TEXT_INTEGER_LENGTH) - p));
+  }
+}
+
+static void text_integer(lmprof_Report *R, lua_Integer value) {
+  if (value < 0) {
+    text_literal(R, "-");
+    text_unsigned(R, l_cast(lu_time, 0) - l_cast(lu_time, value));
+  }
+  else {
+    text_unsigned(R, l_cast(lu_time, value));
+  }
+}
+
+static void text_number(lmprof_Report *R, lua_Number value) {
+  char buff[TEXT_NUMBER_LENGTH];
+  const int length = snprintf(buff, sizeof(buff), LUA_NUMBER_FMT, l_cast(LUAI_UACNUMBER, value));
+  if (length > 0)
+    text_write(R, buff, (l_cast(size_t, length) < sizeof(buff)) ? l_cast(size_t, length) : sizeof(buff) - 1);
+}
+
+/* The subset of lua_pushvfstring used by the formatters: '%s', '%d', and '%%' */
+static void text_vformat(lmprof_Report *R, const char *fmt, va_list argp) {
+  const char *e = l_nullptr;
+  while ((e = strchr(fmt, '%')) != l_nullptr) {
+    text_write(R, fmt, l_cast(size_t, e - fmt));
+    switch (e[1]) {
+      case 's':
+        text_string(R, va_arg(argp, const char *));
+        break;
+      case 'd':
+        text_integer(R, l_cast(lua_Integer, va_arg(argp, int)));
+        break;
+      case '%':
+        text_literal(R, "%");
+        break;
+      default:
+        LMPROF_LOG("<%s>: invalid format option '%%%c'\n", __FUNCTION__, e[1]);
+        R->error = 1;
+        return;
     }
+    fmt = e + 2;
+  }
+  text_string(R, fmt);
+}
 
-    /* Spurious activation record data */
-    LMPROF_PRINTF(f, "linedefined = %d", indent, info->linedefined);
-    LMPROF_PRINTF(f, "lastlinedefined = %d", indent, info->lastlinedefined);
-    LMPROF_PRINTF(f, "nups = %d", indent, info->nups);
-  #if LUA_VERSION_NUM >= 502
-    LMPROF_PRINTF(f, "nparams = %d", indent, info->nparams);
-    LMPROF_PRINTF(f, "isvararg = %d", indent, info->isvararg);
-    LMPROF_PRINTF(f, "istailcall = %d", indent, info->istailcall);
-  #endif
-  #if LUA_VERSION_NUM >= 504
-    LMPROF_PRINTF(f, "ftransfer = %d", indent, info->ftransfer);
-    LMPROF_PRINTF(f, "ntransfer = %d", indent, info->ntransfer);
-  #endif
+/*
+** JSON: values of an object/array are separated by JSON_DELIM; lRecords places
+** each value on its own line.
+*/
+
+#define JSON_OPEN_OBJ "{"
+#define JSON_CLOSE_OBJ "}"
+#define JSON_OPEN_ARRAY "["
+#define JSON_CLOSE_ARRAY "]"
+#define JSON_DELIM ", "
+#define JSON_NEWLINE "\n"
 
-    /* Line profiling enabled */
-    if (record->graph.line_freq != l_nullptr && record->graph.line_freq_size > 0) {
-      const size_t *freq = record->graph.line_freq;
-      const int freq_size = record->graph.line_freq_size;
-      int i = 0;
-
-      fprintf(f, "%s" LMPROF_INDENT "lines = {", indent);
-      fprintf(f, "%zu", freq[0]);
-      for (i = 1; i < freq_size; ++i)
-        fprintf(f, ", %zu", freq[i]);
-      fprintf(f, "}," LMPROF_NL);
+/* Delimit, and key, the next value of the current object/array. */
+static LUA_INLINE void json_key(lmprof_Report *R, const char *key) {
+  if (R->depth > 0) {
+    lmprof_ReportFrame *frame = &R->frames[R->depth - 1];
+    if (frame->count++ == 0) {
     }
-    fprintf(f, "%s}," LMPROF_NL, indent);
-    return LUA_OK;
-#else
-    return LMPROF_REPORT_DISABLED_IO;
-#endif
+    else if (frame->kind == lRecords)
+      text_literal(R, JSON_DELIM JSON_NEWLINE);
+    else
+      text_literal(R, JSON_DELIM);
+
+    if (key != l_nullptr) { /* Constant folded when inlined */
+      const size_t len = strlen(key);
+      if (len + 3 <= LMPROF_REPORT_BUFFER - R->length) {
+        char *p = R->buff + R->length;
+        p[0] = '"';
+        memcpy(p + 1, key, len);
+        p[len + 1] = '"';
+        p[len + 2] = ':';
+        R->length += len + 3;
+      }
+      else {
+        text_literal(R, "\"");
+        text_write(R, key, len);
+        text_literal(R, "\":");
+      }
+    }
+  }
+}
+
+static LUA_INLINE void json_begin(lmprof_Report *R, const char *key, lmprof_ReportKind kind) {
+  json_key(R, key);
+  if (kind == lObject)
+    text_literal(R, JSON_OPEN_OBJ);
+  else if (kind == lArray)
+    text_literal(R, JSON_OPEN_ARRAY);
+  else
+    text_literal(R, JSON_OPEN_ARRAY JSON_NEWLINE);
+  report_push(R, key, kind);
+}
+
+static LUA_INLINE void json_end(lmprof_Report *R) {
+  const lmprof_ReportFrame *frame = report_pop(R);
+  if (frame == l_nullptr)
+    return;
+  else if (frame->kind == lObject)
+    text_literal(R, JSON_CLOSE_OBJ);
+  else if (frame->kind == lArray)
+    text_literal(R, JSON_CLOSE_ARRAY);
+  else
+    text_literal(R, JSON_NEWLINE JSON_CLOSE_ARRAY);
+
+  if (R->depth == 0) { /* Root */
+    text_literal(R, JSON_NEWLINE);
+    text_flush(R);
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-    const char *indent = R->b.indent;
-
-    char rid_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    char fid_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    char pid_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    if (snprintf(rid_str, sizeof(rid_str), "%" PRIluADDR "", record->r_id) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-    if (snprintf(fid_str, sizeof(fid_str), "%" PRIluADDR "", record->f_id) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-    if (snprintf(pid_str, sizeof(pid_str), "%" PRIluADDR "", record->p_id) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-
-    luaL_addfstring(L, b, "%s{" LMPROF_NL, indent);
-
-    /* Function header */
-    luaL_addifstring(L, b, "id = \"%s\"", indent, rid_str);
-    luaL_addifstring(L, b, "func = \"%s\"", indent, fid_str);
-    luaL_addifstring(L, b, "parent = \"%s\"", indent, pid_str);
-    luaL_addifstring(L, b, "parent_line = %d", indent, record->p_currentline);
-    luaL_addifstring(L, b, "ignored = %s", indent, BITFIELD_TEST(info->event, LMPROF_RECORD_IGNORED) ? "true" : "false");
-    luaL_addifstring(L, b, "name = \"%s\"", indent, (info->name == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->name);
-    luaL_addifstring(L, b, "what = \"%s\"", indent, (info->what == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->what);
-    luaL_addifstring(L, b, "source = \"%s\"", indent, (info->source == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->source);
-
-    /* Function statistics */
-    luaL_addifstring(L, b, "count = " LUA_UNIT_FORMAT "", indent, LUA_UNIT_CAST(record->graph.count));
-    if (BITFIELD_TEST(mode, LMPROF_MODE_INSTRUMENT)) {
-      luaL_addifstring(L, b, "time = " LUA_UNIT_FORMAT "", indent, LUA_UNIT_CAST(LMPROF_TIME_ADJ(record->graph.node.time, st->conf)));
-      luaL_addifstring(L, b, "total_time = " LUA_UNIT_FORMAT "", indent, LUA_UNIT_CAST(LMPROF_TIME_ADJ(record->graph.path.time, st->conf)));
+}
+
+static LUA_INLINE void json_integer(lmprof_Report *R, const char *key, lua_Integer value) {
+  json_key(R, key);
+  text_integer(R, value);
+}
+
+static void json_number(lmprof_Report *R, const char *key, lua_Number value) {
+  json_key(R, key);
+  text_number(R, value);
+}
+
+static void json_boolean(lmprof_Report *R, const char *key, int value) {
+  json_key(R, key);
+  if (value)
+    text_literal(R, "true");
+  else
+    text_literal(R, "false");
+}
+
+static LUA_INLINE void json_string(lmprof_Report *R, const char *key, const char *value) {
+  json_key(R, key);
+  text_literal(R, "\"");
+  text_string(R, value);
+  text_literal(R, "\"");
+}
+
+static void json_fstring(lmprof_Report *R, const char *key, const char *fmt, ...) {
+  va_list argp;
+  json_key(R, key);
+  text_literal(R, "\"");
+  va_start(argp, fmt);
+  text_vformat(R, fmt, argp);
+  va_end(argp);
+  text_literal(R, "\"");
+}
+
+static void json_null(lmprof_Report *R, const char *key) {
+  json_key(R, key);
+  text_literal(R, "null");
+}
+
+static const lmprof_ReportWriter json_writer = {
+  json_begin, json_end, json_integer, json_number,
+  json_boolean, json_string, json_fstring, json_null
+};
+
+/*
+** Lua source: a chunk returning the report table, i.e., can be loaded with
+** 'require' or 'dofile'. Each value of an object (and lRecords) is placed on
+** its own (indented) line, while lArray values are placed inline.
+*/
+
+#define SOURCE_NEWLINE "\n"
+
+static void source_indent(lmprof_Report *R, int depth) {
+  static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+  text_write(R, tabs, l_cast(size_t, (depth < LMPROF_REPORT_DEPTH) ? depth : LMPROF_REPORT_DEPTH));
+}
+
+/* Delimit, indent, and key the next value of the current object/array. */
+static void source_key(lmprof_Report *R, const char *key) {
+  if (R->depth > 0) {
+    lmprof_ReportFrame *frame = &R->frames[R->depth - 1];
+    if (frame->kind == lArray) {
+      if (frame->count++ > 0)
+        text_literal(R, ", ");
+      return;
     }
 
-    if (BITFIELD_TEST(mode, LMPROF_MODE_MEMORY)) {
-      luaL_addifstring(L, b, "allocated = " LUA_UNIT_FORMAT "", indent, LUA_UNIT_CAST(record->graph.node.allocated));
-      luaL_addifstring(L, b, "deallocated = " LUA_UNIT_FORMAT "", indent, LUA_UNIT_CAST(record->graph.node.deallocated));
-      luaL_addifstring(L, b, "total_allocated = " LUA_UNIT_FORMAT "", indent, LUA_UNIT_CAST(record->graph.path.allocated));
-      luaL_addifstring(L, b, "total_deallocated = " LUA_UNIT_FORMAT "", indent, LUA_UNIT_CAST(record->graph.path.deallocated));
+    frame->count++;
+    source_indent(R, R->depth);
+    if (key != l_nullptr) {
+      text_string(R, key);
+      text_literal(R, " = ");
     }
+  }
+}
 
-    /* Spurious activation record data */
-    luaL_addifstring(L, b, "linedefined = %d", indent, info->linedefined);
-    luaL_addifstring(L, b, "lastlinedefined = %d", indent, info->lastlinedefined);
-    luaL_addifstring(L, b, "nups = %d", indent, info->nups);
-#if LUA_VERSION_NUM >= 502
-    luaL_addifstring(L, b, "nparams = %d", indent, info->nparams);
-    luaL_addifstring(L, b, "isvararg = %d", indent, info->isvararg);
-    luaL_addifstring(L, b, "istailcall = %d", indent, info->istailcall);
-#endif
-#if LUA_VERSION_NUM >= 504
-    luaL_addifstring(L, b, "ftransfer = %d", indent, info->ftransfer);
-    luaL_addifstring(L, b, "ntransfer = %d", indent, info->ntransfer);
-#endif
+/* Terminate a value of the current object/array. */
+static void source_value_end(lmprof_Report *R) {
+  if (R->depth > 0 && R->frames[R->depth - 1].kind != lArray)
+    text_literal(R, "," SOURCE_NEWLINE);
+}
 
-    /* Line profiling enabled */
-    if (record->graph.line_freq != l_nullptr && record->graph.line_freq_size > 0) {
-      const size_t *freq = record->graph.line_freq;
-      const int freq_size = record->graph.line_freq_size;
-      int i = 0;
-
-      luaL_addfstring(L, b, "%s" LMPROF_INDENT "lines = {", indent);
-      luaL_addfstring(L, b, "%zu", freq[0]);
-      for (i = 1; i < freq_size; ++i)
-        luaL_addfstring(L, b, ", %zu", freq[i]);
-      luaL_addfstring(L, b, "}," LMPROF_NL);
-    }
-    luaL_addfstring(L, b, "%s}," LMPROF_NL, indent);
-    return LUA_OK;
+static void source_begin(lmprof_Report *R, const char *key, lmprof_ReportKind kind) {
+  if (R->depth == 0)
+    text_literal(R, "return ");
+
+  source_key(R, key);
+  if (kind == lArray)
+    text_literal(R, "{");
+  else
+    text_literal(R, "{" SOURCE_NEWLINE);
+  report_push(R, key, kind);
+}
+
+static void source_end(lmprof_Report *R) {
+  const lmprof_ReportFrame *frame = report_pop(R);
+  if (frame == l_nullptr)
+    return;
+  else if (frame->kind != lArray)
+    source_indent(R, R->depth);
+
+  text_literal(R, "}");
+  if (R->depth == 0) { /* Root */
+    text_literal(R, SOURCE_NEWLINE);
+    text_flush(R);
+  }
+  else {
+    source_value_end(R);
   }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
 }
 
-static int graph_report(lua_State *L, lmprof_Report *report) {
-  lmprof_State *st = report->st;
+static void source_integer(lmprof_Report *R, const char *key, lua_Integer value) {
+  source_key(R, key);
+  text_integer(R, value);
+  source_value_end(R);
+}
 
-  luaL_checkstack(L, 8, __FUNCTION__);
-  if (report->type == lTable) {
-    lua_newtable(L); /* [..., header] */
-    profiler_header(L, report);
-    if (BITFIELD_TEST(st->conf, LMPROF_OPT_REPORT_VERBOSE) && !BITFIELD_TEST(st->mode, LMPROF_CALLBACK_MASK)) {
-      lua_newtable(L); /* [..., hash_debug] */
-      lmprof_hash_debug(L, st->i.hash);
-      lua_setfield(L, -2, "debug");
-    }
-    lua_setfield(L, report->t.table_index, "header");
+static void source_number(lmprof_Report *R, const char *key, lua_Number value) {
+  source_key(R, key);
+  text_number(R, value);
+  source_value_end(R);
+}
+
+static void source_boolean(lmprof_Report *R, const char *key, int value) {
+  source_key(R, key);
+  if (value)
+    text_literal(R, "true");
+  else
+    text_literal(R, "false");
+  source_value_end(R);
+}
 
-    lua_newtable(L); /* [..., records] */
-    lmprof_hash_report(L, st->i.hash, (lmprof_hash_Callback)graph_hash_callback, l_pcast(const void *, report));
-    lua_setfield(L, report->t.table_index, "records");
-    return LUA_OK;
+static void source_string(lmprof_Report *R, const char *key, const char *value) {
+  source_key(R, key);
+  text_literal(R, "\"");
+  text_string(R, value);
+  text_literal(R, "\"");
+  source_value_end(R);
+}
+
+static void source_fstring(lmprof_Report *R, const char *key, const char *fmt, ...) {
+  va_list argp;
+  source_key(R, key);
+  text_literal(R, "\"");
+  va_start(argp, fmt);
+  text_vformat(R, fmt, argp);
+  va_end(argp);
+  text_literal(R, "\"");
+  source_value_end(R);
+}
+
+static void source_null(lmprof_Report *R, const char *key) {
+  source_key(R, key);
+  text_literal(R, "nil");
+  source_value_end(R);
+}
+
+static const lmprof_ReportWriter source_writer = {
+  source_begin, source_end, source_integer, source_number,
+  source_boolean, source_string, source_fstring, source_null
+};
+
+/* lmprof_ReportWrite: a luaL_Buffer sink */
+static int buffer_write(void *ud, const char *data, size_t size) {
+  luaL_addlstring(l_pcast(luaL_Buffer *, ud), data, size);
+  return 1;
+}
+
+/*
+** Prepare a report for writing: lTable reports are built by the Lua table
+** builder, while all other report types are formatted as JSON (Trace Events)
+** or Lua source (Graph) and handed to 'write'.
+*/
+static void report_init(lmprof_Report *R, lua_State *L, lmprof_ReportType type, lmprof_ReportWrite write, void *ud) {
+  R->type = type;
+  R->L = L;
+  if (type == lTable)
+    R->writer = &table_writer;
+  else if (BITFIELD_TEST(R->st->mode, LMPROF_MODE_TRACE))
+    R->writer = &json_writer;
+  else
+    R->writer = &source_writer;
+
+  R->depth = 0;
+  R->write = write;
+  R->ud = ud;
+  R->error = 0;
+  R->length = 0;
+}
+
+/* }================================================================== */
+
+/*
+** {==================================================================
+** Graph Profiler Format
+** ===================================================================
+*/
+
+/*
+** For identifiers to be faithfully represented in prior versions of Lua, they
+** are encoded as formatted strings instead of integers.
+*/
+#define IDENTIFIER_BUFFER_LENGTH 256
+
+static void profiler_header(lmprof_Report *R) {
+  lmprof_State *st = R->st;
+  const uint32_t mode = R->st->mode;
+  const uint32_t conf = R->st->conf;
+  report_string(R, "clockid", LMPROF_TIME_ID(conf));
+  report_boolean(R, "instrument", BITFIELD_TEST(mode, LMPROF_MODE_INSTRUMENT) != 0);
+  report_boolean(R, "memory", BITFIELD_TEST(mode, LMPROF_MODE_MEMORY) != 0);
+  report_boolean(R, "sample", BITFIELD_TEST(mode, LMPROF_MODE_SAMPLE) != 0);
+  report_boolean(R, "callback", BITFIELD_TEST(mode, LMPROF_CALLBACK_MASK) != 0);
+  report_boolean(R, "single_thread", BITFIELD_TEST(mode, LMPROF_MODE_SINGLE_THREAD) != 0);
+  report_boolean(R, "mismatch", BITFIELD_TEST(conf, LMPROF_OPT_STACK_MISMATCH) != 0);
+  report_boolean(R, "line_freq", BITFIELD_TEST(conf, LMPROF_OPT_LINE_FREQUENCY) != 0);
+  report_boolean(R, "compress_graph", BITFIELD_TEST(conf, LMPROF_OPT_COMPRESS_GRAPH) != 0);
+  report_integer(R, "sampler_count", st->i.mask_count);
+  report_integer(R, "instr_count", st->i.instr_count);
+  report_integer(R, "profile_overhead", LMPROF_TIME_ADJ(st->thread.r.overhead, conf));
+  report_integer(R, "calibration", LMPROF_TIME_ADJ(st->i.calibration, conf));
+  report_integer(R, "stack_pool_hits", st->thread.pool.hits);
+  report_integer(R, "stack_pool_misses", st->thread.pool.misses);
+}
+
+/*
+** @TODO: Casting from uint64_t to lua_Integer creates potential overflow issues.
+*/
+static int graph_hash_callback(lua_State *L, lmprof_Record *record, void *args) {
+  lmprof_Report *R = l_pcast(lmprof_Report *, args);
+  lmprof_State *st = R->st;
+
+  const uint32_t mode = st->mode;
+  const lmprof_FunctionInfo *info = record->info;
+  char rid_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
+  char fid_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
+  char pid_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
+  UNUSED(L);
+  if (snprintf(rid_str, sizeof(rid_str), "%" PRIluADDR "", record->r_id) < 0)
+    LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
+  if (snprintf(fid_str, sizeof(fid_str), "%" PRIluADDR "", record->f_id) < 0)
+    LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
+  if (snprintf(pid_str, sizeof(pid_str), "%" PRIluADDR "", record->p_id) < 0)
+    LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
+
+  /*
+  ** Output as an array of records. The 'map' equivalent has keys of the form
+  **  ("%s_%s"):format(funcNode.func, funcNode.parent)
+  */
+  report_begin(R, l_nullptr, lObject);
+
+  /* Function header */
+  report_string(R, "id", rid_str);
+  report_string(R, "func", fid_str);
+  report_string(R, "parent", pid_str);
+  report_integer(R, "parent_line", record->p_currentline);
+  report_boolean(R, "ignored", BITFIELD_TEST(info->event, LMPROF_RECORD_IGNORED) != 0);
+  report_string(R, "name", (info->name == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->name);
+  report_string(R, "what", (info->what == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->what);
+  report_string(R, "source", (info->source == l_nullptr) ? LMPROF_RECORD_NAME_UNKNOWN : info->source);
+
+  /* Function statistics */
+  report_integer(R, "count", record->graph.count);
+  if (BITFIELD_TEST(mode, LMPROF_MODE_INSTRUMENT)) {
+    report_integer(R, "time", LMPROF_TIME_ADJ(record->graph.node.time, st->conf));
+    report_integer(R, "total_time", LMPROF_TIME_ADJ(record->graph.path.time, st->conf));
   }
-  else if (report->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    /* Header */
-    report->f.indent = LMPROF_INDENT;
-    fprintf(report->f.file, "return {" LMPROF_NL);
-    fprintf(report->f.file, LMPROF_INDENT "header = {" LMPROF_NL);
-    profiler_header(L, report);
-    fprintf(report->f.file, LMPROF_INDENT "}," LMPROF_NL);
-
-    /* Profile Records */
-    report->f.indent = LMPROF_INDENT LMPROF_INDENT;
-    fprintf(report->f.file, LMPROF_INDENT "records = {" LMPROF_NL);
-    lmprof_hash_report(L, st->i.hash, (lmprof_hash_Callback)graph_hash_callback, l_pcast(const void *, report));
-    fprintf(report->f.file, LMPROF_INDENT "}" LMPROF_NL "}" LMPROF_NL);
-    return LUA_OK;
-#else
-    return LMPROF_REPORT_DISABLED_IO;
-#endif
+
+  if (BITFIELD_TEST(mode, LMPROF_MODE_MEMORY)) {
+    report_integer(R, "allocated", record->graph.node.allocated);
+    report_integer(R, "deallocated", record->graph.node.deallocated);
+    report_integer(R, "total_allocated", record->graph.path.allocated);
+    report_integer(R, "total_deallocated", record->graph.path.deallocated);
+  }
+
+  /* Spurious activation record data */
+  report_integer(R, "linedefined", info->linedefined);
+  report_integer(R, "lastlinedefined", info->lastlinedefined);
+  report_integer(R, "nups", info->nups);
+#if LUA_VERSION_NUM >= 502
+  report_integer(R, "nparams", info->nparams);
+  if (R->type == lTable) {
+    report_boolean(R, "isvararg", info->isvararg);
+    report_boolean(R, "istailcall", info->istailcall);
   }
-  else if (report->type == lBuffer) {
-    luaL_Buffer *b = &report->b.buff;
+  else { /* Formatted as integers by previous versions */
+    report_integer(R, "isvararg", info->isvararg);
+    report_integer(R, "istailcall", info->istailcall);
+  }
+#endif
+#if LUA_VERSION_NUM >= 504
+  report_integer(R, "ftransfer", info->ftransfer);
+  report_integer(R, "ntransfer", info->ntransfer);
+#endif
 
-    /* Header */
-    report->b.indent = LMPROF_INDENT;
-    luaL_addliteral(b, "return {" LMPROF_NL);
-    luaL_addliteral(b, LMPROF_INDENT "header = {" LMPROF_NL);
-    profiler_header(L, report);
-    luaL_addliteral(b, LMPROF_INDENT "}," LMPROF_NL);
+  /* Line profiling enabled */
+  if (record->graph.line_freq != l_nullptr && record->graph.line_freq_size > 0) {
+    const size_t *freq = record->graph.line_freq;
+    const int freq_size = record->graph.line_freq_size;
+    int i = 0;
 
-    /* Profile Records */
-    report->b.indent = LMPROF_INDENT LMPROF_INDENT;
-    luaL_addliteral(b, LMPROF_INDENT "records = {" LMPROF_NL);
-    lmprof_hash_report(L, st->i.hash, (lmprof_hash_Callback)graph_hash_callback, l_pcast(const void *, report));
-    luaL_addliteral(b, LMPROF_INDENT "}" LMPROF_NL "}" LMPROF_NL);
-    return LUA_OK;
+    report_begin(R, "lines", lArray);
+    for (i = 0; i < freq_size; ++i)
+      report_integer(R, l_nullptr, freq[i]);
+    report_end(R);
   }
+  report_end(R);
+  return R->error ? LMPROF_REPORT_FAILURE : LUA_OK;
+}
 
-  return LMPROF_REPORT_FAILURE;
+static int graph_report(lua_State *L, lmprof_Report *R) {
+  lmprof_State *st = R->st;
+
+  report_begin(R, l_nullptr, lObject);
+  report_begin(R, "header", lObject);
+  profiler_header(R);
+  if (R->type == lTable && BITFIELD_TEST(st->conf, LMPROF_OPT_REPORT_VERBOSE) && !BITFIELD_TEST(st->mode, LMPROF_CALLBACK_MASK)) {
+    report_begin(R, "debug", lObject); /* [..., header, hash_debug] */
+    lmprof_hash_debug(L, st->i.hash);
+    if (st->i.idcache != l_nullptr) {
+      report_integer(R, "idcache_hits", st->i.idcache->hits);
+      report_integer(R, "idcache_misses", st->i.idcache->misses);
+    }
+    report_integer(R, "edge_hits", st->i.edge_hits);
+    report_integer(R, "edge_misses", st->i.edge_misses);
+    report_end(R);
+  }
+  report_end(R);
+
+  /* Profile Records */
+  report_begin(R, "records", lRecords);
+  lmprof_hash_report(L, st->i.hash, (lmprof_hash_Callback)graph_hash_callback, l_pcast(const void *, R));
+  report_end(R);
+  report_end(R);
+  return R->error ? LMPROF_REPORT_FAILURE : LUA_OK;
 }
 
 /* }================================================================== */
@@ -492,933 +830,2415 @@ static int graph_report(lua_State *L, lmprof_Report *report) {
 #define CHROME_OPT_NAME(n, o) (((n) == l_nullptr) ? (o) : (n))
 #define CHROME_EVENT_NAME(E) CHROME_OPT_NAME((E)->data.event.info->source, LMPROF_RECORD_NAME_UNKNOWN)
 
-#define JSON_OPEN_OBJ "{"
-#define JSON_CLOSE_OBJ "}"
-#define JSON_OPEN_ARRAY "["
-#define JSON_CLOSE_ARRAY "]"
-#define JSON_DELIM ", "
-#define JSON_NEWLINE "\n"
-#define JSON_STRING(S) "\"" S "\""
-#define JSON_ASSIGN(K, V) "\"" K "\":" V
-
-/* Some sugar for simplifying array incrementing for table reporting */
-#define REPORT_TABLE_APPEND(L, R, X)                            \
-  LUA_MLM_BEGIN                                                 \
-  X; /* @TODO: Sanitize result */                               \
-  if ((R)->type == lTable)                                      \
-    lua_rawseti((L), (R)->t.table_index, (R)->t.array_count++); \
-  LUA_MLM_END
-
-#define REPORT_ENSURE_FILE_DELIM(R)                                    \
-  LUA_MLM_BEGIN                                                        \
-  if ((R)->f.delim) {                                                  \
-    fprintf((R)->f.file, JSON_DELIM JSON_NEWLINE "%s", (R)->f.indent); \
-    (R)->f.delim = 0;                                                  \
-  }                                                                    \
-  LUA_MLM_END
-
-#define REPORT_ENSURE_BUFFER_DELIM(R)                     \
-  LUA_MLM_BEGIN                                           \
-  if ((R)->b.delim) {                                     \
-    luaL_addliteral(&R->b.buff, JSON_DELIM JSON_NEWLINE); \
-    luaL_addstring(&R->b.buff, (R)->b.indent);            \
-    (R)->b.delim = 0;                                     \
-  }                                                       \
-  LUA_MLM_END
+/* Interned process/thread identifiers of a TraceEvent */
+#define EVENT_PROC(R, E) timeline_process(l_pcast(const TraceEventTimeline *, (R)->st->i.trace.arg), (E))
 
 /* MetaEvents */
-static int __metaProcess(lua_State *L, lmprof_Report *R, const lmprof_EventProcess *process, const char *name, const char *pname);
-static int __metaTracingStarted(lua_State *L, lmprof_Report *R, const lmprof_EventProcess *process, const char *name, const char *url);
+static void __metaProcess(lmprof_Report *R, const lmprof_EventProcess *process, const char *name, const char *pname);
+static void __metaTracingStarted(lmprof_Report *R, const lmprof_EventProcess *process, const char *name, const char *url);
 
 /* chrome://tracing/ metadata reporting/ */
-static int __metaAbout(lua_State *L, lmprof_Report *R, const char *name, const char *url);
+static void __metaAbout(lmprof_Report *R, const char *name, const char *url);
 
 /* BEGIN_FRAME */
-static int __enterFrame(lua_State *L, lmprof_Report *R, const TraceEvent *event);
+static void __enterFrame(lmprof_Report *R, const TraceEvent *event);
 
 /* END_FRAME */
-static int __exitFrame(lua_State *L, lmprof_Report *R, const TraceEvent *event);
-static int __drawFrame(lua_State *L, lmprof_Report *R, const TraceEvent *event);
+static void __exitFrame(lmprof_Report *R, const TraceEvent *event);
+static void __drawFrame(lmprof_Report *R, const TraceEvent *event);
 
 /* BEGIN_ROUTINE/END_ROUTINE ENTER_SCOPE/EXIT_SCOPE */
-static int __eventScope(lua_State *L, lmprof_Report *R, const TraceEvent *event, const char *name, const char *eventName);
-static int __eventUpdateCounters(lua_State *L, lmprof_Report *R, const TraceEvent *event);
-static int __eventLineInstance(lua_State *L, lmprof_Report *R, const TraceEvent *event);
-static int __eventSampleInstance(lua_State *L, lmprof_Report *R, const TraceEvent *event);
+static void __eventScope(lmprof_Report *R, const TraceEvent *event, const char *name, const char *eventName);
+static void __eventUpdateCounters(lmprof_Report *R, const TraceEvent *event, lu_sizediff heap);
+static void __eventLineInstance(lmprof_Report *R, const TraceEvent *event);
+static void __eventSampleInstance(lmprof_Report *R, const TraceEvent *event);
+
+/* lmprof_thread_name for the thread identifier/name pairs of lmprof_Report.names */
+static const char *__reportThreadName(lua_State *L, lmprof_Report *R, lua_Integer thread_id, const char *opt) {
+  int i;
+  const char *name = opt;
+  for (i = 1;; i += 2) {
+    lua_rawgeti(L, R->names, i); /* [..., tid] */
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      break;
+    }
+    else if (lua_tointeger(L, -1) == thread_id) {
+      lua_rawgeti(L, R->names, i + 1); /* [..., tid, name] */
+      name = luaL_optstring(L, -1, opt);
+      lua_pop(L, 2);
+      break;
+    }
+    lua_pop(L, 1);
+  }
+  return name;
+}
 
-static const char *__threadName(lua_State *L, lmprof_Report *R, TraceEvent *event) {
+static const char *__threadName(lua_State *L, lmprof_Report *R, const lmprof_EventProcess *process) {
   const char *opt = CHROME_META_TICK;
-  if (event->call.proc.tid == R->st->thread.mainproc.tid)
+  if (process->tid == R->st->thread.mainproc.tid)
     opt = CHROME_NAME_MAIN;
 
-  return lmprof_thread_name(L, event->call.proc.tid, opt);
+  /* Formatted without a lua_State, e.g., on the stream writer thread */
+  if (L == l_nullptr)
+    return opt;
+  else if (R->lookup)
+    return __reportThreadName(L, R, process->tid, opt);
+  return lmprof_thread_name(L, process->tid, opt);
 }
 
-static int __metaProcess(lua_State *L, lmprof_Report *R, const lmprof_EventProcess *process, const char *name, const char *pname) {
-  if (R->type == lTable) {
-    lua_newtable(L); /* [..., header] */
-    luaL_settabss(L, "cat", "__metadata");
-    luaL_settabss(L, "name", name);
-    luaL_settabss(L, "ph", "M");
-    luaL_settabsi(L, "ts", 0);
-    luaL_settabsi(L, "pid", process->pid);
-    luaL_settabsi(L, "tid", process->tid);
-
-    lua_newtable(L); /* [..., header, args] */
-    luaL_settabss(L, "name", pname);
-    lua_setfield(L, -2, "args"); /* [..., header] */
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("cat", JSON_STRING("__metadata")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("%s")), name);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("M")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ts", "0"));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("pid", LUA_INTEGER_FMT), process->pid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), process->tid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("args", ""));
-    fprintf(f, JSON_OPEN_OBJ JSON_ASSIGN("name", JSON_STRING("%s")) JSON_CLOSE_OBJ, pname);
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
-#else
-    return LMPROF_REPORT_DISABLED_IO;
-#endif
+static void __metaProcess(lmprof_Report *R, const lmprof_EventProcess *process, const char *name, const char *pname) {
+  report_begin(R, l_nullptr, lObject);
+  report_string(R, "cat", "__metadata");
+  report_string(R, "name", name);
+  report_string(R, "ph", "M");
+  report_integer(R, "ts", 0);
+  report_integer(R, "pid", process->pid);
+  report_integer(R, "tid", process->tid);
+
+  report_begin(R, "args", lObject);
+  report_string(R, "name", pname);
+  report_end(R);
+  report_end(R);
+}
+
+static void __metaAbout(lmprof_Report *R, const char *name, const char *url) {
+  if (REPORT_JSON(R)) { /* Written verbatim to preserve the output of previous versions */
+    json_key(R, "metadata");
+    text_literal(R, JSON_OPEN_OBJ JSON_NEWLINE "\"bitness\":64" JSON_DELIM JSON_NEWLINE
+                    "\"domain\":\"WIN_QPC\"" JSON_DELIM JSON_NEWLINE
+                    "\"command_line\":\"\"" JSON_DELIM JSON_NEWLINE
+                    "\"highres-ticks\":1" JSON_DELIM JSON_NEWLINE
+                    "\"physical-memory\":0" JSON_DELIM JSON_NEWLINE
+                    "\"user-agent\":\"");
+    text_string(R, name);
+    text_literal(R, "\"" JSON_DELIM JSON_NEWLINE "\"command_line\":\"");
+    text_string(R, url);
+    text_literal(R, "\"" JSON_DELIM JSON_NEWLINE "\"v8-version\":\"" LUA_VERSION "\"" JSON_NEWLINE JSON_CLOSE_OBJ);
+    return;
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
 
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addliteral(b, JSON_ASSIGN("cat", JSON_STRING("__metadata")));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("%s")), name);
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("M")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ts", "0"));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("pid", LUA_INT_FORMAT), LUA_INT_CAST(process->pid));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), LUA_INT_CAST(process->tid));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("args", ""));
-    luaL_addfstring(L, b, JSON_OPEN_OBJ JSON_ASSIGN("name", JSON_STRING("%s")) JSON_CLOSE_OBJ, pname);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
+  report_begin(R, "metadata", lObject);
+  report_integer(R, "bitness", 64);
+  report_string(R, "domain", "WIN_QPC");
+  report_string(R, "command_line", "");
+  report_integer(R, "highres-ticks", 1);
+  report_integer(R, "physical-memory", 0);
+  report_string(R, "user-agent", name);
+  report_string(R, "command_line", url);
+  report_string(R, "v8-version", LUA_VERSION);
+  report_end(R);
+}
+
+static void __metaTracingStarted(lmprof_Report *R, const lmprof_EventProcess *process, const char *name, const char *url) {
+  report_begin(R, l_nullptr, lObject);
+  report_string(R, "cat", CHROME_TIMLINE);
+  report_string(R, "name", "TracingStartedInBrowser");
+  report_string(R, "ph", "I");
+  report_integer(R, "pid", process->pid);
+  report_integer(R, "tid", process->tid);
+  report_integer(R, "ts", 0);
+
+  report_begin(R, "args", lObject);
+  report_begin(R, "data", lObject);
+  report_integer(R, "frameTreeNodeId", 1);
+  report_boolean(R, "persistentIds", 1);
+
+  report_begin(R, "frames", lArray);
+  report_begin(R, l_nullptr, lObject);
+  report_string(R, "frame", "FADE");
+  report_string(R, "url", CHROME_OPT_NAME(url, TRACE_EVENT_DEFAULT_URL));
+  report_string(R, "name", CHROME_OPT_NAME(name, TRACE_EVENT_DEFAULT_NAME));
+  report_integer(R, "processId", process->pid);
+  report_end(R);
+  report_end(R); /* frames */
+  report_end(R); /* data */
+  report_end(R); /* args */
+  report_end(R);
+}
+
+/* Instant events of the timeline frame category */
+static void __frameEvent(lmprof_Report *R, const TraceEvent *event, const char *name) {
+  report_begin(R, l_nullptr, lObject);
+  report_string(R, "cat", CHROME_TIMELINE_FRAME);
+  report_string(R, "name", name);
+  report_string(R, "s", "t");
+  report_string(R, "ph", "I");
+  report_integer(R, "ts", LMPROF_TIME_ADJ(event->time, R->st->conf));
+  report_integer(R, "pid", EVENT_PROC(R, event)->pid);
+  report_integer(R, "tid", EVENT_PROC(R, event)->tid);
+}
+
+/*
+** Arguments of the BeginFrame/DrawFrame events. The JSON encoding is written
+** verbatim to preserve the (padded) output of previous versions.
+*/
+static void __frameArgs(lmprof_Report *R) {
+  if (REPORT_JSON(R)) {
+    json_key(R, "args");
+    text_literal(R, JSON_OPEN_OBJ "\"layerTreeId\":null " JSON_CLOSE_OBJ);
+  }
+  else {
+    report_begin(R, "args", lObject);
+    report_null(R, "layerTreeId");
+    report_end(R);
   }
+}
 
-  return LMPROF_REPORT_UNKNOWN_TYPE;
+static void __enterFrame(lmprof_Report *R, const TraceEvent *event) {
+  __frameEvent(R, event, "BeginFrame");
+  __frameArgs(R);
+  report_end(R);
 }
 
-static int __metaAbout(lua_State *L, lmprof_Report *R, const char *name, const char *url) {
-  if (R->type == lTable) {
-    lua_newtable(L);
-    luaL_settabsi(L, "bitness", 64);
-    luaL_settabss(L, "domain", "WIN_QPC");
-    luaL_settabss(L, "command_line", "");
-    luaL_settabsi(L, "highres-ticks", 1);
-    luaL_settabsi(L, "physical-memory", 0);
-    luaL_settabss(L, "user-agent", name);
-    luaL_settabss(L, "command_line", url);
-    luaL_settabss(L, "v8-version", LUA_VERSION);
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_ASSIGN("metadata", JSON_OPEN_OBJ JSON_NEWLINE));
-    fprintf(f, JSON_ASSIGN("bitness", "64") JSON_DELIM JSON_NEWLINE);
-    fprintf(f, JSON_ASSIGN("domain", JSON_STRING("WIN_QPC")) JSON_DELIM JSON_NEWLINE);
-    fprintf(f, JSON_ASSIGN("command_line", JSON_STRING("")) JSON_DELIM JSON_NEWLINE);
-    fprintf(f, JSON_ASSIGN("highres-ticks", "1") JSON_DELIM JSON_NEWLINE);
-    fprintf(f, JSON_ASSIGN("physical-memory", "0") JSON_DELIM JSON_NEWLINE);
-    fprintf(f, JSON_ASSIGN("user-agent", JSON_STRING("%s")) JSON_DELIM JSON_NEWLINE, name);
-    fprintf(f, JSON_ASSIGN("command_line", JSON_STRING("%s")) JSON_DELIM JSON_NEWLINE, url);
-    fprintf(f, JSON_ASSIGN("v8-version", JSON_STRING(LUA_VERSION)) JSON_NEWLINE);
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
-#else
-    return LMPROF_REPORT_DISABLED_IO;
-#endif
+static void __exitFrame(lmprof_Report *R, const TraceEvent *event) {
+  __frameEvent(R, event, "ActivateLayerTree");
+  report_begin(R, "args", lObject);
+  report_integer(R, "frameId", event->data.frame.frame);
+  report_null(R, "layerTreeId");
+  report_end(R);
+  report_end(R);
+}
+
+/* Per TimelineFrameModel.ts: "Legacy behavior: If DrawFrame is an instant event..." */
+static void __drawFrame(lmprof_Report *R, const TraceEvent *event) {
+  __frameEvent(R, event, "DrawFrame");
+  __frameArgs(R);
+  report_end(R);
+}
+
+static void __eventScope(lmprof_Report *R, const TraceEvent *event, const char *name, const char *eventName) {
+  report_begin(R, l_nullptr, lObject);
+  report_string(R, "cat", CHROME_USER_TIMING);
+  report_string(R, "name", eventName);
+  report_string(R, "ph", name);
+  report_integer(R, "pid", EVENT_PROC(R, event)->pid);
+  if (op_routine(event->op))
+    report_integer(R, "tid", R->st->thread.mainproc.tid);
+  else
+    report_integer(R, "tid", EVENT_PROC(R, event)->tid);
+  report_integer(R, "ts", LMPROF_TIME_ADJ(event->time, R->st->conf));
+  report_end(R);
+}
+
+static void __eventLineInstance(lmprof_Report *R, const TraceEvent *event) {
+  report_begin(R, l_nullptr, lObject);
+  report_string(R, "cat", CHROME_USER_TIMING);
+  report_fstring(R, "name", "%s: Line %d", event->data.line.info->source, event->line);
+  report_string(R, "ph", "I");
+  report_string(R, "s", "t");
+  report_integer(R, "ts", LMPROF_TIME_ADJ(event->time, R->st->conf));
+  report_integer(R, "pid", EVENT_PROC(R, event)->pid);
+  report_integer(R, "tid", EVENT_PROC(R, event)->tid);
+  report_end(R);
+}
+
+static void __eventSampleInstance(lmprof_Report *R, const TraceEvent *event) {
+  const lu_time duration = event->data.sample.next->time - event->time;
+  report_begin(R, l_nullptr, lObject);
+  report_string(R, "cat", CHROME_TIMLINE);
+  report_string(R, "name", "EvaluateScript");
+  report_string(R, "ph", "X");
+  report_integer(R, "pid", R->st->thread.mainproc.pid);
+  report_integer(R, "tid", LMPROF_THREAD_SAMPLE_TIMELINE);
+  report_integer(R, "ts", LMPROF_TIME_ADJ(event->time, R->st->conf));
+  report_integer(R, "dur", LMPROF_TIME_ADJ(duration, R->st->conf));
+  report_end(R);
+}
+
+static void __eventUpdateCounters(lmprof_Report *R, const TraceEvent *event, lu_sizediff heap) {
+  report_begin(R, l_nullptr, lObject);
+  report_string(R, "cat", CHROME_TIMLINE);
+  report_string(R, "name", "UpdateCounters");
+  report_string(R, "ph", "I");
+  report_string(R, "s", "g");
+  report_integer(R, "pid", EVENT_PROC(R, event)->pid);
+  report_integer(R, "tid", EVENT_PROC(R, event)->tid);
+  report_integer(R, "ts", LMPROF_TIME_ADJ(event->time, R->st->conf));
+
+  report_begin(R, "args", lObject);
+  report_begin(R, "data", lObject);
+  report_integer(R, "jsHeapSizeUsed", heap);
+  /*
+    report_integer(R, "documents", 0);
+    report_integer(R, "jsEventListeners", 0);
+    report_integer(R, "nodes", 0);
+  */
+  report_end(R); /* data */
+  report_end(R); /* args */
+  report_end(R);
+}
+
+/*
+** Append the chromium required CrBrowserMain/CrRendererMain metaevents to
+** correctly format the profiled events.
+*/
+static void tracevent_table_header(lua_State *L, lmprof_Report *R, const TraceEventTimeline *list) {
+  lmprof_EventProcess browser = { R->st->thread.mainproc.pid, LMPROF_THREAD_BROWSER };
+  lmprof_EventProcess renderer = { R->st->thread.mainproc.pid, R->st->thread.mainproc.tid };
+  lmprof_EventProcess sampler = { R->st->thread.mainproc.pid, LMPROF_THREAD_SAMPLE_TIMELINE };
+  UNUSED(list);
+
+  /* Default process information */
+  __metaProcess(R, &browser, CHROME_META_PROCESS, CHROME_NAME_BROWSER);
+  __metaProcess(R, &browser, CHROME_META_THREAD, CHROME_NAME_CR_BROWSER);
+  __metaProcess(R, &renderer, CHROME_META_THREAD, CHROME_NAME_CR_RENDERER);
+  __metaProcess(R, &sampler, CHROME_META_THREAD, CHROME_NAME_SAMPLER);
+  if (!BITFIELD_TEST(R->st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING)) {
+    __metaTracingStarted(R, &browser, R->st->i.name, R->st->i.url);
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
 
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_ASSIGN("metadata", JSON_OPEN_OBJ JSON_NEWLINE));
-    luaL_addliteral(b, JSON_ASSIGN("bitness", "64") JSON_DELIM JSON_NEWLINE);
-    luaL_addliteral(b, JSON_ASSIGN("domain", JSON_STRING("WIN_QPC")) JSON_DELIM JSON_NEWLINE);
-    luaL_addliteral(b, JSON_ASSIGN("command_line", JSON_STRING("")) JSON_DELIM JSON_NEWLINE);
-    luaL_addliteral(b, JSON_ASSIGN("highres-ticks", "1") JSON_DELIM JSON_NEWLINE);
-    luaL_addliteral(b, JSON_ASSIGN("physical-memory", "0") JSON_DELIM JSON_NEWLINE);
-    luaL_addfstring(L, b, JSON_ASSIGN("user-agent", JSON_STRING("%s")) JSON_DELIM JSON_NEWLINE, name);
-    luaL_addfstring(L, b, JSON_ASSIGN("command_line", JSON_STRING("%s")) JSON_DELIM JSON_NEWLINE, url);
-    luaL_addliteral(b, JSON_ASSIGN("v8-version", JSON_STRING(LUA_VERSION)) JSON_NEWLINE);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
+  /* Named threads */
+  if (BITFIELD_TEST(R->st->conf, LMPROF_OPT_TRACE_LAYOUT_SPLIT) && R->names != 0) {
+    int i;
+    luaL_checkstack(L, 3, __FUNCTION__);
+    for (i = 1;; i += 2) {
+      const char *name = l_nullptr;
+      lmprof_EventProcess thread;
+
+      lua_rawgeti(L, R->names, i); /* [..., tid] */
+      lua_rawgeti(L, R->names, i + 1); /* [..., tid, name] */
+      if (lua_isnil(L, -2)) {
+        lua_pop(L, 2);
+        break;
+      }
+
+      name = lua_tostring(L, -1); /* Referenced by the names array */
+      thread.pid = LMPROF_PROCESS_MAIN;
+      thread.tid = lua_tointeger(L, -2);
+      lua_pop(L, 2);
+
+      __metaProcess(R, &thread, CHROME_META_THREAD, name);
+    }
   }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
 }
 
-static int __metaTracingStarted(lua_State *L, lmprof_Report *R, const lmprof_EventProcess *process, const char *name, const char *url) {
-  if (R->type == lTable) {
-    lua_newtable(L); /* [..., header] */
-    luaL_settabss(L, "cat", CHROME_TIMLINE);
-    luaL_settabss(L, "name", "TracingStartedInBrowser");
-    luaL_settabss(L, "ph", "I");
-    luaL_settabsi(L, "pid", process->pid);
-    luaL_settabsi(L, "tid", process->tid);
-    luaL_settabsi(L, "ts", 0);
-
-    lua_newtable(L); /* [..., header, args] */
-    lua_newtable(L); /* [..., header, args, data] */
-    luaL_settabsi(L, "frameTreeNodeId", 1);
-    luaL_settabsb(L, "persistentIds", 1);
-
-    lua_newtable(L); /* [..., header, args, data, frames] */
-    lua_newtable(L); /* [..., header, args, data, frames, frames_array] */
-    luaL_settabss(L, "frame", "FADE");
-    luaL_settabss(L, "url", CHROME_OPT_NAME(url, TRACE_EVENT_DEFAULT_URL));
-    luaL_settabss(L, "name", CHROME_OPT_NAME(name, TRACE_EVENT_DEFAULT_NAME));
-    luaL_settabsi(L, "processId", process->pid);
-    lua_rawseti(L, -2, 1); /* [..., header, args, data, frames] */
-    lua_setfield(L, -2, "frames"); /* [..., header, args, data] */
-    lua_setfield(L, -2, "data"); /* [..., header, args] */
-    lua_setfield(L, -2, "args"); /* [..., header] */
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMLINE)));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("TracingStartedInBrowser")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("pid", LUA_INTEGER_FMT), process->pid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), process->tid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ts", "0"));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("args", JSON_OPEN_OBJ));
-    fprintf(f, JSON_ASSIGN("data", JSON_OPEN_OBJ));
-    fprintf(f, JSON_ASSIGN("frameTreeNodeId", "1"));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("persistentIds", "true"));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("frames", JSON_OPEN_ARRAY JSON_OPEN_OBJ));
-    fprintf(f, JSON_ASSIGN("frame", JSON_STRING("FADE")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("url", JSON_STRING("%s")), CHROME_OPT_NAME(url, TRACE_EVENT_DEFAULT_URL));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("%s")), CHROME_OPT_NAME(name, TRACE_EVENT_DEFAULT_NAME));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("processId", LUA_INTEGER_FMT), process->pid);
-    fprintf(f, JSON_CLOSE_OBJ JSON_CLOSE_ARRAY);
-    fprintf(f, JSON_CLOSE_OBJ);
-    fprintf(f, JSON_CLOSE_OBJ);
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
-#endif
+/* Iteration state shared while formatting trace events. */
+typedef struct TraceEventFormat {
+  TraceEvent *samples; /* Linked-list of SAMPLE_EVENT events*/
+  TraceEventPage *synthetic; /* Iterator of the events generated by timeline_expand */
+  size_t synthetic_index;
+  size_t counter;
+  size_t counterFrequency;
+  const char **threads; /* Name of each interned thread identifier, resolved prior to formatting; may be NULL */
+} TraceEventFormat;
+
+static void traceevent_format_init(const lmprof_State *st, TraceEventFormat *F) {
+  F->samples = l_nullptr;
+  F->synthetic = l_nullptr;
+  F->synthetic_index = 0;
+  F->counter = 0;
+  F->counterFrequency = TRACE_EVENT_COUNTER_FREQ;
+  F->threads = l_nullptr;
+  if (st->i.counterFrequency > 0)
+    F->counterFrequency = l_cast(size_t, st->i.counterFrequency);
+}
+
+/* The operation an event is formatted as: scopes of "ignored" functions are skipped */
+static LUA_INLINE TraceEventType traceevent_format_op(const TraceEvent *event) {
+  const TraceEventType op = l_cast(TraceEventType, event->op);
+  if (op == ENTER_SCOPE || op == EXIT_SCOPE) {
+    if (BITFIELD_TEST(event->data.event.info->event, LMPROF_RECORD_IGNORED | LMPROF_RECORD_ROOT))
+      return IGNORE_SCOPE; /* Function "ignored" during profiling */
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addliteral(b, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMLINE)));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("TracingStartedInBrowser")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("pid", LUA_INT_FORMAT), LUA_INT_CAST(process->pid));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), LUA_INT_CAST(process->tid));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ts", "0"));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("args", JSON_OPEN_OBJ));
-    luaL_addliteral(b, JSON_ASSIGN("data", JSON_OPEN_OBJ));
-    luaL_addliteral(b, JSON_ASSIGN("frameTreeNodeId", "1"));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("persistentIds", "true"));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("frames", JSON_OPEN_ARRAY JSON_OPEN_OBJ));
-    luaL_addliteral(b, JSON_ASSIGN("frame", JSON_STRING("FADE")));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("url", JSON_STRING("%s")), CHROME_OPT_NAME(url, TRACE_EVENT_DEFAULT_URL));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("%s")), CHROME_OPT_NAME(name, TRACE_EVENT_DEFAULT_NAME));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("processId", LUA_INT_FORMAT), LUA_INT_CAST(process->pid));
-    luaL_addliteral(b, JSON_CLOSE_OBJ JSON_CLOSE_ARRAY);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
-  }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
-}
-
-static int __enterFrame(lua_State *L, lmprof_Report *R, const TraceEvent *event) {
-  if (R->type == lTable) {
-    lua_newtable(L);
-    luaL_settabss(L, "cat", CHROME_TIMELINE_FRAME);
-    luaL_settabss(L, "name", "BeginFrame");
-    luaL_settabss(L, "s", "t");
-    luaL_settabss(L, "ph", "I");
-    luaL_settabsi(L, "ts", l_cast(lua_Integer, LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)));
-    luaL_settabsi(L, "pid", event->call.proc.pid);
-    luaL_settabsi(L, "tid", event->call.proc.tid);
-    /* layerTreeId = NULL */
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMELINE_FRAME)));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("BeginFrame")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("t")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ts", "%" PRIluTIME ""), LMPROF_TIME_ADJ(event->call.s.time, R->st->conf));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("pid", LUA_INTEGER_FMT), event->call.proc.pid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), event->call.proc.tid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("args", ""));
-    fprintf(f, JSON_OPEN_OBJ JSON_ASSIGN("layerTreeId", "null") " }");
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
-#endif
+  return op;
+}
+
+/* Return true if an UpdateCounters event follows the current ENTER_SCOPE/EXIT_SCOPE event. */
+static LUA_INLINE int traceevent_format_counter(const lmprof_State *st, TraceEventFormat *F) {
+  if (BITFIELD_TEST(st->mode, LMPROF_MODE_MEMORY) && (F->counterFrequency == 1 || ((++F->counter) % F->counterFrequency) == 0)) {
+    F->counter = 0;
+    return 1;
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-    char ts_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    if (snprintf(ts_str, sizeof(ts_str), "%" PRIluTIME "", LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addliteral(b, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMELINE_FRAME)));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("BeginFrame")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("t")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("ts", "%s"), ts_str);
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("pid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.pid));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.tid));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("args", ""));
-    luaL_addliteral(b, JSON_OPEN_OBJ JSON_ASSIGN("layerTreeId", "null") " }");
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
-  }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
-}
-
-static int __exitFrame(lua_State *L, lmprof_Report *R, const TraceEvent *event) {
-  if (R->type == lTable) {
-    lua_newtable(L); /* [..., exit_tab] */
-    luaL_settabss(L, "cat", CHROME_TIMELINE_FRAME);
-    luaL_settabss(L, "name", "ActivateLayerTree");
-    luaL_settabss(L, "s", "t");
-    luaL_settabss(L, "ph", "I");
-    luaL_settabsi(L, "ts", l_cast(lua_Integer, LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)));
-    luaL_settabsi(L, "pid", event->call.proc.pid);
-    luaL_settabsi(L, "tid", event->call.proc.tid);
-
-    lua_newtable(L); /* [..., exit_tab, args] */
-    luaL_settabsi(L, "frameId", l_cast(lua_Integer, event->data.frame.frame));
-    lua_setfield(L, -2, "args"); /* [..., exit_tab] */
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMELINE_FRAME)));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("ActivateLayerTree")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("t")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ts", "%" PRIluTIME ""), LMPROF_TIME_ADJ(event->call.s.time, R->st->conf));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("pid", LUA_INTEGER_FMT), event->call.proc.pid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), event->call.proc.tid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("args", ""));
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("frameId", LUA_INTEGER_FMT), l_cast(lua_Integer, event->data.frame.frame));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("layerTreeId", "null"));
-    fprintf(f, JSON_CLOSE_OBJ);
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
-#endif
+  return 0;
+}
+
+/* Next event generated by timeline_expand, and its page; NULL if exhausted. */
+static TraceEvent *traceevent_format_synthetic(TraceEventFormat *F, const TraceEventPage **page) {
+  if (F->synthetic == l_nullptr)
+    return l_nullptr;
+  else if (F->synthetic_index == F->synthetic->count) {
+    F->synthetic = F->synthetic->next;
+    F->synthetic_index = 0;
+    if (F->synthetic == l_nullptr)
+      return l_nullptr;
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-    char ts_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    if (snprintf(ts_str, sizeof(ts_str), "%" PRIluTIME "", LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addliteral(b, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMELINE_FRAME)));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("ActivateLayerTree")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("t")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("ts", "%s"), ts_str);
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("pid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.pid));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.tid));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("args", ""));
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addfstring(L, b, JSON_ASSIGN("frameId", LUA_INT_FORMAT), LUA_INT_CAST(event->data.frame.frame));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("layerTreeId", "null"));
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
-  }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
+
+  *page = F->synthetic;
+  return &F->synthetic->event_array[F->synthetic_index++];
 }
 
-/* Per TimelineFrameModel.ts: "Legacy behavior: If DrawFrame is an instant event..." */
-static int __drawFrame(lua_State *L, lmprof_Report *R, const TraceEvent *event) {
-  if (R->type == lTable) {
-    lua_newtable(L);
-    luaL_settabss(L, "cat", CHROME_TIMELINE_FRAME);
-    luaL_settabss(L, "name", "DrawFrame");
-    luaL_settabss(L, "s", "t");
-    luaL_settabss(L, "ph", "I");
-    luaL_settabsi(L, "ts", l_cast(lua_Integer, LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)));
-    luaL_settabsi(L, "pid", event->call.proc.pid);
-    luaL_settabsi(L, "tid", event->call.proc.tid);
-    /* layerTreeId = NULL */
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMELINE_FRAME)));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("DrawFrame")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("t")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ts", "%" PRIluTIME ""), LMPROF_TIME_ADJ(event->call.s.time, R->st->conf));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("pid", LUA_INTEGER_FMT), event->call.proc.pid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), event->call.proc.tid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("args", ""));
-    fprintf(f, JSON_OPEN_OBJ JSON_ASSIGN("layerTreeId", "null") " " JSON_CLOSE_OBJ);
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
+/* Name of the thread of a BEGIN_ROUTINE/END_ROUTINE event. */
+static const char *traceevent_format_thread(lua_State *L, lmprof_Report *R, const TraceEventFormat *F, const TraceEvent *event) {
+  if (F->threads != l_nullptr)
+    return F->threads[event->thread];
+  return __threadName(L, R, EVENT_PROC(R, event));
+}
+
+/*
+** Format a single trace event, appending it to the array. Returning zero if the
+** event could not be formatted; one otherwise.
+*/
+static int traceevent_table_event(lua_State *L, lmprof_Report *R, TraceEventFormat *F, const TraceEventPage *page, TraceEvent *event) {
+  lmprof_State *st = R->st;
+  switch (traceevent_format_op(event)) {
+    case BEGIN_FRAME: {
+      __enterFrame(R, event);
+      break;
+    }
+    case END_FRAME: {
+      __exitFrame(R, event);
+      __drawFrame(R, event);
+      break;
+    }
+    case BEGIN_ROUTINE: {
+      __eventScope(R, event, CHROME_META_BEGIN, traceevent_format_thread(L, R, F, event));
+      break;
+    }
+    case END_ROUTINE: {
+      __eventScope(R, event, CHROME_META_END, traceevent_format_thread(L, R, F, event));
+      break;
+    }
+    case SWITCH_ROUTINE: { /* Format the synthetic events generated for the switch */
+      size_t i;
+      TraceEvent *synthetic = l_nullptr;
+      const TraceEventPage *synthetic_page = l_nullptr;
+      for (i = 0; i < event->data.routine.count && (synthetic = traceevent_format_synthetic(F, &synthetic_page)) != l_nullptr; ++i) {
+        if (!traceevent_table_event(L, R, F, synthetic_page, synthetic))
+          return 0;
+      }
+      break;
+    }
+    case LINE_SCOPE: {
+      __eventLineInstance(R, event);
+      break;
+    }
+    case SAMPLE_EVENT: {
+      if (F->samples != l_nullptr) {
+        F->samples->data.sample.next = event;
+        __eventSampleInstance(R, F->samples);
+      }
+      F->samples = event;
+      break;
+    }
+    case ENTER_SCOPE: {
+      __eventScope(R, event, CHROME_META_BEGIN, CHROME_EVENT_NAME(event));
+      if (traceevent_format_counter(st, F))
+        __eventUpdateCounters(R, event, traceevent_heap(page, event));
+      break;
+    }
+    case EXIT_SCOPE: {
+      __eventScope(R, event, CHROME_META_END, CHROME_EVENT_NAME(event));
+      if (traceevent_format_counter(st, F))
+        __eventUpdateCounters(R, event, traceevent_heap(page, event));
+      break;
+    }
+    case PROCESS: {
+      __metaProcess(R, EVENT_PROC(R, event), CHROME_META_PROCESS, CHROME_OPT_NAME(event->data.process.name, CHROME_NAME_PROCESS));
+      break;
+    }
+    case THREAD: {
+      __metaProcess(R, EVENT_PROC(R, event), CHROME_META_THREAD, CHROME_OPT_NAME(event->data.process.name, CHROME_NAME_PROCESS));
+      break;
+    }
+    case IGNORE_SCOPE:
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+/* Format each event of a page-list; returning zero on failure. */
+static int traceevent_table_pages(lua_State *L, lmprof_Report *R, TraceEventFormat *F, TraceEventPage *page) {
+  for (; page != l_nullptr; page = page->next) {
+    size_t i;
+    for (i = 0; i < page->count; ++i) {
+      if (!traceevent_table_event(L, R, F, page, &page->event_array[i]))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+#if LMPROF_HAS_THREADS
+/*
+** Advance the iteration state over an event without formatting it, i.e., the
+** state changes of traceevent_table_event. Returning zero if the event could not
+** be formatted; one otherwise.
+*/
+static int traceevent_format_skip(const lmprof_State *st, TraceEventFormat *F, TraceEvent *event) {
+  switch (traceevent_format_op(event)) {
+    case SWITCH_ROUTINE: {
+      size_t i;
+      TraceEvent *synthetic = l_nullptr;
+      const TraceEventPage *synthetic_page = l_nullptr;
+      for (i = 0; i < event->data.routine.count && (synthetic = traceevent_format_synthetic(F, &synthetic_page)) != l_nullptr; ++i) {
+        if (!traceevent_format_skip(st, F, synthetic))
+          return 0;
+      }
+      break;
+    }
+    case SAMPLE_EVENT:
+      F->samples = event; /* The formatter of the next sample links the pair */
+      break;
+    case ENTER_SCOPE:
+    case EXIT_SCOPE:
+      traceevent_format_counter(st, F);
+      break;
+    case BEGIN_FRAME:
+    case END_FRAME:
+    case BEGIN_ROUTINE:
+    case END_ROUTINE:
+    case LINE_SCOPE:
+    case PROCESS:
+    case THREAD:
+    case IGNORE_SCOPE:
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+/*
+** Parallel formatting (see 'report_threads'): once adjusted, the pages of a
+** timeline only share the TraceEventFormat iteration state. The pages are split
+** into chunks of LMPROF_REPORT_CHUNK pages, the iteration state at the start of
+** each chunk is computed by a serial pass (traceevent_format_skip), and a pool
+** of threads formats each chunk into blocks of memory that are written, in
+** order, by the reporting thread.
+**
+** As with the stream writer, all (de)allocation, Lua API calls, and writes to
+** the report sink remain on the reporting thread: thread names are resolved
+** beforehand and workers request blocks, which are recycled once written.
+*/
+
+/* Formatted output of a chunk */
+typedef struct ReportBlock {
+  struct ReportBlock *next;
+  size_t length;
+  char data[LMPROF_IO_BUFFER];
+} ReportBlock;
+
+typedef struct ReportChunk {
+  size_t page; /* Index of the first page of the chunk */
+  size_t count; /* Number of pages */
+  TraceEventFormat F; /* Iteration state at the start of the chunk */
+  ReportBlock *head;
+  ReportBlock *tail;
+  int done; /* Formatted; its blocks are owned by the reporting thread */
+} ReportChunk;
+
+typedef struct ReportPool {
+  lmprof_Report *R; /* Report being formatted */
+  TraceEventPage **pages; /* Prologue and timeline pages, in order */
+  ReportChunk *chunks;
+  size_t count; /* Number of chunks */
+  size_t claimed; /* Number of chunks claimed by a worker */
+  size_t written; /* Number of chunks written to the report */
+  size_t window; /* Maximum number of chunks claimed ahead of 'written' */
+
+  pthread_mutex_t lock;
+  pthread_cond_t formatted; /* Chunk formatted or a block requested */
+  pthread_cond_t released; /* Chunk written or blocks made available */
+  ReportBlock *free; /* Blocks available to the workers */
+  size_t starved; /* Number of workers waiting on a block */
+  int abort;
+} ReportPool;
+
+typedef struct ReportWorker {
+  ReportPool *P;
+  ReportChunk *chunk; /* Chunk being formatted */
+  pthread_t thread;
+  lmprof_Report report; /* Staging of the worker; shares the open objects/arrays of P->R */
+} ReportWorker;
+
+/* Pop an available block, waiting for the reporting thread to provide one. NULL if aborted. */
+static ReportBlock *pool_acquire(ReportPool *P) {
+  ReportBlock *block = l_nullptr;
+  pthread_mutex_lock(&P->lock);
+  while ((block = P->free) == l_nullptr && !P->abort) {
+    P->starved++;
+    pthread_cond_signal(&P->formatted);
+    pthread_cond_wait(&P->released, &P->lock);
+    P->starved--;
+  }
+
+  if (block != l_nullptr)
+    P->free = block->next;
+  pthread_mutex_unlock(&P->lock);
+  return block;
+}
+
+/* lmprof_ReportWrite: append to the blocks of the chunk being formatted */
+static int pool_write(void *ud, const char *data, size_t size) {
+  ReportWorker *W = l_pcast(ReportWorker *, ud);
+  ReportChunk *chunk = W->chunk;
+  while (size > 0) {
+    size_t length = 0;
+    ReportBlock *block = chunk->tail;
+    if (block == l_nullptr || block->length == sizeof(block->data)) {
+      if ((block = pool_acquire(W->P)) == l_nullptr)
+        return 0;
+
+      block->next = l_nullptr;
+      block->length = 0;
+      if (chunk->tail == l_nullptr)
+        chunk->head = block;
+      else
+        chunk->tail->next = block;
+      chunk->tail = block;
+    }
+
+    length = sizeof(block->data) - block->length;
+    length = (size < length) ? size : length;
+    memcpy(block->data + block->length, data, length);
+    block->length += length;
+    data += length;
+    size -= length;
+  }
+  return 1;
+}
+
+static void *pool_main(void *args) {
+  ReportWorker *W = l_pcast(ReportWorker *, args);
+  ReportPool *P = W->P;
+
+  pthread_mutex_lock(&P->lock);
+  for (;;) {
+    size_t i, j;
+    ReportChunk *chunk = l_nullptr;
+    while (!P->abort && P->claimed < P->count && P->claimed >= P->written + P->window)
+      pthread_cond_wait(&P->released, &P->lock);
+
+    if (P->abort || P->claimed == P->count)
+      break;
+    chunk = W->chunk = &P->chunks[P->claimed++];
+    pthread_mutex_unlock(&P->lock);
+
+    for (i = chunk->page; i < chunk->page + chunk->count; ++i) {
+      TraceEventPage *page = P->pages[i];
+      for (j = 0; j < page->count; ++j)
+        traceevent_table_event(l_nullptr, &W->report, &chunk->F, page, &page->event_array[j]);
+    }
+    text_flush(&W->report);
+
+    pthread_mutex_lock(&P->lock);
+    chunk->done = 1;
+    pthread_cond_signal(&P->formatted);
+  }
+  pthread_mutex_unlock(&P->lock);
+  return l_nullptr;
+}
+
+static void pool_free_blocks(lmprof_Alloc *alloc, ReportBlock *block) {
+  while (block != l_nullptr) {
+    ReportBlock *next = block->next;
+    lmprof_free(alloc, l_pcast(void *, block), sizeof(ReportBlock));
+    block = next;
+  }
+}
+
+/* Write the formatted chunks, in order, servicing block requests of starved workers. */
+static void pool_drain(ReportPool *P, lmprof_Alloc *alloc) {
+  lmprof_Report *R = P->R;
+
+  pthread_mutex_lock(&P->lock);
+  while (P->written < P->count && !P->abort) {
+    ReportChunk *chunk = &P->chunks[P->written];
+    if (chunk->done) {
+      const ReportBlock *block = l_nullptr;
+      pthread_mutex_unlock(&P->lock);
+      for (block = chunk->head; block != l_nullptr; block = block->next)
+        text_write(R, block->data, block->length);
+
+      pthread_mutex_lock(&P->lock);
+      if (chunk->tail != l_nullptr) {
+        chunk->tail->next = P->free;
+        P->free = chunk->head;
+        chunk->head = chunk->tail = l_nullptr;
+      }
+
+      P->written++;
+      P->abort = R->error;
+      pthread_cond_broadcast(&P->released);
+    }
+    else if (P->starved > 0 && P->free == l_nullptr) {
+      ReportBlock *block = l_nullptr;
+      pthread_mutex_unlock(&P->lock);
+      block = l_pcast(ReportBlock *, lmprof_malloc(alloc, sizeof(ReportBlock)));
+
+      pthread_mutex_lock(&P->lock);
+      if (block == l_nullptr)
+        P->abort = R->error = 1;
+      else {
+        block->next = P->free;
+        P->free = block;
+      }
+      pthread_cond_broadcast(&P->released);
+    }
+    else {
+      pthread_cond_wait(&P->formatted, &P->lock);
+    }
+  }
+
+  P->abort = 1; /* Release workers waiting on the window */
+  pthread_cond_broadcast(&P->released);
+  pthread_mutex_unlock(&P->lock);
+}
+
+/*
+** Format all chunks on a pool of (at most) 'count' threads. Returning zero if no
+** thread could be created.
+*/
+static int pool_run(ReportPool *P, lmprof_Alloc *alloc, size_t count) {
+  size_t i, j;
+  ReportWorker *workers = l_nullptr;
+  if ((workers = l_pcast(ReportWorker *, lmprof_malloc(alloc, count * sizeof(ReportWorker)))) == l_nullptr)
+    return 0;
+
+  P->claimed = P->written = 0;
+  P->window = 2 * count;
+  P->free = l_nullptr;
+  P->starved = 0;
+  P->abort = 0;
+  pthread_mutex_init(&P->lock, l_nullptr);
+  pthread_cond_init(&P->formatted, l_nullptr);
+  pthread_cond_init(&P->released, l_nullptr);
+  for (i = 0; i < count; ++i) {
+    ReportWorker *W = &workers[i];
+    W->P = P;
+    W->chunk = l_nullptr;
+    W->report = *P->R;
+    W->report.L = l_nullptr;
+    W->report.write = pool_write;
+    W->report.ud = l_pcast(void *, W);
+    W->report.error = 0;
+    W->report.length = 0;
+    if (pthread_create(&W->thread, l_nullptr, pool_main, l_pcast(void *, W)) != 0)
+      break;
+  }
+
+  if (i > 0) {
+    pool_drain(P, alloc);
+    for (j = 0; j < i; ++j) {
+      pthread_join(workers[j].thread, l_nullptr);
+      P->R->error |= workers[j].report.error;
+    }
+    P->R->error |= (P->written < P->count);
+  }
+
+  pthread_cond_destroy(&P->released);
+  pthread_cond_destroy(&P->formatted);
+  pthread_mutex_destroy(&P->lock);
+  for (j = 0; j < P->count; ++j)
+    pool_free_blocks(alloc, P->chunks[j].head);
+  pool_free_blocks(alloc, P->free);
+  lmprof_free(alloc, l_pcast(void *, workers), count * sizeof(ReportWorker));
+  return i > 0;
+}
+
+/*
+** Split the pages of the timeline into chunks and compute the iteration state
+** at the start of each. Returning zero if an event cannot be formatted, i.e.,
+** the output is truncated (see traceevent_table_pages).
+*/
+static int pool_chunks(ReportPool *P, const lmprof_State *st, TraceEventTimeline *list, TraceEventFormat *F, size_t page_count) {
+  size_t i, j, k;
+  TraceEventPage *page = l_nullptr;
+
+  i = 0;
+  for (page = (list->prologue == l_nullptr) ? l_nullptr : list->prologue->head; page != l_nullptr; page = page->next)
+    P->pages[i++] = page;
+  for (page = list->head; page != l_nullptr; page = page->next)
+    P->pages[i++] = page;
+
+  for (i = 0; i < P->count; ++i) {
+    ReportChunk *chunk = &P->chunks[i];
+    chunk->page = i * LMPROF_REPORT_CHUNK;
+    chunk->count = page_count - chunk->page;
+    chunk->count = (chunk->count < LMPROF_REPORT_CHUNK) ? chunk->count : LMPROF_REPORT_CHUNK;
+    chunk->F = *F;
+    chunk->head = chunk->tail = l_nullptr;
+    chunk->done = 0;
+    for (j = chunk->page; j < chunk->page + chunk->count; ++j) {
+      for (page = P->pages[j], k = 0; k < page->count; ++k) {
+        if (!traceevent_format_skip(st, F, &page->event_array[k]))
+          return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/*
+** Format the buffered trace events, see traceevent_table_events, on a pool of
+** 'report_threads' threads. Returning zero if the events must be formatted
+** serially: the report is not JSON, there are too few pages, or the pool could
+** not be created.
+*/
+static int traceevent_parallel_events(lua_State *L, lmprof_Report *R, TraceEventTimeline *list, const TraceEventFormat *F) {
+  lmprof_State *st = R->st;
+  lmprof_Alloc *alloc = &st->hook.alloc;
+  const size_t thread_count = list->threads->count;
+
+  int result = 0;
+  size_t i, page_count = 0;
+  ReportPool P;
+  TraceEventFormat S = *F;
+  TraceEventPage *page = l_nullptr;
+  const char **threads = l_nullptr;
+
+  /* The first event of each chunk is delimited from the events preceding it */
+  if (st->i.reportThreads <= 1 || !REPORT_JSON(R) || R->depth == 0 || R->frames[R->depth - 1].count == 0)
+    return 0;
+
+  for (page = (list->prologue == l_nullptr) ? l_nullptr : list->prologue->head; page != l_nullptr; page = page->next)
+    page_count++;
+  for (page = list->head; page != l_nullptr; page = page->next)
+    page_count++;
+  if (page_count <= LMPROF_REPORT_CHUNK)
+    return 0;
+
+  P.R = R;
+  P.count = (page_count + LMPROF_REPORT_CHUNK - 1) / LMPROF_REPORT_CHUNK;
+  P.pages = l_pcast(TraceEventPage **, lmprof_malloc(alloc, page_count * sizeof(TraceEventPage *)));
+  P.chunks = l_pcast(ReportChunk *, lmprof_malloc(alloc, P.count * sizeof(ReportChunk)));
+  threads = l_pcast(const char **, lmprof_malloc(alloc, (thread_count + 1) * sizeof(const char *)));
+  if (P.pages != l_nullptr && P.chunks != l_nullptr && threads != l_nullptr) {
+    /* Workers cannot use the Lua API: the names array/table anchors each string */
+    for (i = 0; i < thread_count; ++i)
+      threads[i] = __threadName(L, R, timeline_thread(list, l_cast(unsigned int, i)));
+
+    S.threads = threads;
+    if (pool_chunks(&P, st, list, &S, page_count)) {
+      const size_t count = l_cast(size_t, st->i.reportThreads);
+      result = pool_run(&P, alloc, (count < P.count) ? count : P.count);
+    }
+  }
+
+  if (threads != l_nullptr)
+    lmprof_free(alloc, l_pcast(void *, threads), (thread_count + 1) * sizeof(const char *));
+  if (P.chunks != l_nullptr)
+    lmprof_free(alloc, l_pcast(void *, P.chunks), P.count * sizeof(ReportChunk));
+  if (P.pages != l_nullptr)
+    lmprof_free(alloc, l_pcast(void *, P.pages), page_count * sizeof(TraceEventPage *));
+  return result;
+}
 #endif
+
+/*
+** Adjust the (expanded) timeline and compress small records to reduce the size
+** of the output. Unlike timeline_expand, neither allocate.
+*/
+static int traceevent_table_adjust(const lmprof_State *st, TraceEventTimeline *list) {
+  timeline_adjust(list);
+  if (BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_COMPRESS)) {
+    TraceEventCompressOpts opts;
+    opts.id.pid = 0;
+    opts.id.tid = 0;
+    opts.threshold = st->i.event_threshold;
+    return timeline_compress(list, opts);
+  }
+  return TRACE_EVENT_OK;
+}
+
+/* Format all buffered trace events, appending them to the open array. */
+static void traceevent_table_events(lua_State *L, lmprof_Report *R, TraceEventTimeline *list) {
+  lmprof_State *st = R->st;
+
+  int result;
+  TraceEventFormat F;
+  traceevent_format_init(st, &F);
+
+  /* Rebuild the scope events of each (compact) coroutine switch */
+  if ((result = timeline_expand(list)) != TRACE_EVENT_OK) {
+    luaL_error(L, "trace event expansion error: %d", result);
+    return;
+  }
+  else if (list->synthetic != l_nullptr) {
+    F.synthetic = list->synthetic->head;
+  }
+
+  if ((result = traceevent_table_adjust(st, list)) != TRACE_EVENT_OK) {
+    luaL_error(L, "trace event compression error: %d", result);
+    return;
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-    char ts_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    if (snprintf(ts_str, sizeof(ts_str), "%" PRIluTIME "", LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addliteral(b, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMELINE_FRAME)));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("DrawFrame")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("t")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("ts", "%s"), ts_str);
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("pid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.pid));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.tid));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("args", ""));
-    luaL_addliteral(b, JSON_OPEN_OBJ JSON_ASSIGN("layerTreeId", "null") " " JSON_CLOSE_OBJ);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
-  }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
-}
-
-static int __eventScope(lua_State *L, lmprof_Report *R, const TraceEvent *event, const char *name, const char *eventName) {
+
+#if LMPROF_HAS_THREADS
+  if (traceevent_parallel_events(L, R, list, &F))
+    return;
+#endif
+
+  if (list->prologue != l_nullptr && !traceevent_table_pages(L, R, &F, list->prologue->head))
+    return;
+  traceevent_table_pages(L, R, &F, list->head);
+}
+
+static void traceevent_report_header(lmprof_Report *R) {
+  lmprof_State *st = R->st;
+  const TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
+
+  profiler_header(R);
+  report_boolean(R, "compress", BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_COMPRESS) != 0);
+  report_integer(R, "eventsize", timeline_event_size(list));
+  report_integer(R, "eventpages", timeline_event_array_size(list));
+
+  report_integer(R, "usedpages", list->pageCount);
+  report_integer(R, "totalpages", list->pageLimit);
+  report_integer(R, "pagelimit", list->pageLimit * timeline_page_size());
+  report_integer(R, "pagesize", timeline_page_size());
+  report_number(R, "pageusage", timeline_usage(list));
+  report_boolean(R, "ring", BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_RING) != 0);
+  report_integer(R, "recycledpages", list->recycleCount);
+}
+
+/*
+** Open the array of trace events: lTable reports are a table with a 'header'
+** and 'records' (see TRACE_EVENT_FORMAT), while the formatted reports are only
+** the records. When formatted for chrome://tracing, the records are an object
+** with a 'traceEvents' array and 'metadata'.
+*/
+static void traceevent_open(lmprof_Report *R) {
   if (R->type == lTable) {
-    lua_newtable(L);
-    luaL_settabss(L, "cat", CHROME_USER_TIMING);
-    luaL_settabss(L, "name", eventName);
-    luaL_settabss(L, "ph", name);
-    luaL_settabsi(L, "pid", event->call.proc.pid);
-    if (op_routine(event->op))
-      luaL_settabsi(L, "tid", R->st->thread.mainproc.tid);
-    else
-      luaL_settabsi(L, "tid", event->call.proc.tid);
-    luaL_settabsi(L, "ts", l_cast(lua_Integer, LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)));
-    return LUA_OK;
+    report_begin(R, l_nullptr, lObject);
+    report_begin(R, "header", lObject);
+    traceevent_report_header(R);
+    report_end(R);
+  }
+
+  if (BITFIELD_TEST(R->st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING)) {
+    report_begin(R, (R->type == lTable) ? "records" : l_nullptr, lObject);
+    report_begin(R, "traceEvents", lRecords);
+  }
+  else {
+    report_begin(R, (R->type == lTable) ? "records" : l_nullptr, lRecords);
+  }
+}
+
+/* Close the array of trace events; see traceevent_open. */
+static void traceevent_close(lmprof_Report *R) {
+  if (REPORT_JSON(R) && BITFIELD_TEST(R->st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING)) {
+    report_pop(R); /* 'traceEvents' is closed without a trailing newline */
+    text_literal(R, JSON_CLOSE_ARRAY);
+  }
+  else {
+    report_end(R);
+  }
+
+  if (BITFIELD_TEST(R->st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING)) {
+    __metaAbout(R, LMPROF, LUA_VERSION);
+    report_end(R);
+  }
+
+  if (R->type == lTable)
+    report_end(R);
+}
+
+static int traceevent_report(lua_State *L, lmprof_Report *report) {
+  TraceEventTimeline *list = l_pcast(TraceEventTimeline *, report->st->i.trace.arg);
+
+  traceevent_open(report);
+  tracevent_table_header(L, report, list);
+  traceevent_table_events(L, report, list);
+  traceevent_close(report);
+  return report->error ? LMPROF_REPORT_FAILURE : LUA_OK;
+}
+
+/* }================================================================== */
+
+/*
+** {==================================================================
+** Trace Event Streaming
+** ===================================================================
+*/
+#if LMPROF_HAS_THREADS
+/*
+** The profiled thread hands full pages to the writer in batches, i.e., once the
+** timeline reaches its page limit, and is given formatted pages in return. All
+** (de)allocation remains on the profiled thread: the writer only formats events
+** and writes to the file.
+*/
+typedef struct lmprof_Stream {
+  lmprof_State snapshot; /* Configuration of the profiler when the stream was opened */
+  lmprof_Report report;
+  TraceEventFormat F;
+  TraceEvent sample; /* Last SAMPLE_EVENT of a released page; see traceevent_table_event */
+  lmprof_Alloc *page_allocator; /* TraceEventTimeline.page_allocator */
+  lu_time baseTime; /* TraceEventTimeline.baseTime of the queued pages */
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready; /* Pages queued or the stream is closing */
+  pthread_cond_t drained; /* Pages released by the writer */
+  TraceEventPage *queue; /* Pages awaiting formatting */
+  TraceEventPage *queue_tail;
+  TraceEventPage *free; /* Formatted pages available for reuse */
+  size_t pending; /* Number of queued pages (or being formatted) */
+  int closing;
+  int running;
+  lmprof_IO io; /* Sink of the report */
+  char iobuf[LMPROF_IO_BUFFER]; /* stdio buffer of io.file */
+} lmprof_Stream;
+
+/* Format all events of a page and ensure no iterator references the page. */
+static void stream_format_page(lmprof_Stream *S, TraceEventPage *page, lu_time baseTime) {
+  size_t i;
+  traceevent_adjust(page, baseTime);
+  for (i = 0; i < page->count; ++i)
+    traceevent_table_event(l_nullptr, &S->report, &S->F, page, &page->event_array[i]);
+
+  if (S->F.samples != l_nullptr
+      && S->F.samples >= page->event_array
+      && S->F.samples < (page->event_array + page->count)) {
+    S->sample = *S->F.samples;
+    S->F.samples = &S->sample;
+  }
+}
+
+static void *stream_main(void *args) {
+  lmprof_Stream *S = l_pcast(lmprof_Stream *, args);
+
+  pthread_mutex_lock(&S->lock);
+  for (;;) {
+    lu_time baseTime = 0;
+    TraceEventPage *page = l_nullptr;
+    while (S->queue == l_nullptr && !S->closing)
+      pthread_cond_wait(&S->ready, &S->lock);
+
+    if ((page = S->queue) == l_nullptr)
+      break; /* Closing and drained */
+    else if ((S->queue = page->next) == l_nullptr)
+      S->queue_tail = l_nullptr;
+    baseTime = S->baseTime;
+    pthread_mutex_unlock(&S->lock);
+
+    page->next = l_nullptr;
+    stream_format_page(S, page, baseTime);
+
+    pthread_mutex_lock(&S->lock);
+    page->next = S->free;
+    S->free = page;
+    S->pending--;
+    pthread_cond_signal(&S->drained);
+  }
+  pthread_mutex_unlock(&S->lock);
+  return l_nullptr;
+}
+
+/* Join the writer thread; all queued pages are formatted before it exits. */
+static void stream_join(lmprof_Stream *S) {
+  if (S->running) {
+    pthread_mutex_lock(&S->lock);
+    S->closing = 1;
+    pthread_cond_signal(&S->ready);
+    pthread_mutex_unlock(&S->lock);
+
+    pthread_join(S->thread, l_nullptr);
+    S->running = 0;
+  }
+}
+
+static void stream_free_pages(lmprof_Alloc *alloc, TraceEventPage *page) {
+  while (page != l_nullptr) {
+    TraceEventPage *next = page->next;
+    traceevent_free(alloc, page);
+    page = next;
+  }
+}
+
+LUA_API int lmprof_stream_open(lmprof_State *st, const char *path) {
+  lmprof_Stream *S = l_nullptr;
+  if (st->i.writer != l_nullptr)
+    return LMPROF_REPORT_FAILURE;
+  else if ((S = l_pcast(lmprof_Stream *, lmprof_malloc(&st->hook.alloc, sizeof(lmprof_Stream)))) == l_nullptr)
+    return LMPROF_REPORT_FAILURE;
+  else if (!io_open(&S->io, path, "w", io_compressed(path), S->iobuf)) {
+    lmprof_free(&st->hook.alloc, l_pcast(void *, S), sizeof(lmprof_Stream));
+    return LMPROF_REPORT_FAILURE;
+  }
+
+  S->snapshot = *st;
+  S->page_allocator = l_pcast(TraceEventTimeline *, st->i.trace.arg)->page_allocator;
+  S->report.st = &S->snapshot;
+  S->report.names = 0;
+  S->report.lookup = 0;
+  report_init(&S->report, l_nullptr, lWriter, io_write, l_pcast(void *, &S->io));
+  traceevent_format_init(st, &S->F);
+  S->baseTime = 0;
+  S->queue = S->queue_tail = S->free = l_nullptr;
+  S->pending = 0;
+  S->closing = 0;
+  S->running = 0;
+  traceevent_open(&S->report);
+
+  pthread_mutex_init(&S->lock, l_nullptr);
+  pthread_cond_init(&S->ready, l_nullptr);
+  pthread_cond_init(&S->drained, l_nullptr);
+  if (pthread_create(&S->thread, l_nullptr, stream_main, l_pcast(void *, S)) != 0) {
+    pthread_cond_destroy(&S->drained);
+    pthread_cond_destroy(&S->ready);
+    pthread_mutex_destroy(&S->lock);
+    io_close(&S->io);
+    lmprof_free(&st->hook.alloc, l_pcast(void *, S), sizeof(lmprof_Stream));
+    return LMPROF_REPORT_FAILURE;
+  }
+
+  S->running = 1;
+  st->i.writer = S;
+  return LUA_OK;
+}
+
+LUA_API int lmprof_stream_flush(lmprof_State *st, TraceEventTimeline *list) {
+  size_t count = 0;
+  const size_t batch = list->pageLimit + 1; /* Pages buffered by the timeline */
+  lmprof_Stream *S = st->i.writer;
+  TraceEventPage *page = l_nullptr;
+  TraceEventPage *reuse = l_nullptr;
+  TraceEventPage *detached = l_nullptr;
+
+  pthread_mutex_lock(&S->lock);
+  while (S->pending >= 2 * batch) /* Backpressure: the writer is too far behind */
+    pthread_cond_wait(&S->drained, &S->lock);
+  while (S->free != l_nullptr && count < batch) {
+    page = S->free;
+    S->free = page->next;
+    page->next = reuse;
+    reuse = page;
+    count++;
+  }
+  pthread_mutex_unlock(&S->lock);
+
+  /* Metadata names are released by the thread that allocated them */
+  for (page = reuse; page != l_nullptr; page = page->next)
+    traceevent_clear(list->page_allocator, page);
+
+  if ((detached = timeline_detach(list, reuse)) == l_nullptr)
+    return TRACE_EVENT_ERRMEM;
+
+  for (count = 1, page = detached; page->next != l_nullptr; page = page->next)
+    count++;
+
+  pthread_mutex_lock(&S->lock);
+  if (S->queue_tail == l_nullptr)
+    S->queue = detached;
+  else
+    S->queue_tail->next = detached;
+  S->queue_tail = page;
+  S->pending += count;
+  S->baseTime = list->baseTime;
+  pthread_cond_signal(&S->ready);
+  pthread_mutex_unlock(&S->lock);
+  return TRACE_EVENT_OK;
+}
+
+LUA_API int lmprof_stream_close(lua_State *L, lmprof_State *st, int names) {
+  int result = 0;
+  lmprof_Stream *S = st->i.writer;
+  TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
+  if (S == l_nullptr || S->report.write == l_nullptr)
+    return 0;
+
+  stream_join(S);
+  if (list != l_nullptr) { /* Remaining (partial) batch */
+    TraceEventPage *page = l_nullptr;
+    for (page = list->head; page != l_nullptr; page = page->next)
+      stream_format_page(S, page, list->baseTime);
+  }
+
+  S->report.names = names;
+  tracevent_table_header(L, &S->report, list);
+  traceevent_close(&S->report);
+
+  result = !S->report.error;
+  result = io_close(&S->io) && result;
+  S->report.write = l_nullptr; /* marked as closed */
+  return result;
+}
+
+LUA_API void lmprof_stream_free(lmprof_State *st) {
+  lmprof_Stream *S = st->i.writer;
+  if (S != l_nullptr) {
+    stream_join(S);
+    if (S->report.write != l_nullptr)
+      io_close(&S->io);
+
+    stream_free_pages(S->page_allocator, S->queue);
+    stream_free_pages(S->page_allocator, S->free);
+    pthread_cond_destroy(&S->drained);
+    pthread_cond_destroy(&S->ready);
+    pthread_mutex_destroy(&S->lock);
+    lmprof_free(&st->hook.alloc, l_pcast(void *, S), sizeof(lmprof_Stream));
+    st->i.writer = l_nullptr;
   }
-  else if (R->type == lFile) {
+}
+#else
+LUA_API int lmprof_stream_open(lmprof_State *st, const char *path) {
+  UNUSED(st);
+  UNUSED(path);
+  return LMPROF_REPORT_DISABLED_IO;
+}
+
+LUA_API int lmprof_stream_flush(lmprof_State *st, TraceEventTimeline *list) {
+  UNUSED(st);
+  UNUSED(list);
+  return TRACE_EVENT_ERRPAGEFULL;
+}
+
+LUA_API int lmprof_stream_close(lua_State *L, lmprof_State *st, int names) {
+  UNUSED(L);
+  UNUSED(st);
+  UNUSED(names);
+  return 0;
+}
+
+LUA_API void lmprof_stream_free(lmprof_State *st) {
+  UNUSED(st);
+}
+#endif
+/* }================================================================== */
+
+/*
+** {==================================================================
+** Trace Event Binary
+** ===================================================================
+*/
 #if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("cat", JSON_STRING(CHROME_USER_TIMING)));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("%s")), eventName);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("%s")), name);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("pid", LUA_INTEGER_FMT), event->call.proc.pid);
-    if (op_routine(event->op))
-      fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), R->st->thread.mainproc.tid);
-    else
-      fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), event->call.proc.tid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ts", "%" PRIluTIME ""), LMPROF_TIME_ADJ(event->call.s.time, R->st->conf));
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
+
+#define BINARY_MAGIC "\x1bLMP"
+#define BINARY_VERSION 1
+
+/* Section tags */
+#define BINARY_HEADER 'H'
+#define BINARY_SOURCES 'S'
+#define BINARY_FUNCTIONS 'F'
+#define BINARY_THREADS 'T'
+#define BINARY_NAMES 'N'
+#define BINARY_PROLOGUE 'P'
+#define BINARY_EVENTS 'E'
+#define BINARY_END 'Z'
+
+/* Encoded TraceEvent references */
+#define BINARY_REF_NULL 0
+#define BINARY_REF_DETACHED 1 /* TraceEventTimeline.detached */
+#define BINARY_REF_OFFSET 2 /* Zigzag encoded distance to the referenced event */
+
+/* Varint word: wide enough for all lu_time, lu_sizediff and lua_Integer values */
+#if !LUA_32BITS
+typedef uint64_t BinaryWord;
+typedef int64_t BinarySigned;
 #else
-    return LMPROF_REPORT_DISABLED_IO;
+typedef size_t BinaryWord;
+typedef ptrdiff_t BinarySigned;
 #endif
+
+#define BINARY_VARINT_MAX ((sizeof(BinaryWord) * 8 + 6) / 7)
+#define BINARY_EVENT_MAX (1 + 9 * BINARY_VARINT_MAX)
+
+/* TraceEventType of events whose data is a function info with event references */
+#define binary_op_info(op) (op_event(op) || op_routine(op) || (op) == LINE_SCOPE)
+
+static LUA_INLINE BinaryWord binary_zigzag(BinarySigned v) {
+  return (v < 0) ? ((~l_cast(BinaryWord, v)) << 1) | 1 : (l_cast(BinaryWord, v) << 1);
+}
+
+static LUA_INLINE BinarySigned binary_unzigzag(BinaryWord w) {
+  return (w & 1) ? (-l_cast(BinarySigned, w >> 1) - 1) : l_cast(BinarySigned, w >> 1);
+}
+
+/* Growable byte buffer: the payload of the section being written. */
+typedef struct BinaryBuffer {
+  lmprof_Alloc *alloc;
+  unsigned char *data;
+  size_t length;
+  size_t size;
+} BinaryBuffer;
+
+/* Ensure 'n' additional bytes can be written to the buffer; returning zero on failure. */
+static int binary_reserve(BinaryBuffer *B, size_t n) {
+  if (B->length + n > B->size) {
+    unsigned char *data = l_nullptr;
+    size_t size = (B->size == 0) ? 4096 : B->size;
+    while (B->length + n > size)
+      size <<= 1;
+
+    if ((data = l_pcast(unsigned char *, lmprof_realloc(B->alloc, B->data, B->size, size))) == l_nullptr)
+      return 0;
+    B->data = data;
+    B->size = size;
+  }
+  return 1;
+}
+
+/* Append an unsigned LEB128 value; BINARY_VARINT_MAX bytes must be reserved. */
+static LUA_INLINE void binary_varint(BinaryBuffer *B, BinaryWord w) {
+  unsigned char *p = B->data + B->length;
+  for (; w >= 0x80; w >>= 7)
+    *p++ = l_cast(unsigned char, (w & 0x7F) | 0x80);
+  *p++ = l_cast(unsigned char, w);
+  B->length = l_cast(size_t, p - B->data);
+}
+
+/* Append a length-prefixed string: zero denotes NULL, otherwise the length plus one. */
+static int binary_string(BinaryBuffer *B, const char *str, size_t len) {
+  if (!binary_reserve(B, BINARY_VARINT_MAX + len))
+    return 0;
+  else if (str == l_nullptr) {
+    binary_varint(B, BINARY_REF_NULL);
+    return 1;
+  }
+
+  binary_varint(B, l_cast(BinaryWord, len) + 1);
+  memcpy(B->data + B->length, str, len);
+  B->length += len;
+  return 1;
+}
+
+/* Pointer identity to (insertion ordered) index map */
+typedef struct BinaryMap {
+  lmprof_Alloc *alloc;
+  size_t count; /* Number of interned pointers */
+  size_t size; /* Capacity of 'slots'; 'items' holds half as many */
+  size_t *slots; /* Open-addressing index of 'items': offset by one, zero if empty */
+  const void **items; /* Interned pointers in insertion order */
+} BinaryMap;
+
+#define BINARY_HASH(P) ((l_cast(size_t, l_pcast(lu_addr, (P)) >> 4)) * l_cast(size_t, 2654435761U))
+
+static void binary_map_slot(size_t *slots, size_t size, const void *key, size_t index) {
+  size_t i = BINARY_HASH(key) & (size - 1);
+  while (slots[i] != 0)
+    i = (i + 1) & (size - 1);
+  slots[i] = index + 1;
+}
+
+/* Return the index of a pointer (interning it if required); returning zero on failure. */
+static int binary_map_intern(BinaryMap *M, const void *key, size_t *index) {
+  size_t i;
+  if (M->count > 0) {
+    for (i = BINARY_HASH(key) & (M->size - 1); M->slots[i] != 0; i = (i + 1) & (M->size - 1)) {
+      if (M->items[M->slots[i] - 1] == key) {
+        *index = M->slots[i] - 1;
+        return 1;
+      }
+    }
+  }
+
+  if ((M->count + 1) * 2 > M->size) { /* Rehash */
+    const size_t size = (M->size == 0) ? 64 : (M->size << 1);
+    const void **items = l_nullptr;
+    size_t *slots = l_pcast(size_t *, lmprof_malloc(M->alloc, size * sizeof(size_t)));
+    if (slots == l_nullptr)
+      return 0;
+
+    items = l_pcast(const void **, lmprof_realloc(M->alloc, l_pcast(void *, M->items), (M->size >> 1) * sizeof(void *), (size >> 1) * sizeof(void *)));
+    if (items == l_nullptr) {
+      lmprof_free(M->alloc, l_pcast(void *, slots), size * sizeof(size_t));
+      return 0;
+    }
+
+    memset(slots, 0, size * sizeof(size_t));
+    for (i = 0; i < M->count; ++i)
+      binary_map_slot(slots, size, items[i], i);
+
+    lmprof_free(M->alloc, l_pcast(void *, M->slots), M->size * sizeof(size_t));
+    M->slots = slots;
+    M->items = items;
+    M->size = size;
+  }
+
+  M->items[M->count] = key;
+  binary_map_slot(M->slots, M->size, key, M->count);
+  *index = M->count++;
+  return 1;
+}
+
+static void binary_map_free(BinaryMap *M) {
+  lmprof_free(M->alloc, l_pcast(void *, M->slots), M->size * sizeof(size_t));
+  lmprof_free(M->alloc, l_pcast(void *, M->items), (M->size >> 1) * sizeof(void *));
+  M->slots = l_nullptr;
+  M->items = l_nullptr;
+  M->count = M->size = 0;
+}
+
+/* A buffered page and the (global) index of its first event */
+typedef struct BinaryPage {
+  const TraceEventPage *page;
+  size_t index;
+} BinaryPage;
+
+typedef struct BinaryDump {
+  TraceEventTimeline *list;
+  FILE *file;
+  BinaryBuffer B;
+  BinaryMap infos; /* Function info of all events */
+  BinaryMap sources; /* Source strings of all function info */
+  BinaryPage *pages; /* Prologue and timeline pages, sorted by address */
+  size_t page_count;
+} BinaryDump;
+
+static int binary_page_compare(const void *a, const void *b) {
+  const lu_addr pa = l_pcast(lu_addr, l_pcast(const BinaryPage *, a)->page);
+  const lu_addr pb = l_pcast(lu_addr, l_pcast(const BinaryPage *, b)->page);
+  return (pa < pb) ? -1 : ((pa > pb) ? 1 : 0);
+}
+
+/* Encode a reference from the event at 'index' to another event. */
+static BinaryWord binary_ref(const BinaryDump *D, size_t index, const TraceEvent *event) {
+  const lu_addr addr = l_pcast(lu_addr, event);
+  size_t lo = 0, hi = D->page_count;
+  if (event == l_nullptr)
+    return BINARY_REF_NULL;
+  else if (event == &D->list->detached)
+    return BINARY_REF_DETACHED;
+
+  while (lo < hi) { /* Last page whose address is not greater than the event */
+    const size_t mid = lo + ((hi - lo) >> 1);
+    if (l_pcast(lu_addr, D->pages[mid].page) <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo > 0) {
+    const BinaryPage *p = &D->pages[lo - 1];
+    const lu_addr begin = l_pcast(lu_addr, p->page->event_array);
+    if (addr < begin + p->page->count * sizeof(TraceEvent)) {
+      const size_t target = p->index + l_cast(size_t, (addr - begin) / sizeof(TraceEvent));
+      return BINARY_REF_OFFSET + binary_zigzag(l_cast(BinarySigned, target) - l_cast(BinarySigned, index));
+    }
+  }
+  return BINARY_REF_NULL; /* Not a buffered event */
+}
+
+static BinaryWord binary_info(BinaryDump *D, const lmprof_FunctionInfo *info) {
+  size_t index = 0;
+  if (info == l_nullptr || !binary_map_intern(&D->infos, l_pcast(const void *, info), &index))
+    return BINARY_REF_NULL;
+  return l_cast(BinaryWord, index) + 1;
+}
+
+/* Encode a single event; times and heap usage are delta encoded. */
+static int binary_event(BinaryDump *D, size_t index, const TraceEventPage *page, const TraceEvent *event, lu_time *time, lu_sizediff *heap) {
+  BinaryBuffer *B = &D->B;
+  if (!binary_reserve(B, BINARY_EVENT_MAX))
+    return 0;
+
+  B->data[B->length++] = l_cast(unsigned char, event->op | (event->flags << 4));
+  binary_varint(B, l_cast(BinaryWord, event->thread));
+  binary_varint(B, binary_zigzag(l_cast(BinarySigned, event->time - *time)));
+  binary_varint(B, binary_zigzag(l_cast(BinarySigned, event->line)));
+  *time = event->time;
+  if (page->heap != l_nullptr) {
+    const lu_sizediff h = traceevent_heap(page, event);
+    binary_varint(B, binary_zigzag(l_cast(BinarySigned, h - *heap)));
+    *heap = h;
+  }
+
+  switch (event->op) {
+    case BEGIN_FRAME:
+    case END_FRAME:
+      binary_varint(B, l_cast(BinaryWord, event->data.frame.frame));
+      break;
+    case SWITCH_ROUTINE:
+      binary_varint(B, l_cast(BinaryWord, event->data.routine.from));
+      binary_varint(B, l_cast(BinaryWord, event->data.routine.to));
+      binary_varint(B, l_cast(BinaryWord, event->data.routine.frame));
+      binary_varint(B, l_cast(BinaryWord, event->data.routine.count));
+      break;
+    case LINE_SCOPE:
+      binary_varint(B, binary_info(D, event->data.line.info));
+      binary_varint(B, binary_ref(D, index, event->data.line.previous));
+      binary_varint(B, binary_ref(D, index, event->data.line.next));
+      break;
+    case SAMPLE_EVENT:
+      binary_varint(B, binary_ref(D, index, event->data.sample.next));
+      break;
+    case PROCESS:
+    case THREAD: {
+      const char *name = event->data.process.name;
+      return binary_string(B, name, (name == l_nullptr) ? 0 : strlen(name));
+    }
+    case BEGIN_ROUTINE:
+    case END_ROUTINE:
+    case ENTER_SCOPE:
+    case EXIT_SCOPE:
+    case IGNORE_SCOPE:
+    default:
+      binary_varint(B, binary_info(D, event->data.event.info));
+      binary_varint(B, binary_ref(D, index, event->data.event.sibling));
+      binary_varint(B, binary_ref(D, index, event->data.event.lines));
+      break;
+  }
+  return 1;
+}
+
+/* Write the buffered payload as a length-prefixed section. */
+static int binary_section(BinaryDump *D, int tag) {
+  unsigned char header[1 + BINARY_VARINT_MAX];
+  size_t n = 1;
+  BinaryWord w = l_cast(BinaryWord, D->B.length);
+
+  header[0] = l_cast(unsigned char, tag);
+  for (; w >= 0x80; w >>= 7)
+    header[n++] = l_cast(unsigned char, (w & 0x7F) | 0x80);
+  header[n++] = l_cast(unsigned char, w);
+  if (fwrite(header, 1, n, D->file) != n)
+    return 0;
+  else if (D->B.length > 0 && fwrite(D->B.data, 1, D->B.length, D->file) != D->B.length)
+    return 0;
+
+  D->B.length = 0;
+  return 1;
+}
+
+/* Gather all pages of the timeline and the function info referenced by their events. */
+static int binary_collect(BinaryDump *D) {
+  size_t i, p, index = 0, info = 0;
+  const TraceEventPage *page = l_nullptr;
+  const TraceEventPage *heads[2];
+  heads[0] = (D->list->prologue == l_nullptr) ? l_nullptr : D->list->prologue->head;
+  heads[1] = D->list->head;
+
+  for (p = 0; p < 2; ++p) {
+    for (page = heads[p]; page != l_nullptr; page = page->next)
+      D->page_count++;
+  }
+
+  D->pages = l_pcast(BinaryPage *, lmprof_malloc(D->B.alloc, D->page_count * sizeof(BinaryPage)));
+  if (D->pages == l_nullptr) {
+    D->page_count = 0;
+    return 0;
+  }
+
+  D->page_count = 0;
+  for (p = 0; p < 2; ++p) {
+    for (page = heads[p]; page != l_nullptr; page = page->next) {
+      D->pages[D->page_count].page = page;
+      D->pages[D->page_count++].index = index;
+      index += page->count;
+      for (i = 0; i < page->count; ++i) {
+        const TraceEvent *event = &page->event_array[i];
+        if (binary_op_info(event->op) && event->data.event.info != l_nullptr
+            && !binary_map_intern(&D->infos, l_pcast(const void *, event->data.event.info), &info))
+          return 0;
+      }
+    }
+  }
+
+  for (i = 0; i < D->infos.count; ++i) {
+    const lmprof_FunctionInfo *fi = l_pcast(const lmprof_FunctionInfo *, D->infos.items[i]);
+    if (fi->source != l_nullptr && !binary_map_intern(&D->sources, l_pcast(const void *, fi->source), &info))
+      return 0;
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-    char ts_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    if (snprintf(ts_str, sizeof(ts_str), "%" PRIluTIME "", LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addliteral(b, JSON_ASSIGN("cat", JSON_STRING(CHROME_USER_TIMING)));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("%s")), eventName);
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("%s")), name);
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("pid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.pid));
-    if (op_routine(event->op))
-      luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), LUA_INT_CAST(R->st->thread.mainproc.tid));
+
+  qsort(D->pages, D->page_count, sizeof(BinaryPage), binary_page_compare);
+  return 1;
+}
+
+/* Encode the events of each non-empty page of a page-list as a section. */
+static int binary_pages(BinaryDump *D, int tag, const TraceEventPage *page, size_t *index) {
+  for (; page != l_nullptr; page = page->next) {
+    size_t i;
+    lu_time time = 0;
+    lu_sizediff heap = 0;
+    if (page->count == 0)
+      continue;
+    else if (!binary_reserve(&D->B, BINARY_VARINT_MAX))
+      return 0;
+
+    binary_varint(&D->B, l_cast(BinaryWord, page->count));
+    for (i = 0; i < page->count; ++i) {
+      if (!binary_event(D, (*index)++, page, &page->event_array[i], &time, &heap))
+        return 0;
+    }
+
+    if (!binary_section(D, tag))
+      return 0;
+  }
+  return 1;
+}
+
+/* Encode the thread names of the registry as thread identifier/name pairs. */
+static int binary_names(lua_State *L, BinaryDump *D) {
+  int result = 1;
+  BinaryWord count = 0;
+  lmprof_thread_info(L, LMPROF_TAB_THREAD_NAMES); /* [..., names] */
+  for (lua_pushnil(L); lua_next(L, -2) != 0; lua_pop(L, 1)) { /* [..., names, key, value] */
+    if (lua_isnumber(L, -2) && (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER))
+      count++;
+  }
+
+  if ((result = binary_reserve(&D->B, BINARY_VARINT_MAX)) != 0)
+    binary_varint(&D->B, count);
+
+  lua_pushnil(L); /* [..., names, nil] */
+  while (result && lua_next(L, -2) != 0) { /* [..., names, key, value] */
+    if (lua_isnumber(L, -2) && (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER)) {
+      size_t len = 0;
+      const char *name = l_nullptr;
+
+      lua_pushvalue(L, -1); /* [..., names, key, value, value]: lua_tolstring converts numbers in-place */
+      name = lua_tolstring(L, -1, &len);
+      if ((result = binary_reserve(&D->B, BINARY_VARINT_MAX)) != 0) {
+        binary_varint(&D->B, binary_zigzag(l_cast(BinarySigned, lua_tointeger(L, -3))));
+        result = binary_string(&D->B, name, len);
+      }
+      lua_pop(L, 1); /* [..., names, key, value] */
+    }
+    lua_pop(L, 1); /* [..., names, key] */
+  }
+
+  if (!result)
+    lua_pop(L, 1); /* [..., names] */
+  lua_pop(L, 1);
+  return result;
+}
+
+static int binary_write(lua_State *L, lmprof_State *st, BinaryDump *D) {
+  size_t i, index = 0;
+  BinaryBuffer *B = &D->B;
+  TraceEventTimeline *list = D->list;
+  const unsigned char version = BINARY_VERSION;
+  if (fwrite(BINARY_MAGIC, 1, sizeof(BINARY_MAGIC) - 1, D->file) != sizeof(BINARY_MAGIC) - 1)
+    return 0;
+  else if (fwrite(&version, 1, 1, D->file) != 1)
+    return 0;
+
+  /* Profiler configuration required to format the events */
+  if (!binary_reserve(B, 12 * BINARY_VARINT_MAX))
+    return 0;
+  binary_varint(B, l_cast(BinaryWord, st->mode));
+  binary_varint(B, l_cast(BinaryWord, st->conf));
+  binary_varint(B, binary_zigzag(l_cast(BinarySigned, st->thread.mainproc.pid)));
+  binary_varint(B, binary_zigzag(l_cast(BinarySigned, st->thread.mainproc.tid)));
+  binary_varint(B, binary_zigzag(l_cast(BinarySigned, st->i.counterFrequency)));
+  binary_varint(B, l_cast(BinaryWord, st->i.event_threshold));
+  binary_varint(B, l_cast(BinaryWord, list->flags & TRACE_EVENT_TIMELINE_HEAP));
+  binary_varint(B, l_cast(BinaryWord, list->frameCount));
+  binary_varint(B, l_cast(BinaryWord, list->switchCount));
+  binary_varint(B, l_cast(BinaryWord, list->recycleCount));
+  binary_varint(B, l_cast(BinaryWord, list->baseTime));
+  if (!binary_string(B, st->i.name, (st->i.name == l_nullptr) ? 0 : strlen(st->i.name))
+      || !binary_string(B, st->i.url, (st->i.url == l_nullptr) ? 0 : strlen(st->i.url))
+      || !binary_section(D, BINARY_HEADER))
+    return 0;
+
+  /* String table: function sources */
+  if (!binary_reserve(B, BINARY_VARINT_MAX))
+    return 0;
+  binary_varint(B, l_cast(BinaryWord, D->sources.count));
+  for (i = 0; i < D->sources.count; ++i) {
+    const char *source = l_pcast(const char *, D->sources.items[i]);
+    if (!binary_string(B, source, strlen(source)))
+      return 0;
+  }
+  if (!binary_section(D, BINARY_SOURCES))
+    return 0;
+
+  /* Record table: the function info referenced by events */
+  if (!binary_reserve(B, (1 + 2 * D->infos.count) * BINARY_VARINT_MAX))
+    return 0;
+  binary_varint(B, l_cast(BinaryWord, D->infos.count));
+  for (i = 0; i < D->infos.count; ++i) {
+    const lmprof_FunctionInfo *info = l_pcast(const lmprof_FunctionInfo *, D->infos.items[i]);
+    size_t source = 0;
+    binary_varint(B, l_cast(BinaryWord, l_cast(uint32_t, info->event)));
+    if (info->source != l_nullptr && binary_map_intern(&D->sources, l_pcast(const void *, info->source), &source))
+      binary_varint(B, l_cast(BinaryWord, source) + 1);
     else
-      luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.tid));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("ts", "%s"), ts_str);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
+      binary_varint(B, BINARY_REF_NULL);
+  }
+  if (!binary_section(D, BINARY_FUNCTIONS))
+    return 0;
+
+  /* Interned process/thread identifiers */
+  if (!binary_reserve(B, (1 + 2 * list->threads->count) * BINARY_VARINT_MAX))
+    return 0;
+  binary_varint(B, l_cast(BinaryWord, list->threads->count));
+  for (i = 0; i < list->threads->count; ++i) {
+    const lmprof_EventProcess *proc = timeline_thread(list, l_cast(unsigned int, i));
+    binary_varint(B, binary_zigzag(l_cast(BinarySigned, proc->pid)));
+    binary_varint(B, binary_zigzag(l_cast(BinarySigned, proc->tid)));
+  }
+  if (!binary_section(D, BINARY_THREADS))
+    return 0;
+  else if (!binary_names(L, D) || !binary_section(D, BINARY_NAMES))
+    return 0;
+
+  /* Events: the prologue precedes the timeline */
+  if (list->prologue != l_nullptr && !binary_pages(D, BINARY_PROLOGUE, list->prologue->head, &index))
+    return 0;
+  else if (!binary_pages(D, BINARY_EVENTS, list->head, &index))
+    return 0;
+  return binary_section(D, BINARY_END);
+}
+
+/*
+** Write the buffered (pre-formatting) events of the timeline, along with the
+** function info and thread names they reference, to the report file.
+*/
+static int traceevent_dump(lua_State *L, lmprof_Report *R, FILE *file) {
+  int result = LMPROF_REPORT_FAILURE;
+  lmprof_State *st = R->st;
+
+  BinaryDump D;
+  D.list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
+  D.file = file;
+  D.B.alloc = D.infos.alloc = D.sources.alloc = &st->hook.alloc;
+  D.B.data = l_nullptr;
+  D.B.length = D.B.size = 0;
+  D.infos.count = D.infos.size = D.sources.count = D.sources.size = 0;
+  D.infos.slots = D.sources.slots = l_nullptr;
+  D.infos.items = D.sources.items = l_nullptr;
+  D.pages = l_nullptr;
+  D.page_count = 0;
+
+  luaL_checkstack(L, 4, __FUNCTION__);
+  if (binary_collect(&D) && binary_write(L, st, &D))
+    result = LUA_OK;
+
+  lmprof_free(D.B.alloc, l_pcast(void *, D.pages), D.page_count * sizeof(BinaryPage));
+  lmprof_free(D.B.alloc, l_pcast(void *, D.B.data), D.B.size);
+  binary_map_free(&D.infos);
+  binary_map_free(&D.sources);
+  return result;
+}
+
+/* A binary dump being converted; owned by a LMPROF_BINARY_METATABLE userdata. */
+typedef struct BinaryTrace {
+  lmprof_State st; /* Configuration of the profiler that wrote the dump; 'hook.alloc' owns all memory */
+  unsigned char *data; /* Contents of the dump */
+  size_t size;
+  size_t capacity;
+  TraceEventTimeline *list;
+  lmprof_FunctionInfo *infos;
+  size_t info_count;
+  char **sources;
+  size_t source_count;
+} BinaryTrace;
+
+typedef struct BinaryReader {
+  const unsigned char *data;
+  const unsigned char *end;
+  int error; /* Malformed or truncated input */
+} BinaryReader;
+
+/* Events of a rebuilt timeline, indexable by their (global) index */
+typedef struct BinaryIndex {
+  TraceEventPage **pages;
+  size_t count; /* Number of pages */
+  size_t events; /* Number of events */
+} BinaryIndex;
+
+#define BINARY_ERRMEM "not enough memory"
+#define BINARY_ERRFORMAT "malformed binary trace"
+
+static BinaryWord binary_read(BinaryReader *R) {
+  BinaryWord w = 0;
+  unsigned int shift = 0;
+  while (R->data < R->end) {
+    const unsigned char b = *R->data++;
+    if (shift < sizeof(BinaryWord) * 8)
+      w |= l_cast(BinaryWord, b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      return w;
+    shift += 7;
+  }
+  R->error = 1;
+  return 0;
+}
+
+/* Read a length-prefixed string; returning NULL for NULL (or malformed) strings. */
+static const char *binary_read_bytes(BinaryReader *R, size_t *len) {
+  const char *str = l_nullptr;
+  const BinaryWord w = binary_read(R);
+  *len = 0;
+  if (R->error || w == BINARY_REF_NULL)
+    return l_nullptr;
+  else if (w - 1 > l_cast(BinaryWord, R->end - R->data)) {
+    R->error = 1;
+    return l_nullptr;
+  }
+
+  str = l_pcast(const char *, R->data);
+  *len = l_cast(size_t, w - 1);
+  R->data += *len;
+  return str;
+}
+
+/* binary_read_bytes, returning an allocated copy; zero if the copy could not be allocated. */
+static int binary_read_string(BinaryReader *R, lmprof_Alloc *alloc, char **str, size_t *len) {
+  const char *bytes = binary_read_bytes(R, len);
+  *str = l_nullptr;
+  if (bytes == l_nullptr)
+    return 1;
+  else if ((*str = l_pcast(char *, lmprof_malloc(alloc, *len + 1))) == l_nullptr)
+    return 0;
+
+  memcpy(*str, bytes, *len);
+  (*str)[*len] = '\0';
+  return 1;
+}
+
+/* Read an event reference of the event at 'index', see binary_ref, as a global index. */
+static TraceEvent *binary_read_ref(BinaryReader *R, size_t index) {
+  BinaryWord code = binary_read(R);
+  if (code >= BINARY_REF_OFFSET) {
+    const BinarySigned target = l_cast(BinarySigned, index) + binary_unzigzag(code - BINARY_REF_OFFSET);
+    code = (target < 0) ? BINARY_REF_NULL : (l_cast(BinaryWord, target) + BINARY_REF_OFFSET);
+  }
+  return l_pcast(TraceEvent *, l_cast(lu_addr, code)); /* Resolved by binary_resolve */
+}
+
+static const lmprof_FunctionInfo *binary_read_info(BinaryTrace *T, BinaryReader *R) {
+  const BinaryWord ref = binary_read(R);
+  if (ref == BINARY_REF_NULL)
+    return l_nullptr;
+  else if (ref > l_cast(BinaryWord, T->info_count)) {
+    R->error = 1;
+    return l_nullptr;
   }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
+  return &T->infos[ref - 1];
 }
 
-static int __eventLineInstance(lua_State *L, lmprof_Report *R, const TraceEvent *event) {
-  if (R->type == lTable) {
-    lua_newtable(L);
-    luaL_settabss(L, "cat", CHROME_USER_TIMING);
-    luaL_settabss(L, "ph", "I");
-    luaL_settabss(L, "s", "t");
-    luaL_settabsi(L, "pid", event->call.proc.pid);
-    luaL_settabsi(L, "tid", event->call.proc.tid);
-    luaL_settabsi(L, "ts", l_cast(lua_Integer, LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)));
-    lua_pushfstring(L, "%s: Line %d\"", event->data.line.info->source, event->data.line.line);
-    lua_setfield(L, -2, "name");
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("cat", JSON_STRING(CHROME_USER_TIMING)));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("%s: Line %d")), event->data.line.info->source, event->data.line.line);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("t")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ts", "%" PRIluTIME ""), LMPROF_TIME_ADJ(event->call.s.time, R->st->conf));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("pid", LUA_INTEGER_FMT), event->call.proc.pid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), event->call.proc.tid);
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
-#else
-    return LMPROF_REPORT_DISABLED_IO;
-#endif
-  }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-    char ts_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    if (snprintf(ts_str, sizeof(ts_str), "%" PRIluTIME "", LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addliteral(b, JSON_ASSIGN("cat", JSON_STRING(CHROME_USER_TIMING)));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("%s: Line %d")), event->data.line.info->source, event->data.line.line);
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("t")));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("ts", "%s"), ts_str);
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("pid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.pid));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), LUA_INT_CAST(event->call.proc.tid));
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
-  }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
-}
-
-static int __eventSampleInstance(lua_State *L, lmprof_Report *R, const TraceEvent *event) {
-  const lu_time duration = event->data.sample.next->call.s.time - event->call.s.time;
-  if (R->type == lTable) {
-    lua_newtable(L);
-    luaL_settabss(L, "cat", CHROME_TIMLINE);
-    luaL_settabss(L, "name", "EvaluateScript");
-    luaL_settabss(L, "ph", "X");
-    luaL_settabsi(L, "pid", R->st->thread.mainproc.pid);
-    luaL_settabsi(L, "tid", LMPROF_THREAD_SAMPLE_TIMELINE);
-    luaL_settabsi(L, "ts", LMPROF_TIME_ADJ(event->call.s.time, R->st->conf));
-    luaL_settabsi(L, "dur", LMPROF_TIME_ADJ(duration, R->st->conf));
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMLINE)));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("EvaluateScript")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("X")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("pid", LUA_INTEGER_FMT), R->st->thread.mainproc.pid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), l_cast(lua_Integer, LMPROF_THREAD_SAMPLE_TIMELINE));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ts", "%" PRIluTIME ""), LMPROF_TIME_ADJ(event->call.s.time, R->st->conf));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("dur", "%" PRIluTIME ""), LMPROF_TIME_ADJ(duration, R->st->conf));
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
-#else
-    return LMPROF_REPORT_DISABLED_IO;
-#endif
+static const char *binary_load_header(BinaryTrace *T, BinaryReader *R) {
+  lmprof_State *st = &T->st;
+  char *str = l_nullptr;
+  size_t len = 0;
+  int flags = 0;
+
+  st->mode = l_cast(uint32_t, binary_read(R));
+  st->conf = l_cast(uint32_t, binary_read(R)) & ~l_cast(uint32_t, LMPROF_OPT_TRACE_BINARY);
+  st->thread.mainproc.pid = l_cast(lua_Integer, binary_unzigzag(binary_read(R)));
+  st->thread.mainproc.tid = l_cast(lua_Integer, binary_unzigzag(binary_read(R)));
+  st->i.counterFrequency = l_cast(lua_Integer, binary_unzigzag(binary_read(R)));
+  st->i.event_threshold = l_cast(lu_time, binary_read(R));
+  flags = l_cast(int, binary_read(R));
+  if (R->error || T->list != l_nullptr || !BITFIELD_TEST(st->mode, LMPROF_MODE_TRACE))
+    return BINARY_ERRFORMAT;
+  else if ((T->list = timeline_new(&st->hook.alloc, 0, BITFIELD_TEST(flags, TRACE_EVENT_TIMELINE_HEAP))) == l_nullptr)
+    return BINARY_ERRMEM;
+
+  st->i.trace.arg = l_pcast(void *, T->list);
+  T->list->frameCount = l_cast(size_t, binary_read(R));
+  T->list->switchCount = l_cast(size_t, binary_read(R));
+  T->list->recycleCount = l_cast(size_t, binary_read(R));
+  T->list->baseTime = l_cast(lu_time, binary_read(R));
+
+  if (!binary_read_string(R, &st->hook.alloc, &str, &len))
+    return BINARY_ERRMEM;
+  st->i.name = str;
+  if (!binary_read_string(R, &st->hook.alloc, &str, &len))
+    return BINARY_ERRMEM;
+  st->i.url = str;
+  return l_nullptr;
+}
+
+static const char *binary_load_sources(BinaryTrace *T, BinaryReader *R) {
+  size_t i, len = 0;
+  const BinaryWord count = binary_read(R);
+  if (R->error || T->sources != l_nullptr || count > l_cast(BinaryWord, R->end - R->data))
+    return BINARY_ERRFORMAT;
+  else if ((T->sources = l_pcast(char **, lmprof_malloc(&T->st.hook.alloc, l_cast(size_t, count) * sizeof(char *)))) == l_nullptr)
+    return BINARY_ERRMEM;
+
+  T->source_count = l_cast(size_t, count);
+  for (i = 0; i < T->source_count; ++i)
+    T->sources[i] = l_nullptr;
+  for (i = 0; i < T->source_count && !R->error; ++i) {
+    if (!binary_read_string(R, &T->st.hook.alloc, &T->sources[i], &len))
+      return BINARY_ERRMEM;
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-    char ts_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    char dur_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    if (snprintf(ts_str, sizeof(ts_str), "%" PRIluTIME "", LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-    if (snprintf(dur_str, sizeof(dur_str), "%" PRIluTIME "", LMPROF_TIME_ADJ(duration, R->st->conf)) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addliteral(b, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMLINE)));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("EvaluateScript")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("X")));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("pid", LUA_INT_FORMAT), LUA_INT_CAST(R->st->thread.mainproc.pid));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), LUA_INT_CAST(LMPROF_THREAD_SAMPLE_TIMELINE));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("ts", "%s"), ts_str);
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("dur", "%s"), dur_str);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
-  }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
-}
-
-static int __eventUpdateCounters(lua_State *L, lmprof_Report *R, const TraceEvent *event) {
-  if (R->type == lTable) {
-    lua_newtable(L); /* [..., process] */
-    luaL_settabss(L, "cat", CHROME_TIMLINE);
-    luaL_settabss(L, "name", "UpdateCounters");
-    luaL_settabss(L, "ph", "I");
-    luaL_settabss(L, "s", "g");
-    luaL_settabsi(L, "pid", event->call.proc.pid);
-    luaL_settabsi(L, "tid", event->call.proc.tid);
-    luaL_settabsi(L, "ts", l_cast(lua_Integer, LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)));
-
-    lua_newtable(L); /* [..., process, args] */
-    lua_newtable(L); /* [..., process, args, data] */
-    luaL_settabsi(L, "jsHeapSizeUsed", l_cast(lua_Integer, unit_allocated(&event->call.s)));
-    /*
-      luaL_settabsi(L, "documents", 0);
-      luaL_settabsi(L, "jsEventListeners", 0);
-      luaL_settabsi(L, "nodes", 0);
-    */
-    lua_setfield(L, -2, "data"); /* [..., process, args] */
-    lua_setfield(L, -2, "args"); /* [..., process] */
-    return LUA_OK;
-  }
-  else if (R->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    FILE *f = R->f.file;
-
-    REPORT_ENSURE_FILE_DELIM(R);
-    fprintf(f, JSON_OPEN_OBJ);
-    fprintf(f, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMLINE)));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("UpdateCounters")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("g")));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("pid", LUA_INTEGER_FMT), event->call.proc.pid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("tid", LUA_INTEGER_FMT), event->call.proc.tid);
-    fprintf(f, JSON_DELIM JSON_ASSIGN("ts", "%" PRIluTIME ""), LMPROF_TIME_ADJ(event->call.s.time, R->st->conf));
-    fprintf(f, JSON_DELIM JSON_ASSIGN("args", JSON_OPEN_OBJ));
-    fprintf(f, JSON_ASSIGN("data", JSON_OPEN_OBJ));
-    fprintf(f, JSON_ASSIGN("jsHeapSizeUsed", "%" PRIluSIZEDIFF), unit_allocated(&event->call.s));
-    fprintf(f, JSON_CLOSE_OBJ);
-    fprintf(f, JSON_CLOSE_OBJ);
-    fprintf(f, JSON_CLOSE_OBJ);
-    R->f.delim = 1;
-    return LUA_OK;
-#else
-    return LMPROF_REPORT_DISABLED_IO;
-#endif
+  return l_nullptr;
+}
+
+static const char *binary_load_functions(BinaryTrace *T, BinaryReader *R) {
+  size_t i;
+  const BinaryWord count = binary_read(R);
+  if (R->error || T->infos != l_nullptr || count > l_cast(BinaryWord, R->end - R->data))
+    return BINARY_ERRFORMAT;
+  else if ((T->infos = l_pcast(lmprof_FunctionInfo *, lmprof_malloc(&T->st.hook.alloc, l_cast(size_t, count) * sizeof(lmprof_FunctionInfo)))) == l_nullptr)
+    return BINARY_ERRMEM;
+
+  T->info_count = l_cast(size_t, count);
+  memset(T->infos, 0, T->info_count * sizeof(lmprof_FunctionInfo));
+  for (i = 0; i < T->info_count && !R->error; ++i) {
+    lmprof_FunctionInfo *info = &T->infos[i];
+    BinaryWord source = 0;
+
+    info->event = l_cast(int, l_cast(uint32_t, binary_read(R)));
+    if ((source = binary_read(R)) > l_cast(BinaryWord, T->source_count))
+      return BINARY_ERRFORMAT;
+    else if (source != BINARY_REF_NULL)
+      info->source = T->sources[source - 1];
   }
-  else if (R->type == lBuffer) {
-    luaL_Buffer *b = &R->b.buff;
-    char hs_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    char ts_str[IDENTIFIER_BUFFER_LENGTH] = LMPROF_ZERO_STRUCT;
-    if (snprintf(ts_str, sizeof(ts_str), "%" PRIluTIME "", LMPROF_TIME_ADJ(event->call.s.time, R->st->conf)) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-    if (snprintf(hs_str, sizeof(hs_str), "%" PRIluSIZEDIFF "", unit_allocated(&event->call.s)) < 0)
-      LMPROF_LOG("<%s>:sprintf encoding error\n", __FUNCTION__);
-
-    REPORT_ENSURE_BUFFER_DELIM(R);
-    luaL_addliteral(b, JSON_OPEN_OBJ);
-    luaL_addliteral(b, JSON_ASSIGN("cat", JSON_STRING(CHROME_TIMLINE)));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("name", JSON_STRING("UpdateCounters")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("ph", JSON_STRING("I")));
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("s", JSON_STRING("g")));
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("pid", LUA_INT_FORMAT), event->call.proc.pid);
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("tid", LUA_INT_FORMAT), event->call.proc.tid);
-    luaL_addfstring(L, b, JSON_DELIM JSON_ASSIGN("ts", "%s"), ts_str);
-    luaL_addliteral(b, JSON_DELIM JSON_ASSIGN("args", JSON_OPEN_OBJ));
-    luaL_addliteral(b, JSON_ASSIGN("data", JSON_OPEN_OBJ));
-    luaL_addfstring(L, b, JSON_ASSIGN("jsHeapSizeUsed", "%s"), hs_str);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    luaL_addliteral(b, JSON_CLOSE_OBJ);
-    R->b.delim = 1;
-    return LUA_OK;
-  }
-  return LMPROF_REPORT_UNKNOWN_TYPE;
+  return l_nullptr;
 }
 
-/*
-** Append the chromium required CrBrowserMain/CrRendererMain metaevents to
-** correctly format the profiled events.
-*/
-static void tracevent_table_header(lua_State *L, lmprof_Report *R, const TraceEventTimeline *list) {
-  lmprof_EventProcess browser = { R->st->thread.mainproc.pid, LMPROF_THREAD_BROWSER };
-  lmprof_EventProcess renderer = { R->st->thread.mainproc.pid, R->st->thread.mainproc.tid };
-  lmprof_EventProcess sampler = { R->st->thread.mainproc.pid, LMPROF_THREAD_SAMPLE_TIMELINE };
-  luaL_checkstack(L, 3, __FUNCTION__);
-  UNUSED(list);
+static const char *binary_load_threads(BinaryTrace *T, BinaryReader *R) {
+  size_t i;
+  const BinaryWord count = binary_read(R);
+  if (R->error || T->list == l_nullptr || T->list->threads->count > 0)
+    return BINARY_ERRFORMAT;
+
+  for (i = 0; i < l_cast(size_t, count) && !R->error; ++i) {
+    unsigned int id = 0;
+    lmprof_EventProcess proc;
+    proc.pid = l_cast(lua_Integer, binary_unzigzag(binary_read(R)));
+    proc.tid = l_cast(lua_Integer, binary_unzigzag(binary_read(R)));
+    if (timeline_intern(T->list, proc, &id) != TRACE_EVENT_OK)
+      return BINARY_ERRMEM;
+    else if (id != i) /* Duplicate identifiers */
+      return BINARY_ERRFORMAT;
+  }
+  return l_nullptr;
+}
 
-  /* Default process information */
-  REPORT_TABLE_APPEND(L, R, __metaProcess(L, R, &browser, CHROME_META_PROCESS, CHROME_NAME_BROWSER));
-  REPORT_TABLE_APPEND(L, R, __metaProcess(L, R, &browser, CHROME_META_THREAD, CHROME_NAME_CR_BROWSER));
-  REPORT_TABLE_APPEND(L, R, __metaProcess(L, R, &renderer, CHROME_META_THREAD, CHROME_NAME_CR_RENDERER));
-  REPORT_TABLE_APPEND(L, R, __metaProcess(L, R, &sampler, CHROME_META_THREAD, CHROME_NAME_SAMPLER));
-  if (!BITFIELD_TEST(R->st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING)) {
-    REPORT_TABLE_APPEND(L, R, __metaTracingStarted(L, R, &browser, R->st->i.name, R->st->i.url));
+/* Append the thread identifier/name pairs to the array at 'names'. */
+static const char *binary_load_names(lua_State *L, BinaryReader *R, int names) {
+  size_t i, len = 0;
+  int n = 0;
+  const BinaryWord count = binary_read(R);
+  for (i = 0; i < l_cast(size_t, count) && !R->error; ++i) {
+    const lua_Integer tid = l_cast(lua_Integer, binary_unzigzag(binary_read(R)));
+    const char *name = binary_read_bytes(R, &len);
+    if (name != l_nullptr) {
+      lua_pushinteger(L, tid);
+      lua_rawseti(L, names, ++n);
+      lua_pushlstring(L, name, len);
+      lua_rawseti(L, names, ++n);
+    }
   }
+  return l_nullptr;
+}
 
-  /* Named threads */
-  if (BITFIELD_TEST(R->st->conf, LMPROF_OPT_TRACE_LAYOUT_SPLIT)) {
-    lmprof_thread_info(L, LMPROF_TAB_THREAD_NAMES); /* [..., names] */
-    lua_pushnil(L); /* [..., names, nil] */
-    while (lua_next(L, -2) != 0) { /* [..., names, key, value] */
-      if (lua_isnumber(L, -2)) {
-        const char *name = lua_tostring(L, -1);
-
-        lmprof_EventProcess thread;
-        thread.pid = LMPROF_PROCESS_MAIN;
-        thread.tid = lua_tointeger(L, -2);
-
-        REPORT_TABLE_APPEND(L, R, __metaProcess(L, R, &thread, CHROME_META_THREAD, name));
-      }
-      lua_pop(L, 1); /* [..., names, key] */
+/* Append the events of a page section to the timeline (or its prologue). */
+static const char *binary_load_events(BinaryTrace *T, BinaryReader *R, int prologue, size_t *index) {
+  size_t i;
+  lu_time time = 0;
+  lu_sizediff heap = 0;
+  TraceEventTimeline *list = l_nullptr;
+  const BinaryWord count = binary_read(R);
+  if (R->error || T->list == l_nullptr)
+    return BINARY_ERRFORMAT;
+  else if ((list = prologue ? timeline_prologue(T->list) : T->list) == l_nullptr)
+    return BINARY_ERRMEM;
+
+  for (i = 0; i < l_cast(size_t, count) && !R->error; ++i) {
+    TraceEvent *event = l_nullptr;
+    unsigned int op = 0, flags = 0;
+    BinaryWord thread = 0;
+    int line = 0;
+    if (R->data >= R->end)
+      return BINARY_ERRFORMAT;
+
+    op = *R->data & 0xF;
+    flags = *R->data >> 4;
+    R->data++;
+
+    thread = binary_read(R);
+    time += l_cast(lu_time, binary_unzigzag(binary_read(R)));
+    line = l_cast(int, binary_unzigzag(binary_read(R)));
+    if (BITFIELD_TEST(list->flags, TRACE_EVENT_TIMELINE_HEAP))
+      heap += l_cast(lu_sizediff, binary_unzigzag(binary_read(R)));
+    if (R->error || op > IGNORE_SCOPE || thread >= l_cast(BinaryWord, T->list->threads->count))
+      return BINARY_ERRFORMAT;
+    else if ((event = timeline_reserve(list, heap)) == l_nullptr)
+      return BINARY_ERRMEM;
+
+    memset(&event->data, 0, sizeof(event->data));
+    event->op = op;
+    event->flags = flags;
+    event->thread = l_cast(unsigned int, thread);
+    event->time = time;
+    event->line = line;
+    switch (op) {
+      case BEGIN_FRAME:
+      case END_FRAME:
+        event->data.frame.frame = l_cast(size_t, binary_read(R));
+        break;
+      case SWITCH_ROUTINE:
+        event->data.routine.from = l_cast(unsigned int, binary_read(R));
+        event->data.routine.to = l_cast(unsigned int, binary_read(R));
+        event->data.routine.frame = l_cast(size_t, binary_read(R));
+        event->data.routine.count = l_cast(size_t, binary_read(R));
+        if (event->data.routine.from >= T->list->threads->count || event->data.routine.to >= T->list->threads->count)
+          return BINARY_ERRFORMAT;
+        break;
+      case LINE_SCOPE:
+        if ((event->data.line.info = binary_read_info(T, R)) == l_nullptr)
+          return BINARY_ERRFORMAT;
+        event->data.line.previous = binary_read_ref(R, *index);
+        event->data.line.next = binary_read_ref(R, *index);
+        break;
+      case SAMPLE_EVENT:
+        event->data.sample.next = binary_read_ref(R, *index);
+        break;
+      case PROCESS:
+      case THREAD:
+        if (!binary_read_string(R, list->page_allocator, &event->data.process.name, &event->data.process.nameLen))
+          return BINARY_ERRMEM;
+        break;
+      default: /* Scopes are formatted with their function info; routines have none */
+        event->data.event.info = binary_read_info(T, R);
+        if (event->data.event.info == l_nullptr && (op == ENTER_SCOPE || op == EXIT_SCOPE))
+          return BINARY_ERRFORMAT;
+        event->data.event.sibling = binary_read_ref(R, *index);
+        event->data.event.lines = binary_read_ref(R, *index);
+        break;
     }
-    lua_pop(L, 1);
+    (*index)++;
+  }
+  return l_nullptr;
+}
+
+/* Index the (densely packed) pages of a rebuilt timeline */
+static int binary_index(lmprof_Alloc *alloc, const TraceEventTimeline *list, BinaryIndex *X) {
+  TraceEventPage *page = l_nullptr;
+  X->pages = l_nullptr;
+  X->count = X->events = 0;
+  if (list == l_nullptr)
+    return 1;
+
+  for (page = list->head; page != l_nullptr; page = page->next)
+    X->count++;
+  if ((X->pages = l_pcast(TraceEventPage **, lmprof_malloc(alloc, X->count * sizeof(TraceEventPage *)))) == l_nullptr)
+    return 0;
+
+  X->count = 0;
+  for (page = list->head; page != l_nullptr; page = page->next) {
+    X->pages[X->count++] = page;
+    X->events += page->count;
   }
+  return 1;
 }
 
+/* Event reference fields, see binary_resolve_ref */
+#define BINARY_LINK_SIBLING 0 /* ENTER_SCOPE/EXIT_SCOPE 'sibling' */
+#define BINARY_LINK_LINES 1 /* ENTER_SCOPE 'lines': the most recent line */
+#define BINARY_LINK_PREVIOUS 2 /* LINE_SCOPE 'previous' */
+#define BINARY_LINK_NEXT 3 /* LINE_SCOPE 'next' */
+#define BINARY_LINK_SAMPLE 4 /* SAMPLE_EVENT 'next' */
+
 /*
-** Assuming a LUA_TTABLE is on top of the provided lua_State, format all trace
-** buffered trace events and append them to the array, starting at "arrayIndex"
+** Return true if 'target' may be referenced by the 'link' field of the event at
+** (global) index 'index'; see traceevent_exitscope and traceevent_sample. Line
+** lists are strictly ordered, i.e., cannot form a cycle.
 */
-static void traceevent_table_events(lua_State *L, lmprof_Report *R, TraceEventTimeline *list) {
-  lmprof_State *st = R->st;
-  TraceEventPage *page = l_nullptr; /* Page iterator */
-  TraceEvent *samples = l_nullptr; /* Linked-list of SAMPLE_EVENT events*/
+static int binary_link_valid(const TraceEvent *event, size_t index, int link, const TraceEvent *target, size_t target_index) {
+  const unsigned int op = target->op;
+  switch (link) {
+    case BINARY_LINK_SIBLING:
+      if (target == event || !op_event(op))
+        return 0;
+      else if (event->op == ENTER_SCOPE) /* Relocated events reference their copy */
+        return op == IGNORE_SCOPE || op == ((event->flags & TRACE_EVENT_RELOCATED) ? ENTER_SCOPE : EXIT_SCOPE);
+      else if (event->op == EXIT_SCOPE)
+        return op == IGNORE_SCOPE || op == ENTER_SCOPE;
+      return 1;
+    case BINARY_LINK_LINES:
+    case BINARY_LINK_NEXT:
+      return (op == LINE_SCOPE || op == IGNORE_SCOPE) && target_index > index;
+    case BINARY_LINK_PREVIOUS:
+      return (op == LINE_SCOPE || op == IGNORE_SCOPE) && target_index < index;
+    case BINARY_LINK_SAMPLE:
+      return op == SAMPLE_EVENT;
+    default:
+      return 0;
+  }
+}
 
-  size_t counter = 0;
-  size_t counterFrequency = TRACE_EVENT_COUNTER_FREQ;
+/*
+** Replace the encoded 'link' reference of the event at 'index', see
+** binary_read_ref, with the event it references. Returning zero if the
+** reference is out of bounds or to an event of an unexpected type.
+*/
+static int binary_resolve_ref(TraceEventTimeline *list, const BinaryIndex *X, TraceEvent *event, size_t index, int link, TraceEvent **ref) {
+  const size_t size = timeline_event_array_size(list);
+  const lu_addr code = l_pcast(lu_addr, *ref);
+  size_t t, target, local;
+  if (code == BINARY_REF_NULL)
+    return 1;
+  else if (code == BINARY_REF_DETACHED) { /* Stand-in for an ENTER_SCOPE */
+    *ref = &list->detached;
+    return link == BINARY_LINK_SIBLING && event->op != ENTER_SCOPE;
+  }
 
-  timeline_adjust(list);
-  if (st->i.counterFrequency > 0)
-    counterFrequency = l_cast(size_t, st->i.counterFrequency);
+  *ref = l_nullptr;
+  target = local = l_cast(size_t, code - BINARY_REF_OFFSET);
+  for (t = 0; t < 2; ++t) { /* Prologue, then the timeline */
+    if (local < X[t].events) {
+      TraceEvent *referenced = &X[t].pages[local / size]->event_array[local % size];
+      if (!binary_link_valid(event, index, link, referenced, target))
+        return 0;
 
-  /* Compress small records to reduce size of output */
-  if (BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_COMPRESS)) {
-    int result;
-    TraceEventCompressOpts opts;
-    opts.id.pid = 0;
-    opts.id.tid = 0;
-    opts.threshold = st->i.event_threshold;
-    if ((result = timeline_compress(list, opts)) != TRACE_EVENT_OK) {
-      luaL_error(L, "trace event compression error: %d", result);
-      return;
+      *ref = referenced;
+      return 1;
     }
+    local -= X[t].events;
   }
+  return 0;
+}
 
-  luaL_checkstack(L, 8, __FUNCTION__);
-  for (page = list->head; page != l_nullptr; page = page->next) {
-    size_t i;
-    for (i = 0; i < page->count; ++i) {
-      TraceEvent *event = &page->event_array[i];
-      TraceEventType op = event->op;
-      if (op == ENTER_SCOPE || op == EXIT_SCOPE) {
-        if (BITFIELD_TEST(event->data.event.info->event, LMPROF_RECORD_IGNORED | LMPROF_RECORD_ROOT))
-          op = IGNORE_SCOPE; /* Function "ignored" during profiling */
-      }
-
-      switch (op) {
-        case BEGIN_FRAME: {
-          REPORT_TABLE_APPEND(L, R, __enterFrame(L, R, event));
-          break;
-        }
-        case END_FRAME: {
-          REPORT_TABLE_APPEND(L, R, __exitFrame(L, R, event));
-          REPORT_TABLE_APPEND(L, R, __drawFrame(L, R, event));
-          break;
-        }
-        case BEGIN_ROUTINE: {
-          REPORT_TABLE_APPEND(L, R, __eventScope(L, R, event, CHROME_META_BEGIN, __threadName(L, R, event)));
-          break;
-        }
-        case END_ROUTINE: {
-          REPORT_TABLE_APPEND(L, R, __eventScope(L, R, event, CHROME_META_END, __threadName(L, R, event)));
-          break;
-        }
-        case LINE_SCOPE: {
-          REPORT_TABLE_APPEND(L, R, __eventLineInstance(L, R, event));
-          break;
-        }
-        case SAMPLE_EVENT: {
-          if (samples != l_nullptr) {
-            samples->data.sample.next = event;
-            REPORT_TABLE_APPEND(L, R, __eventSampleInstance(L, R, samples));
-          }
-          samples = event;
-          break;
-        }
-        case ENTER_SCOPE: {
-          REPORT_TABLE_APPEND(L, R, __eventScope(L, R, event, CHROME_META_BEGIN, CHROME_EVENT_NAME(event)));
-          if (BITFIELD_TEST(st->mode, LMPROF_MODE_MEMORY) && (counterFrequency == 1 || ((++counter) % counterFrequency) == 0)) {
-            REPORT_TABLE_APPEND(L, R, __eventUpdateCounters(L, R, event));
-            counter = 0;
-          }
-          break;
-        }
-        case EXIT_SCOPE: {
-          REPORT_TABLE_APPEND(L, R, __eventScope(L, R, event, CHROME_META_END, CHROME_EVENT_NAME(event)));
-          if (BITFIELD_TEST(st->mode, LMPROF_MODE_MEMORY) && (counterFrequency == 1 || ((++counter) % counterFrequency) == 0)) {
-            REPORT_TABLE_APPEND(L, R, __eventUpdateCounters(L, R, event));
-            counter = 0;
-          }
-          break;
-        }
-        case PROCESS: {
-          REPORT_TABLE_APPEND(L, R, __metaProcess(L, R, &event->call.proc, CHROME_META_PROCESS, CHROME_OPT_NAME(event->data.process.name, CHROME_NAME_PROCESS)));
-          break;
-        }
-        case THREAD: {
-          REPORT_TABLE_APPEND(L, R, __metaProcess(L, R, &event->call.proc, CHROME_META_THREAD, CHROME_OPT_NAME(event->data.process.name, CHROME_NAME_PROCESS)));
+/* Resolve all event references of the rebuilt timeline. */
+static const char *binary_resolve(BinaryTrace *T) {
+  const char *error = l_nullptr;
+  TraceEventTimeline *list = T->list;
+  BinaryIndex X[2];
+  size_t t, p, i, index = 0;
+
+  X[1].pages = l_nullptr;
+  X[1].count = 0;
+  if (!binary_index(&T->st.hook.alloc, list->prologue, &X[0]) || !binary_index(&T->st.hook.alloc, list, &X[1]))
+    error = BINARY_ERRMEM;
+
+  for (t = 0; t < 2 && error == l_nullptr; ++t) {
+    for (p = 0; p < X[t].count && error == l_nullptr; ++p) {
+      TraceEventPage *page = X[t].pages[p];
+      for (i = 0; i < page->count; ++i, ++index) {
+        TraceEvent *event = &page->event_array[i];
+        int ok = 1;
+        if (event->op == LINE_SCOPE)
+          ok = binary_resolve_ref(list, X, event, index, BINARY_LINK_PREVIOUS, &event->data.line.previous)
+               & binary_resolve_ref(list, X, event, index, BINARY_LINK_NEXT, &event->data.line.next);
+        else if (event->op == SAMPLE_EVENT)
+          ok = binary_resolve_ref(list, X, event, index, BINARY_LINK_SAMPLE, &event->data.sample.next);
+        else if (op_routine(event->op)) /* Routines reference no other event */
+          ok = event->data.event.sibling == l_nullptr && event->data.event.lines == l_nullptr;
+        else if (binary_op_info(event->op))
+          ok = binary_resolve_ref(list, X, event, index, BINARY_LINK_SIBLING, &event->data.event.sibling)
+               & binary_resolve_ref(list, X, event, index, BINARY_LINK_LINES, &event->data.event.lines);
+
+        if (!ok) {
+          error = BINARY_ERRFORMAT;
           break;
         }
-        case IGNORE_SCOPE:
-          break;
-        default:
-          return;
       }
     }
   }
-}
 
-static int traceevent_report_header(lua_State *L, lmprof_Report *R) {
-  if (R->type == lTable) {
-    lmprof_State *st = R->st;
-    const TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
+  for (t = 0; t < 2; ++t)
+    lmprof_free(&T->st.hook.alloc, l_pcast(void *, X[t].pages), X[t].count * sizeof(TraceEventPage *));
+  return error;
+}
 
-    profiler_header(L, R);
-    luaL_settabsb(L, "compress", BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_COMPRESS));
-    luaL_settabsi(L, "eventsize", l_cast(lua_Integer, sizeof(TraceEvent)));
-    luaL_settabsi(L, "eventpages", l_cast(lua_Integer, timeline_event_array_size()));
+/* Rebuild the profiler state and timeline of a binary dump; returning an error message on failure. */
+static const char *binary_load(lua_State *L, BinaryTrace *T, int names) {
+  const char *error = l_nullptr;
+  size_t index = 0;
+  int events = 0;
+
+  BinaryReader R;
+  R.data = T->data;
+  R.end = T->data + T->size;
+  R.error = 0;
+  if (T->size <= sizeof(BINARY_MAGIC) - 1 || memcmp(T->data, BINARY_MAGIC, sizeof(BINARY_MAGIC) - 1) != 0)
+    return "not a binary trace";
+  else if (T->data[sizeof(BINARY_MAGIC) - 1] != BINARY_VERSION)
+    return "unsupported binary trace version";
+
+  R.data += (sizeof(BINARY_MAGIC) - 1) + 1; /* Magic & version */
+  while (R.data < R.end && error == l_nullptr) {
+    BinaryReader S;
+    const int tag = *R.data++;
+    const BinaryWord length = binary_read(&R);
+    if (R.error || length > l_cast(BinaryWord, R.end - R.data))
+      return BINARY_ERRFORMAT;
+
+    S.data = R.data;
+    S.end = R.data + l_cast(size_t, length);
+    S.error = 0;
+    R.data = S.end;
+    switch (tag) {
+      case BINARY_HEADER:
+        error = binary_load_header(T, &S);
+        break;
+      case BINARY_SOURCES:
+        error = binary_load_sources(T, &S);
+        break;
+      case BINARY_FUNCTIONS:
+        error = binary_load_functions(T, &S);
+        break;
+      case BINARY_THREADS:
+        error = binary_load_threads(T, &S);
+        break;
+      case BINARY_NAMES:
+        error = binary_load_names(L, &S, names);
+        break;
+      case BINARY_PROLOGUE:
+        error = events ? BINARY_ERRFORMAT : binary_load_events(T, &S, 1, &index);
+        break;
+      case BINARY_EVENTS:
+        events = 1;
+        error = binary_load_events(T, &S, 0, &index);
+        break;
+      case BINARY_END:
+        return (T->list == l_nullptr) ? BINARY_ERRFORMAT : binary_resolve(T);
+      default: /* Unknown sections are skipped */
+        break;
+    }
 
-    luaL_settabsi(L, "usedpages", l_cast(lua_Integer, list->pageCount));
-    luaL_settabsi(L, "totalpages", l_cast(lua_Integer, list->pageLimit));
-    luaL_settabsi(L, "pagelimit", l_cast(lua_Integer, list->pageLimit * timeline_page_size()));
-    luaL_settabsi(L, "pagesize", l_cast(lua_Integer, timeline_page_size()));
-    luaL_settabsn(L, "pageusage", l_cast(lua_Number, timeline_usage(list)));
+    if (error == l_nullptr && S.error)
+      error = BINARY_ERRFORMAT;
   }
-  return LUA_OK;
+  return (error == l_nullptr) ? BINARY_ERRFORMAT : error;
 }
 
-static int traceevent_report(lua_State *L, lmprof_Report *report) {
-  lmprof_State *st = report->st;
-  TraceEventTimeline *list = l_pcast(TraceEventTimeline *, st->i.trace.arg);
-  if (report->type == lTable) {
-    const int prev_table = report->t.table_index;
-
-    lua_newtable(L); /* [..., header_table] */
-    report->t.table_index = lua_absindex(L, -1);
-    traceevent_report_header(L, report);
-    lua_setfield(L, prev_table, "header");
-    report->t.table_index = prev_table;
-
-    lua_newtable(L); /* [..., records] */
-    report->t.table_index = lua_absindex(L, -1);
-    if (BITFIELD_TEST(report->st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING)) {
-      lua_newtable(L); /* [..., records, traceEvents] */
-      tracevent_table_header(L, report, list);
-      traceevent_table_events(L, report, list);
-      lua_setfield(L, -2, "traceEvents"); /* [..., records] */
-      __metaAbout(L, report, LMPROF, LUA_VERSION); /* [..., records, metadata] */
-      lua_setfield(L, -2, "metadata"); /* [..., records] */
-    }
-    else {
-      tracevent_table_header(L, report, list);
-      traceevent_table_events(L, report, list);
+/* Read the contents of a file into the binary trace; returning zero on failure. */
+static int binary_read_file(BinaryTrace *T, FILE *f) {
+  for (;;) {
+    size_t n = 0;
+    if (T->size == T->capacity) {
+      const size_t capacity = (T->capacity == 0) ? 65536 : (T->capacity << 1);
+      unsigned char *data = l_pcast(unsigned char *, lmprof_realloc(&T->st.hook.alloc, T->data, T->capacity, capacity));
+      if (data == l_nullptr)
+        return 0;
+      T->data = data;
+      T->capacity = capacity;
     }
 
-    lua_setfield(L, prev_table, "records");
-    report->t.table_index = prev_table;
-    return LUA_OK;
+    n = fread(T->data + T->size, 1, T->capacity - T->size, f);
+    T->size += n;
+    if (n == 0)
+      return !ferror(f);
   }
-  else if (report->type == lFile) {
-#if defined(LMPROF_FILE_API)
-    if (BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING))
-      fprintf(report->f.file, JSON_OPEN_OBJ JSON_STRING("traceEvents") ":" JSON_OPEN_ARRAY JSON_NEWLINE);
-    else
-      fprintf(report->f.file, JSON_OPEN_ARRAY JSON_NEWLINE);
-
-    tracevent_table_header(L, report, list);
-    traceevent_table_events(L, report, list);
-    if (BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING)) {
-      report->f.delim = 0;
-      fprintf(report->f.file, JSON_CLOSE_ARRAY JSON_DELIM);
-      __metaAbout(L, report, LMPROF, LUA_VERSION);
-      fprintf(report->f.file, JSON_CLOSE_OBJ JSON_NEWLINE);
-    }
-    else {
-      fprintf(report->f.file, JSON_NEWLINE JSON_CLOSE_ARRAY JSON_NEWLINE);
-    }
-    return LUA_OK;
+}
+
+static void binary_free(BinaryTrace *T) {
+  lmprof_Alloc *alloc = &T->st.hook.alloc;
+  size_t i;
+  if (T->list != l_nullptr)
+    timeline_free(T->list);
+  for (i = 0; i < T->source_count; ++i) {
+    if (T->sources[i] != l_nullptr)
+      lmprof_strdup_free(alloc, T->sources[i], 0);
+  }
+  if (T->st.i.name != l_nullptr)
+    lmprof_strdup_free(alloc, T->st.i.name, 0);
+  if (T->st.i.url != l_nullptr)
+    lmprof_strdup_free(alloc, T->st.i.url, 0);
+
+  lmprof_free(alloc, l_pcast(void *, T->sources), T->source_count * sizeof(char *));
+  lmprof_free(alloc, l_pcast(void *, T->infos), T->info_count * sizeof(lmprof_FunctionInfo));
+  lmprof_free(alloc, l_pcast(void *, T->data), T->capacity);
+  T->list = l_nullptr;
+  T->sources = l_nullptr;
+  T->infos = l_nullptr;
+  T->data = l_nullptr;
+  T->st.i.name = T->st.i.url = l_nullptr;
+  T->source_count = T->info_count = T->size = T->capacity = 0;
+}
+
+static int binary_gc(lua_State *L) {
+  binary_free(l_pcast(BinaryTrace *, luaL_checkudata(L, 1, LMPROF_BINARY_METATABLE)));
+  return 0;
+}
+
+#endif
+/* }================================================================== */
+
+/*
+** {==================================================================
+** Asynchronous Reports
+** ===================================================================
+*/
+
+/* @SEE API */
+static void lmprof_resolve_records(lua_State *L, lmprof_State *st);
+static int report_thread_names(lua_State *L);
+
+/*
+** A report whose formatting, see lmprof_report_async, is finished by a worker
+** thread. The reporting thread resolves everything that requires the Lua API:
+** records, thread names, and the report header; and moves the profile data of
+** the profiler state to the handle. As with the stream writer, the worker only
+** formats events and writes to the file: the profile data is released by the
+** reporting thread once the worker has been joined.
+*/
+typedef struct lmprof_Async {
+  int result; /* Report written; valid once the worker has been joined */
+#if LMPROF_HAS_THREADS
+  int running; /* The worker requires joining */
+  int done; /* The worker has finished */
+  lmprof_State snapshot; /* Owner of the profile data; see lmprof_move_state */
+  lmprof_Report report;
+  TraceEventFormat F;
+  size_t thread_count; /* Number of interned threads, i.e., the length of F.threads */
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  lmprof_IO io; /* Sink of the report */
+  char iobuf[LMPROF_IO_BUFFER]; /* stdio buffer of io.file */
+#endif
+} lmprof_Async;
+
+#if LMPROF_HAS_THREADS
+static void *async_main(void *args) {
+  lmprof_Async *A = l_pcast(lmprof_Async *, args);
+  lmprof_Report *R = &A->report;
+  TraceEventTimeline *list = l_pcast(TraceEventTimeline *, A->snapshot.i.trace.arg);
+  int result = 0;
+
+  if (traceevent_table_adjust(&A->snapshot, list) != TRACE_EVENT_OK)
+    R->error = 1;
+  else if (list->prologue == l_nullptr || traceevent_table_pages(l_nullptr, R, &A->F, list->prologue->head))
+    traceevent_table_pages(l_nullptr, R, &A->F, list->head);
+  traceevent_close(R);
+
+  result = !R->error;
+  result = io_close(&A->io) && result;
+
+  pthread_mutex_lock(&A->lock);
+  A->result = result;
+  A->done = 1;
+  pthread_mutex_unlock(&A->lock);
+  return l_nullptr;
+}
+
+/* Release the profile data moved to the handle. */
+static void async_free(lmprof_Async *A) {
+  lmprof_State *st = &A->snapshot;
+  if (A->F.threads != l_nullptr) {
+    lmprof_free(&st->hook.alloc, l_pcast(void *, A->F.threads), (A->thread_count + 1) * sizeof(const char *));
+    A->F.threads = l_nullptr;
+  }
+
+  if (st->i.trace.free != l_nullptr) /* Before the page providers, see lmprof_clear_state */
+    st->i.trace.free(l_nullptr, st->i.trace.arg);
+  st->i.trace.arg = l_nullptr;
+  st->i.trace.free = l_nullptr;
+  lmprof_clear_state(l_nullptr, st);
+}
+
+/* Timelines allocating from 'from', i.e., the moved profiler state, allocate from 'to' */
+static void async_rebind(TraceEventTimeline *list, const lmprof_Alloc *from, lmprof_Alloc *to) {
+  if (list->page_allocator == from)
+    list->page_allocator = to;
+  if (list->synthetic != l_nullptr && list->synthetic->page_allocator == from)
+    list->synthetic->page_allocator = to;
+  if (list->prologue != l_nullptr && list->prologue->page_allocator == from)
+    list->prologue->page_allocator = to;
+}
+
+/*
+** Begin an asynchronous report of the profiler state to 'file': the handle is
+** at the top of the stack. Returning zero if the report of the profiler state
+** cannot be finished without the Lua API, e.g., graph reports, streamed or
+** binary traces; one otherwise.
+*/
+static int async_start(lua_State *L, lmprof_Async *A, lmprof_State *st, const char *file) {
+  lmprof_Report *R = &A->report;
+  TraceEventTimeline *list = l_nullptr;
+
+  int result = TRACE_EVENT_OK;
+  size_t i, size = 0;
+  if (!BITFIELD_TEST(st->mode, LMPROF_MODE_TRACE) || BITFIELD_TEST(st->mode, LMPROF_MODE_TIME | LMPROF_MODE_EXT_CALLBACK))
+    return 0;
+  else if ((list = l_pcast(TraceEventTimeline *, st->i.trace.arg)) == l_nullptr)
+    return 0;
+  else if (st->i.writer != l_nullptr || BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_BINARY))
+    return 0; /* Streamed or dumped */
+
+  /* Rebuild the scope events of each (compact) coroutine switch: allocates */
+  if ((result = timeline_expand(list)) != TRACE_EVENT_OK)
+    return luaL_error(L, "trace event expansion error: %d", result);
+
+  lmprof_resolve_records(L, st);
+  traceevent_format_init(st, &A->F);
+  A->thread_count = list->threads->count;
+  size = (A->thread_count + 1) * sizeof(const char *);
+  if ((A->F.threads = l_pcast(const char **, lmprof_malloc(&st->hook.alloc, size))) == l_nullptr)
+    return 1; /* Failure */
+  else if (!io_open(&A->io, file, "w", io_compressed(file), A->iobuf)) {
+    lmprof_free(&st->hook.alloc, l_pcast(void *, A->F.threads), size);
+    A->F.threads = l_nullptr;
+    return 1; /* Failure */
+  }
+
+  /* Snapshot of the named threads: anchoring each name until the handle is collected */
+  R->st = st;
+  R->names = report_thread_names(L); /* [..., handle, names] */
+  R->lookup = 1;
+  report_init(R, l_nullptr, lWriter, io_write, l_pcast(void *, &A->io));
+  for (i = 0; i < A->thread_count; ++i)
+    A->F.threads[i] = __threadName(L, R, timeline_thread(list, l_cast(unsigned int, i)));
+
+  traceevent_open(R);
+  tracevent_table_header(L, R, list);
+  R->names = 0;
+#if LUA_VERSION_NUM >= 504
+  lua_setiuservalue(L, -2, 1);
+#elif LUA_VERSION_NUM >= 502
+  lua_setuservalue(L, -2);
 #else
-    return LMPROF_REPORT_DISABLED_IO;
+  lua_setfenv(L, -2);
 #endif
+
+  /* The worker owns the events until joined */
+  if (list->synthetic != l_nullptr)
+    A->F.synthetic = list->synthetic->head;
+  lmprof_move_state(st, &A->snapshot);
+  async_rebind(list, &st->hook.alloc, &A->snapshot.hook.alloc);
+  R->st = &A->snapshot;
+
+  A->done = 0;
+  pthread_mutex_init(&A->lock, l_nullptr);
+  if (pthread_create(&A->thread, l_nullptr, async_main, l_pcast(void *, A)) != 0) {
+    async_main(l_pcast(void *, A)); /* Formatted by the reporting thread */
+    pthread_mutex_destroy(&A->lock);
+    async_free(A);
   }
-  else if (report->type == lBuffer) {
-    if (BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING))
-      luaL_addliteral(&report->b.buff, JSON_OPEN_OBJ JSON_STRING("traceEvents") ":" JSON_OPEN_ARRAY JSON_NEWLINE);
-    else
-      luaL_addliteral(&report->b.buff, JSON_OPEN_ARRAY JSON_NEWLINE);
-
-    tracevent_table_header(L, report, list);
-    traceevent_table_events(L, report, list);
-    if (BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_ABOUT_TRACING)) {
-      report->f.delim = 0;
-      luaL_addliteral(&report->b.buff, JSON_CLOSE_ARRAY JSON_DELIM);
-      __metaAbout(L, report, LMPROF, LUA_VERSION);
-      luaL_addliteral(&report->b.buff, JSON_CLOSE_OBJ JSON_NEWLINE);
-    }
-    else {
-      luaL_addliteral(&report->b.buff, JSON_NEWLINE JSON_CLOSE_ARRAY JSON_NEWLINE);
-    }
-    return LUA_OK;
+  else {
+    A->running = 1;
   }
-  return LMPROF_REPORT_FAILURE;
+  return 1;
+}
+#endif
+
+/* Join the worker, if any, and release the profile data owned by the handle. */
+static void async_join(lmprof_Async *A) {
+#if LMPROF_HAS_THREADS
+  if (A->running) {
+    pthread_join(A->thread, l_nullptr);
+    pthread_mutex_destroy(&A->lock);
+    A->running = 0;
+    async_free(A);
+  }
+#else
+  UNUSED(A);
+#endif
+}
+
+static int async_done(lua_State *L) {
+  lmprof_Async *A = l_pcast(lmprof_Async *, luaL_checkudata(L, 1, LMPROF_ASYNC_METATABLE));
+  int done = 1;
+#if LMPROF_HAS_THREADS
+  if (A->running) {
+    pthread_mutex_lock(&A->lock);
+    done = A->done;
+    pthread_mutex_unlock(&A->lock);
+    if (done) /* Release the profile data as soon as possible */
+      async_join(A);
+  }
+#else
+  UNUSED(A);
+#endif
+  lua_pushboolean(L, done);
+  return 1;
+}
+
+static int async_wait(lua_State *L) {
+  lmprof_Async *A = l_pcast(lmprof_Async *, luaL_checkudata(L, 1, LMPROF_ASYNC_METATABLE));
+  async_join(A);
+  lua_pushboolean(L, A->result);
+  return 1;
+}
+
+static int async_gc(lua_State *L) {
+  async_join(l_pcast(lmprof_Async *, luaL_checkudata(L, 1, LMPROF_ASYNC_METATABLE)));
+  return 0;
 }
 
 /* }================================================================== */
@@ -1429,6 +3249,29 @@ static int traceevent_report(lua_State *L, lmprof_Report *report) {
 ** ===================================================================
 */
 
+typedef struct lmprof_ResolveArgs {
+  lmprof_Alloc *alloc;
+  int intern; /* Absolute stack index of the interning table */
+} lmprof_ResolveArgs;
+
+static int resolve_hash_callback(lua_State *L, lmprof_Record *record, const lmprof_ResolveArgs *args) {
+  lmprof_record_resolve(L, args->alloc, record, args->intern);
+  return LUA_OK;
+}
+
+/* Format all records whose function information was deferred: LMPROF_OPT_LAZY_INFO */
+static void lmprof_resolve_records(lua_State *L, lmprof_State *st) {
+  lmprof_ResolveArgs args;
+  if (st->i.hash == l_nullptr || !BITFIELD_TEST(st->conf, LMPROF_OPT_LAZY_INFO))
+    return;
+
+  lua_newtable(L); /* [..., intern] */
+  args.alloc = &st->hook.alloc;
+  args.intern = lua_gettop(L);
+  lmprof_hash_report(L, st->i.hash, (lmprof_hash_Callback)resolve_hash_callback, l_pcast(const void *, &args));
+  lua_pop(L, 1);
+}
+
 static LUA_INLINE int lmprof_push_report(lua_State *L, lmprof_Report *report) {
   if (BITFIELD_TEST(report->st->mode, LMPROF_MODE_TIME | LMPROF_MODE_EXT_CALLBACK))
     return LMPROF_REPORT_FAILURE;
@@ -1440,6 +3283,15 @@ static LUA_INLINE int lmprof_push_report(lua_State *L, lmprof_Report *report) {
 }
 
 LUA_API void lmprof_report_initialize(lua_State *L) {
+  static const luaL_Reg asyncmeth[] = {
+    { "done", async_done },
+    { "wait", async_wait },
+    { "__gc", async_gc },
+    { "__close", async_gc },
+    { "__index", l_nullptr }, /* placeholder */
+    { l_nullptr, l_nullptr }
+  };
+
 #if defined(LMPROF_FILE_API)
   static const luaL_Reg metameth[] = {
     { "__gc", io_fgc },
@@ -1447,6 +3299,11 @@ LUA_API void lmprof_report_initialize(lua_State *L) {
     { l_nullptr, l_nullptr }
   };
 
+  static const luaL_Reg binarymeth[] = {
+    { "__gc", binary_gc },
+    { l_nullptr, l_nullptr }
+  };
+
   if (luaL_newmetatable(L, LMPROF_IO_METATABLE)) { /* metatable for file handles */
   #if LUA_VERSION_NUM == 501
     luaL_register(L, l_nullptr, metameth); /* add metamethods to new metatable */
@@ -1455,60 +3312,74 @@ LUA_API void lmprof_report_initialize(lua_State *L) {
   #endif
   }
   lua_pop(L, 1); /* pop metatable */
+
+  if (luaL_newmetatable(L, LMPROF_BINARY_METATABLE)) { /* metatable for binary traces being converted */
+  #if LUA_VERSION_NUM == 501
+    luaL_register(L, l_nullptr, binarymeth);
+  #else
+    luaL_setfuncs(L, binarymeth, 0);
+  #endif
+  }
+  lua_pop(L, 1); /* pop metatable */
+#endif
+
+  if (luaL_newmetatable(L, LMPROF_ASYNC_METATABLE)) { /* metatable for asynchronous report handles */
+#if LUA_VERSION_NUM == 501
+    luaL_register(L, l_nullptr, asyncmeth);
 #else
-  ((void)L);
+    luaL_setfuncs(L, asyncmeth, 0);
 #endif
+    lua_pushvalue(L, -1); /* push metatable */
+    lua_setfield(L, -2, "__index"); /* metatable.__index = metatable */
+  }
+  lua_pop(L, 1); /* pop metatable */
 }
 
-LUA_API int lmprof_report(lua_State *L, lmprof_State *st, lmprof_ReportType type, const char *file) {
-  lmprof_Report report;
-  report.st = st;
-
-  if (BITFIELD_TEST(st->mode, LMPROF_MODE_TIME)) {
-    const lu_time t = lmprof_clock_diff(st->thread.r.s.time, LMPROF_TIME(st));
-    lua_pushinteger(L, l_cast(lua_Integer, LMPROF_TIME_ADJ(t, st->conf)));
-  }
-  else if (type == lTable) {
-    lua_newtable(L);
-    report.type = lTable;
-    report.t.array_count = 1;
-    report.t.table_index = lua_gettop(L);
-    if (lmprof_push_report(L, &report) != LUA_OK) {
-      lua_pop(L, 1); /* Invalid encoding; return nil.*/
+/* Format the report as 'type', placing the result (see lmprof_report) ontop of the stack. */
+static void lmprof_report_output(lua_State *L, lmprof_Report *report, lmprof_ReportType type, const char *file) {
+  if (type == lTable) {
+    const int top = lua_gettop(L);
+    report_init(report, L, lTable, l_nullptr, l_nullptr);
+    if (lmprof_push_report(L, report) != LUA_OK) {
+      lua_settop(L, top); /* Invalid encoding; return nil.*/
       lua_pushnil(L);
     }
   }
   else if (type == lBuffer) {
+    luaL_Buffer b;
+    int result = LUA_OK;
     const int top = lua_gettop(L);
-    report.type = lBuffer;
-    report.b.delim = 0;
-    report.b.indent = "";
-    luaL_buffinit(L, &report.b.buff);
-    if (lmprof_push_report(L, &report) != LUA_OK) {
+
+    luaL_buffinit(L, &b);
+    report_init(report, L, lBuffer, buffer_write, l_pcast(void *, &b));
+    if ((result = lmprof_push_report(L, report)) != LUA_OK || report->error) {
       lua_settop(L, top); /* Invalid encoding; return nil.*/
       lua_pushnil(L);
     }
-
-    luaL_pushresult(&report.b.buff);
+    else {
+      luaL_pushresult(&b);
+    }
   }
   else if (type == lFile) {
 #if defined(LMPROF_FILE_API)
-    FILE **pf;
+    lmprof_IO *io = l_nullptr;
     int result = LUA_OK;
+    const int binary = BITFIELD_TEST(report->st->conf, LMPROF_OPT_TRACE_BINARY)
+                       && BITFIELD_TEST(report->st->mode, LMPROF_MODE_TRACE)
+                       && !BITFIELD_TEST(report->st->mode, LMPROF_MODE_EXT_CALLBACK);
     if (file == l_nullptr)
       result = LMPROF_REPORT_FAILURE;
-    else if ((pf = io_fud(L, file)) != l_nullptr) { /* [..., io_ud] */
-      report.type = lFile;
-      report.f.file = *pf;
-      report.f.delim = 0;
-      report.f.indent = "";
-      result = lmprof_push_report(L, &report);
-      if (fclose(*pf) == 0) {
-        *pf = l_nullptr; /* marked as closed */
-        lua_pushnil(L); /* preemptively remove finalizer */
-        lua_setmetatable(L, -2);
-      }
-
+    else if ((io = io_fud(L, file, binary ? "wb" : "w", !binary && io_compressed(file))) != l_nullptr) { /* [..., io_ud] */
+      report_init(report, L, lFile, io_write, l_pcast(void *, io));
+      if (binary)
+        result = traceevent_dump(L, report, io->file);
+      else if ((result = lmprof_push_report(L, report)) == LUA_OK && report->error)
+        result = LMPROF_REPORT_FAILURE;
+
+      if (!io_close(io)) /* marked as closed */
+        result = LMPROF_REPORT_FAILURE;
+      lua_pushnil(L); /* preemptively remove finalizer */
+      lua_setmetatable(L, -2);
       lua_pop(L, 1);
     }
 
@@ -1518,10 +3389,168 @@ LUA_API int lmprof_report(lua_State *L, lmprof_State *st, lmprof_ReportType type
     lua_pushboolean(L, 0); /* Failure */
 #endif
   }
+  else if (type == lWriter) {
+    int result = LMPROF_REPORT_FAILURE;
+    if (report->write != l_nullptr) {
+      report_init(report, L, lWriter, report->write, report->ud);
+      if ((result = lmprof_push_report(L, report)) == LUA_OK && report->error)
+        result = LMPROF_REPORT_FAILURE;
+    }
+    lua_pushboolean(L, result == LUA_OK); /* Success */
+  }
   else {
     lua_pushnil(L);
   }
+}
+
+/*
+** Push an array of thread identifier/name pairs, see lmprof_Report.names, of
+** all named threads; returning its absolute stack index.
+*/
+static int report_thread_names(lua_State *L) {
+  int n = 0;
+  luaL_checkstack(L, 5, __FUNCTION__);
+  lua_newtable(L); /* [..., pairs] */
+  lmprof_thread_info(L, LMPROF_TAB_THREAD_NAMES); /* [..., pairs, names] */
+  for (lua_pushnil(L); lua_next(L, -2) != 0; lua_pop(L, 1)) { /* [..., pairs, names, key, value] */
+    if (lua_isnumber(L, -2) && (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER)) {
+      lua_pushinteger(L, lua_tointeger(L, -2));
+      lua_rawseti(L, -5, ++n);
+
+      lua_pushvalue(L, -1); /* [..., pairs, names, key, value, value]: lua_tolstring converts numbers in-place */
+      lua_tostring(L, -1);
+      lua_rawseti(L, -5, ++n);
+    }
+  }
+  lua_pop(L, 1); /* [..., pairs] */
+  return lua_gettop(L);
+}
+
+/* lmprof_report and lmprof_report_write: the 'write' and 'ud' of lWriter reports are preset. */
+static int report_run(lua_State *L, lmprof_Report *report, lmprof_ReportType type, const char *file) {
+  lmprof_State *st = report->st;
+  report->names = 0;
+  report->lookup = 0;
+  lmprof_resolve_records(L, st);
+
+  /* Snapshot of the named threads, see __reportThreadName */
+  if (BITFIELD_TEST(st->mode, LMPROF_MODE_TRACE) && BITFIELD_TEST(st->conf, LMPROF_OPT_TRACE_LAYOUT_SPLIT))
+    report->names = report_thread_names(L); /* [..., names] */
+
+  if (st->i.writer != l_nullptr) { /* Events have been written to the stream */
+    lua_pushboolean(L, lmprof_stream_close(L, st, report->names));
+  }
+  else if (BITFIELD_TEST(st->mode, LMPROF_MODE_TIME)) {
+    const lu_time t = lmprof_clock_diff(st->thread.r.s.time, LMPROF_TIME(st));
+    lua_pushinteger(L, l_cast(lua_Integer, LMPROF_TIME_ADJ(t, st->conf)));
+  }
+  else {
+    lmprof_report_output(L, report, type, file);
+  }
+
+  if (report->names != 0)
+    lua_remove(L, report->names);
+  return lua_type(L, -1);
+}
+
+LUA_API int lmprof_report(lua_State *L, lmprof_State *st, lmprof_ReportType type, const char *file) {
+  lmprof_Report report;
+  report.st = st;
+  report.write = l_nullptr;
+  report.ud = l_nullptr;
+  return report_run(L, &report, type, file);
+}
+
+LUA_API int lmprof_report_write(lua_State *L, lmprof_State *st, lmprof_ReportWrite write, void *ud) {
+  lmprof_Report report;
+  report.st = st;
+  report.write = write;
+  report.ud = ud;
+  return report_run(L, &report, lWriter, l_nullptr);
+}
+
+LUA_API int lmprof_report_async(lua_State *L, lmprof_State *st, const char *file) {
+  lmprof_Async *A = l_nullptr;
+  luaL_checkstack(L, 4, __FUNCTION__);
+#if LUA_VERSION_NUM >= 504
+  A = l_pcast(lmprof_Async *, lua_newuserdatauv(L, sizeof(lmprof_Async), 1)); /* [..., handle] */
+#else
+  A = l_pcast(lmprof_Async *, lmprof_newuserdata(L, sizeof(lmprof_Async))); /* [..., handle] */
+#endif
+  A->result = 0;
+#if LMPROF_HAS_THREADS
+  A->running = 0;
+  A->done = 1;
+  A->F.threads = l_nullptr;
+#endif
+#if LUA_VERSION_NUM == 501
+  luaL_getmetatable(L, LMPROF_ASYNC_METATABLE);
+  lua_setmetatable(L, -2);
+#else
+  luaL_setmetatable(L, LMPROF_ASYNC_METATABLE);
+#endif
+
+#if LMPROF_HAS_THREADS
+  if (async_start(L, A, st, file))
+    return LUA_TUSERDATA;
+#endif
+
+  lmprof_report(L, st, lFile, file); /* [..., handle, result]: formatted by the reporting thread */
+  A->result = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return LUA_TUSERDATA;
+}
+
+LUA_API int lmprof_report_convert(lua_State *L, const char *input, const char *output, lua_Integer threads) {
+#if defined(LMPROF_FILE_API)
+  lmprof_IO *io = l_nullptr;
+  BinaryTrace *T = l_nullptr;
+  const char *error = l_nullptr;
+  lmprof_Report report;
+  int names = 0;
+
+  luaL_checkstack(L, 8, __FUNCTION__);
+  T = l_pcast(BinaryTrace *, lmprof_newuserdata(L, sizeof(BinaryTrace))); /* [..., trace] */
+  memset(T, 0, sizeof(BinaryTrace));
+  T->st.hook.alloc.f = lua_getallocf(L, &T->st.hook.alloc.ud);
+  #if LUA_VERSION_NUM == 501
+  luaL_getmetatable(L, LMPROF_BINARY_METATABLE);
+  lua_setmetatable(L, -2);
+  #else
+  luaL_setmetatable(L, LMPROF_BINARY_METATABLE);
+  #endif
+
+  lua_newtable(L); /* [..., trace, names] */
+  names = lua_gettop(L);
+  if ((io = io_fud(L, input, "rb", 0)) != l_nullptr) { /* [..., trace, names, io_ud] */
+    const int read = binary_read_file(T, io->file);
+    io_close(io); /* marked as closed */
+    lua_pushnil(L); /* preemptively remove finalizer */
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+    if (!read)
+      return luaL_error(L, "cannot read file '%s'", input);
+  }
+
+  if ((error = binary_load(L, T, names)) != l_nullptr)
+    return luaL_error(L, "cannot convert '%s': %s", input, error);
+
+  T->st.i.reportThreads = threads;
+  report.st = &T->st;
+  report.names = names;
+  report.lookup = 1;
+  lmprof_report_output(L, &report, (output == l_nullptr) ? lBuffer : lFile, output); /* [..., trace, names, result] */
+  binary_free(T);
+
+  lua_replace(L, -3); /* [..., result, names] */
+  lua_pop(L, 1);
   return lua_type(L, -1);
+#else
+  UNUSED(input);
+  UNUSED(output);
+  UNUSED(threads);
+  return luaL_error(L, "binary traces require LMPROF_FILE_API");
+#endif
 }
 
 /* }================================================================== */
@@ -22,6 +22,62 @@
 /* An emulation of LUA_FILEHANDLE */
 #define LMPROF_IO_METATABLE "lmprof_io_metatable"
 
+/* Binary Trace Event dumps being converted; see lmprof_report_convert */
+#define LMPROF_BINARY_METATABLE "lmprof_binary_metatable"
+
+/* Handles of asynchronous reports; see lmprof_report_async */
+#define LMPROF_ASYNC_METATABLE "lmprof_async_metatable"
+
+/*
+@@ LMPROF_THREADS: Enable the TraceEvent stream writer (see 'stream' option): a
+**  POSIX thread that formats and writes full TraceEvent pages to a file while
+**  the profiled script continues to execute, and the parallel formatting of
+**  TraceEvent reports (see 'report_threads' option) and of asynchronous reports
+**  (see lmprof_report_async). Requires LMPROF_FILE_API.
+*/
+#if defined(LMPROF_THREADS) && defined(LMPROF_FILE_API) && !defined(_WIN32)
+  #define LMPROF_HAS_THREADS 1
+#else
+  #define LMPROF_HAS_THREADS 0
+#endif
+
+/*
+@@ LMPROF_IO_BUFFER: Size (in bytes) of the stdio buffer given to each report
+**  file, i.e., the size of the block writes of the formatted output.
+*/
+#if !defined(LMPROF_IO_BUFFER)
+  #define LMPROF_IO_BUFFER (64 * 1024)
+#endif
+
+/*
+@@ LMPROF_ZLIB: Compress (gzip) the formatted reports written to output paths
+**  ending in ".gz". Requires LMPROF_FILE_API.
+**
+@@ LMPROF_ZLIB_LEVEL: zlib compression level of compressed reports.
+*/
+#if defined(LMPROF_ZLIB) && defined(LMPROF_FILE_API)
+  #define LMPROF_HAS_ZLIB 1
+#else
+  #define LMPROF_HAS_ZLIB 0
+#endif
+
+#if !defined(LMPROF_ZLIB_LEVEL)
+  #define LMPROF_ZLIB_LEVEL 1
+#endif
+
+/* Number of pages buffered between stream hand-offs when no page limit is set */
+#if !defined(LMPROF_STREAM_PAGES)
+  #define LMPROF_STREAM_PAGES 8
+#endif
+
+/*
+@@ LMPROF_REPORT_CHUNK: Number of TraceEvent pages formatted, as a unit, by each
+**  thread of a parallel report; see 'report_threads'.
+*/
+#if !defined(LMPROF_REPORT_CHUNK)
+  #define LMPROF_REPORT_CHUNK 16
+#endif
+
 /*
 ** TIME_FORMAT: A numeric value, representing the time between start/stop
 **  operations.
@@ -113,8 +169,9 @@
 **    compress - SEE lmprof_get_option.
 **
 **  [INTEGER]:
-**    eventsize - Size of the TraceEvent struct. (Debug)
-**    eventpages - Number of TraceEvents per-page. (Debug)
+**    eventsize - Page bytes used by each TraceEvent, including its heap usage in
+**      memory mode. (Debug)
+**    eventpages - Effective number of TraceEvents per-page. (Debug)
 **    pagesize - Size (in bytes) of each trace event 'page'.
 **    pagelimit - Maximum size (in bytes) of the trace event list; zero for infinite.
 **    usedpages - Number of allocated pages.
@@ -135,49 +192,115 @@
 **  require change in the future and there are still many @TODO's remaining.
 */
 
+/*
+** BINARY_FORMAT: A compact dump of the buffered (unformatted) Trace Event
+** timeline, see the 'binary' option, that is converted to TRACE_EVENT_FORMAT
+** offline by lmprof_report_convert.
+**
+** LAYOUT: The magic "\x1bLMP", a version byte, and a sequence of sections:
+**  [tag: byte][length: varint][payload: length bytes]. All integers are LEB128
+**  varints; signed values are zigzag encoded. Strings are a varint length
+**  followed by its bytes.
+**
+**  'H' - Header: mode, conf, pid, tid, counterFrequency, event_threshold,
+**    heap flag, frameCount, switchCount, recycleCount, baseTime, name, url.
+**  'S' - Source table: count, followed by each source string.
+**  'F' - Function table: count, followed by each (event, source + 1) pair.
+**  'T' - Interned thread table: count, followed by each (pid, tid) pair.
+**  'N' - Thread names: count, followed by each (tid, name) pair.
+**  'P' - A page of prologue (metadata) events; zero or more.
+**  'E' - A page of timeline events; zero or more.
+**  'Z' - End of dump.
+**
+** EVENTS: Each page is an event count followed by its events; an event is a
+**  byte (op | flags << 4), the thread, the time and (if the heap flag is set)
+**  heap usage delta encoded against the previous event of the page, the line,
+**  and a payload that depends on its op. Function references are 'F' indices
+**  plus one; event references are 0 (NULL), 1 (detached), or two plus the
+**  zigzag encoded distance, in events, to the referenced event.
+*/
+
 typedef enum lmprof_ReportType {
   lTable, /* Generate an array of profiling records. */
   lFile, /* Write profiling records to file (format defined by profiling mode); requires LMPROF_FILE_API */
   lBuffer, /* Write profiling records to a luaL_Buffer; returning the string. */
+  lWriter, /* Hand the formatted profiling records to a lmprof_ReportWrite callback. */
 } lmprof_ReportType;
 
+/*
+** Sink of a formatted report, i.e., every report type other than lTable: called
+** with each consecutive block of the output. Returning zero on failure (e.g., an
+** IO error), which fails the report.
+*/
+typedef int (*lmprof_ReportWrite)(void *ud, const char *data, size_t size);
+
+/* Values opened by lmprof_ReportWriter.begin */
+typedef enum lmprof_ReportKind {
+  lObject, /* Keyed values */
+  lArray, /* Values appended with a NULL key */
+  lRecords, /* An lArray that is formatted with one value per line */
+} lmprof_ReportKind;
+
+struct lmprof_Report;
+
+/*
+** Encoder of a report. Each report format is described once as a tree of
+** objects and arrays and the encoder, e.g., a Lua table builder or JSON text,
+** determines its representation. A NULL 'key' appends the value to the
+** enclosing array.
+*/
+typedef struct lmprof_ReportWriter {
+  void (*begin)(struct lmprof_Report *R, const char *key, lmprof_ReportKind kind);
+  void (*end)(struct lmprof_Report *R);
+  void (*integer)(struct lmprof_Report *R, const char *key, lua_Integer value);
+  void (*number)(struct lmprof_Report *R, const char *key, lua_Number value);
+  void (*boolean)(struct lmprof_Report *R, const char *key, int value);
+  void (*string)(struct lmprof_Report *R, const char *key, const char *value);
+  void (*fstring)(struct lmprof_Report *R, const char *key, const char *fmt, ...); /* '%s', '%d', and '%%' */
+  void (*null)(struct lmprof_Report *R, const char *key); /* Omitted from Lua tables */
+} lmprof_ReportWriter;
+
+/* Maximum nesting of objects/arrays within a report */
+#define LMPROF_REPORT_DEPTH 16
+
+/* Size (in bytes) of the buffer staging the output of a text encoder */
+#if !defined(LMPROF_REPORT_BUFFER)
+  #define LMPROF_REPORT_BUFFER 4096
+#endif
+
+typedef struct lmprof_ReportFrame {
+  const char *key; /* Key of the value within its parent */
+  lua_Integer count; /* Number of values written */
+  lmprof_ReportKind kind;
+} lmprof_ReportFrame;
+
 /* Common header for dumping reports */
 typedef struct lmprof_Report {
   lmprof_State *st;
   lmprof_ReportType type;
-  union {
-    /* Generate an array of profiling records. */
-    struct {
-      int table_index; /* Absolute index of the table on the Lua stack. */
-#if LUA_VERSION_NUM >= 503
-      lua_Integer array_count; /* Array index counter */
-#else
-      int array_count;
-#endif
-    } t;
-    /*
-    ** Write the profiling records/results to a file. The format and layout of
-    ** the records depend upon the profiling mode and configuration. See
-    ** documentation above.
-    **
-    ** @NOTE See caveats with the LMPROF_FILE_API option.
-    ** @NOTE Ideally a luaL_stream would be used. However that feature was not
-    **  introduced Lua 5.2.
-    */
-    struct {
-      FILE *file;
-      int delim; /* Requires delimitation on next write */
-      const char *indent; /* Current indentation string (often a function of some nested depth) */
-    } f;
-    struct {
-      luaL_Buffer buff;
-      int delim;
-      const char *indent;
-    } b;
-  };
+  int names; /* Absolute stack index of an array of thread identifier/name pairs, i.e., the named threads of the report; zero otherwise */
+  int lookup; /* Thread names are resolved with 'names' instead of LMPROF_TAB_THREAD_NAMES */
+
+  lua_State *L; /* State of the Lua table builder */
+  const lmprof_ReportWriter *writer;
+  int depth; /* Number of open objects/arrays */
+  lmprof_ReportFrame frames[LMPROF_REPORT_DEPTH];
+
+  /*
+  ** Formatted output is staged and handed to the sink in blocks.
+  **
+  ** @NOTE: A luaL_Buffer sink requires its box to remain ontop of the Lua stack
+  **  while the report is written. All values pushed while formatting must be
+  **  popped before the next write.
+  */
+  lmprof_ReportWrite write;
+  void *ud;
+  int error; /* A write has failed */
+  size_t length;
+  char buff[LMPROF_REPORT_BUFFER];
 } lmprof_Report;
 
-/* Initialize LMPROF_IO_METATABLE */
+/* Initialize LMPROF_IO_METATABLE, LMPROF_BINARY_METATABLE, and LMPROF_ASYNC_METATABLE */
 LUA_API void lmprof_report_initialize(lua_State *L);
 
 /*
@@ -186,4 +309,66 @@ LUA_API void lmprof_report_initialize(lua_State *L);
 */
 LUA_API int lmprof_report(lua_State *L, lmprof_State *st, lmprof_ReportType type, const char *file);
 
+/*
+** Generate a formatted 'report' (see lmprof_report) that is handed, in blocks,
+** to the 'write' callback. Pushing a boolean denoting success.
+*/
+LUA_API int lmprof_report_write(lua_State *L, lmprof_State *st, lmprof_ReportWrite write, void *ud);
+
+/*
+** Generate a report (see lmprof_report) of the profiler state to 'file' whose
+** formatting is finished by a worker thread, pushing a LMPROF_ASYNC_METATABLE
+** handle: 'done' returns true once the report has finished and 'wait' blocks
+** until the report has finished, returning a boolean denoting success.
+**
+** The profile data of Trace Event reports is moved to the handle (see
+** lmprof_move_state) and released once the worker is joined; other reports, or
+** when compiled without LMPROF_HAS_THREADS, are formatted before returning.
+*/
+LUA_API int lmprof_report_async(lua_State *L, lmprof_State *st, const char *file);
+
+/*
+** Convert a binary Trace Event dump, see BINARY_FORMAT, into the Trace Event
+** (JSON) format: written to 'output' if not NULL, otherwise the formatted string
+** is placed onto the stack. The events are formatted on 'threads' threads, see
+** LMPROF_OPT_REPORT_THREADS. Returning the type of the 'reported' object.
+*/
+LUA_API int lmprof_report_convert(lua_State *L, const char *input, const char *output, lua_Integer threads);
+
+/*
+** {==================================================================
+** TraceEvent Streaming
+** ===================================================================
+*/
+
+/*
+** Create a stream writer for the profiler state (st->i.writer): the output file
+** is opened and a writer thread formats, in JSON, each page handed to it by
+** lmprof_stream_flush.
+**
+** @RETURN LUA_OK on success; LMPROF_REPORT_DISABLED_IO if the library was
+**  compiled without LMPROF_HAS_THREADS; LMPROF_REPORT_FAILURE otherwise.
+*/
+LUA_API int lmprof_stream_open(lmprof_State *st, const char *path);
+
+/*
+** Hand all buffered pages of the timeline to the writer thread, replacing them
+** with pages the writer has already formatted. Blocks while the writer is too
+** far behind. The caller must redirect all references to the buffered events,
+** see timeline_detach, before calling this function.
+*/
+LUA_API int lmprof_stream_flush(lmprof_State *st, TraceEventTimeline *list);
+
+/*
+** Drain the writer thread, format the remaining events of the timeline and all
+** metadata events, and close the stream. Returning one on success. See
+** lmprof_Report.names for 'names'.
+*/
+LUA_API int lmprof_stream_close(lua_State *L, lmprof_State *st, int names);
+
+/* Stop the writer thread (if running) and release all stream resources. */
+LUA_API void lmprof_stream_free(lmprof_State *st);
+
+/* }================================================================== */
+
 #endif
@@ -10,6 +10,7 @@
 #include <stdint.h>
 
 #include "lmprof_conf.h"
+#include "collections/lmprof_stack.h"
 
 #define LMPROF_LMPROF_STATE_METATABLE "lmprof_profiler_metatable"
 
@@ -51,11 +52,19 @@
 #define LMPROF_OPT_STACK_MISMATCH    0x20 /* Allow start/stop to be called at different stack levels. */
 #define LMPROF_OPT_COMPRESS_GRAPH    0x40 /* p_id is defined by the parents f_id; otherwise the parents record id */
 #define LMPROF_OPT_GC_COUNT_INIT     0x80 /* Include garbage collector statistics (LUA_GCCOUNT[B]) on profiler init */
+#define LMPROF_OPT_LAZY_INFO        0x100 /* Defer the formatting of Lua function records to lmprof_report */
+#define LMPROF_OPT_FOLD_RECURSION   0x200 /* Graph: recursive re-entries of a function reuse the stack instance (and record) of their caller */
+#define LMPROF_OPT_PAGE_MMAP        0x400 /* Serve TraceEvent pages and arena chunks from memory mappings; see LMPROF_MMAP */
 
 #define LMPROF_OPT_REPORT_VERBOSE       0x1000 /* Include additional debug information */
 #define LMPROF_OPT_REPORT_STRING        0x2000 /* Output a formatted Lua string instead of an encoded table. */
+#define LMPROF_OPT_TRACE_STREAM         0x4000 /* Reserved: Stream TraceEvent pages to a file on a writer thread */
+#define LMPROF_OPT_TRACE_BINARY         0x8000 /* Write a binary dump of the TraceEvent timeline to the output path */
+#define LMPROF_OPT_STACK_POOL          0x10000 /* Reserved */
+#define LMPROF_OPT_STACK_GC            0x20000 /* Reserved */
 #define LMPROF_OPT_HASH_SIZE           0x40000 /* Reserved */
 #define LMPROF_OPT_LINE_FREQUENCY      0x80000 /* Reserved */
+#define LMPROF_OPT_TRACE_RING         0x100000 /* Recycle the oldest TraceEvent pages once the page limit is reached */
 
 #define LMPROF_OPT_TRACE_COUNTERS_FREQ   0x200000 /* Reversed: Reduce the number of UpdateCounters events */
 #define LMPROF_OPT_TRACE_IGNORE_YIELD    0x400000 /* Ignore all coroutine.yield() records */
@@ -70,6 +79,14 @@
 #define LMPROF_OPT_TRACE_COMPRESS      0x40000000 /* Ignore sub-microsecond functions from output. */
 #define LMPROF_OPT_TRACE_THRESHOLD     0x80000000 /* Reversed: Trace event compression threshold */
 
+/*
+** Integer options without a configuration bit. Every bit of the configuration
+** is taken: option codes (lmprof_option_codes) are 64-bit and these options are
+** placed above the configuration mask, i.e., never tested against 'conf'.
+*/
+#define LMPROF_OPT_INTEGER(N) (l_cast(uint64_t, (N)) << 32)
+#define LMPROF_OPT_REPORT_THREADS LMPROF_OPT_INTEGER(1) /* Reserved: Number of threads formatting Trace Event reports */
+
 #if LUA_32BITS
   #define LMPROF_OPT_DEFAULT (LMPROF_OPT_CLOCK_INIT | LMPROF_OPT_CLOCK_MICRO | LMPROF_OPT_LOAD_STACK | LMPROF_OPT_COMPRESS_GRAPH)
 #else
@@ -120,6 +137,15 @@ typedef void (*lmprof_Error)(lua_State *, lmprof_State *);
 */
 typedef int (*lmprof_TraceRoutine)(lua_State *, lmprof_State *, lmprof_EventProcess, int);
 
+/*
+** Change in coroutine (compact) event handler: invoked with the identifiers of
+** the suspended and resumed threads, in place of the routine and scope handlers,
+** when the layout is not split (LMPROF_OPT_TRACE_LAYOUT_SPLIT). Optional.
+**
+** Returning LUA_OK on success; an error code otherwise.
+*/
+typedef int (*lmprof_TraceTransfer)(lua_State *, lmprof_State *, lua_Integer, lua_Integer);
+
 /*
 ** ENTER_SCOPE/EXIT_SCOPE event handler (functions).
 **
@@ -164,6 +190,9 @@ struct lmprof_State {
     lua_State *state; /* Executing thread. */
     struct lmprof_Stack *call_stack; /* stack containing memory use when entering a function */
     size_t stack_count; /* Number of allocated stacks */
+    size_t stack_gc; /* Number of allocated stacks between garbage collection steps */
+    lmprof_StackPool pool; /* Recycled profiler stacks of dead coroutines */
+    lmprof_ThreadMap map; /* lua_State to profiler stack (LMPROF_THREAD_MAP) */
   } thread;
 
   /*
@@ -192,18 +221,29 @@ struct lmprof_State {
     /* TraceEvent */
     const char *url; /* TraceEvent URL */
     const char *name; /* TraceEvent Name */
+    const char *stream; /* TraceEvent streaming output path; see LMPROF_OPT_TRACE_STREAM */
+    struct lmprof_Stream *writer; /* Active TraceEvent stream writer */
+    struct lmprof_Pages *pages; /* TraceEvent page provider; see LMPROF_OPT_PAGE_MMAP */
+    struct lmprof_Pages *chunks; /* Arena chunk provider; see LMPROF_OPT_PAGE_MMAP */
     lua_Integer pageLimit; /* Maximum TraceEvent list size (in bytes) */
     lua_Integer counterFrequency; /* Reduce 'UpdateCounters' count */
     lu_time event_threshold; /* Threshold */
+    lua_Integer reportThreads; /* Number of threads formatting the report; see LMPROF_OPT_REPORT_THREADS */
 
     /* Structures */
     lu_addr record_count; /* Number of lmprof_Record's created (used to assign unique identifiers) */
+    lmprof_Arena arena; /* Allocator of all lmprof_Record's in 'hash' */
+    lmprof_Arena info_arena; /* Allocator of the (cold) lmprof_Record function info */
     struct lmprof_Hash *hash; /* hash table containing information of each function call */
+    struct lmprof_IdentityCache *idcache; /* lmprof_record_id cache */
+    size_t edge_hits; /* lmprof_fetch_child_record: edge cache hits */
+    size_t edge_misses; /* lmprof_fetch_child_record: edge cache misses */
     union {
       /* struct { } graph; */
       struct {
         void *arg; /* Shared callback arguments */
         lmprof_TraceRoutine routine; /* Change in coroutine; see LMPROF_OPT_TRACE_LAYOUT_SPLIT */
+        lmprof_TraceTransfer transfer; /* Change in coroutine (compact); may be NULL */
         lmprof_TraceScope scope; /* Profiler events: LUA_HOOKCALL/LUA_HOOKRET/LUA_HOOKTAILCALL */
         lmprof_TraceSample sample; /* Profiler events: LUA_MASKCOUNT | LUA_MASKLINE */
         lmprof_TraceFree free; /* Callback finalization */